@@ -15,7 +15,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /*
     A C program to repair corrupted video files that can sometimes be produced by
     DJI quadcopters.
-    Version 2016-04-19
+    Version 2026-10-14
 
     Copyright (c) 2014-2016 Live Networks, Inc.  All rights reserved.
 
@@ -49,55 +49,1014 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
     - 2015-11-03: We now support an additional video format - 1520p/30
     - 2015-11-27: Corrected(?) the SPS NAL unit prepended to each frame for the 2160p/25 format.
     - 2016-04-19: We now support an additional video format - 1520p/25
+    - 2026-10-14: 'Type 1' repairs now copy the file in large blocks (or, on Linux, inside the
+            kernel, using "copy_file_range()" or "sendfile()"), rather than one byte at a time.
+	    Where possible, we also memory-map the input file, so that checking the start of the
+	    file (and skipping over junk data) no longer goes through 'stdio'.  And when looking for
+	    sane data after garbage (at the start of a file, or after a 'mdat' atom), we now scan
+	    many bytes at a time (using SIMD instructions, where available).
+	    'Type 2' repairs now read and write each NAL unit (with its 'start code') as a block.
+	    We can now also repair many files at once (named on the command line, or in a list
+	    file, or all files in a directory), several in parallel.  In this 'batch mode', we skip
+	    files that don't appear to be corrupted.
+	    The video format for 'type 2' repairs can now be given on the command line ("-f"), or in
+	    the environment variable "DJIFIX_FORMAT", so that these repairs can run unattended.
+	    We also now try to detect the video format automatically, by checking which of our SPS
+	    and PPS NAL units make sense of the file's first few slice headers.
+	    A file can now be repaired as a stream: from our standard input to our standard
+	    output (named "-"), without seeking.  The repaired file can also now be named ("-o").
+	    'Type 2' repairs can now produce a '.mp4' file ("-t mp4"), rather than a '.h264' file.
+	    When repairing a single (memory-mapped) 'type 2' file, we now first find all of its
+	    NAL units, and then copy them using several threads.
+	    After an anomalous 'NAL size', we now scan quickly (many bytes at a time) for where sane
+	    data resumes - checking a chain of two NAL unit sizes, rather than accepting the first
+	    0x00000002 that we find - and report how many bytes we skipped.
+	    The probing and repair code can now also be built as a library (see "djifix.h"), so
+	    that other programs can repair files - from a name, a file descriptor, or data in
+	    memory - without running this program.
+	    A new 'probe' mode ("-p") just classifies each file (as not corrupted, 'type 1' - perhaps
+	    with nested 'ftyp's - or 'type 2', or unrepairable), without repairing it, and writes
+	    the result - with the file position at which the repair would begin - as a JSON line.
+	    'Type 1' repairs can now be done in place ("-i"), changing the original file rather
+	    than copying it: we remove the data before the 'ftyp' atom (using "fallocate()", where
+	    possible), make whatever's left of it into a 'free' atom, and fix the chunk offsets.
+	    Repairs can now report their progress ("-v") - how much of the file has been read,
+	    how fast, and (for 'type 2' repairs) how many NAL units and anomalies we've seen - and
+	    write this, with each repair's final statistics, as JSON lines ("-s").
+	    A new 'benchmark' mode ("-B size") generates a synthetic damaged file of each kind
+	    that we can repair, and times probing, repairing and recovering from anomalies in it.
+	    File positions and sizes are now 64 bits throughout (even on 32-bit systems), and we
+	    understand 64-bit ('largesize') atom sizes, so files larger than 4 GB - e.g., long
+	    2160p recordings - can be repaired in one pass, without first being split.
+	    When we copy data ourselves (rather than in the kernel), the output file is now
+	    written by a separate thread, from a ring of buffers, so that reading the input file
+	    overlaps writing the output file.
+	    Repairs can now be resumed after being interrupted ("-c"): as we go, we record how far
+	    we've got - and the video format - in a 'checkpoint' file beside the repaired file.
+	    Repairing the same file again then continues from there, once we've checked that the
+	    end of what's already been written is what we wrote.
+	    'Type 2' repairs to a '.h264' file can now also write a compact binary index of its
+	    NAL units ("-x") - each one's position, size and type, and whether it begins an access
+	    unit - so that other programs can seek in the file (e.g., to key frames) without
+	    scanning it.  (The format is described in "djifix.h".)
+	    A 'type 1' file recovered after a power cut can hold several recordings, one after
+	    another (perhaps with junk in between).  These can now be salvaged separately ("-m"):
+	    we find each one - in a single scan of the file - and copy it (several at a time) to
+	    its own repaired file.
+	    'Type 1' repairs can now put the 'moov' atom at the start of the repaired file ("-F"),
+	    so that it can be played (and seeked in) as it streams, without a separate
+	    'faststart' pass.  We use the repaired data's own 'moov' atom - or, if it has none,
+	    the one that came before the 'mdat' - once we've checked that each chunk that it
+	    describes is within the repaired data, and then correct its chunk offsets.
+	    When we know how much we're going to write, we now preallocate the output file (on
+	    Linux), so that it's less fragmented.  And if a 'type 1' file has holes (e.g., a
+	    recovered card image), the repaired file now has the same holes, rather than zeros.
+	    Each phase of a probe and repair - probing the start of the file, checking its atoms,
+	    walking through nested 'ftyp's, the 'type 1' copy, the 'type 2' NAL unit loop, and
+	    recovering from anomalies - can now be profiled ("-P"): its time, and how much of the
+	    file it covered, and (on Linux) its CPU cycles and cache misses.
+	    If a 'type 2' file's video format can't be detected for sure, it can now be repaired
+	    to a trial '.h264' file for each format that it might be ("-T"), in a single pass
+	    over the file: we repair it once, and then give each of the other files its own SPS
+	    and PPS, followed by a copy of (or, where the file system allows it, a reflink to)
+	    the first file's data.
+	    Library users can now repair a file that's not on a local file system (e.g., in
+	    object storage), through a 'reader' function that reads ranges of it
+	    ("djifixOpenReader()").  A probe then reads only a few KB, and the bulk of the file
+	    is copied in large reads, several at a time.
+	    Added the "-M" option, which keeps all of a repair's buffers within a fixed amount
+	    of memory (allocated once, and shared among parallel repairs), for containers with
+	    memory limits.  (Library users set "memory" and "memorySize".)
+	    Added the "-V" option, which gives the CRC-32C checksum of each repaired file -
+	    computed as it's written (including its holes, patched sizes, and the pieces
+	    written by parallel threads), so without reading the file back - and checks that
+	    its structure is sound: its top-level atoms and 'moov' atom, or the NAL units of a
+	    '.h264' file (none of which may contain a 'start code'), or - for a '.mp4' file -
+	    that its samples fill its 'mdat' atom.  (Library users set "verify".)
+	    Added a 'watch mode' ("-w directory"), which keeps running, and repairs each file
+	    that arrives in a directory (e.g., from a camera card) once it has been written -
+	    the smallest waiting file first - with a fixed number of worker threads.  On Linux,
+	    we're told about each file by "inotify"; elsewhere, we look at the directory every
+	    few seconds.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for "copy_file_range()" */
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* so that "off_t" - and "fseeko()" etc. - are 64 bits, even on 32-bit systems */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "djifix.h"
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP 1
+#define HAVE_DIRENT 1
+#define HAVE_THREADS 1
+#define HAVE_FILE_DESCRIPTORS 1
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(HAVE_THREADS) && defined(HAVE_DIRENT)
+#define HAVE_WATCH_MODE 1 /* we can watch a directory for files to repair ("-w") */
+#endif
+#if defined(__linux__) && defined(HAVE_WATCH_MODE)
+#define HAVE_INOTIFY 1 /* so that we're told when each file arrives in a watched directory */
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#if defined(__linux__) && defined(HAVE_FILE_DESCRIPTORS) && defined(__NR_perf_event_open)
+#define HAVE_PERF_EVENTS 1 /* so that profiling can count CPU cycles and cache misses */
+#endif
+#if (defined(__linux__) && defined(_GNU_SOURCE)) || defined(__APPLE__) || defined(__FreeBSD__) || \
+  defined(__NetBSD__) || defined(__OpenBSD__)
+#define HAVE_READER_STREAMS 1 /* 'stdio' can read through our own functions (for a "DjifixReader") */
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_CRC32C_INSTRUCTION 1 /* (if the CPU has SSE 4.2, which we check once we start) */
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && defined(__BYTE_ORDER__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_CRC32C_INSTRUCTION 1
+#include <arm_acle.h>
+#endif
 
-static void usage(char const* progName) {
-  fprintf(stderr, "Usage: %s name-of-video-file-to-repair\n", progName);
-}
+/* File positions and sizes are "DjifixOffset"s (64 bits, even where "long" is only 32 bits,
+   so that we can handle files larger than 2 or 4 GB).  These are the 'stdio' functions that
+   we use for them: */
+#if defined(HAVE_FILE_DESCRIPTORS)
+#define fseek64(fid, offset, whence) fseeko((fid), (off_t)(offset), (whence))
+#define ftell64(fid) ((DjifixOffset)ftello(fid))
+#elif defined(_WIN32)
+#define fseek64(fid, offset, whence) _fseeki64((fid), (offset), (whence))
+#define ftell64(fid) ((DjifixOffset)_ftelli64(fid))
+#else
+#define fseek64(fid, offset, whence) fseek((fid), (long)(offset), (whence))
+#define ftell64(fid) ((DjifixOffset)ftell(fid))
+#endif
+#define MAX_OFFSET ((DjifixOffset)(~0ULL>>1)) /* the largest "DjifixOffset" */
+
+/* SIMD instructions that we can use to speed up scanning through data: */
+#if defined(__AVX2__)
+#define USE_AVX2 1
+#define SCAN_BLOCK_SIZE 32
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2 1
+#define SCAN_BLOCK_SIZE 16
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#define USE_NEON 1
+#define SCAN_BLOCK_SIZE 16
+#include <arm_neon.h>
+#endif
 
 #define fourcc_ftyp (('f'<<24)|('t'<<16)|('y'<<8)|'p')
 #define fourcc_moov (('m'<<24)|('o'<<16)|('o'<<8)|'v')
 #define fourcc_free (('f'<<24)|('r'<<16)|('e'<<8)|'e')
 #define fourcc_mdat (('m'<<24)|('d'<<16)|('a'<<8)|'t')
+#define fourcc_trak (('t'<<24)|('r'<<16)|('a'<<8)|'k')
+#define fourcc_mdia (('m'<<24)|('d'<<16)|('i'<<8)|'a')
+#define fourcc_minf (('m'<<24)|('i'<<16)|('n'<<8)|'f')
+#define fourcc_stbl (('s'<<24)|('t'<<16)|('b'<<8)|'l')
+#define fourcc_stco (('s'<<24)|('t'<<16)|('c'<<8)|'o')
+#define fourcc_co64 (('c'<<24)|('o'<<16)|('6'<<8)|'4')
+#define fourcc_stsz (('s'<<24)|('t'<<16)|('s'<<8)|'z')
+#define fourcc_stsc (('s'<<24)|('t'<<16)|('s'<<8)|'c')
+#define fourcc_dinf (('d'<<24)|('i'<<16)|('n'<<8)|'f')
+#define fourcc_edts (('e'<<24)|('d'<<16)|('t'<<8)|'s')
 
-static int get1Byte(FILE* fid, unsigned char* result); /* forward */
-static int get4Bytes(FILE* fid, unsigned* result); /* forward */
-static int checkAtom(FILE* fid, unsigned fourccToCheck, unsigned* numRemainingBytesToSkip); /* forward */
-static void doRepairType1(FILE* inputFID, FILE* outputFID, unsigned ftypSize); /* forward */
-static void doRepairType2(FILE* inputFID, FILE* outputFID, unsigned second4Bytes); /* forward */
+typedef struct Arena Arena;
+static void* arenaAlloc(Arena* arena, size_t size); /* forward */
+static void* arenaRealloc(Arena* arena, void* ptr, size_t size); /* forward */
+static void arenaFree(Arena* arena, void* ptr); /* forward */
 
-static char const* versionStr = "2016-04-19";
-static char const* repairedFilenameStr = "-repaired";
+/* The file that we're repairing.  If possible, we memory-map it, so that reading it - and
+   seeking within it - is just pointer arithmetic.  Otherwise, we read it using 'stdio'.
+   If it's our standard input (named "-"), we treat it as a stream, which we can't seek: we
+   keep the data that we've read from it in a buffer, so that we can still move back (a
+   little) in it, and forward, without seeking.  (A library caller can also give us data that's
+   already in memory; we then treat it like a mapping, except that we don't unmap it.  Or it
+   can give us a "DjifixReader"; "fid" then reads through it, with no file descriptor.): */
+typedef struct InputFile {
+  FILE* fid;
+  unsigned char const* mapStart; /* NULL if the file is not memory-mapped */
+  DjifixOffset mapSize;
+  DjifixOffset mapPos; /* our current position within the mapping; may be past the end */
+  unsigned char* streamBuffer; /* NULL if the file is not a stream */
+  size_t streamBufferSize, streamBufferLen;
+  DjifixOffset streamBufferPos; /* the stream position of the start of "streamBuffer" */
+  DjifixOffset streamPos; /* our current position within the stream; never before "streamBufferPos" */
+  int streamIsForwardOnly; /* if set, we no longer keep data from before "streamPos" */
+  DjifixReader const* reader; /* if not NULL, "fid" reads through this */
+  unsigned char* stdioBuffer; /* if not NULL, the buffer (in "arena") that "fid" uses */
+  Arena* arena; /* where we allocate our buffers (NULL: with "malloc()") */
+} InputFile;
+
+static InputFile* openInputFile(char const* fileName, Arena* arena); /* forward */
+static InputFile* openInputFID(FILE* fid, int isStream, Arena* arena); /* forward */
+static InputFile* openInputBuffer(unsigned char const* data, size_t dataSize, Arena* arena); /* forward */
+static InputFile* openInputReader(DjifixReader const* reader, Arena* arena); /* forward */
+static void closeInputFile(InputFile* inputFile); /* forward */
+static int inputSeek(InputFile* inputFile, DjifixOffset offset, int whence); /* forward */
+static DjifixOffset inputTell(InputFile* inputFile); /* forward */
+static FILE* inputFIDAtCurrentPosition(InputFile* inputFile); /* forward */
+static void inputDiscardHistory(InputFile* inputFile); /* forward */
+static int get1Byte(InputFile* inputFile, unsigned char* result); /* forward */
+static int get4Bytes(InputFile* inputFile, unsigned* result); /* forward */
+static size_t getBytes(InputFile* inputFile, unsigned char* to, size_t numBytes); /* forward */
+static int checkAtom(InputFile* inputFile, unsigned fourccToCheck, DjifixOffset* numRemainingBytesToSkip); /* forward */
+static size_t findSaneData(unsigned char const* buf, size_t len); /* forward */
+static size_t findNALSize2(unsigned char const* buf, size_t len); /* forward */
+static int scanInput(InputFile* inputFile, size_t (*finder)(unsigned char const*, size_t),
+		     unsigned stride); /* forward */
+static int isUncorruptedFile(InputFile* inputFile); /* forward */
+typedef struct Checkpoint Checkpoint;
+typedef struct AsyncWriter AsyncWriter;
+typedef struct FaststartLayout FaststartLayout;
+static int doRepair(DjifixContext* ctx, FILE* outputFID, Checkpoint* resume); /* forward */
+static int doRepairType1(DjifixContext* ctx, FILE* outputFID, int isResuming); /* forward */
+static int repairFaststart(DjifixContext* ctx, FILE* outputFID); /* forward */
+static void checkRepairedAtoms(DjifixContext* ctx, FaststartLayout const* faststart); /* forward */
+static int checkAtomTree(unsigned char const* p, size_t size); /* forward */
+#ifndef DJIFIX_NO_MAIN
+static int checkCRC32CShift(void); /* forward */
+#endif
+static int doRepairType2(DjifixContext* ctx, FILE* outputFID, Checkpoint* resume); /* forward */
+static void startProgress(DjifixContext* ctx); /* forward */
+static void noteProgress(DjifixContext* ctx, DjifixOffset inputPos, DjifixOffset outputPos); /* forward */
+static void reportProgress(DjifixContext* ctx, int isDone); /* forward */
+static void writeJSONString(FILE* fid, char const* str); /* forward */
+static double secondsNow(void); /* forward */
+static void profileBegin(DjifixContext* ctx, int phase, DjifixOffset pos); /* forward */
+static void profileEnd(DjifixContext* ctx, int phase, DjifixOffset pos); /* forward */
+static void resetProfile(DjifixContext* ctx); /* forward */
+static void closeProfiler(DjifixContext* ctx); /* forward */
+static Arena* openArena(void* memory, size_t size); /* forward */
+static void noteMemoryPeak(DjifixContext* ctx); /* forward */
+static void closeArena(Arena* arena); /* forward */
+static void writeCheckpoint(DjifixContext* ctx); /* forward */
+static void noteCheckpointWriter(DjifixContext* ctx, AsyncWriter* writer); /* forward */
+
+static char const* versionStr = "2026-10-14";
 static char const* startingToRepair = "Repairing the file (please wait)...";
+static char const* resumingRepair = "Resuming the repair of the file (please wait)...";
 static char const* cantRepair = "  We cannot repair this file!";
 
-int main(int argc, char** argv) {
-  char* inputFileName;
+#ifdef HAVE_THREADS
+/* Used (in batch mode) to stop repairs from prompting the user at the same time: */
+static pthread_mutex_t promptMutex = PTHREAD_MUTEX_INITIALIZER;
+#define lockPrompt() pthread_mutex_lock(&promptMutex)
+#define unlockPrompt() pthread_mutex_unlock(&promptMutex)
+#else
+#define lockPrompt()
+#define unlockPrompt()
+#endif
+
+#ifdef HAVE_THREADS
+/* Used to stop different repairs (in batch mode) from writing stats at the same time: */
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+#define lockStats() pthread_mutex_lock(&statsMutex)
+#define unlockStats() pthread_mutex_unlock(&statsMutex)
+#else
+#define lockStats()
+#define unlockStats()
+#endif
+
+/* A video format for 'type 2' repairs is an index into "videoFormats[]" (below), or
+   FORMAT_NONE if we should detect it if we can (and otherwise prompt for it), or FORMAT_AUTO if
+   we should always use the format that we detect: */
+#define FORMAT_NONE DJIFIX_FORMAT_DETECT
+#define FORMAT_AUTO DJIFIX_FORMAT_AUTO
+
+#ifndef DJIFIX_NO_MAIN
+/* The "djifix" program.  (Building with DJIFIX_NO_MAIN defined leaves just the library
+   interface, declared in "djifix.h".) */
+
+static char const* repairedFilenameStr = "-repaired";
+
+/* The video format to use for 'type 2' repairs: */
+static int formatOption = FORMAT_NONE;
+
+/* The name of the repaired file, if given on the command line ("-" means our standard output);
+   otherwise NULL (and we generate the name from the name of the file being repaired): */
+static char const* outputFileNameOption = NULL;
+
+/* Set if 'type 2' repairs should produce a MP4 file, rather than a raw H.264 ('.h264') file: */
+static int type2OutputIsMP4 = 0;
+
+/* The number of threads that copy a 'type 2' file's NAL units (if the file is memory-mapped): */
+static unsigned numCopyThreads = 1;
+
+/* Set if 'type 1' repairs should change the file itself ("-i"), rather than writing a new file: */
+static int repairInPlace = 0;
+
+/* Set if repairs should record checkpoints ("-c"), so that they can be resumed if they're
+   interrupted: */
+static int checkpointOption = 0;
+
+/* Set if 'type 1' repairs should copy each recording in the file to its own repaired file
+   ("-m"), rather than copying everything after the first 'ftyp': */
+static int multiSegmentOption = 0;
+
+/* Set if 'type 1' repairs should put the 'moov' atom at the start of the repaired file ("-F"),
+   so that it can be played as it streams: */
+static int faststartOption = 0;
+
+/* Set if 'type 2' repairs to a '.h264' file should also write a NAL index ("-x"), in a file
+named by adding "indexFilenameStr" to the repaired file's name: */
+static int indexOption = 0;
+static char const* indexFilenameStr = ".nalindex";
+
+/* Set if we should just classify each file ("-p"), rather than repairing it: */
+static int probeOnly = 0;
+
+/* If non-zero, the size of the synthetic files that we generate (and then time probing and
+   repairing) in benchmark mode ("-B"): */
+static DjifixOffset benchmarkSize = 0;
+
+/* Set if we should report each repair's progress ("-v"): */
+static int showProgressOption = 0;
+
+/* Where we write each repair's progress, as JSON lines ("-s"); otherwise NULL: */
+static FILE* statsFID = NULL;
+
+/* Set if we should profile each phase of each probe and repair ("-P"): */
+static int profileOption = 0;
+
+/* Set if - when we can't detect a 'type 2' file's video format for sure - we should write a
+   trial '.h264' file for each format that it might be ("-T"), named by adding "-<format>" to
+   the (base) name of the repaired file: */
+static int trialOption = 0;
+
+/* Set if we should checksum (CRC-32C) each repaired file as it's written, and check its
+   structure ("-V"): */
+static int verifyOption = 0;
+
+/* The directory that we watch for files to repair ("-w"); otherwise NULL: */
+static char const* watchDirOption = NULL;
+
+/* If non-zero, the most memory that each repair may use for its buffers ("-M", divided among
+   the repairs that run in parallel); each repair allocates it once, when it begins: */
+static size_t memoryOption = 0;
+static size_t memoryPerRepair = 0;
+
+/* The results of "repairFile()": */
+#define REPAIR_OK 0
+#define REPAIR_FAILED 1
+#define REPAIR_SKIPPED 2 /* the file did not appear to be corrupted */
+
+/* Multi-segment salvage ("-m"): Each segment of a 'type 1' file is copied to a file named by
+   adding "-1", "-2", etc. to the (base) name of the repaired file.  The segments are copied by
+   up to "numCopyThreads" threads: */
+typedef struct {
+  DjifixContext* ctx;
+  DjifixSegment const* segments;
+  char** fileNames;
+  int* copied;
+  unsigned numSegments, nextSegment;
+#ifdef HAVE_THREADS
+  pthread_mutex_t mutex;
+#endif
+} SegmentCopies;
+
+static void* segmentCopyWorker(void* copiesPtr) {
+  SegmentCopies* copies = (SegmentCopies*)copiesPtr;
+
+  while (1) {
+    unsigned i;
+    FILE* outputFID;
+
+#ifdef HAVE_THREADS
+    pthread_mutex_lock(&copies->mutex);
+#endif
+    i = copies->nextSegment;
+    if (i < copies->numSegments) ++copies->nextSegment;
+#ifdef HAVE_THREADS
+    pthread_mutex_unlock(&copies->mutex);
+#endif
+    if (i >= copies->numSegments) break;
+
+    outputFID = fopen(copies->fileNames[i], "wb");
+    if (outputFID == NULL) continue;
+    copies->copied[i] = djifixCopySegment(copies->ctx, &copies->segments[i], outputFID);
+    if (fclose(outputFID) != 0) copies->copied[i] = 0;
+    if (!copies->copied[i]) remove(copies->fileNames[i]);
+  }
+
+  return NULL;
+}
+
+/* Returns REPAIR_OK or REPAIR_FAILED - or -1 if the file holds only one segment (and so should
+   be repaired as usual): */
+static int repairSegments(DjifixContext* ctx, char const* outputFileName, FILE* logFID) {
+  SegmentCopies copies;
+  DjifixSegment* segments;
+  char const* fileNamePart = strrchr(outputFileName, '/');
+  char const* dotPtr;
+  size_t baseNameLen;
+  unsigned i, numWorkers = numCopyThreads, numCopied = 0;
+  int result = REPAIR_FAILED;
+#ifdef HAVE_THREADS
+  pthread_t* workers;
+  unsigned numStarted = 0;
+#endif
+
+  copies.numSegments = djifixFindSegments(ctx, &segments);
+  if (copies.numSegments <= 1) {
+    free(segments);
+    fprintf(logFID, "(This file holds just one recording, so we'll repair it as usual.)\n");
+    return -1;
+  }
+  fprintf(logFID, "This file holds %u recordings; we'll copy each one to its own file.\n",
+	  copies.numSegments);
+
+  /* Name each segment's file by putting "-<number>" before the extension (if any): */
+  fileNamePart = fileNamePart == NULL ? outputFileName : fileNamePart+1;
+  dotPtr = strrchr(fileNamePart, '.');
+  baseNameLen = dotPtr == NULL ? strlen(outputFileName) : (size_t)(dotPtr - outputFileName);
+  copies.ctx = ctx;
+  copies.segments = segments;
+  copies.nextSegment = 0;
+  copies.fileNames = calloc(copies.numSegments, sizeof (char*));
+  copies.copied = calloc(copies.numSegments, sizeof (int));
+  do {
+    if (copies.fileNames == NULL || copies.copied == NULL) {
+      fprintf(logFID, "Failed to allocate the segment file names!\n");
+      break;
+    }
+    for (i = 0; i < copies.numSegments; ++i) {
+      copies.fileNames[i] = malloc(strlen(outputFileName) + 1/*'-'*/ + 10/*number*/ + 1);
+      if (copies.fileNames[i] == NULL) break;
+      sprintf(copies.fileNames[i], "%.*s-%u%s", (int)baseNameLen, outputFileName, i+1,
+	      &outputFileName[baseNameLen]);
+    }
+    if (i < copies.numSegments) {
+      fprintf(logFID, "Failed to allocate the segment file names!\n");
+      break;
+    }
+
+    fprintf(logFID, "%s", startingToRepair);
+    if (numWorkers > copies.numSegments) numWorkers = copies.numSegments;
+#ifdef HAVE_THREADS
+    pthread_mutex_init(&copies.mutex, NULL);
+    workers = numWorkers > 1 ? malloc((numWorkers-1)*sizeof (pthread_t)) : NULL;
+    if (workers != NULL) {
+      for (i = 0; i < numWorkers-1; ++i) {
+	if (pthread_create(&workers[i], NULL, segmentCopyWorker, &copies) != 0) break;
+	++numStarted;
+      }
+    }
+#endif
+    segmentCopyWorker(&copies); /* does its share of the work (or all of it) in this thread */
+#ifdef HAVE_THREADS
+    for (i = 0; i < numStarted; ++i) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&copies.mutex);
+#endif
+    fprintf(logFID, "...done\n\n");
+
+    for (i = 0; i < copies.numSegments; ++i) {
+      if (copies.copied[i]) {
+	++numCopied;
+	fprintf(logFID, "Recording %u (%lld bytes, at file position 0x%llx) is \"%s\"%s\n", i+1,
+		segments[i].size, segments[i].start, copies.fileNames[i],
+		segments[i].hasMoov ? "" : " (it has no 'moov' atom, so may not be playable)");
+      } else {
+	fprintf(logFID, "Failed to copy recording %u (%lld bytes, at file position 0x%llx)!\n", i+1,
+		segments[i].size, segments[i].start);
+      }
+    }
+    if (numCopied == copies.numSegments) result = REPAIR_OK;
+  } while (0);
+
+  if (copies.fileNames != NULL) {
+    for (i = 0; i < copies.numSegments; ++i) free(copies.fileNames[i]);
+  }
+  free(copies.fileNames);
+  free(copies.copied);
+  free(segments);
+  return result;
+}
+
+/* Reports (in "logFID") the repaired file's CRC-32C checksum, and whether its structure checked
+   out, if we were verifying it ("-V"): */
+static void reportVerification(DjifixContext const* ctx, FILE* logFID) {
+  if (!ctx->verify) return;
+  if (ctx->haveOutputCRC32C) {
+    fprintf(logFID, "Its CRC-32C checksum is %08lx\n", ctx->outputCRC32C);
+  }
+  if (!ctx->structureChecked) {
+    fprintf(logFID, "(Its structure was not checked.)\n");
+  } else if (ctx->structureProblem == NULL) {
+    fprintf(logFID, "Its structure checks out.\n");
+  } else {
+    fprintf(logFID, "Warning: Its structure is not sound: %s!\n", ctx->structureProblem);
+  }
+}
+
+/* Repairs a 'type 2' file to a trial '.h264' file for each video format that it might be (see
+   "djifixRepairTrials()").  Returns one of the REPAIR_* values - or -1 if we detected the
+   format for sure (in which case the file should be repaired as usual, in that format): */
+static int repairTrials(DjifixContext* ctx, char const* outputFileName, FILE* logFID) {
+  int* formats = malloc(djifixNumFormats()*sizeof (int));
+  char** fileNames = calloc(djifixNumFormats(), sizeof (char*));
+  FILE** outputFIDs = calloc(djifixNumFormats(), sizeof (FILE*));
+  char const* fileNamePart = strrchr(outputFileName, '/');
+  char const* dotPtr;
+  size_t baseNameLen;
+  unsigned i, numFormats = 0;
+  int result = REPAIR_FAILED;
+
+  if (formats == NULL || fileNames == NULL || outputFIDs == NULL) {
+    fprintf(logFID, "Failed to allocate the trial file names!\n");
+  } else if ((numFormats = djifixCandidateFormats(ctx, formats)) == 1) {
+    ctx->format = formats[0];
+    result = -1;
+  }
+  if (numFormats <= 1) {
+    free(formats); free(fileNames); free(outputFIDs);
+    return result;
+  }
+  fprintf(logFID, "We'll repair this file to a '.h264' file for each of the %u video formats that it might be.\n",
+	  numFormats);
+
+  /* Name each file by putting "-<format>" before the extension (if any): */
+  fileNamePart = fileNamePart == NULL ? outputFileName : fileNamePart+1;
+  dotPtr = strrchr(fileNamePart, '.');
+  baseNameLen = dotPtr == NULL ? strlen(outputFileName) : (size_t)(dotPtr - outputFileName);
+  do {
+    for (i = 0; i < numFormats; ++i) {
+      char const* formatName = djifixFormatName(formats[i]);
+
+      fileNames[i] = malloc(strlen(outputFileName) + 1/*'-'*/ + strlen(formatName) + 1);
+      if (fileNames[i] == NULL) {
+	fprintf(logFID, "Failed to allocate the trial file names!\n");
+	break;
+      }
+      sprintf(fileNames[i], "%.*s-%s%s", (int)baseNameLen, outputFileName, formatName,
+	      &outputFileName[baseNameLen]);
+      if ((outputFIDs[i] = fopen(fileNames[i], "w+b")) == NULL) {
+	fprintf(logFID, "Failed to open output file: %s\n", strerror(errno));
+	break;
+      }
+    }
+    if (i < numFormats) break;
+
+    if (djifixRepairTrials(ctx, outputFIDs, formats, numFormats)) result = REPAIR_OK;
+  } while (0);
+
+  for (i = 0; i < numFormats; ++i) {
+    if (outputFIDs[i] != NULL && fclose(outputFIDs[i]) != 0) result = REPAIR_FAILED;
+  }
+  if (result == REPAIR_OK) {
+    fprintf(logFID, "...done\n\n");
+    for (i = 0; i < numFormats; ++i) {
+      fprintf(logFID, "If the video format was %s, the repaired file is \"%s\"\n",
+	      djifixFormatName(formats[i]), fileNames[i]);
+    }
+    fprintf(logFID, "(Each can be played by the VLC media player (available at <http://www.videolan.org/vlc/>); the first is the most likely.)\n");
+    if (ctx->verify) fprintf(logFID, "For the first file:\n");
+    reportVerification(ctx, logFID);
+  } else {
+    fprintf(logFID, "\nFailed to write the trial files!\n");
+  }
+  for (i = 0; i < numFormats; ++i) {
+    if (result != REPAIR_OK && outputFIDs[i] != NULL) remove(fileNames[i]);
+    free(fileNames[i]);
+  }
+  free(formats); free(fileNames); free(outputFIDs);
+  return result;
+}
+
+/* Reports how long each phase of the probe and repair took (and how much of the input file
+   it covered, and - if we could count them - its CPU cycles and cache misses), in "logFID", and
+   (as JSON lines) in "statsFID": */
+static void reportProfile(DjifixContext* ctx, FILE* logFID) {
+  int phase;
+
+  if (!ctx->profile) return;
+  fprintf(logFID, "\nProfile (each phase includes those indented below it):\n");
+  for (phase = 0; phase < DJIFIX_NUM_PHASES; ++phase) {
+    DjifixPhaseProfile const* prof = &ctx->phaseProfiles[phase];
+    int isInner = phase == DJIFIX_PHASE_ATOM_CHECKS || phase == DJIFIX_PHASE_NESTED_FTYPS ||
+      phase == DJIFIX_PHASE_RECOVERY;
+
+    if (prof->numCalls == 0) continue;
+    fprintf(logFID, "\t%s%-*s %6lu x %10.6f s %14lld bytes", isInner ? "  " : "", isInner ? 12 : 14,
+	    djifixPhaseName(phase), prof->numCalls, prof->seconds, prof->bytes);
+    if (prof->seconds > 0.0) fprintf(logFID, " (%.1f MB/s)", prof->bytes/prof->seconds/(1024*1024));
+    if (prof->cycles >= 0) fprintf(logFID, ", %lld cycles", prof->cycles);
+    if (prof->cacheMisses >= 0) fprintf(logFID, ", %lld cache misses", prof->cacheMisses);
+    fprintf(logFID, "\n");
+
+    if (ctx->statsFID != NULL) {
+      lockStats();
+      fprintf(ctx->statsFID, "{\"event\":\"profile\",\"file\":");
+      if (ctx->inputFileName != NULL) writeJSONString(ctx->statsFID, ctx->inputFileName);
+      else fprintf(ctx->statsFID, "null");
+      fprintf(ctx->statsFID, ",\"phase\":\"%s\",\"calls\":%lu,\"seconds\":%.6f,\"bytes\":%lld,\"cycles\":%lld,\"cacheMisses\":%lld}\n",
+	      djifixPhaseName(phase), prof->numCalls, prof->seconds, prof->bytes, prof->cycles,
+	      prof->cacheMisses);
+      fflush(ctx->statsFID);
+      unlockStats();
+    }
+  }
+  if (ctx->phaseProfiles[DJIFIX_PHASE_PROBE].cycles < 0) {
+    fprintf(logFID, "\t(We couldn't count CPU cycles or cache misses here.)\n");
+  }
+}
+
+/* Removes the output file of a repair that failed - unless it's not a regular file (e.g., it's
+   a device, such as "/dev/full"), which we leave alone: */
+static void removeOutputFile(char const* fileName) {
+#ifdef HAVE_FILE_DESCRIPTORS
+  struct stat sb;
+
+  if (stat(fileName, &sb) != 0 || !S_ISREG(sb.st_mode)) return;
+#endif
+  remove(fileName);
+}
+
+/* Repairs a single file.  Messages about the repair are written to "logFID".
+   If "skipIfUncorrupted" is set, we don't repair files that appear not to be corrupted.
+   If "memory" is not NULL, it's "memoryPerRepair" bytes, for all of the repair's buffers.
+*/
+static int repairFileUsing(char const* inputFileName, FILE* logFID, int skipIfUncorrupted,
+			   void* memory) {
+  DjifixContext ctx;
   char* outputFileName;
-  FILE* inputFID;
+  char* indexFileName = NULL;
   FILE* outputFID;
-  unsigned numBytesToSkip, dummy;
-  int repairType = 1; /* by default */
-  unsigned repairType1FtypSize; /* used only for 'repair type 1' files */
-  unsigned repairType2Second4Bytes; /* used only for 'repair type 2' files */
+  int toStdout, repaired;
+
+  djifixInitContext(&ctx);
+  ctx.logFID = logFID;
+  ctx.format = formatOption;
+  ctx.numCopyThreads = numCopyThreads;
+  ctx.skipIfUncorrupted = skipIfUncorrupted;
+  ctx.canPrompt = 1;
+  ctx.inputFileName = inputFileName;
+  ctx.showProgress = showProgressOption;
+  ctx.statsFID = statsFID;
+  ctx.faststart = faststartOption;
+  ctx.profile = profileOption;
+  ctx.memory = memory;
+  ctx.memorySize = memoryPerRepair;
+  ctx.verify = verifyOption;
 
   do {
-    fprintf(stderr, "%s, version %s; Copyright (c) 2014-2016 Live Networks, Inc. All rights reserved.\n", argv[0], versionStr);
 
-    if (argc != 2) {
-      usage(argv[0]);
+    /* Open the input file: */
+    if (!djifixOpenFile(&ctx, inputFileName)) {
+      fprintf(logFID, "Failed to open file to repair: %s\n", strerror(errno));
       break;
     }
-    inputFileName = argv[1];
 
-    /* Open the input file: */
-    inputFID  = fopen(inputFileName, "rb");
-    if (inputFID == NULL) {
-      perror("Failed to open file to repair");
+    /* Check the start of the file, to see whether - and how - we can repair it: */
+    djifixProbe(&ctx);
+    if (ctx.probeResult == DJIFIX_PROBE_UNCORRUPTED) {
+      fprintf(logFID, "This file appears not to be corrupted, so we are not repairing it.\n");
+      djifixClose(&ctx);
+      return REPAIR_SKIPPED;
+    }
+    if (ctx.probeResult != DJIFIX_PROBE_REPAIRABLE) break;
+
+    if (repairInPlace) {
+#ifdef HAVE_FILE_DESCRIPTORS
+      if (ctx.repairType == 1 && ctx.inputFile->streamBuffer == NULL) {
+	int fd = open(inputFileName, O_RDWR);
+	int inPlaceResult;
+
+	if (fd < 0) {
+	  fprintf(logFID, "Failed to open the file for writing: %s\n", strerror(errno));
+	  break;
+	}
+	fprintf(logFID, "Repairing the file in place (please wait)...");
+	inPlaceResult = djifixRepairInPlace(&ctx, fd);
+	if (close(fd) != 0) inPlaceResult = 0;
+	if (!inPlaceResult) {
+	  fprintf(logFID, "Failed to repair the file in place!\n");
+	  break;
+	}
+	fprintf(logFID, "...done\n");
+	djifixClose(&ctx);
+	fprintf(logFID, "\nRepaired file is \"%s\" (the original file, changed in place)\n",
+		inputFileName);
+	return REPAIR_OK;
+      }
+#endif
+      fprintf(logFID, "(We can't repair this file in place, so we'll write a new file instead.)\n");
+    }
+
+    if (ctx.repairType == 2) {
+      /* We write a MP4 file if asked - unless we're writing to our standard output (because we
+	 need to go back to fill in the size of the 'mdat' atom): */
+      if (type2OutputIsMP4) {
+	char const* name = outputFileNameOption != NULL ? outputFileNameOption
+	  : ctx.inputFile->streamBuffer != NULL ? "-" : "";
+
+	ctx.outputIsMP4 = strcmp(name, "-") != 0;
+	if (!ctx.outputIsMP4) fprintf(logFID, "We can't write a '.mp4' file to our standard output.\n");
+      }
+      if (ctx.outputIsMP4) {
+	fprintf(logFID, "We can repair this file.  The result will be a '.mp4' file (containing just the video).\n");
+      } else {
+	fprintf(logFID, "We can repair this file, but the result will be a '.h264' file (playable by the VLC media player), not a '.mp4' file.\n");
+      }
+    }
+
+    /* Now generate the output file name: */
+    if (outputFileNameOption != NULL || ctx.inputFile->streamBuffer != NULL) {
+      /* The name was given on the command line - or we're repairing our standard input, in
+	 which case we also write to our standard output (unless told otherwise): */
+      char const* name = outputFileNameOption != NULL ? outputFileNameOption : "-";
+
+      outputFileName = malloc(strlen(name) + 1);
+      if (outputFileName == NULL) {
+	fprintf(logFID, "Failed to allocate the output file name!\n");
+	break;
+      }
+      strcpy(outputFileName, name);
+    } else {
+      char const* fileNamePart = strrchr(inputFileName, '/');
+      char const* dotPtr;
+      size_t baseNameLen;
+
+      /* The output file name is the input file name, minus its extension (if any), plus
+	 "repairedFilenameStr", plus the new extension: */
+      fileNamePart = fileNamePart == NULL ? inputFileName : fileNamePart+1;
+      dotPtr = strrchr(fileNamePart, '.');
+      baseNameLen = dotPtr == NULL ? strlen(inputFileName) : (size_t)(dotPtr - inputFileName);
+
+      outputFileName = malloc(baseNameLen + strlen(repairedFilenameStr) + 1/*dot*/ + 4/*h264*/
+			      + 1/*trailing '\0'*/);
+      if (outputFileName == NULL) {
+	fprintf(logFID, "Failed to allocate the output file name!\n");
+	break;
+      }
+      sprintf(outputFileName, "%.*s%s.%s", (int)baseNameLen, inputFileName, repairedFilenameStr,
+	      ctx.repairType == 1 || ctx.outputIsMP4 ? "mp4" : "h264");
+    }
+
+    /* Then do the repair.  (If we're recording checkpoints, the library opens the output
+       file - so that it can continue an earlier repair of it - and we keep what's been written
+       if the repair fails.): */
+    toStdout = strcmp(outputFileName, "-") == 0;
+    if (multiSegmentOption && ctx.repairType == 1) {
+      if (toStdout || ctx.inputFile->streamBuffer != NULL) {
+	fprintf(logFID, "(We can't copy each recording to its own file when reading our standard input or writing our standard output.)\n");
+      } else {
+	int result = repairSegments(&ctx, outputFileName, logFID);
+
+	if (result >= 0) {
+	  free(outputFileName);
+	  djifixClose(&ctx);
+	  return result;
+	}
+      }
+    }
+    if (trialOption && ctx.repairType == 2 &&
+	(formatOption == FORMAT_NONE || formatOption == FORMAT_AUTO)) {
+      if (ctx.outputIsMP4 || toStdout) {
+	fprintf(logFID, "(We can write trial files - one for each video format - only as '.h264' files, and not to our standard output.)\n");
+      } else {
+	int result = repairTrials(&ctx, outputFileName, logFID);
+
+	if (result >= 0) {
+	  free(outputFileName);
+	  djifixClose(&ctx);
+	  reportProfile(&ctx, logFID);
+	  return result;
+	}
+      }
+    }
+    if (indexOption && ctx.repairType == 2 && !ctx.outputIsMP4) {
+      /* Also write a NAL index for the '.h264' file.  (If we're recording checkpoints, we keep
+	 any existing index, because the library might continue writing it.): */
+      if (toStdout) {
+	fprintf(logFID, "(We can't write a NAL index for our standard output.)\n");
+      } else {
+	indexFileName = malloc(strlen(outputFileName) + strlen(indexFilenameStr) + 1);
+	if (indexFileName == NULL) {
+	  fprintf(logFID, "Failed to allocate the NAL index file name!\n");
+	  free(outputFileName);
+	  break;
+	}
+	sprintf(indexFileName, "%s%s", outputFileName, indexFilenameStr);
+	ctx.indexFID = checkpointOption ? fopen(indexFileName, "r+b") : NULL;
+	if (ctx.indexFID == NULL) ctx.indexFID = fopen(indexFileName, checkpointOption ? "w+b" : "wb");
+	if (ctx.indexFID == NULL) {
+	  fprintf(logFID, "Failed to open the NAL index file: %s\n", strerror(errno));
+	  free(indexFileName);
+	  free(outputFileName);
+	  break;
+	}
+      }
+    }
+    if (checkpointOption && !toStdout) {
+      repaired = djifixRepairWithCheckpoints(&ctx, outputFileName);
+    } else {
+      outputFID = toStdout ? stdout : fopen(outputFileName, "wb");
+      if (outputFID == NULL) {
+	fprintf(logFID, "Failed to open output file: %s\n", strerror(errno));
+	free(outputFileName);
+	break;
+      }
+      repaired = djifixRepair(&ctx, outputFID);
+      if (fclose(outputFID) != 0 && repaired) {
+	fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	repaired = 0;
+      }
+      if (!repaired && !toStdout) removeOutputFile(outputFileName);
+    }
+    if (ctx.indexFID != NULL) {
+      if (fclose(ctx.indexFID) != 0) fprintf(logFID, "Failed to write the NAL index!\n");
+      ctx.indexFID = NULL;
+      if (!repaired && !checkpointOption) remove(indexFileName);
+    }
+    if (!repaired) {
+      free(indexFileName);
+      free(outputFileName);
+      break;
+    }
+
+    fprintf(logFID, "...done\n");
+    djifixClose(&ctx);
+    if (toStdout) {
+      fprintf(logFID, "\nThe repaired file was written to our standard output.\n");
+    } else {
+      fprintf(logFID, "\nRepaired file is \"%s\"\n", outputFileName);
+    }
+    if (indexFileName != NULL) fprintf(logFID, "Its NAL index is \"%s\"\n", indexFileName);
+    free(indexFileName);
+    reportVerification(&ctx, logFID);
+    reportProfile(&ctx, logFID);
+
+    if (ctx.repairType == 2 && !ctx.outputIsMP4 && !toStdout) {
+      fprintf(logFID, "This file can be played by the VLC media player (available at <http://www.videolan.org/vlc/>)\n");
+
+      /* Check whether the output file name ends with ".h264" (or ".H264").  If it doesn't,
+	 warn the user that he needs to change the name in order for the file to be playable.
+      */
+      {
+	size_t outputFileNameLen = strlen(outputFileName);
+	if (outputFileNameLen < 5 ||
+	    (strcmp(&outputFileName[outputFileNameLen-5], ".h264") != 0 &&
+	     strcmp(&outputFileName[outputFileNameLen-5], ".H264") != 0)) {
+	  fprintf(logFID, "but you MUST first rename the file so that its name ends with \".h264\"!\n");
+	}
+      }
+    }
+    free(outputFileName);
+
+    /* OK */
+    return REPAIR_OK;
+  } while (0);
+
+  /* An error occurred: */
+  djifixClose(&ctx);
+  reportProfile(&ctx, logFID);
+  return REPAIR_FAILED;
+}
+
+static int repairFile(char const* inputFileName, FILE* logFID, int skipIfUncorrupted) {
+  void* memory = NULL;
+  int result;
+
+  if (memoryPerRepair > 0 && (memory = malloc(memoryPerRepair)) == NULL) {
+    fprintf(logFID, "Failed to allocate %lu bytes of memory for the repair!\n",
+	    (unsigned long)memoryPerRepair);
+    return REPAIR_FAILED;
+  }
+  result = repairFileUsing(inputFileName, logFID, skipIfUncorrupted, memory);
+  free(memory);
+  return result;
+}
+#endif
+
+/* The library interface (see "djifix.h"): */
+
+char const* djifixVersion(void) {
+  return versionStr;
+}
+
+void djifixInitContext(DjifixContext* ctx) {
+  memset(ctx, 0, sizeof (DjifixContext));
+  ctx->logFID = stderr;
+  ctx->format = FORMAT_NONE;
+  ctx->numCopyThreads = 1;
+  ctx->progressInterval = DJIFIX_DEFAULT_PROGRESS_INTERVAL;
+  ctx->checkpointInterval = DJIFIX_DEFAULT_CHECKPOINT_INTERVAL;
+  ctx->chosenFormat = FORMAT_NONE;
+}
+
+/* With "memory", each file that we open gets a new arena there, so any file that's already
+   open (using the old one) must be closed first.  Returns 0 if "memory" is too small to hold
+   an arena: */
+static int prepareArena(DjifixContext* ctx) {
+  if (ctx->memory == NULL) return 1;
+  djifixClose(ctx);
+  if (ctx->memorySize < DJIFIX_MIN_MEMORY_SIZE) return 0;
+  ctx->memoryPeak = 0;
+  ctx->arena = openArena(ctx->memory, ctx->memorySize);
+  return ctx->arena != NULL;
+}
+
+static void setInputFile(DjifixContext* ctx, InputFile* inputFile) {
+  if (ctx->memory == NULL) djifixClose(ctx); /* (otherwise, "prepareArena()" did this) */
+  ctx->inputFile = inputFile;
+}
+
+int djifixOpenFile(DjifixContext* ctx, char const* fileName) {
+  InputFile* inputFile;
+
+  if (!prepareArena(ctx) || (inputFile = openInputFile(fileName, ctx->arena)) == NULL) return 0;
+  setInputFile(ctx, inputFile);
+  return 1;
+}
+
+int djifixOpenFD(DjifixContext* ctx, int fd) {
+#ifdef HAVE_FILE_DESCRIPTORS
+  /* We use our own copy of the file descriptor, so that closing it leaves the caller's open: */
+  struct stat sb;
+  int ourFD;
+  FILE* fid;
+  InputFile* inputFile;
+
+  if (!prepareArena(ctx) || fstat(fd, &sb) != 0 || (ourFD = dup(fd)) < 0) return 0;
+  fid = fdopen(ourFD, "rb");
+  if (fid == NULL) {
+    close(ourFD);
+    return 0;
+  }
+
+  /* Anything other than a regular file (e.g., a pipe or socket) is treated as a stream: */
+  inputFile = openInputFID(fid, !S_ISREG(sb.st_mode), ctx->arena);
+  if (inputFile == NULL) {
+    fclose(fid);
+    return 0;
+  }
+  setInputFile(ctx, inputFile);
+  return 1;
+#else
+  (void)ctx; (void)fd;
+  return 0;
+#endif
+}
+
+int djifixOpenBuffer(DjifixContext* ctx, unsigned char const* data, size_t dataSize) {
+  InputFile* inputFile;
+
+  if (!prepareArena(ctx) || (inputFile = openInputBuffer(data, dataSize, ctx->arena)) == NULL) {
+    return 0;
+  }
+  setInputFile(ctx, inputFile);
+  return 1;
+}
+
+int djifixOpenReader(DjifixContext* ctx, DjifixReader const* reader) {
+  InputFile* inputFile;
+
+  if (!prepareArena(ctx) || (inputFile = openInputReader(reader, ctx->arena)) == NULL) return 0;
+  setInputFile(ctx, inputFile);
+  return 1;
+}
+
+int djifixProbe(DjifixContext* ctx) {
+  InputFile* inputFile = ctx->inputFile;
+  FILE* logFID = ctx->logFID;
+  DjifixOffset numBytesToSkip, dummy;
+  int repairType = 1; /* by default */
+  unsigned repairType1FtypSize = 0; /* used only for 'repair type 1' files */
+  unsigned repairType2Second4Bytes = 0; /* used only for 'repair type 2' files */
+  DjifixOffset dataOffset = 0;
+  unsigned numNestedFtyps = 0;
+  DjifixOffset moovPos = 0, moovSize = 0; /* the 'moov' atom before the 'mdat' (if any) */
+
+  ctx->probeResult = DJIFIX_PROBE_UNREPAIRABLE;
+  resetProfile(ctx);
+  do {
+    if (inputFile == NULL) break;
+    profileBegin(ctx, DJIFIX_PHASE_PROBE, 0);
+
+    if (ctx->skipIfUncorrupted && isUncorruptedFile(inputFile)) {
+      ctx->probeResult = DJIFIX_PROBE_UNCORRUPTED;
       break;
     }
 
@@ -108,8 +1067,8 @@ int main(int argc, char** argv) {
       int fileStartIsOK;
       int amAtStartOfFile = 1;
 
-      if (!get4Bytes(inputFID, &first4Bytes) || !get4Bytes(inputFID, &next4Bytes)) {
-	fprintf(stderr, "Unable to read the start of the file.%s\n", cantRepair);
+      if (!get4Bytes(inputFile, &first4Bytes) || !get4Bytes(inputFile, &next4Bytes)) {
+	fprintf(logFID, "Unable to read the start of the file.%s\n", cantRepair);
 	break;
       }
 
@@ -117,46 +1076,45 @@ int main(int argc, char** argv) {
       while (1) {
 	if (next4Bytes == fourcc_ftyp) {
 	  /* Repair type 1 */
-	  if (first4Bytes < 8 || fseek(inputFID, first4Bytes-8, SEEK_CUR) != 0) {
-	    fprintf(stderr, "Bad length for initial 'ftyp' atom.%s\n", cantRepair);
+	  if (first4Bytes < 8 || inputSeek(inputFile, first4Bytes-8, SEEK_CUR) != 0) {
+	    fprintf(logFID, "Bad length for initial 'ftyp' atom.%s\n", cantRepair);
 	    fileStartIsOK = 0;
 	  } else {
-	    if (!amAtStartOfFile) fprintf(stderr, "Found 'ftyp' (at file position 0x%lx)\n", ftell(inputFID) - 8); else fprintf(stderr, "Saw initial 'ftyp'.\n");
+	    if (!amAtStartOfFile) fprintf(logFID, "Found 'ftyp' (at file position 0x%llx)\n", inputTell(inputFile) - 8); else fprintf(logFID, "Saw initial 'ftyp'.\n");
 	  }
 	} else if (first4Bytes == 0x00000002) {
 	  /* Assume repair type 2 */
-	  if (!amAtStartOfFile) fprintf(stderr, "Found 0x00000002 (at file position 0x%lx)\n", ftell(inputFID) - 8);
+	  if (!amAtStartOfFile) fprintf(logFID, "Found 0x00000002 (at file position 0x%llx)\n", inputTell(inputFile) - 8);
 	  repairType = 2;
 	  repairType2Second4Bytes = next4Bytes;
+	  dataOffset = inputTell(inputFile) - 8;
 	} else if (first4Bytes == 0x00000000 || first4Bytes == 0xFFFFFFFF) {
 	  /* Skip initial 0x00000000 or 0xFFFFFFFF data at the start of the file: */
 	  if (amAtStartOfFile) {
-	    fprintf(stderr, "Skipping initial junk 0x%08X bytes at the start of the file...\n", first4Bytes);
+	    fprintf(logFID, "Skipping initial junk 0x%08X bytes at the start of the file...\n", first4Bytes);
 	    amAtStartOfFile = 0;
 	  }
 	  first4Bytes = next4Bytes;
-	  if (!get4Bytes(inputFID, &next4Bytes)) {
-	    fprintf(stderr, "File appears to contain nothing but zeros or 0xFF!%s\n", cantRepair);
+	  if (!get4Bytes(inputFile, &next4Bytes)) {
+	    fprintf(logFID, "File appears to contain nothing but zeros or 0xFF!%s\n", cantRepair);
 	    fileStartIsOK = 0;
 	  } else {
 	    continue;
 	  }
 	} else {
 	  /* There's garbage at the beginning of the file.  Skip until we find sane data: */
-	  unsigned char c;
-
 	  if (amAtStartOfFile) {
-	    fprintf(stderr, "Didn't see an initial 'ftyp' atom, or 0x00000002.  Looking for data that we understand...\n");
+	    fprintf(logFID, "Didn't see an initial 'ftyp' atom, or 0x00000002.  Looking for data that we understand...\n");
 	    amAtStartOfFile = 0;
 	  }
-	  if (!get1Byte(inputFID, &c)) {
+	  /* Scan forward from 1 byte past the start of "first4Bytes" (i.e., 7 bytes back): */
+	  if (inputSeek(inputFile, -7, SEEK_CUR) != 0 || !scanInput(inputFile, findSaneData, 1) ||
+	      !get4Bytes(inputFile, &first4Bytes) || !get4Bytes(inputFile, &next4Bytes)) {
 	    /* We reached the end of the file, without seeing any data that we understand! */
-	    fprintf(stderr, "...Unable to find sane initial data.%s\n", cantRepair);
+	    fprintf(logFID, "...Unable to find sane initial data.%s\n", cantRepair);
 	    fileStartIsOK = 0;
 	  } else {
-	    /* Shift "first4Bytes" and "next4Bytes" 1-byte to the left, and keep trying: */
-	    first4Bytes = ((first4Bytes<<8)&0xFFFFFF00) | ((next4Bytes>>24)&0x000000FF);
-	    next4Bytes = ((next4Bytes<<8)&0xFFFFFF00) | c;
+	    /* Check the sane data that we found: */
 	    continue;
 	  }
 	}
@@ -169,364 +1127,6746 @@ int main(int argc, char** argv) {
 
     if (repairType == 1) {
       /* Check for a 'moov' atom next: */
-      if (checkAtom(inputFID, fourcc_moov, &numBytesToSkip)) {
-	fprintf(stderr, "Saw 'moov' (size %d == 0x%08x).\n", 8+numBytesToSkip, 8+numBytesToSkip);
-	if (fseek(inputFID, numBytesToSkip, SEEK_CUR) != 0) {
-	  fprintf(stderr, "Input file was truncated before end of 'moov'.%s\n", cantRepair);
+      moovPos = inputTell(inputFile);
+      profileBegin(ctx, DJIFIX_PHASE_ATOM_CHECKS, moovPos);
+      if (checkAtom(inputFile, fourcc_moov, &numBytesToSkip)) {
+	fprintf(logFID, "Saw 'moov' (size %lld == 0x%08llx).\n", 8+numBytesToSkip, 8+numBytesToSkip);
+	moovSize = inputTell(inputFile) - moovPos + numBytesToSkip;
+	if (inputSeek(inputFile, numBytesToSkip, SEEK_CUR) != 0) {
+	  fprintf(logFID, "Input file was truncated before end of 'moov'.%s\n", cantRepair);
 	  break;
 	}
       } else {
-	fprintf(stderr, "Didn't see a 'moov' atom.\n");
+	fprintf(logFID, "Didn't see a 'moov' atom.\n");
 	/* It's possible that this was a 'mdat' atom instead.  Rewind, and check for that next: */
-	if (fseek(inputFID, -8, SEEK_CUR) != 0) {
-	  fprintf(stderr, "Failed to rewind 8 bytes.%s\n", cantRepair);
+	if (inputSeek(inputFile, -8, SEEK_CUR) != 0) {
+	  fprintf(logFID, "Failed to rewind 8 bytes.%s\n", cantRepair);
 	  break;
 	}
       }
 
       /* Check for a 'free' atom that sometimes appears before 'mdat': */
-      if (checkAtom(inputFID, fourcc_free, &numBytesToSkip)) {
-	fprintf(stderr, "Saw 'free' (size %d == 0x%08x).\n", 8+numBytesToSkip, 8+numBytesToSkip);
-	if (fseek(inputFID, numBytesToSkip, SEEK_CUR) != 0) {
-	  fprintf(stderr, "Input file was truncated before end of 'free'.%s\n", cantRepair);
+      if (checkAtom(inputFile, fourcc_free, &numBytesToSkip)) {
+	fprintf(logFID, "Saw 'free' (size %lld == 0x%08llx).\n", 8+numBytesToSkip, 8+numBytesToSkip);
+	if (inputSeek(inputFile, numBytesToSkip, SEEK_CUR) != 0) {
+	  fprintf(logFID, "Input file was truncated before end of 'free'.%s\n", cantRepair);
 	  break;
 	}
       } else {
 	// It wasn't 'free', so rewind over the header
-	if (fseek(inputFID, -8, SEEK_CUR) != 0) {
-	  fprintf(stderr, "Failed to rewind 8 bytes.%s\n", cantRepair);
+	if (inputSeek(inputFile, -8, SEEK_CUR) != 0) {
+	  fprintf(logFID, "Failed to rewind 8 bytes.%s\n", cantRepair);
 	  break;
 	}
       }
 
       /* Check for a 'mdat' atom next: */
-      if (checkAtom(inputFID, fourcc_mdat, &dummy)) {
-	fprintf(stderr, "Saw 'mdat'.\n");
+      if (checkAtom(inputFile, fourcc_mdat, &dummy)) {
+	fprintf(logFID, "Saw 'mdat'.\n");
 
 	/* Check whether the 'mdat' data begins with a 'ftyp' atom: */
-	if (checkAtom(inputFID, fourcc_ftyp, &numBytesToSkip)) {
+	if (checkAtom(inputFile, fourcc_ftyp, &numBytesToSkip)) {
 	  /* On rare occasions, this situation is repeated: The remainder of the file consists
 	     of 'ftyp', 'moov', 'mdat' - with the 'mdat' data beginning with 'ftyp' again.
 	     Check for this now:
 	  */
-	  long curPos;
+	  DjifixOffset curPos;
 
+	  profileBegin(ctx, DJIFIX_PHASE_NESTED_FTYPS, inputTell(inputFile));
 	  while (1) {
-	    unsigned nbts_moov;
-
-	    curPos = ftell(inputFID); /* remember where we are now */
-	    if (fseek(inputFID, numBytesToSkip, SEEK_CUR) != 0) break;
-	    if (!checkAtom(inputFID, fourcc_moov, &nbts_moov)) break;
-	    if (fseek(inputFID, nbts_moov, SEEK_CUR) != 0) break;
-	    if (!checkAtom(inputFID, fourcc_mdat, &dummy)) break; /* can 0x0000002 ever occur? */
-	    if (!checkAtom(inputFID, fourcc_ftyp, &numBytesToSkip)) break;
-	    fprintf(stderr, "(Saw nested 'ftyp' within 'mdat')\n");
+	    DjifixOffset nbts_moov, nestedMoovPos, nestedMoovSize;
+
+	    curPos = inputTell(inputFile); /* remember where we are now */
+	    if (inputSeek(inputFile, numBytesToSkip, SEEK_CUR) != 0) break;
+	    nestedMoovPos = inputTell(inputFile);
+	    if (!checkAtom(inputFile, fourcc_moov, &nbts_moov)) break;
+	    nestedMoovSize = inputTell(inputFile) - nestedMoovPos + nbts_moov;
+	    if (inputSeek(inputFile, nbts_moov, SEEK_CUR) != 0) break;
+	    if (!checkAtom(inputFile, fourcc_mdat, &dummy)) break; /* can 0x0000002 ever occur? */
+	    if (!checkAtom(inputFile, fourcc_ftyp, &numBytesToSkip)) break;
+	    fprintf(logFID, "(Saw nested 'ftyp' within 'mdat')\n");
+	    ++numNestedFtyps;
+	    moovPos = nestedMoovPos; /* the innermost 'moov' is the most likely to describe the data */
+	    moovSize = nestedMoovSize;
 	  }
-	  fseek(inputFID, curPos, SEEK_SET); /* restore our old position */
+	  profileEnd(ctx, DJIFIX_PHASE_NESTED_FTYPS, inputTell(inputFile));
+	  inputSeek(inputFile, curPos, SEEK_SET); /* restore our old position */
 
-	  repairType1FtypSize = numBytesToSkip+8;
-	  fprintf(stderr, "Saw a 'ftyp' within the 'mdat' data.  We can repair this file.\n");
+	  repairType1FtypSize = (unsigned)numBytesToSkip+8;
+	  dataOffset = curPos - 8;
+	  fprintf(logFID, "Saw a 'ftyp' within the 'mdat' data.  We can repair this file.\n");
 	} else {
-	  fprintf(stderr, "Didn't see a 'ftyp' atom inside the 'mdat' data.\n");
+	  fprintf(logFID, "Didn't see a 'ftyp' atom inside the 'mdat' data.\n");
 	  /* It's possible that the 'mdat' data began with 0x00000002 (i.e., a 'type 2' repair).*/
 	  /* Rewind, and check for that next: */
-	  if (fseek(inputFID, -8, SEEK_CUR) != 0) {
-	    fprintf(stderr, "Failed to rewind 8 bytes.%s\n", cantRepair);
+	  if (inputSeek(inputFile, -8, SEEK_CUR) != 0) {
+	    fprintf(logFID, "Failed to rewind 8 bytes.%s\n", cantRepair);
 	    break;
 	  }
 	  repairType = 2;
 	}
       } else {
-	fprintf(stderr, "Didn't see a 'mdat' atom.\n");
+	fprintf(logFID, "Didn't see a 'mdat' atom.\n");
 	/* It's possible that the remaining bytes begin with 0x00000002 (i.e., a 'type 2' repair).*/
 	/* Check for that next: */
 	repairType = 2;
       }
+      profileEnd(ctx, DJIFIX_PHASE_ATOM_CHECKS, inputTell(inputFile));
 
       if (repairType == 2) {
 	/* Check for 0x00000002 occurring next, or nearby, at a 4-byte boundary: */
 	unsigned first4Bytes, next4Bytes;
 	int saw2 = 0;
 
-	fprintf(stderr, "Looking for 0x00000002...\n");
-	while (1) {
-	  if (!get4Bytes(inputFID, &first4Bytes) || !get4Bytes(inputFID, &next4Bytes)) break;/*eof*/
-	  if (first4Bytes == 0x00000002) {
-	    saw2 = 1;
-	    fprintf(stderr, "Found 0x00000002 (at file position 0x%lx)\n", ftell(inputFID) - 8);
-	    repairType2Second4Bytes = next4Bytes;
-	    break;
-	  } else {
-	    first4Bytes = next4Bytes;
-	    if (!get4Bytes(inputFID, &next4Bytes)) break;/*eof*/
-	  }
+	fprintf(logFID, "Looking for 0x00000002...\n");
+	if (scanInput(inputFile, findNALSize2, 4) &&
+	    get4Bytes(inputFile, &first4Bytes) && get4Bytes(inputFile, &next4Bytes)) {
+	  saw2 = 1;
+	  fprintf(logFID, "Found 0x00000002 (at file position 0x%llx)\n", inputTell(inputFile) - 8);
+	  repairType2Second4Bytes = next4Bytes;
+	  dataOffset = inputTell(inputFile) - 8;
 	}
 
 	if (!saw2) {
 	  /* OK, now we have to give up: */
-	  fprintf(stderr, "Didn't see 0x00000002.%s\n", cantRepair);
+	  fprintf(logFID, "Didn't see 0x00000002.%s\n", cantRepair);
 	  break;
 	}
       }
     }
 
-    if (repairType == 2) {
-      fprintf(stderr, "We can repair this file, but the result will be a '.h264' file (playable by the VLC media player), not a '.mp4' file.\n");
-    }
-
-    /* Now generate the output file name, and open the output file: */
-    {
-      unsigned suffixLen, outputFileNameSize;
-      char* dotPtr = strrchr(inputFileName, '.');
-      if (dotPtr == NULL) {
-	dotPtr = &inputFileName[strlen(inputFileName)];
-      }
-      *dotPtr = '\0';
-
-      suffixLen = repairType == 1 ? 3/*mp4*/ : 4/*h264*/;
-      outputFileNameSize = (dotPtr - inputFileName) + 1/*dot*/ + suffixLen + 1/*trailing '\0'*/;
-      outputFileName = malloc(outputFileNameSize);
-      sprintf(outputFileName, "%s%s.%s", inputFileName, repairedFilenameStr,
-	      repairType == 1 ? "mp4" : "h264");
+    /* OK */
+    ctx->probeResult = DJIFIX_PROBE_REPAIRABLE;
+    ctx->repairType = repairType;
+    ctx->ftypSize = repairType1FtypSize;
+    ctx->second4Bytes = repairType2Second4Bytes;
+    ctx->dataOffset = dataOffset;
+    ctx->numNestedFtyps = numNestedFtyps;
+    ctx->outerMoovPos = repairType == 1 ? moovPos : 0;
+    ctx->outerMoovSize = repairType == 1 ? moovSize : 0;
+  } while (0);
+  if (inputFile != NULL) {
+    /* (If we gave up part-way through, end the phases that we were in): */
+    DjifixOffset pos = inputTell(inputFile);
 
-      outputFID = fopen(outputFileName, "wb");
-      if (outputFID == NULL) {
-	perror("Failed to open output file");
-	free(outputFileName);
-	break;
-      }
-    }
+    profileEnd(ctx, DJIFIX_PHASE_ATOM_CHECKS, pos);
+    profileEnd(ctx, DJIFIX_PHASE_PROBE, pos);
+  }
+  noteMemoryPeak(ctx);
 
-    /* Begin the repair: */
-    if (repairType == 1) {
-      doRepairType1(inputFID, outputFID, repairType1FtypSize);
-    } else { /* repairType == 2 */
-      doRepairType2(inputFID, outputFID, repairType2Second4Bytes);
-    }
+  return ctx->probeResult;
+}
 
-    fprintf(stderr, "...done\n");
-    fclose(outputFID);
-    fprintf(stderr, "\nRepaired file is \"%s\"\n", outputFileName);
-    free(outputFileName);
+int djifixRepair(DjifixContext* ctx, FILE* outputFID) {
+  if (ctx->inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE) return 0;
 
-    if (repairType == 2) {
-      fprintf(stderr, "This file can be played by the VLC media player (available at <http://www.videolan.org/vlc/>)\n");
+  return doRepair(ctx, outputFID, NULL);
+}
 
-      /* Check whether the output file name ends with ".h264" (or ".H264").  If it doesn't,
-	 warn the user that he needs to change the name in order for the file to be playable.
-      */
-      {
-	size_t outputFileNameLen = strlen(outputFileName);
-	if (outputFileNameLen < 5 ||
-	    (strcmp(&outputFileName[outputFileNameLen-5], ".h264") != 0 &&
-	     strcmp(&outputFileName[outputFileNameLen-5], ".H264") != 0)) {
-	  fprintf(stderr, "but you MUST first rename the file so that its name ends with \".h264\"!\n");
-	}
-      }
-    }
+int djifixRepairToFD(DjifixContext* ctx, int fd) {
+#ifdef HAVE_FILE_DESCRIPTORS
+  int ourFD = dup(fd);
+  FILE* outputFID;
+  int result;
 
-    /* OK */
+  if (ourFD < 0) return 0;
+  outputFID = fdopen(ourFD, "wb");
+  if (outputFID == NULL) {
+    close(ourFD);
     return 0;
+  }
+
+  result = djifixRepair(ctx, outputFID);
+  if (fclose(outputFID) != 0) result = 0;
+  return result;
+#else
+  (void)ctx; (void)fd;
+  return 0;
+#endif
+}
+
+/* In-place 'type 1' repairs.  A 'type 1' repair just drops the data before the (innermost)
+   'ftyp' atom, so instead of copying the file, we can change the file itself:
+	1/ If the file system lets us (on Linux, using "fallocate()"), we remove as much of this
+	   data as we can (a whole number of file system blocks) from the start of the file.
+	2/ Any data that's left before the 'ftyp' atom becomes a 'free' atom, placed after a copy
+	   of the 'ftyp' atom (at the start of the file).
+	3/ Because the rest of the file's data is now at a different offset from the start of the
+	   file, we adjust the chunk offsets (in the 'stco' and 'co64' atoms) to match.
+   Only the start of the file, and the chunk offsets, get written.
+   (If we're interrupted, the file may be left unrepairable - by us or anyone else.)
+*/
+
+#ifdef HAVE_FILE_DESCRIPTORS
+/* The largest 'ftyp' atom that we'll move: */
+#define MAX_IN_PLACE_FTYP_SIZE 4096
+
+typedef struct {
+  DjifixOffset pos; /* the file position of the table's first entry */
+  unsigned numEntries;
+  int is64Bit; /* 'co64' rather than 'stco' */
+} ChunkOffsetTable;
+
+typedef struct {
+  ChunkOffsetTable* tables;
+  unsigned numTables, numTablesAllocated;
+  Arena* arena; /* where "tables" is allocated (NULL: with "malloc()") */
+} ChunkOffsetTables;
+
+/* Finds the chunk offset tables in the atoms between file positions "pos" and "end"
+   (descending into those atoms that can contain them).  We also check that none of the
+   32-bit offsets would overflow if we added "maxDelta" to them.  Returns 0 if we can't
+   adjust the offsets: */
+static int findChunkOffsetTables(InputFile* inputFile, DjifixOffset pos, DjifixOffset end, DjifixOffset maxDelta,
+				 ChunkOffsetTables* tables) {
+  while (pos <= end - 8) {
+    unsigned size32, fourcc;
+    DjifixOffset atomSize, headerSize = 8;
+
+    if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	!get4Bytes(inputFile, &size32) || !get4Bytes(inputFile, &fourcc)) return 0;
+    if (size32 == 1) { /* a 64-bit 'largesize' follows */
+      unsigned sizeHigh, sizeLow;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) return 0;
+      atomSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      headerSize = 16;
+    } else if (size32 == 0) { /* the atom extends to the end */
+      atomSize = end - pos;
+    } else {
+      atomSize = (DjifixOffset)size32;
+    }
+    if (atomSize < headerSize) return 0;
+    if (atomSize > end - pos) {
+      /* The atom is truncated (e.g., a 'mdat' atom, if recording stopped unexpectedly).  That's
+	 OK, unless it could contain chunk offsets: */
+      if (fourcc == fourcc_moov) return 0;
+      break;
+    }
+
+    if (fourcc == fourcc_moov || fourcc == fourcc_trak || fourcc == fourcc_mdia ||
+	fourcc == fourcc_minf || fourcc == fourcc_stbl) {
+      if (!findChunkOffsetTables(inputFile, pos + headerSize, pos + atomSize, maxDelta, tables)) {
+	return 0;
+      }
+    } else if (fourcc == fourcc_stco || fourcc == fourcc_co64) {
+      unsigned versionAndFlags, numEntries, i;
+      int is64Bit = fourcc == fourcc_co64;
+      ChunkOffsetTable* table;
+
+      if (!get4Bytes(inputFile, &versionAndFlags) || !get4Bytes(inputFile, &numEntries)) return 0;
+      if ((DjifixOffset)numEntries > (atomSize - headerSize - 8)/(is64Bit ? 8 : 4)) {
+	return 0;
+      }
+      for (i = 0; i < numEntries && !is64Bit; ++i) {
+	unsigned offset;
+
+	if (!get4Bytes(inputFile, &offset)) return 0;
+	if ((DjifixOffset)offset + maxDelta > 0xFFFFFFFFLL) return 0;
+      }
+
+      if (tables->numTables == tables->numTablesAllocated) {
+	unsigned newNumAllocated = tables->numTablesAllocated == 0 ? 4 : 2*tables->numTablesAllocated;
+	ChunkOffsetTable* newTables = arenaRealloc(tables->arena, tables->tables,
+						   newNumAllocated*sizeof (ChunkOffsetTable));
+
+	if (newTables == NULL) return 0;
+	tables->tables = newTables;
+	tables->numTablesAllocated = newNumAllocated;
+      }
+      table = &tables->tables[tables->numTables++];
+      table->pos = pos + headerSize + 8;
+      table->numEntries = numEntries;
+      table->is64Bit = is64Bit;
+    }
+
+    pos += atomSize;
+  }
+
+  return 1;
+}
+
+/* Adds "delta" to each entry of a chunk offset table (at file position "pos"): */
+static int adjustChunkOffsetTable(int fd, DjifixOffset pos, ChunkOffsetTable const* table, DjifixOffset delta) {
+  unsigned char buffer[4096];
+  unsigned entrySize = table->is64Bit ? 8 : 4;
+  unsigned numRemaining = table->numEntries;
+
+  while (numRemaining > 0) {
+    unsigned numEntries = numRemaining < sizeof buffer/entrySize ? numRemaining : sizeof buffer/entrySize;
+    size_t numBytes = numEntries*entrySize;
+    unsigned i;
+
+    if (pread(fd, buffer, numBytes, (off_t)pos) != (ssize_t)numBytes) return 0;
+    for (i = 0; i < numEntries; ++i) {
+      unsigned char* p = &buffer[i*entrySize];
+      unsigned long long offset = 0;
+      unsigned j;
+
+      for (j = 0; j < entrySize; ++j) offset = (offset<<8)|p[j];
+      offset += (unsigned long long)delta;
+      for (j = entrySize; j > 0; --j) { p[j-1] = (unsigned char)offset; offset >>= 8; }
+    }
+    if (pwrite(fd, buffer, numBytes, (off_t)pos) != (ssize_t)numBytes) return 0;
+
+    pos += numBytes;
+    numRemaining -= numEntries;
+  }
+
+  return 1;
+}
+#endif
+
+int djifixRepairInPlace(DjifixContext* ctx, int fd) {
+#ifdef HAVE_FILE_DESCRIPTORS
+  InputFile* inputFile = ctx->inputFile;
+  FILE* logFID = ctx->logFID;
+  struct stat sb;
+  DjifixOffset fileSize, collapseSize = 0, freeSize;
+  unsigned char header[MAX_IN_PLACE_FTYP_SIZE + 8];
+  unsigned headerSize;
+  ChunkOffsetTables tables;
+  unsigned i;
+  int result = 0;
+
+  if (inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE || ctx->repairType != 1 ||
+      inputFile->streamBuffer != NULL) return 0;
+  if (ctx->ftypSize > MAX_IN_PLACE_FTYP_SIZE || ctx->dataOffset > 0xFFFFFFFFLL) {
+    fprintf(logFID, "This file's layout doesn't let us repair it in place.\n");
+    return 0;
+  }
+
+  /* Check that "fd" is the file that we probed: */
+  if (inputSeek(inputFile, 0, SEEK_END) != 0) return 0;
+  fileSize = inputTell(inputFile);
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || (DjifixOffset)sb.st_size != fileSize) {
+    fprintf(logFID, "The file to repair in place is not the file that we checked!\n");
+    return 0;
+  }
+
+#if defined(__linux__) && defined(FALLOC_FL_COLLAPSE_RANGE)
+  /* We can remove only whole blocks - and must leave either none, or at least 8 bytes (for a
+     'free' atom header) before the 'ftyp' atom: */
+  if (sb.st_blksize > 0) {
+    collapseSize = ctx->dataOffset - ctx->dataOffset%sb.st_blksize;
+    if (ctx->dataOffset - collapseSize > 0 && ctx->dataOffset - collapseSize < 8) {
+      collapseSize -= sb.st_blksize;
+    }
+  }
+#endif
+
+  /* Before we change anything, read the 'ftyp' atom, and find the chunk offset tables: */
+  headerSize = ctx->ftypSize;
+  memset(&tables, 0, sizeof tables);
+  tables.arena = ctx->arena;
+  if (inputSeek(inputFile, ctx->dataOffset, SEEK_SET) != 0 ||
+      getBytes(inputFile, header, headerSize) != headerSize ||
+      !findChunkOffsetTables(inputFile, ctx->dataOffset, fileSize, ctx->dataOffset, &tables)) {
+    fprintf(logFID, "We can't adjust this file's chunk offsets, so we can't repair it in place.\n");
+    arenaFree(tables.arena, tables.tables);
+    return 0;
+  }
+
+  do {
+    /* 1/ Remove whole blocks from the start of the file (if we can): */
+#if defined(__linux__) && defined(FALLOC_FL_COLLAPSE_RANGE)
+    if (collapseSize > 0 && fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, (off_t)collapseSize) != 0) {
+      collapseSize = 0; /* the file system doesn't support this; use just a 'free' atom */
+    }
+#endif
+    freeSize = ctx->dataOffset - collapseSize;
+    if (freeSize == 0) {
+      /* The 'ftyp' atom is already at the start of the file, so we're done: */
+      result = 1;
+      break;
+    }
+
+    /* 3/ Adjust the chunk offsets (first, so that the file doesn't start with a 'ftyp' atom -
+       i.e., look uncorrupted - until we've done so): */
+    for (i = 0; i < tables.numTables; ++i) {
+      if (!adjustChunkOffsetTable(fd, tables.tables[i].pos - collapseSize, &tables.tables[i],
+				  freeSize)) break;
+    }
+    if (i < tables.numTables) {
+      fprintf(logFID, "Failed to adjust the chunk offsets: %s\n", strerror(errno));
+      break;
+    }
+
+    /* 2/ The 'ftyp' atom, followed by the header of the 'free' atom: */
+    header[headerSize++] = freeSize>>24; header[headerSize++] = freeSize>>16;
+    header[headerSize++] = freeSize>>8; header[headerSize++] = freeSize;
+    header[headerSize++] = 'f'; header[headerSize++] = 'r';
+    header[headerSize++] = 'e'; header[headerSize++] = 'e';
+    if (pwrite(fd, header, headerSize, 0) != (ssize_t)headerSize) {
+      fprintf(logFID, "Failed to write the start of the file: %s\n", strerror(errno));
+      break;
+    }
+
+    result = 1;
   } while (0);
 
-  /* An error occurred: */
+  if (collapseSize > 0) {
+    fprintf(logFID, "(Removed %lld bytes from the start of the file%s)\n", collapseSize,
+	    freeSize > 0 ? "; the rest became a 'free' atom" : "");
+  }
+  arenaFree(tables.arena, tables.tables);
+
+  /* The file that we probed has now changed, so it can't be repaired (again) this way: */
+  ctx->probeResult = DJIFIX_PROBE_UNREPAIRABLE;
+  return result;
+#else
+  (void)ctx; (void)fd;
+  return 0;
+#endif
+}
+
+void djifixClose(DjifixContext* ctx) {
+  if (ctx->inputFile != NULL) closeInputFile(ctx->inputFile);
+  ctx->inputFile = NULL;
+  closeProfiler(ctx);
+  if (ctx->arena != NULL) {
+    noteMemoryPeak(ctx);
+    closeArena(ctx->arena);
+    ctx->arena = NULL;
+  }
+  ctx->probeResult = DJIFIX_PROBE_UNREPAIRABLE;
+  ctx->chosenFormat = FORMAT_NONE;
+}
+
+/* Returns true iff the file appears to be a complete, uncorrupted MP4 (or QuickTime) file:
+   i.e., it consists entirely of well-formed top-level atoms - beginning with 'ftyp', and
+   including 'moov' and 'mdat' (whose data does not begin with a 'ftyp' atom).
+   Leaves the file positioned at its start.
+*/
+static int isUncorruptedFile(InputFile* inputFile) {
+  DjifixOffset fileSize, pos;
+  int sawMoov = 0, sawMdat = 0;
+
+  if (inputSeek(inputFile, 0, SEEK_END) != 0) return 0;
+  fileSize = inputTell(inputFile);
+
+  for (pos = 0; pos < fileSize; ) {
+    unsigned size32, fourcc;
+    DjifixOffset atomSize, dummy;
+
+    if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	!get4Bytes(inputFile, &size32) || !get4Bytes(inputFile, &fourcc)) break;
+    if (pos == 0 && fourcc != fourcc_ftyp) break;
+    atomSize = size32;
+    if (size32 == 1) { /* a 64-bit 'largesize' follows */
+      unsigned sizeHigh, sizeLow;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) break;
+      atomSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      if (atomSize < 16) break;
+    }
+    if (size32 == 0 && fourcc == fourcc_mdat) atomSize = fileSize - pos; /* to the end */
+    if (atomSize < 8 || atomSize > fileSize - pos) break;
+
+    if (fourcc == fourcc_moov) {
+      sawMoov = 1;
+    } else if (fourcc == fourcc_mdat) {
+      if (checkAtom(inputFile, fourcc_ftyp, &dummy)) break; /* a 'type 1' corrupted file */
+      sawMdat = 1;
+    }
+    pos += atomSize;
+  }
+
+  inputSeek(inputFile, 0, SEEK_SET);
+  return pos == fileSize && sawMoov && sawMdat;
+}
+
+#ifndef DJIFIX_NO_MAIN
+/* Batch mode: Repairing many files (named on the command line, or in a list file, or the
+   files in a directory), several at a time.  Files that don't appear to be corrupted are
+   skipped.  The messages about each file are collected, and then output together when
+   that file is done, so that messages about different files don't get mixed up: */
+
+typedef struct {
+  char** fileNames;
+  unsigned numFiles;
+  unsigned numFilesAllocated;
+  unsigned nextFile; /* the next file to be repaired by a worker */
+  unsigned numRepaired, numSkipped, numFailed;
+} Batch;
+
+#ifdef HAVE_THREADS
+static pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+#define lockBatch() pthread_mutex_lock(&batchMutex)
+#define unlockBatch() pthread_mutex_unlock(&batchMutex)
+#else
+#define lockBatch()
+#define unlockBatch()
+#endif
+
+static void addToBatch(Batch* batch, char const* fileName) {
+  char* fileNameCopy;
+
+  if (batch->numFiles == batch->numFilesAllocated) {
+    unsigned newNumAllocated = batch->numFilesAllocated == 0 ? 64 : 2*batch->numFilesAllocated;
+    char** newFileNames = realloc(batch->fileNames, newNumAllocated*sizeof (char*));
+    if (newFileNames == NULL) {
+      fprintf(stderr, "Too many files!  Ignoring \"%s\"\n", fileName);
+      return;
+    }
+    batch->fileNames = newFileNames;
+    batch->numFilesAllocated = newNumAllocated;
+  }
+
+  fileNameCopy = malloc(strlen(fileName) + 1);
+  if (fileNameCopy == NULL) return;
+  strcpy(fileNameCopy, fileName);
+  batch->fileNames[batch->numFiles++] = fileNameCopy;
+}
+
+/* Adds a name (from the command line, or a list file) to the batch.  If it's a directory, we
+   add each file in it instead - except for files that we ourselves produced: */
+static void addNameToBatch(Batch* batch, char const* name) {
+#ifdef HAVE_DIRENT
+  DIR* dir = opendir(name);
+
+  if (dir != NULL) {
+    struct dirent* entry;
+    size_t nameLen = strlen(name);
+
+    while ((entry = readdir(dir)) != NULL) {
+      char* fileName;
+      struct stat sb;
+
+      if (entry->d_name[0] == '.') continue; /* also skips "." and ".." */
+      if (strstr(entry->d_name, repairedFilenameStr) != NULL) continue;
+
+      fileName = malloc(nameLen + 1/*slash*/ + strlen(entry->d_name) + 1/*trailing '\0'*/);
+      if (fileName == NULL) break;
+      sprintf(fileName, "%s%s%s", name, nameLen > 0 && name[nameLen-1] == '/' ? "" : "/",
+	      entry->d_name);
+      if (stat(fileName, &sb) == 0 && S_ISREG(sb.st_mode)) addToBatch(batch, fileName);
+      free(fileName);
+    }
+    closedir(dir);
+    return;
+  }
+#endif
+
+  addToBatch(batch, name);
+}
+
+/* Adds each of the names (one per line) in a list file (or "-" for stdin) to the batch: */
+static int addListFileToBatch(Batch* batch, char const* listFileName) {
+  FILE* listFID;
+  char line[4096];
+
+  listFID = strcmp(listFileName, "-") == 0 ? stdin : fopen(listFileName, "r");
+  if (listFID == NULL) {
+    perror("Failed to open list of files to repair");
+    return 0;
+  }
+
+  while (fgets(line, sizeof line, listFID) != NULL) {
+    size_t len = strcspn(line, "\r\n");
+
+    line[len] = '\0';
+    if (len > 0) addNameToBatch(batch, line);
+  }
+
+  if (listFID != stdin) fclose(listFID);
+  return 1;
+}
+
+/* Probe mode: Classifies a file - reading only as much of it as we need to decide how to
+   repair it - without repairing it.  The result (a JSON object, on one line) is written to
+   "resultFID":
+	{"file":name,"verdict":verdict, ...}
+   where "verdict" is one of "uncorrupted", "type1", "type1-nested", "type2", "unrepairable",
+   or "unreadable".  For the 'type' verdicts, we also give the file position ("offset") of the
+   'ftyp' atom (and its "ftypSize"), or of the 0x00000002, at which the repair would begin.
+*/
+static int probeFile(char const* inputFileName, FILE* logFID, FILE* resultFID) {
+  DjifixContext ctx;
+  int result = REPAIR_OK;
+
+  djifixInitContext(&ctx);
+  ctx.logFID = logFID;
+  ctx.skipIfUncorrupted = 1;
+
+  fprintf(resultFID, "{\"file\":");
+  writeJSONString(resultFID, inputFileName);
+  fprintf(resultFID, ",\"verdict\":");
+  if (!djifixOpenFile(&ctx, inputFileName)) {
+    fprintf(resultFID, "\"unreadable\"");
+    result = REPAIR_FAILED;
+  } else if (djifixProbe(&ctx) == DJIFIX_PROBE_UNCORRUPTED) {
+    fprintf(resultFID, "\"uncorrupted\"");
+    result = REPAIR_SKIPPED;
+  } else if (ctx.probeResult != DJIFIX_PROBE_REPAIRABLE) {
+    fprintf(resultFID, "\"unrepairable\"");
+    result = REPAIR_FAILED;
+  } else if (ctx.repairType == 1) {
+    fprintf(resultFID, "\"%s\",\"offset\":%lld,\"ftypSize\":%u",
+	    ctx.numNestedFtyps > 0 ? "type1-nested" : "type1", ctx.dataOffset, ctx.ftypSize);
+    if (ctx.numNestedFtyps > 0) fprintf(resultFID, ",\"numNested\":%u", ctx.numNestedFtyps);
+  } else {
+    fprintf(resultFID, "\"type2\",\"offset\":%lld", ctx.dataOffset);
+  }
+  fprintf(resultFID, "}\n");
+
+  djifixClose(&ctx);
+  return result;
+}
+
+/* Probes or repairs a single file of a batch (or, in watch mode, a file that has arrived),
+   collecting its messages, and then outputting them together.  Returns one of the REPAIR_*
+   values: */
+static int processBatchFile(char const* fileName) {
+  FILE* logFID;
+  char* logData = NULL;
+  FILE* resultFID = stdout; /* used only in probe mode */
+  char* resultData = NULL; /* ditto */
+#ifdef HAVE_THREADS
+  size_t logDataSize = 0, resultDataSize = 0;
+#endif
+  int result;
+
+#ifdef HAVE_THREADS
+  logFID = open_memstream(&logData, &logDataSize);
+  if (probeOnly) {
+    /* Collect the verdict as well (so that verdicts don't get mixed up either): */
+    resultFID = open_memstream(&resultData, &resultDataSize);
+    if (resultFID == NULL) resultFID = stdout;
+  }
+#else
+  logFID = NULL;
+#endif
+  if (logFID == NULL) {
+    /* We can't collect the messages, so just output them as we go: */
+    lockBatch();
+    fprintf(stderr, "\n==> %s <==\n", fileName);
+    unlockBatch();
+  }
+  if (probeOnly) {
+    result = probeFile(fileName, logFID != NULL ? logFID : stderr, resultFID);
+    if (resultFID != stdout) fclose(resultFID);
+  } else {
+    result = repairFile(fileName, logFID != NULL ? logFID : stderr, 1);
+  }
+  if (logFID != NULL) fclose(logFID);
+
+  lockBatch();
+  if (logData != NULL) {
+    /* (In probe mode, only the verdict matters, so we discard the messages.) */
+    if (!probeOnly) fprintf(stderr, "\n==> %s <==\n%s", fileName, logData);
+    free(logData);
+  }
+  if (resultData != NULL) {
+    fputs(resultData, stdout);
+    free(resultData);
+  }
+  unlockBatch();
+
+  return result;
+}
+
+static void* batchWorker(void* batchPtr) {
+  Batch* batch = (Batch*)batchPtr;
+
+  while (1) {
+    char const* fileName;
+    int result;
+
+    lockBatch();
+    if (batch->nextFile >= batch->numFiles) {
+      unlockBatch();
+      break;
+    }
+    fileName = batch->fileNames[batch->nextFile++];
+    unlockBatch();
+
+    result = processBatchFile(fileName);
+
+    lockBatch();
+    if (result == REPAIR_OK) ++batch->numRepaired;
+    else if (result == REPAIR_SKIPPED) ++batch->numSkipped;
+    else ++batch->numFailed;
+    unlockBatch();
+  }
+
+  return NULL;
+}
+
+/* If the repairs' memory is limited ("-M"), shares it among "numWorkers" parallel repairs,
+   and returns how many of them to run (fewer, if each wouldn't get enough): */
+static unsigned shareMemory(unsigned numWorkers) {
+  if (memoryOption > 0) {
+    if (numWorkers > memoryOption/DJIFIX_MIN_MEMORY_SIZE) {
+      numWorkers = memoryOption/DJIFIX_MIN_MEMORY_SIZE;
+    }
+    memoryPerRepair = memoryOption/numWorkers;
+  }
+  return numWorkers;
+}
+
+static int repairBatch(Batch* batch, unsigned numWorkers) {
+  unsigned i;
+
+  if (numWorkers > batch->numFiles) numWorkers = batch->numFiles;
+  numWorkers = shareMemory(numWorkers);
+#ifdef HAVE_THREADS
+  if (numWorkers > 1) {
+    pthread_t* workers = malloc(numWorkers*sizeof (pthread_t));
+    unsigned numStarted = 0;
+
+    if (workers != NULL) {
+      for (i = 0; i < numWorkers; ++i) {
+	if (pthread_create(&workers[i], NULL, batchWorker, batch) != 0) break;
+	++numStarted;
+      }
+      for (i = 0; i < numStarted; ++i) pthread_join(workers[i], NULL);
+      free(workers);
+    }
+  }
+#endif
+  batchWorker(batch); /* does the work (or whatever's left) in this thread */
+
+  if (probeOnly) {
+    fprintf(stderr, "%u file(s) probed: %u need repair; %u not corrupted; %u could not be repaired.\n",
+	    batch->numFiles, batch->numRepaired, batch->numSkipped, batch->numFailed);
+  } else {
+    fprintf(stderr, "\n%u file(s) repaired; %u file(s) skipped (not corrupted); %u file(s) could not be repaired.\n",
+	    batch->numRepaired, batch->numSkipped, batch->numFailed);
+  }
+
+  for (i = 0; i < batch->numFiles; ++i) free(batch->fileNames[i]);
+  free(batch->fileNames);
+
+  /* (In probe mode, unrepairable files are just another verdict; not a failure.) */
+  return batch->numFailed == 0 || probeOnly ? 0 : 1;
+}
+
+/* The default number of files to repair in parallel: */
+static unsigned defaultNumWorkers(void) {
+#if defined(HAVE_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (numCPUs > 1) return (unsigned)numCPUs;
+#endif
+  return 1;
+}
+
+#ifdef HAVE_WATCH_MODE
+/* Watch mode ("-w directory"): Watching a directory (e.g., the one that camera cards are
+   offloaded to) and repairing each file that arrives in it - once it has been written - with
+   a fixed number of worker threads.  The smallest waiting file is repaired first, so that
+   short clips aren't held up behind long ones.  (As in batch mode, files that don't appear to
+   be corrupted are skipped; the files already in the directory when we start are also
+   repaired, unless they already have a repaired file.)  On Linux, we're told (by "inotify")
+   when each file has been written (i.e., closed) or moved into the directory.  Otherwise -
+   and for files that were already there, or were changed while we weren't told about it - we
+   look at the directory every few seconds, and take a file to have been written once it
+   hasn't changed for a few seconds.  We stop (after finishing the repairs in progress) when
+   we get SIGINT or SIGTERM.
+*/
+
+#define WATCH_SCAN_SECONDS 2 /* how often we look at the directory (or the files that are settling) */
+#define WATCH_SETTLE_SECONDS 5 /* how long a file must not have changed, before we repair it */
+
+/* A file that's waiting to be repaired: */
+typedef struct {
+  char* fileName;
+  DjifixOffset size; /* smaller files are repaired first */
+  unsigned long seq; /* (and files of the same size in the order in which they arrived) */
+} WatchJob;
+
+/* A file in the directory that we know about: */
+typedef struct {
+  char* name; /* (within the directory) */
+  DjifixOffset size;
+  time_t mtime;
+  int isSettling; /* we're waiting for it to stop changing, before we queue it */
+} WatchedFile;
+
+typedef struct {
+  char const* dirName;
+  WatchedFile* files; /* sorted by name */
+  unsigned numFiles, numFilesAllocated;
+
+  /* Shared with the workers: */
+  pthread_mutex_t mutex;
+  pthread_cond_t jobReady;
+  WatchJob* jobs; /* a heap: "jobs[0]" is the next to be repaired */
+  unsigned numJobs, numJobsAllocated;
+  unsigned long nextSeq;
+  int stopping;
+  unsigned numRepaired, numSkipped, numFailed;
+} Watch;
+
+static volatile sig_atomic_t watchStopRequested = 0;
+
+static void requestWatchStop(int sig) {
+  (void)sig;
+  watchStopRequested = 1;
+}
+
+static int watchJobComesFirst(WatchJob const* a, WatchJob const* b) {
+  return a->size < b->size || (a->size == b->size && a->seq < b->seq);
+}
+
+/* Queues a file (in the directory) to be repaired - unless it's already waiting: */
+static void queueWatchedFile(Watch* watch, char const* name, DjifixOffset size) {
+  size_t dirNameLen = strlen(watch->dirName);
+  char* fileName = malloc(dirNameLen + 1/*slash*/ + strlen(name) + 1/*trailing '\0'*/);
+  WatchJob job;
+  unsigned i;
+
+  if (fileName == NULL) return;
+  sprintf(fileName, "%s%s%s", watch->dirName,
+	  dirNameLen > 0 && watch->dirName[dirNameLen-1] == '/' ? "" : "/", name);
+
+  pthread_mutex_lock(&watch->mutex);
+  for (i = 0; i < watch->numJobs; ++i) {
+    if (strcmp(watch->jobs[i].fileName, fileName) == 0) break;
+  }
+  if (i < watch->numJobs) {
+    free(fileName); /* it's already waiting (and will be repaired as it is then) */
+  } else {
+    if (watch->numJobs == watch->numJobsAllocated) {
+      unsigned newNumAllocated = watch->numJobsAllocated == 0 ? 64 : 2*watch->numJobsAllocated;
+      WatchJob* newJobs = realloc(watch->jobs, newNumAllocated*sizeof (WatchJob));
+
+      if (newJobs == NULL) {
+	pthread_mutex_unlock(&watch->mutex);
+	fprintf(stderr, "Too many files!  Ignoring \"%s\"\n", fileName);
+	free(fileName);
+	return;
+      }
+      watch->jobs = newJobs;
+      watch->numJobsAllocated = newNumAllocated;
+    }
+
+    /* Add the job to the heap ('sifting' it up to its place): */
+    job.fileName = fileName;
+    job.size = size;
+    job.seq = watch->nextSeq++;
+    for (i = watch->numJobs++; i > 0 && watchJobComesFirst(&job, &watch->jobs[(i-1)/2]);
+	 i = (i-1)/2) {
+      watch->jobs[i] = watch->jobs[(i-1)/2];
+    }
+    watch->jobs[i] = job;
+    pthread_cond_signal(&watch->jobReady);
+  }
+  pthread_mutex_unlock(&watch->mutex);
+}
+
+/* Removes the first job from the heap (which must not be empty).  Called with the mutex held: */
+static WatchJob takeWatchJob(Watch* watch) {
+  WatchJob first = watch->jobs[0];
+  WatchJob last = watch->jobs[--watch->numJobs];
+  unsigned i = 0;
+
+  /* Put the last job in the first place, and 'sift' it down to its place: */
+  while (1) {
+    unsigned child = 2*i + 1;
+
+    if (child >= watch->numJobs) break;
+    if (child+1 < watch->numJobs && watchJobComesFirst(&watch->jobs[child+1], &watch->jobs[child])) {
+      ++child;
+    }
+    if (!watchJobComesFirst(&watch->jobs[child], &last)) break;
+    watch->jobs[i] = watch->jobs[child];
+    i = child;
+  }
+  if (watch->numJobs > 0) watch->jobs[i] = last;
+  return first;
+}
+
+static void* watchWorker(void* watchPtr) {
+  Watch* watch = (Watch*)watchPtr;
+
+  while (1) {
+    WatchJob job;
+    int result;
+
+    pthread_mutex_lock(&watch->mutex);
+    while (watch->numJobs == 0 && !watch->stopping) {
+      pthread_cond_wait(&watch->jobReady, &watch->mutex);
+    }
+    if (watch->stopping) {
+      pthread_mutex_unlock(&watch->mutex);
+      break;
+    }
+    job = takeWatchJob(watch);
+    pthread_mutex_unlock(&watch->mutex);
+
+    result = processBatchFile(job.fileName);
+    free(job.fileName);
+
+    pthread_mutex_lock(&watch->mutex);
+    if (result == REPAIR_OK) ++watch->numRepaired;
+    else if (result == REPAIR_SKIPPED) ++watch->numSkipped;
+    else ++watch->numFailed;
+    pthread_mutex_unlock(&watch->mutex);
+  }
+
+  return NULL;
+}
+
+/* Whether a file in the directory is one that we might repair - i.e., not a hidden file (e.g.,
+   one that's still being copied, under a temporary name), or one that we ourselves produced: */
+static int isWatchCandidate(char const* name) {
+  return name[0] != '.' && strstr(name, repairedFilenameStr) == NULL;
+}
+
+/* Notes the size and modification time of a file (that we know about) in the directory.  If
+   either has changed, it's settling (again).  Returns 0 iff it's no longer there (or no longer
+   a regular file): */
+static int updateWatchedFile(Watch const* watch, WatchedFile* file) {
+  size_t dirNameLen = strlen(watch->dirName);
+  char* fileName = malloc(dirNameLen + 1/*slash*/ + strlen(file->name) + 1/*trailing '\0'*/);
+  struct stat sb;
+  int exists;
+
+  if (fileName == NULL) return 1; /* try again next time */
+  sprintf(fileName, "%s%s%s", watch->dirName,
+	  dirNameLen > 0 && watch->dirName[dirNameLen-1] == '/' ? "" : "/", file->name);
+  exists = stat(fileName, &sb) == 0 && S_ISREG(sb.st_mode);
+  free(fileName);
+  if (!exists) return 0;
+
+  if ((DjifixOffset)sb.st_size != file->size || sb.st_mtime != file->mtime) {
+    file->size = (DjifixOffset)sb.st_size;
+    file->mtime = sb.st_mtime;
+    file->isSettling = 1;
+  }
+  return 1;
+}
+
+/* Updates a file (above), and - if it's settling, and hasn't changed for a while - queues it.
+   Returns 0 iff it's no longer there: */
+static int checkWatchedFile(Watch* watch, WatchedFile* file, time_t now) {
+  if (!updateWatchedFile(watch, file)) return 0;
+  if (file->isSettling && now - file->mtime >= WATCH_SETTLE_SECONDS) {
+    file->isSettling = 0;
+    queueWatchedFile(watch, file->name, file->size);
+  }
+  return 1;
+}
+
+/* Returns true iff the directory (whose names - all of them, sorted - are "names") already
+   holds a repaired file for "name": */
+static int hasRepairedFile(char** names, unsigned numNames, char const* name) {
+  char const* dotPtr = strrchr(name, '.');
+  size_t baseNameLen = dotPtr == NULL ? strlen(name) : (size_t)(dotPtr - name);
+  char* prefix = malloc(baseNameLen + strlen(repairedFilenameStr) + 1);
+  unsigned lo = 0, hi = numNames;
+  int result;
+
+  if (prefix == NULL) return 0;
+  sprintf(prefix, "%.*s%s", (int)baseNameLen, name, repairedFilenameStr);
+  while (lo < hi) {
+    unsigned mid = lo + (hi-lo)/2;
+
+    if (strcmp(names[mid], prefix) < 0) lo = mid+1;
+    else hi = mid;
+  }
+  result = lo < numNames && strncmp(names[lo], prefix, strlen(prefix)) == 0;
+  free(prefix);
+  return result;
+}
+
+static int compareNames(void const* a, void const* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Looks at each file in the directory: Files that we didn't know about are added (as settling
+   - or, when we first start, as done already, if they have a repaired file), and files that
+   were removed are forgotten.  Then each file is checked (above).  Returns 0 iff we couldn't
+   read the directory: */
+static int scanWatchedDirectory(Watch* watch, int isFirstScan) {
+  DIR* dir = opendir(watch->dirName);
+  struct dirent* entry;
+  char** names = NULL;
+  unsigned numNames = 0, numNamesAllocated = 0, i, j;
+  WatchedFile* files;
+  unsigned numFiles = 0;
+  time_t now = time(NULL);
+
+  if (dir == NULL) return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (numNames == numNamesAllocated) {
+      unsigned newNumAllocated = numNamesAllocated == 0 ? 64 : 2*numNamesAllocated;
+      char** newNames = realloc(names, newNumAllocated*sizeof (char*));
+
+      if (newNames == NULL) break;
+      names = newNames;
+      numNamesAllocated = newNumAllocated;
+    }
+    if ((names[numNames] = malloc(strlen(entry->d_name) + 1)) == NULL) break;
+    strcpy(names[numNames++], entry->d_name);
+  }
+  closedir(dir);
+  qsort(names, numNames, sizeof (char*), compareNames);
+
+  /* Merge the (sorted) names with the files that we know about, into a new list of files: */
+  files = malloc((numNames > 0 ? numNames : 1)*sizeof (WatchedFile));
+  if (files == NULL || entry != NULL) {
+    free(files); /* we couldn't read all of the names, so try again next time */
+  } else {
+    for (i = j = 0; j < numNames; ++j) {
+      WatchedFile* file;
+      int isNew;
+
+      if (!isWatchCandidate(names[j])) continue;
+      while (i < watch->numFiles && strcmp(watch->files[i].name, names[j]) < 0) {
+	free(watch->files[i++].name); /* it's no longer there */
+      }
+      isNew = i == watch->numFiles || strcmp(watch->files[i].name, names[j]) != 0;
+      file = &files[numFiles];
+      if (!isNew) {
+	*file = watch->files[i++];
+      } else {
+	if ((file->name = malloc(strlen(names[j]) + 1)) == NULL) continue;
+	strcpy(file->name, names[j]);
+	file->size = -1;
+	file->mtime = 0;
+	file->isSettling = 1;
+      }
+
+      if (isNew && isFirstScan && hasRepairedFile(names, numNames, file->name)) {
+	/* Don't repair this file again - unless it changes: */
+	if (!updateWatchedFile(watch, file)) {
+	  free(file->name);
+	  continue;
+	}
+	file->isSettling = 0;
+      } else if (!checkWatchedFile(watch, file, now)) {
+	free(file->name);
+	continue;
+      }
+      ++numFiles;
+    }
+    while (i < watch->numFiles) free(watch->files[i++].name);
+    free(watch->files);
+    watch->files = files;
+    watch->numFilesAllocated = numNames > 0 ? numNames : 1;
+    watch->numFiles = numFiles;
+  }
+
+  for (i = 0; i < numNames; ++i) free(names[i]);
+  free(names);
+  return 1;
+}
+
+#ifdef HAVE_INOTIFY
+/* (When we're told about each file - rather than looking at the whole directory - we find,
+   add, and remove the files that we know about one at a time:) */
+
+/* Returns the index in "watch->files" at which "name" is (or would be): */
+static unsigned findWatchedFile(Watch const* watch, char const* name) {
+  unsigned lo = 0, hi = watch->numFiles;
+
+  while (lo < hi) {
+    unsigned mid = lo + (hi-lo)/2;
+
+    if (strcmp(watch->files[mid].name, name) < 0) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* Returns the entry for "name" in "watch->files", adding it (as a file that's settling) if
+   it's not there.  Returns NULL if we couldn't add it: */
+static WatchedFile* addWatchedFile(Watch* watch, char const* name) {
+  unsigned i = findWatchedFile(watch, name);
+  char* nameCopy;
+
+  if (i < watch->numFiles && strcmp(watch->files[i].name, name) == 0) return &watch->files[i];
+
+  if (watch->numFiles == watch->numFilesAllocated) {
+    unsigned newNumAllocated = watch->numFilesAllocated == 0 ? 64 : 2*watch->numFilesAllocated;
+    WatchedFile* newFiles = realloc(watch->files, newNumAllocated*sizeof (WatchedFile));
+
+    if (newFiles == NULL) return NULL;
+    watch->files = newFiles;
+    watch->numFilesAllocated = newNumAllocated;
+  }
+  if ((nameCopy = malloc(strlen(name) + 1)) == NULL) return NULL;
+  strcpy(nameCopy, name);
+  memmove(&watch->files[i+1], &watch->files[i], (watch->numFiles - i)*sizeof (WatchedFile));
+  ++watch->numFiles;
+  watch->files[i].name = nameCopy;
+  watch->files[i].size = -1;
+  watch->files[i].mtime = 0;
+  watch->files[i].isSettling = 1;
+  return &watch->files[i];
+}
+
+static void forgetWatchedFile(Watch* watch, char const* name) {
+  unsigned i = findWatchedFile(watch, name);
+
+  if (i == watch->numFiles || strcmp(watch->files[i].name, name) != 0) return;
+  free(watch->files[i].name);
+  --watch->numFiles;
+  memmove(&watch->files[i], &watch->files[i+1], (watch->numFiles - i)*sizeof (WatchedFile));
+}
+
+/* Notes that a file has just been written (i.e., closed) or moved into the directory, so we
+   can queue it now: */
+static void noteWatchedFileWritten(Watch* watch, char const* name) {
+  WatchedFile* file;
+
+  if (!isWatchCandidate(name) || (file = addWatchedFile(watch, name)) == NULL) return;
+  if (!updateWatchedFile(watch, file)) {
+    forgetWatchedFile(watch, name);
+    return;
+  }
+  file->isSettling = 0;
+  queueWatchedFile(watch, file->name, file->size);
+}
+
+/* Checks just the files that are settling: */
+static void checkSettlingFiles(Watch* watch) {
+  time_t now = time(NULL);
+  unsigned i;
+
+  for (i = 0; i < watch->numFiles; ++i) {
+    if (watch->files[i].isSettling) checkWatchedFile(watch, &watch->files[i], now);
+  }
+}
+#endif
+
+static int watchDirectory(char const* dirName, unsigned numWorkers) {
+  Watch watch;
+  pthread_t* workers;
+  unsigned numStarted = 0, i;
+  sigset_t stopSignals, oldMask;
+  int result = 0;
+#ifdef HAVE_INOTIFY
+  int inotifyFD;
+  time_t lastCheck = time(NULL);
+#endif
+
+  memset(&watch, 0, sizeof watch);
+  watch.dirName = dirName;
+  pthread_mutex_init(&watch.mutex, NULL);
+  pthread_cond_init(&watch.jobReady, NULL);
+  numWorkers = shareMemory(numWorkers);
+
+  /* (Begin watching before we first look at the directory, so that we miss nothing:) */
+#ifdef HAVE_INOTIFY
+  inotifyFD = inotify_init1(IN_CLOEXEC);
+  if (inotifyFD >= 0 &&
+      inotify_add_watch(inotifyFD, dirName, IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE|IN_MOVED_FROM|
+			IN_DELETE_SELF|IN_MOVE_SELF) < 0) {
+    close(inotifyFD);
+    inotifyFD = -1;
+  }
+  if (inotifyFD < 0) {
+    fprintf(stderr, "(We can't be told about new files in \"%s\", so we'll look for them every %u seconds.)\n",
+	    dirName, WATCH_SCAN_SECONDS);
+  }
+#endif
+  if (!scanWatchedDirectory(&watch, 1)) {
+    perror("Failed to read the directory to watch");
+#ifdef HAVE_INOTIFY
+    if (inotifyFD >= 0) close(inotifyFD);
+#endif
+    return 1;
+  }
+
+  /* Start the workers - with SIGINT and SIGTERM blocked, so that only this thread gets them
+     (and stops waiting, to stop): */
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  signal(SIGINT, requestWatchStop);
+  signal(SIGTERM, requestWatchStop);
+  fprintf(stderr, "Watching \"%s\" for files to repair (%u at a time).  (Stop with Control-C.)\n",
+	  dirName, numWorkers);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+  workers = malloc(numWorkers*sizeof (pthread_t));
+  if (workers != NULL) {
+    for (i = 0; i < numWorkers; ++i) {
+      if (pthread_create(&workers[i], NULL, watchWorker, &watch) != 0) break;
+      ++numStarted;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  if (numStarted == 0) {
+    fprintf(stderr, "Failed to start the repairs!\n");
+    watchStopRequested = 1;
+    result = 1;
+  }
+
+  while (!watchStopRequested) {
+#ifdef HAVE_INOTIFY
+    if (inotifyFD >= 0) {
+      struct pollfd pfd;
+      union {
+	struct inotify_event event; /* (for its alignment) */
+	char bytes[64*1024];
+      } buffer;
+      ssize_t numRead;
+      char* p;
+
+      /* Wait for events (but now and then, also check the files that are settling): */
+      pfd.fd = inotifyFD;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, WATCH_SCAN_SECONDS*1000) > 0 &&
+	  (numRead = read(inotifyFD, buffer.bytes, sizeof buffer.bytes)) > 0) {
+	for (p = buffer.bytes; p < &buffer.bytes[numRead]; ) {
+	  struct inotify_event* event = (struct inotify_event*)p;
+
+	  p += sizeof (struct inotify_event) + event->len;
+	  if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED)) {
+	    fprintf(stderr, "The directory \"%s\" was removed (or moved)!\n", dirName);
+	    watchStopRequested = 1;
+	    result = 1;
+	  } else if (event->mask & IN_Q_OVERFLOW) {
+	    scanWatchedDirectory(&watch, 0); /* we missed some events */
+	  } else if (event->len == 0) {
+	    continue;
+	  } else if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+	    noteWatchedFileWritten(&watch, event->name);
+	  } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
+	    forgetWatchedFile(&watch, event->name);
+	  }
+	}
+      }
+      if (time(NULL) - lastCheck >= WATCH_SCAN_SECONDS) {
+	checkSettlingFiles(&watch);
+	lastCheck = time(NULL);
+      }
+      continue;
+    }
+#endif
+    sleep(WATCH_SCAN_SECONDS);
+    if (!watchStopRequested && !scanWatchedDirectory(&watch, 0)) {
+      perror("Failed to read the directory being watched");
+      watchStopRequested = 1;
+      result = 1;
+    }
+  }
+
+  /* Stop, once the repairs in progress are done.  (Another Control-C stops us at once.): */
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  fprintf(stderr, "\nStopping (once the repairs in progress are done)...\n");
+  pthread_mutex_lock(&watch.mutex);
+  watch.stopping = 1;
+  pthread_cond_broadcast(&watch.jobReady);
+  pthread_mutex_unlock(&watch.mutex);
+  for (i = 0; i < numStarted; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+#ifdef HAVE_INOTIFY
+  if (inotifyFD >= 0) close(inotifyFD);
+#endif
+
+  fprintf(stderr, "\n%u file(s) repaired; %u file(s) skipped (not corrupted); %u file(s) could not be repaired; %u file(s) were still waiting.\n",
+	  watch.numRepaired, watch.numSkipped, watch.numFailed, watch.numJobs);
+  for (i = 0; i < watch.numJobs; ++i) free(watch.jobs[i].fileName);
+  free(watch.jobs);
+  for (i = 0; i < watch.numFiles; ++i) free(watch.files[i].name);
+  free(watch.files);
+  pthread_cond_destroy(&watch.jobReady);
+  pthread_mutex_destroy(&watch.mutex);
+  return result || watch.numFailed > 0;
+}
+#endif
+
+/* Benchmark mode ("-B size"): For each kind of damaged file that we know how to repair, we
+   generate a synthetic file of about "size" bytes, and time probing it, repairing it, and -
+   within the repair - recovering from anomalous data.  We write one line (a JSON object) per
+   file to our standard output.  The files are written in the current directory (or the
+   directory given with "-o"), and removed afterwards.  (Because we've just written them, the
+   files will usually still be in memory, so this measures our own speed, not the disk's.)
+*/
+
+#define BENCH_JUNK_SIZE (64*1024) /* of junk before the data that we understand */
+#define BENCH_NUM_ANOMALIES 8 /* in files that have anomalous 'NAL sizes' */
+#define BENCH_BUFFER_SIZE (64*1024)
+
+/* A fast pseudo-random number generator ('xorshift'), for the files' contents: */
+static unsigned benchRandom(unsigned* state) {
+  unsigned x = *state;
+
+  x ^= x<<13; x &= 0xFFFFFFFF;
+  x ^= x>>17;
+  x ^= x<<5; x &= 0xFFFFFFFF;
+  return *state = x;
+}
+
+static void benchPut4Bytes(FILE* fid, unsigned long value) {
+  putc((int)((value>>24)&0xFF), fid); putc((int)((value>>16)&0xFF), fid);
+  putc((int)((value>>8)&0xFF), fid); putc((int)(value&0xFF), fid);
+}
+
+/* Writes "numBytes" bytes: each "fillByte", or (if "fillByte" is < 0) random: */
+static void benchPutBytes(FILE* fid, DjifixOffset numBytes, int fillByte, unsigned* state) {
+  static unsigned char buffer[BENCH_BUFFER_SIZE];
+
+  while (numBytes > 0) {
+    size_t numToWrite = numBytes < (DjifixOffset)sizeof buffer ? (size_t)numBytes : sizeof buffer;
+    size_t i;
+
+    if (fillByte >= 0) {
+      memset(buffer, fillByte, numToWrite);
+    } else {
+      for (i = 0; i < numToWrite; ++i) buffer[i] = benchRandom(state)>>24;
+    }
+    fwrite(buffer, 1, numToWrite, fid);
+    numBytes -= numToWrite;
+  }
+}
+
+static void benchPutAtom(FILE* fid, unsigned fourcc, unsigned bodySize, unsigned* state) {
+  benchPut4Bytes(fid, 8 + bodySize);
+  benchPut4Bytes(fid, fourcc);
+  benchPutBytes(fid, bodySize, -1, state);
+}
+
+/* The start of a (damaged) file from a camera: a 'ftyp' and 'moov', then the header of a
+   'mdat' atom (with a bad size): */
+static void benchPutBadStart(FILE* fid, unsigned* state) {
+  benchPutAtom(fid, fourcc_ftyp, 12, state);
+  benchPutAtom(fid, fourcc_moov, 300, state);
+  benchPut4Bytes(fid, 12345);
+  benchPut4Bytes(fid, fourcc_mdat);
+}
+
+/* A 'type 1' file's data (at least, as much of it as we copy): "numNested" (damaged) file
+   starts, then a 'ftyp', 'moov' and 'mdat', filling "size" bytes in all: */
+static void benchPutType1(FILE* fid, DjifixOffset size, unsigned numNested, int withFree,
+			  unsigned* state) {
+  DjifixOffset mdatSize;
+  unsigned i;
+
+  benchPutBadStart(fid, state);
+  for (i = 0; i < numNested; ++i) benchPutBadStart(fid, state);
+  benchPutAtom(fid, fourcc_ftyp, 16, state);
+  benchPutAtom(fid, fourcc_moov, 50, state);
+  if (withFree) {
+    benchPut4Bytes(fid, 8 + 40); benchPut4Bytes(fid, fourcc_free);
+    benchPutBytes(fid, 40, 0, state);
+  }
+  mdatSize = size - ftell64(fid);
+  if (mdatSize < 8) mdatSize = 8;
+  benchPut4Bytes(fid, mdatSize <= 0xFFFFFFFF ? (unsigned long)mdatSize : 0); /* 0 means 'to the end of the file' */
+  benchPut4Bytes(fid, fourcc_mdat);
+  benchPutBytes(fid, mdatSize - 8, -1, state);
+}
+
+/* 'Type 2' data (H.264 NAL units, each preceded by its size), filling "size" bytes in all.  If
+   "anomalyByte" is >= 0, there are also BENCH_NUM_ANOMALIES places where the data is damaged:
+   by a run of "anomalyByte" (if it's 0), or (otherwise) by an oversized 'NAL size' followed by
+   junk.  After each of these, the data resumes with a new 0x00000002: */
+static void benchPutType2(FILE* fid, DjifixOffset size, int anomalyByte, unsigned* state) {
+  DjifixOffset anomalySize = size/(16*BENCH_NUM_ANOMALIES);
+  DjifixOffset nextAnomalyPos = anomalyByte >= 0 ? size/(BENCH_NUM_ANOMALIES+1) : size;
+  unsigned numNALUnits = 0;
+  DjifixOffset pos;
+
+  if (anomalySize > 1024*1024) anomalySize = 1024*1024;
+  while ((pos = ftell64(fid)) < size) {
+    unsigned nalSize;
+
+    if (pos >= nextAnomalyPos || numNALUnits == 0) {
+      if (numNALUnits > 0) {
+	if (anomalyByte == 0) {
+	  benchPutBytes(fid, anomalySize, 0, state);
+	} else {
+	  benchPut4Bytes(fid, 0x7FFFFFFF);
+	  benchPutBytes(fid, anomalySize, anomalyByte, state);
+	}
+	nextAnomalyPos += size/(BENCH_NUM_ANOMALIES+1);
+      }
+      benchPut4Bytes(fid, 0x00000002); putc(0x09, fid); putc(0x10, fid); /* an 'access unit delimiter' */
+    }
+
+    nalSize = 3 + benchRandom(state)%65533;
+    if (pos + 4 + (DjifixOffset)nalSize > size) nalSize = size - pos > 8 ? (unsigned)(size - pos - 4) : 4;
+    benchPut4Bytes(fid, nalSize);
+    putc(numNALUnits%30 == 0 ? 0x65 : 0x41, fid); /* an IDR or non-IDR slice */
+    benchPutBytes(fid, nalSize - 1, -1, state);
+    ++numNALUnits;
+  }
+}
+
+static void benchGenerate(FILE* fid, int layout, DjifixOffset size, unsigned* state) {
+  char const garbage[] = "garbage!";
+  long i;
+
+  switch (layout) {
+    case 0: benchPutType1(fid, size, 0, 0, state); break;
+    case 1: benchPutBytes(fid, BENCH_JUNK_SIZE, 0x00, state); benchPutType1(fid, size, 0, 0, state); break;
+    case 2: benchPutBytes(fid, BENCH_JUNK_SIZE, 0xFF, state); benchPutType1(fid, size, 0, 0, state); break;
+    case 3: {
+      for (i = 0; i < BENCH_JUNK_SIZE; ++i) putc(garbage[i%(sizeof garbage - 1)], fid);
+      benchPutType1(fid, size, 0, 0, state);
+      break;
+    }
+    case 4: benchPutType1(fid, size, 0, 1, state); break;
+    case 5: benchPutType1(fid, size, 2, 0, state); break;
+    case 6: benchPutType2(fid, size, -1, state); break;
+    case 7: benchPutType2(fid, size, 0x00, state); break;
+    case 8: benchPutType2(fid, size, 0x12, state); break;
+    case 9: benchPutBadStart(fid, state); benchPutType2(fid, size, -1, state); break;
+  }
+}
+
+static char const* const benchLayoutNames[] = {
+  "type1", "type1-zeros", "type1-ff", "type1-garbage", "type1-free", "type1-nested",
+  "type2", "type2-holes", "type2-oversized", "type1-to-type2"
+};
+#define BENCH_NUM_LAYOUTS ((int)(sizeof benchLayoutNames/sizeof benchLayoutNames[0]))
+
+static int runBenchmark(char const* dirName) {
+  FILE* logFID = tmpfile(); /* for the repairs' messages, which we don't show */
+  int numFailed = 0, crcIsRight;
+  int layout;
+
+  if (logFID == NULL) logFID = stderr;
+  for (layout = 0; layout < BENCH_NUM_LAYOUTS; ++layout) {
+    DjifixContext ctx;
+    char* inputFileName = malloc(strlen(dirName) + 50);
+    char* outputFileName = malloc(strlen(dirName) + 50);
+    unsigned state = 2463534242U + layout;
+    double startTime, probeSeconds = 0.0, repairSeconds = 0.0;
+    FILE* fid;
+    int ok = 0;
+
+    if (inputFileName == NULL || outputFileName == NULL) {
+      free(inputFileName); free(outputFileName);
+      fprintf(stderr, "Failed to allocate memory!\n");
+      return 1;
+    }
+    sprintf(inputFileName, "%s/djifix-bench-%s.MOV", dirName, benchLayoutNames[layout]);
+    sprintf(outputFileName, "%s/djifix-bench-%s-repaired.out", dirName, benchLayoutNames[layout]);
+
+    fprintf(stderr, "Generating \"%s\"...", inputFileName);
+    if ((fid = fopen(inputFileName, "wb")) == NULL) {
+      perror("Failed to create the file");
+      free(inputFileName); free(outputFileName);
+      return 1;
+    }
+    benchGenerate(fid, layout, benchmarkSize, &state);
+    if (fclose(fid) != 0) {
+      perror("Failed to write the file");
+      remove(inputFileName);
+      free(inputFileName); free(outputFileName);
+      return 1;
+    }
+    fprintf(stderr, "done\n");
+
+    djifixInitContext(&ctx);
+    ctx.logFID = logFID;
+    ctx.format = formatOption == FORMAT_NONE || formatOption == FORMAT_AUTO
+      ? djifixFormatForName("1080p30") : formatOption; /* our slices' headers aren't real */
+    ctx.outputIsMP4 = type2OutputIsMP4;
+    ctx.numCopyThreads = numCopyThreads;
+    ctx.inputFileName = inputFileName;
+
+    do {
+      startTime = secondsNow();
+      if (!djifixOpenFile(&ctx, inputFileName)) break;
+      if (djifixProbe(&ctx) != DJIFIX_PROBE_REPAIRABLE) {
+	probeSeconds = secondsNow() - startTime;
+	break;
+      }
+      probeSeconds = secondsNow() - startTime;
+
+      if ((fid = fopen(outputFileName, "wb")) == NULL) break;
+      startTime = secondsNow();
+      ok = djifixRepair(&ctx, fid);
+      if (fclose(fid) != 0) ok = 0;
+      repairSeconds = secondsNow() - startTime;
+      ok = ok && ctx.repairType == (layout >= 6 ? 2 : 1)
+	&& ctx.numAnomalies == (layout == 7 || layout == 8 ? BENCH_NUM_ANOMALIES : 0);
+    } while (0);
+    djifixClose(&ctx);
+
+    printf("{\"layout\":\"%s\",\"bytes\":%lld,\"repairType\":%d,\"probeSeconds\":%.6f,\"repairSeconds\":%.3f,\"recoverySeconds\":%.6f,\"mbPerSecond\":%.1f,\"anomalies\":%u,\"ok\":%s}\n",
+	   benchLayoutNames[layout], benchmarkSize, ok ? ctx.repairType : 0, probeSeconds,
+	   repairSeconds, ok ? ctx.recoverySeconds : 0.0,
+	   repairSeconds > 0.0 ? benchmarkSize/(1024*1024*repairSeconds) : 0.0,
+	   ok ? ctx.numAnomalies : 0, ok ? "true" : "false");
+    fflush(stdout);
+    if (!ok) ++numFailed;
+
+    remove(inputFileName);
+    remove(outputFileName);
+    free(inputFileName); free(outputFileName);
+  }
+  if (logFID != stderr) fclose(logFID);
+
+  fprintf(stderr, "%d file(s) benchmarked; %d could not be repaired as expected.\n",
+	  BENCH_NUM_LAYOUTS, numFailed);
+
+  /* (Also check the checksum that "-V" gives for long runs of zeros - e.g., holes:) */
+  crcIsRight = checkCRC32CShift();
+  if (!crcIsRight) fprintf(stderr, "The CRC-32C checksum of long runs of zeros is wrong!\n");
+  return numFailed == 0 && crcIsRight ? 0 : 1;
+}
+#endif
+
+/* The SPS and PPS NAL units that we prepend to a 'type 2' repair.  The SPS depends upon the
+   video format; the PPS upon the camera model: */
+static unsigned char const SPS_2160p30[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x03, 0xc0, 0x04, 0x3e, 0xc0, 0x5a, 0x80, 0x80, 0x80, 0xa0, 0x00, 0x00, 0x7d, 0x20, 0x00, 0x1d, 0x4c, 0x1d, 0x0c, 0x00, 0x07, 0x27, 0x08, 0x00, 0x01, 0xc9, 0xc3, 0x97, 0x79, 0x71, 0xa1, 0x80, 0x00, 0xe4, 0xe1, 0x00, 0x00, 0x39, 0x38, 0x72, 0xef, 0x2e, 0x1f, 0x08, 0x84, 0x53, 0x80 };
+// The following was used in an earlier version of the software, but does not appear to be correct:
+//static unsigned char const SPS_2160p25[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x01, 0x00, 0x01, 0x0f, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x40, 0x00, 0x06, 0x1a, 0x87, 0x43, 0x00, 0x01, 0xc9, 0xc2, 0x00, 0x00, 0x72, 0x70, 0xe5, 0xde, 0x5c, 0x68, 0x60, 0x00, 0x39, 0x38, 0x40, 0x00, 0x0e, 0x4e, 0x1c, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0xe0 };
+static unsigned char const SPS_2160p25[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x03, 0xc0, 0x04, 0x3e, 0xc0, 0x5a, 0x80, 0x80, 0x80, 0xa0, 0x00, 0x00, 0x7d, 0x00, 0x00, 0x18, 0x6a, 0x1d, 0x0c, 0x00, 0x07, 0x27, 0x08, 0x00, 0x01, 0xc9, 0xc3, 0x97, 0x79, 0x71, 0xa1, 0x80, 0x00, 0xe4, 0xe1, 0x00, 0x00, 0x39, 0x38, 0x72, 0xef, 0x2e, 0x1f, 0x08, 0x84, 0x53, 0x80 };
+static unsigned char const SPS_2160p24[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x01, 0x00, 0x01, 0x0f, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x48, 0x00, 0x05, 0xdc, 0x07, 0x43, 0x00, 0x01, 0xc9, 0xc2, 0x00, 0x00, 0x72, 0x70, 0xe5, 0xde, 0x5c, 0x68, 0x60, 0x00, 0x39, 0x38, 0x40, 0x00, 0x0e, 0x4e, 0x1c, 0xbb };
+static unsigned char const SPS_1520p30[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x02, 0xa4, 0x0b, 0xfb, 0x01, 0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x01, 0xf4, 0x80, 0x00, 0x75, 0x30, 0x74, 0x30, 0x00, 0x13, 0x12, 0xc0, 0x00, 0x04, 0xc4, 0xb4, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x02, 0x62, 0x58, 0x00, 0x00, 0x98, 0x96, 0x8b, 0xbc, 0xb8, 0x7c, 0x22, 0x11, 0x4e, 0x00, 0x00, 0x00 };
+static unsigned char const SPS_1520p25[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x02, 0xa4, 0x0b, 0xfb, 0x01, 0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80, 0x00, 0x00, 0x19, 0x74, 0x30, 0x00, 0x13, 0x12, 0xc0, 0x00, 0x04, 0xc4, 0xb4, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x02, 0x62, 0x58, 0x00, 0x00, 0x98, 0x96, 0x8b, 0xbc, 0xb8, 0x7c, 0x22, 0x11, 0x4e };
+static unsigned char const SPS_1080p60[] = { 0x27, 0x64, 0x00, 0x2a, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd2, 0x00, 0x03, 0xa9, 0x81, 0xd0, 0xc0, 0x00, 0x4c, 0x4b, 0x00, 0x00, 0x13, 0x12, 0xd1, 0x77, 0x97, 0x1a, 0x18, 0x00, 0x09, 0x89, 0x60, 0x00, 0x02, 0x62, 0x5a, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16 };
+static unsigned char const SPS_1080i60[] = { 0x27, 0x4d, 0x00, 0x2a, 0x9a, 0x66, 0x03, 0xc0, 0x22, 0x3e, 0xf0, 0x16, 0xc8, 0x00, 0x00, 0x1f, 0x48, 0x00, 0x07, 0x53, 0x07, 0x43, 0x00, 0x02, 0x36, 0x78, 0x00, 0x02, 0x36, 0x78, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x04, 0x6c, 0xf0, 0x00, 0x04, 0x6c, 0xf0, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0x58 };
+static unsigned char const SPS_1080p50[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd0, 0x00, 0x03, 0x0d, 0x41, 0xd0, 0xc0, 0x00, 0x4c, 0x4b, 0x00, 0x00, 0x13, 0x12, 0xd1, 0x77, 0x97, 0x1a, 0x18, 0x00, 0x09, 0x89, 0x60, 0x00, 0x02, 0x62, 0x5a, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16 };
+static unsigned char const SPS_1080p30[] = { 0x27, 0x4d, 0x00, 0x28, 0x9a, 0x66, 0x03, 0xc0, 0x11, 0x3f, 0x2e, 0x02, 0xd9, 0x00, 0x00, 0x03, 0x03, 0xe9, 0x00, 0x00, 0xea, 0x60, 0xe8, 0x60, 0x00, 0xe2, 0x98, 0x00, 0x03, 0x8a, 0x60, 0xbb, 0xcb, 0x8d, 0x0c, 0x00, 0x1c, 0x53, 0x00, 0x00, 0x71, 0x4c, 0x17, 0x79, 0x70, 0xf8, 0x44, 0x22, 0x8b };
+static unsigned char const SPS_1080p25[] = { 0x27, 0x4d, 0x00, 0x28, 0x9a, 0x66, 0x03, 0xc0, 0x11, 0x3f, 0x2e, 0x02, 0xd9, 0x00, 0x00, 0x03, 0x03, 0xe8, 0x00, 0x00, 0xc3, 0x50, 0xe8, 0x60, 0x00, 0xdc, 0xf0, 0x00, 0x03, 0x73, 0xb8, 0xbb, 0xcb, 0x8d, 0x0c, 0x00, 0x1b, 0x9e, 0x00, 0x00, 0x6e, 0x77, 0x17, 0x79, 0x70, 0xf8, 0x44, 0x22, 0x8b };
+static unsigned char const SPS_1080p24[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd2, 0x00, 0x01, 0x77, 0x01, 0xd0, 0xc0, 0x00, 0xbe, 0xbc, 0x00, 0x00, 0xbe, 0xbc, 0x17, 0x79, 0x71, 0xa1, 0x80, 0x01, 0x7d, 0x78, 0x00, 0x01, 0x7d, 0x78, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16, 0x00, 0x00, 0x00 };
+static unsigned char const SPS_720p60[] = { 0x27, 0x4d, 0x00, 0x20, 0x9a, 0x66, 0x02, 0x80, 0x2d, 0xd8, 0x0b, 0x64, 0x00, 0x00, 0x0f, 0xa4, 0x00, 0x07, 0x53, 0x03, 0xa1, 0x80, 0x03, 0x8a, 0x60, 0x00, 0x0e, 0x29, 0x82, 0xef, 0x2e, 0x34, 0x30, 0x00, 0x71, 0x4c, 0x00, 0x01, 0xc5, 0x30, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x34 };
+static unsigned char const SPS_720p30[] = { 0x27, 0x4d, 0x00, 0x1f, 0x9a, 0x66, 0x02, 0x80, 0x2d, 0xd8, 0x0b, 0x64, 0x00, 0x00, 0x0f, 0xa4, 0x00, 0x03, 0xa9, 0x83, 0xa1, 0x80, 0x02, 0x5c, 0x40, 0x00, 0x09, 0x71, 0x02, 0xef, 0x2e, 0x34, 0x30, 0x00, 0x4b, 0x88, 0x00, 0x01, 0x2e, 0x20, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x34 };
+static unsigned char const SPS_720p25[] = { 0x27, 0x64, 0x00, 0x28, 0xac, 0x34, 0xc8, 0x05, 0x00, 0x5b, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x40, 0x00, 0x06, 0x1a, 0x87, 0x43, 0x00, 0x0f, 0xd4, 0x80, 0x00, 0xfd, 0x4b, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x1f, 0xa9, 0x00, 0x01, 0xfa, 0x96, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0x78 };
+static unsigned char const SPS_480p30[] = { 0x27, 0x4d, 0x40, 0x1e, 0x9a, 0x66, 0x05, 0x01, 0xed, 0x80, 0xb6, 0x40, 0x00, 0x00, 0xfa, 0x40, 0x00, 0x3a, 0x98, 0x3a, 0x10, 0x00, 0x5e, 0x68, 0x00, 0x02, 0xf3, 0x40, 0xbb, 0xcb, 0x8d, 0x08, 0x00, 0x2f, 0x34, 0x00, 0x01, 0x79, 0xa0, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x3c };
+
+static unsigned char const PPS_P2VP[] =    { 0x28, 0xee, 0x3c, 0x80 };
+static unsigned char const PPS_Inspire[] = { 0x28, 0xee, 0x38, 0x30 };
+
+/* The video formats that we know about.  A format's position in this table also gives the
+   'menu code' that the user types for it at the prompt in "doRepairType2()": '0'-'9', then
+   'A', 'B', etc. */
+typedef struct {
+  char const* name; /* for the command line */
+  unsigned width, height, fps;
+  int isInterlaced;
+  char const* camera;
+  int isCameraDefault; /* our guess for files from this camera, if the user doesn't know */
+  unsigned char const* sps;
+  unsigned spsSize;
+  unsigned char const* pps;
+  unsigned ppsSize;
+} VideoFormat;
+
+static VideoFormat const videoFormats[] = {
+  { "2160p30", 3840, 2160, 30, 0, "Inspire", 0, SPS_2160p30, sizeof SPS_2160p30, PPS_Inspire, sizeof PPS_Inspire },
+  { "2160p25", 3840, 2160, 25, 0, "Inspire", 0, SPS_2160p25, sizeof SPS_2160p25, PPS_Inspire, sizeof PPS_Inspire },
+  { "2160p24", 4096, 2160, 24, 0, "Inspire", 1, SPS_2160p24, sizeof SPS_2160p24, PPS_Inspire, sizeof PPS_Inspire },
+  { "1520p30", 2704, 1520, 30, 0, "Inspire", 0, SPS_1520p30, sizeof SPS_1520p30, PPS_Inspire, sizeof PPS_Inspire },
+  { "1520p25", 2704, 1520, 25, 0, "Inspire", 0, SPS_1520p25, sizeof SPS_1520p25, PPS_Inspire, sizeof PPS_Inspire },
+  { "1080p60", 1920, 1080, 60, 0, "Inspire", 0, SPS_1080p60, sizeof SPS_1080p60, PPS_Inspire, sizeof PPS_Inspire },
+  { "1080i60", 1920, 1080, 60, 1, "Phantom 2 Vision+", 0, SPS_1080i60, sizeof SPS_1080i60, PPS_P2VP, sizeof PPS_P2VP },
+  { "1080p50", 1920, 1080, 50, 0, "Inspire", 0, SPS_1080p50, sizeof SPS_1080p50, PPS_Inspire, sizeof PPS_Inspire },
+  { "1080p30", 1920, 1080, 30, 0, "Phantom 2 Vision+", 1, SPS_1080p30, sizeof SPS_1080p30, PPS_P2VP, sizeof PPS_P2VP },
+  { "1080p25", 1920, 1080, 25, 0, "Phantom 2 Vision+", 0, SPS_1080p25, sizeof SPS_1080p25, PPS_P2VP, sizeof PPS_P2VP },
+  { "1080p24", 1920, 1080, 24, 0, "Inspire", 0, SPS_1080p24, sizeof SPS_1080p24, PPS_Inspire, sizeof PPS_Inspire },
+  { "720p60", 1280, 720, 60, 0, "Phantom 2 Vision+", 0, SPS_720p60, sizeof SPS_720p60, PPS_P2VP, sizeof PPS_P2VP },
+  { "720p30", 1280, 720, 30, 0, "Phantom 2 Vision+", 0, SPS_720p30, sizeof SPS_720p30, PPS_P2VP, sizeof PPS_P2VP },
+  { "720p25", 1280, 720, 25, 0, "Inspire", 0, SPS_720p25, sizeof SPS_720p25, PPS_Inspire, sizeof PPS_Inspire },
+  { "480p30", 640, 480, 30, 0, "Phantom 2 Vision+", 0, SPS_480p30, sizeof SPS_480p30, PPS_P2VP, sizeof PPS_P2VP }
+};
+#define NUM_VIDEO_FORMATS ((int)(sizeof videoFormats/sizeof videoFormats[0]))
+
+static int menuCodeForFormat(int formatIndex) {
+  return formatIndex < 10 ? '0' + formatIndex : 'A' + formatIndex - 10;
+}
+
+/* Returns the index of the format with this 'menu code' (in either case), or FORMAT_NONE: */
+static int formatForMenuCode(int menuCode) {
+  int formatIndex;
+
+  if (menuCode >= '0' && menuCode <= '9') {
+    formatIndex = menuCode - '0';
+  } else if (menuCode >= 'a' && menuCode <= 'z') {
+    formatIndex = menuCode - 'a' + 10;
+  } else if (menuCode >= 'A' && menuCode <= 'Z') {
+    formatIndex = menuCode - 'A' + 10;
+  } else {
+    return FORMAT_NONE;
+  }
+
+  return formatIndex < NUM_VIDEO_FORMATS ? formatIndex : FORMAT_NONE;
+}
+
+int djifixNumFormats(void) {
+  return NUM_VIDEO_FORMATS;
+}
+
+char const* djifixFormatName(int format) {
+  return format >= 0 && format < NUM_VIDEO_FORMATS ? videoFormats[format].name : NULL;
+}
+
+/* Accepts a format name (in either case), or a 'menu code': */
+int djifixFormatForName(char const* name) {
+  int i;
+
+  for (i = 0; i < NUM_VIDEO_FORMATS; ++i) {
+    char const* p = videoFormats[i].name;
+    char const* q = name;
+
+    while (*p != '\0' && (*p == *q || (*p == 'p' && *q == 'P') || (*p == 'i' && *q == 'I'))) {
+      ++p; ++q;
+    }
+    if (*p == '\0' && *q == '\0') return i;
+  }
+
+  if (name[0] != '\0' && name[1] == '\0') return formatForMenuCode(name[0]);
+
+  return FORMAT_NONE;
+}
+
+#ifndef DJIFIX_NO_MAIN
+/* Sets "formatOption" from a format name (or from a 'menu code', or "auto"): */
+static int setFormatOption(char const* name) {
+  int format;
+
+  if (strcmp(name, "auto") == 0) {
+    formatOption = FORMAT_AUTO;
+    return 1;
+  }
+
+  if ((format = djifixFormatForName(name)) != FORMAT_NONE) {
+    formatOption = format;
+    return 1;
+  }
+
+  fprintf(stderr, "Unknown video format \"%s\"\n", name);
+  return 0;
+}
+
+static int isDirectory(char const* name) {
+#ifdef HAVE_DIRENT
+  struct stat sb;
+
+  return stat(name, &sb) == 0 && S_ISDIR(sb.st_mode);
+#else
+  return 0;
+#endif
+}
+
+/* Parses a size given on the command line ("-B", "-M"): a positive number of bytes, optionally
+   followed by "K", "M" or "G" (for KB, MB or GB; in either case).  Returns 0 iff it's not
+   such a size: */
+static int parseSizeOption(char const* arg, double* size) {
+  char suffix = '\0';
+
+  if (sscanf(arg, "%lf%c", size, &suffix) < 1 || *size <= 0.0 ||
+      (suffix != '\0' && strchr("KkMmGg", suffix) == NULL)) {
+    return 0;
+  }
+  if (suffix == 'K' || suffix == 'k') *size *= 1024;
+  else if (suffix == 'M' || suffix == 'm') *size *= 1024*1024;
+  else if (suffix == 'G' || suffix == 'g') *size *= 1024*1024*1024.0;
+  return 1;
+}
+
+static void usage(char const* progName) {
+  int i;
+
+  fprintf(stderr, "Usage: %s [-f video-format] [-t h264|mp4 | -T] [-v] [-s stats-file|-] [-P] [-M size[K|M|G]] [-V] [-c] [-x] [-m | -F] [-i | -o name-of-repaired-file|-] name-of-video-file-to-repair|-\n", progName);
+#ifdef HAVE_THREADS
+  fprintf(stderr, "   or: %s [-f video-format] [-t h264|mp4 | -T] [-s stats-file|-] [-P] [-M size[K|M|G]] [-V] [-c] [-x] [-m | -F] [-j num-parallel-repairs] [-L file-containing-names|-] name-of-file-or-directory ...\n", progName);
+#else
+  fprintf(stderr, "   or: %s [-f video-format] [-t h264|mp4 | -T] [-s stats-file|-] [-P] [-M size[K|M|G]] [-V] [-c] [-x] [-m | -F] [-L file-containing-names|-] name-of-file-or-directory ...\n", progName);
+#endif
+#ifdef HAVE_WATCH_MODE
+  fprintf(stderr, "   or: %s -w directory-to-watch [-f video-format] [-t h264|mp4 | -T] [-s stats-file|-] [-P] [-M size[K|M|G]] [-V] [-c] [-x] [-m | -F] [-i] [-j num-parallel-repairs]\n", progName);
+#endif
+  fprintf(stderr, "   or: %s -p [-j num-parallel-probes] [-L file-containing-names|-] name-of-file-or-directory ...\n", progName);
+  fprintf(stderr, "   or: %s -B size[K|M|G] [-f video-format] [-t h264|mp4] [-j num-copy-threads] [-o directory]\n", progName);
+  fprintf(stderr, "The video format (used only for 'type 2' repairs) is one of:\n\t");
+  for (i = 0; i < NUM_VIDEO_FORMATS; ++i) fprintf(stderr, "%s%s", videoFormats[i].name, i+1 < NUM_VIDEO_FORMATS ? " " : "\n");
+  fprintf(stderr, "or \"auto\" (use the format that best fits the file's contents).  (You can also set the environment variable \"DJIFIX_FORMAT\" to one of these.)\n");
+  fprintf(stderr, "If it's not given, we use the format that fits the file's contents - or, if we can't tell, you will be asked for it.\n");
+#ifdef HAVE_THREADS
+  fprintf(stderr, "(When repairing a single file, \"-j\" gives the number of threads that copy a 'type 2' file's data.)\n");
+#endif
+  fprintf(stderr, "'Type 2' repairs produce a raw H.264 ('.h264') file, unless \"-t mp4\" is given.  \"-x\" also writes an index of its NAL units (in its name, plus \".nalindex\"), for seeking.\n");
+  fprintf(stderr, "\"-T\" (trial) - if a 'type 2' file's video format isn't given, and can't be detected for sure - repairs it (once) to a '.h264' file for each format that it might be, named \"-<format>\".\n");
+  fprintf(stderr, "\"-m\" copies each recording in a 'type 1' file (e.g., after a power cut, several may follow one another) to its own repaired file, numbered \"-1\", \"-2\", etc.\n");
+  fprintf(stderr, "\"-F\" (faststart) puts a 'type 1' file's 'moov' atom (checked against its data, and with its chunk offsets corrected) at the start of the repaired file, so that it can be played - and seeked in - as it streams.\n");
+  fprintf(stderr, "\"-i\" repairs a 'type 1' file in place (changing the original file), rather than writing a new file.\n");
+  fprintf(stderr, "\"-v\" reports the repair's progress (every 64 MB).  \"-s\" writes it - and each repair's final statistics - to a file (or our standard output), as JSON lines.\n");
+  fprintf(stderr, "\"-P\" (profile) reports the time - and, on Linux, the CPU cycles and cache misses - of each phase of the probe and repair (also in the \"-s\" file, if given).\n");
+  fprintf(stderr, "\"-M\" (memory) keeps all of the repairs' buffers within the given size (at least 16M; shared among the repairs that run in parallel), allocated once per repair.\n");
+  fprintf(stderr, "\"-V\" (verify) gives the CRC-32C checksum of each repaired file (computed as it's written, so without reading it back), and checks that its structure (its atoms, or its NAL units) is sound.\n");
+  fprintf(stderr, "\"-c\" records checkpoints (in the repaired file's name, plus \".checkpoint\") as the repair goes, so that if it's interrupted, running it again continues from where it left off.\n");
+#ifdef HAVE_WATCH_MODE
+  fprintf(stderr, "\"-w\" (watch) keeps running, repairing each file that arrives in the directory (and those already there, unless already repaired) once it has been written - the smallest first - until stopped by Control-C.\n");
+#endif
+  fprintf(stderr, "\"-B\" (benchmark) generates a synthetic damaged file of each kind that we can repair - of the given size - and times probing and repairing it (writing one JSON line per file to our standard output).\n");
+  fprintf(stderr, "\"-p\" (probe) just classifies each file - without repairing it - writing one line (a JSON object) per file to our standard output.\n");
+  fprintf(stderr, "A file name of \"-\" means our standard input (the repaired file is then written to our standard output, unless \"-o\" is given) or output.\n");
+}
+
+int main(int argc, char** argv) {
+  Batch batch;
+  unsigned numWorkers;
+  char const* formatName;
+  char const* firstName = NULL;
+  unsigned numNames = 0;
+  int sawStdin = 0;
+  int sawListFile = 0;
+  char const* statsFileName = NULL;
+  int i;
+
+  fprintf(stderr, "%s, version %s; Copyright (c) 2014-2016 Live Networks, Inc. All rights reserved.\n", argv[0], versionStr);
+
+  formatName = getenv("DJIFIX_FORMAT");
+  if (formatName != NULL && formatName[0] != '\0' && !setFormatOption(formatName)) return 1;
+
+  memset(&batch, 0, sizeof batch);
+  numWorkers = defaultNumWorkers();
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+      if (!setFormatOption(argv[++i])) {
+	usage(argv[0]);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%u", &numWorkers) != 1 || numWorkers == 0) {
+	usage(argv[0]);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "-L") == 0 && i+1 < argc) {
+      if (!addListFileToBatch(&batch, argv[++i])) return 1;
+      sawListFile = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+      outputFileNameOption = argv[++i];
+#ifdef HAVE_WATCH_MODE
+    } else if (strcmp(argv[i], "-w") == 0 && i+1 < argc) {
+      watchDirOption = argv[++i];
+#endif
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "mp4") == 0) {
+	type2OutputIsMP4 = 1;
+      } else if (strcmp(argv[i], "h264") == 0) {
+	type2OutputIsMP4 = 0;
+      } else {
+	usage(argv[0]);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "-p") == 0) {
+      probeOnly = 1;
+    } else if (strcmp(argv[i], "-i") == 0) {
+      repairInPlace = 1;
+    } else if (strcmp(argv[i], "-B") == 0 && i+1 < argc) {
+      double size;
+
+      if (!parseSizeOption(argv[++i], &size)) {
+	usage(argv[0]);
+	return 1;
+      }
+      if (size < 1024 || size > 1e15) {
+	fprintf(stderr, "Bad size for \"-B\"\n");
+	return 1;
+      }
+      benchmarkSize = (DjifixOffset)size;
+    } else if (strcmp(argv[i], "-M") == 0 && i+1 < argc) {
+      double size;
+
+      if (!parseSizeOption(argv[++i], &size)) {
+	usage(argv[0]);
+	return 1;
+      }
+      if (size < DJIFIX_MIN_MEMORY_SIZE || size > (double)((size_t)-1)) {
+	fprintf(stderr, "The size for \"-M\" must be at least %uM\n",
+		DJIFIX_MIN_MEMORY_SIZE/(1024*1024));
+	return 1;
+      }
+      memoryOption = (size_t)size;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      showProgressOption = 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      checkpointOption = 1;
+    } else if (strcmp(argv[i], "-x") == 0) {
+      indexOption = 1;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      multiSegmentOption = 1;
+    } else if (strcmp(argv[i], "-F") == 0) {
+      faststartOption = 1;
+    } else if (strcmp(argv[i], "-P") == 0) {
+      profileOption = 1;
+    } else if (strcmp(argv[i], "-T") == 0) {
+      trialOption = 1;
+    } else if (strcmp(argv[i], "-V") == 0) {
+      verifyOption = 1;
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      statsFileName = argv[++i];
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      if (numNames++ == 0) firstName = argv[i];
+      if (strcmp(argv[i], "-") == 0) sawStdin = 1;
+    }
+  }
+  if (benchmarkSize > 0) {
+    if (numNames != 0 || sawListFile || probeOnly || repairInPlace || checkpointOption ||
+	indexOption || multiSegmentOption || faststartOption || trialOption ||
+	statsFileName != NULL || memoryOption > 0 || verifyOption || watchDirOption != NULL) {
+      usage(argv[0]);
+      return 1;
+    }
+    numCopyThreads = numWorkers;
+    return runBenchmark(outputFileNameOption != NULL ? outputFileNameOption : ".");
+  }
+
+  if ((numNames == 0 && !sawListFile && watchDirOption == NULL) ||
+      (watchDirOption != NULL && (numNames != 0 || sawListFile || probeOnly ||
+				  outputFileNameOption != NULL)) ||
+      ((sawStdin || outputFileNameOption != NULL) && (numNames != 1 || sawListFile)) ||
+      ((probeOnly || repairInPlace) && outputFileNameOption != NULL) ||
+      (repairInPlace && sawStdin) ||
+      ((statsFileName != NULL || checkpointOption || indexOption || multiSegmentOption ||
+	faststartOption || trialOption || memoryOption > 0 || verifyOption) && probeOnly) ||
+      (trialOption && (checkpointOption || indexOption)) ||
+      ((multiSegmentOption || faststartOption) && (repairInPlace || checkpointOption)) ||
+      (multiSegmentOption && faststartOption) ||
+      (verifyOption && (repairInPlace || multiSegmentOption)) ||
+      (statsFileName != NULL && strcmp(statsFileName, "-") == 0 &&
+       (outputFileNameOption != NULL ? strcmp(outputFileNameOption, "-") == 0 : sawStdin))) {
+    /* (We can repair our standard input - or give the name of the repaired file - only when
+       repairing a single file.  And our standard output can't be both the repaired file and
+       the statistics.) */
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (statsFileName != NULL) {
+    statsFID = strcmp(statsFileName, "-") == 0 ? stdout : fopen(statsFileName, "a");
+    if (statsFID == NULL) {
+      perror("Failed to open the statistics file");
+      return 1;
+    }
+  }
+
+#ifdef HAVE_WATCH_MODE
+  if (watchDirOption != NULL) {
+    if (!isDirectory(watchDirOption)) {
+      fprintf(stderr, "\"%s\" is not a directory!\n", watchDirOption);
+      return 1;
+    }
+    /* (Nobody will be there to be asked for a 'type 2' file's video format, so we use the
+       format that best fits the file:) */
+    if (formatOption == FORMAT_NONE) formatOption = FORMAT_AUTO;
+    return watchDirectory(watchDirOption, numWorkers);
+  }
+#endif
+
+  if (numNames == 1 && !sawListFile && !probeOnly && !isDirectory(firstName)) {
+    /* The usual case: A single file to repair.  (We can use several threads to do this.) */
+    numCopyThreads = numWorkers;
+    memoryPerRepair = memoryOption;
+    return repairFile(firstName, stderr, 0) == REPAIR_OK ? 0 : 1;
+  }
+
+  /* Batch mode (or probe mode): */
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-v") == 0 ||
+	strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "-m") == 0 ||
+	strcmp(argv[i], "-F") == 0 || strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "-T") == 0 ||
+	strcmp(argv[i], "-V") == 0) {
+      continue; /* no parameter */
+    }
+    if (argv[i][0] == '-' && argv[i][1] != '\0') ++i; /* skip over the option, and its parameter */
+    else addNameToBatch(&batch, argv[i]);
+  }
+  if (batch.numFiles == 0) {
+    fprintf(stderr, "No files to repair!\n");
+    return 1;
+  }
+
+  return repairBatch(&batch, numWorkers);
+}
+#endif
+
+/* The sizes of the buffer that we use for a stream: initially, and the most that we'll let
+   it grow to (in order to keep data that we might move back to): */
+#define STREAM_BUFFER_MIN_SIZE (64*1024)
+#define STREAM_BUFFER_MAX_SIZE (64*1024*1024)
+
+static InputFile* openInputFile(char const* fileName, Arena* arena) {
+  FILE* fid;
+  InputFile* inputFile;
+
+  if (strcmp(fileName, "-") == 0) return openInputFID(stdin, 1, arena);
+
+  fid = fopen(fileName, "rb");
+  if (fid == NULL) return NULL;
+
+  inputFile = openInputFID(fid, 0, arena);
+  if (inputFile == NULL) fclose(fid);
+  return inputFile;
+}
+
+/* Makes an "InputFile" for an open file (which is closed - unless it's stdin - when the
+   "InputFile" is closed): */
+static InputFile* openInputFID(FILE* fid, int isStream, Arena* arena) {
+  InputFile* inputFile;
+
+  inputFile = arenaAlloc(arena, sizeof (InputFile));
+  if (inputFile == NULL) return NULL;
+  memset(inputFile, 0, sizeof (InputFile));
+  inputFile->fid = fid;
+  inputFile->arena = arena;
+
+  if (isStream) {
+    inputFile->streamBufferSize = STREAM_BUFFER_MIN_SIZE;
+    inputFile->streamBuffer = arenaAlloc(arena, inputFile->streamBufferSize);
+    if (inputFile->streamBuffer == NULL) {
+      arenaFree(arena, inputFile);
+      return NULL;
+    }
+    return inputFile;
+  }
+
+#ifdef HAVE_MMAP
+  {
+    /* Try to memory-map the file.  If this fails (e.g., because the file is empty, or isn't a
+       regular file, or is too big for our address space), we just use 'stdio' instead: */
+    struct stat sb;
+
+    if (fstat(fileno(inputFile->fid), &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	(off_t)(size_t)sb.st_size == sb.st_size) {
+      void* mapStart = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE,
+			    fileno(inputFile->fid), 0);
+      if (mapStart != MAP_FAILED) {
+	inputFile->mapStart = mapStart;
+	inputFile->mapSize = (DjifixOffset)sb.st_size;
+      }
+    }
+  }
+#endif
+
+  if (arena != NULL && inputFile->mapStart == NULL && fid != stdin) {
+    /* So that 'stdio' doesn't allocate its own buffer, give it one from the arena: */
+    inputFile->stdioBuffer = arenaAlloc(arena, BUFSIZ);
+    if (inputFile->stdioBuffer == NULL ||
+	setvbuf(fid, (char*)inputFile->stdioBuffer, _IOFBF, BUFSIZ) != 0) {
+      arenaFree(arena, inputFile->stdioBuffer);
+      arenaFree(arena, inputFile);
+      return NULL;
+    }
+  }
+
+  return inputFile;
+}
+
+/* Makes an "InputFile" for data that's already in memory (and that the caller owns): */
+static InputFile* openInputBuffer(unsigned char const* data, size_t dataSize, Arena* arena) {
+  InputFile* inputFile;
+
+  if (data == NULL || dataSize == 0) return NULL;
+
+  inputFile = arenaAlloc(arena, sizeof (InputFile));
+  if (inputFile == NULL) return NULL;
+  memset(inputFile, 0, sizeof (InputFile));
+  inputFile->arena = arena;
+
+  inputFile->mapStart = data;
+  inputFile->mapSize = (DjifixOffset)dataSize;
+  return inputFile; /* with no "fid" */
+}
+
+/* Reading through a "DjifixReader": We give 'stdio' our own read and seek functions, so that
+   the rest of our code can read the file as it would any other (unmapped) file.  Each read
+   from the reader may be a round trip over a network, so we read ahead: we begin with a small
+   read (so that a probe fetches little more than it looks at), and double the size of each
+   read that continues on from the previous one, up to a limit.  (A seek elsewhere starts
+   again from a small read.  Anything larger than our current read-ahead size is read
+   directly into the caller's buffer.): */
+#ifdef HAVE_READER_STREAMS
+#define READER_MIN_READ_AHEAD (16*1024)
+#define READER_MAX_READ_AHEAD (4*1024*1024)
+
+typedef struct {
+  DjifixReader reader;
+  DjifixOffset pos; /* our current position in the file */
+  unsigned char* cache; /* the data that we read ahead */
+  size_t cacheSize, cacheLen;
+  DjifixOffset cachePos; /* the file position of the start of "cache" */
+  DjifixOffset lastReadEnd; /* the file position just after our most recent read from "reader" */
+  size_t readAheadSize;
+  Arena* arena;
+} ReaderStream;
+
+static long long readerStreamRead(ReaderStream* rs, char* buf, size_t numBytes) {
+  long long total = 0;
+
+  while (numBytes > 0 && rs->pos < rs->reader.size) {
+    DjifixOffset numAvailable = rs->reader.size - rs->pos;
+    size_t numToRead;
+    long long numRead;
+
+    if (rs->pos >= rs->cachePos && rs->pos < rs->cachePos + (DjifixOffset)rs->cacheLen) {
+      /* Some (or all) of the data is in our cache: */
+      size_t offset = (size_t)(rs->pos - rs->cachePos);
+      size_t numCached = rs->cacheLen - offset < numBytes ? rs->cacheLen - offset : numBytes;
+
+      memcpy(buf, &rs->cache[offset], numCached);
+      buf += numCached; numBytes -= numCached;
+      rs->pos += numCached; total += numCached;
+      continue;
+    }
+
+    /* We need to read from the reader.  Work out how much: */
+    if (rs->pos != rs->lastReadEnd || rs->readAheadSize == 0) {
+      rs->readAheadSize = READER_MIN_READ_AHEAD;
+    } else if (rs->readAheadSize < READER_MAX_READ_AHEAD) {
+      rs->readAheadSize *= 2;
+    }
+
+    if (numBytes < rs->readAheadSize && rs->cacheSize < rs->readAheadSize) {
+      /* We need a larger cache.  (We free the old one first, so that - in an arena - the new
+	 one can take its place.  If we can't allocate it, we read directly.): */
+      arenaFree(rs->arena, rs->cache);
+      rs->cacheLen = rs->cacheSize = 0;
+      rs->cache = arenaAlloc(rs->arena, rs->readAheadSize);
+      if (rs->cache != NULL) rs->cacheSize = rs->readAheadSize;
+    }
+
+    if (numBytes >= rs->readAheadSize || rs->cacheSize < rs->readAheadSize) {
+      /* Read directly into the caller's buffer: */
+      numToRead = (DjifixOffset)numBytes < numAvailable ? numBytes : (size_t)numAvailable;
+      numRead = rs->reader.read(rs->reader.opaque, buf, numToRead, rs->pos);
+      if (numRead <= 0) return total > 0 || numRead == 0 ? total : -1;
+      rs->lastReadEnd = rs->pos + numRead;
+      buf += numRead; numBytes -= numRead;
+      rs->pos += numRead; total += numRead;
+      continue;
+    }
+
+    /* Otherwise, read ahead into our cache: */
+    numToRead = (DjifixOffset)rs->readAheadSize < numAvailable ? rs->readAheadSize : (size_t)numAvailable;
+    rs->cacheLen = 0;
+    numRead = rs->reader.read(rs->reader.opaque, rs->cache, numToRead, rs->pos);
+    if (numRead <= 0) return total > 0 || numRead == 0 ? total : -1;
+    rs->cachePos = rs->pos;
+    rs->cacheLen = (size_t)numRead;
+    rs->lastReadEnd = rs->pos + numRead;
+  }
+
+  return total;
+}
+
+static int readerStreamSeek(ReaderStream* rs, DjifixOffset* offset, int whence) {
+  DjifixOffset newPos;
+
+  switch (whence) {
+    case SEEK_SET: { newPos = *offset; break; }
+    case SEEK_CUR: { newPos = rs->pos + *offset; break; }
+    case SEEK_END: { newPos = rs->reader.size + *offset; break; }
+    default: { return -1; }
+  }
+  if (newPos < 0) return -1;
+
+  *offset = rs->pos = newPos;
+  return 0;
+}
+
+static int readerStreamClose(ReaderStream* rs) {
+  if (rs->reader.close != NULL) (*rs->reader.close)(rs->reader.opaque);
+  arenaFree(rs->arena, rs->cache);
+  arenaFree(rs->arena, rs);
+  return 0;
+}
+
+/* The functions that we give to 'stdio' ("fopencookie()" on Linux; "funopen()" elsewhere): */
+#if defined(__linux__)
+static ssize_t readerCookieRead(void* cookie, char* buf, size_t numBytes) {
+  return (ssize_t)readerStreamRead((ReaderStream*)cookie, buf, numBytes);
+}
+
+static int readerCookieSeek(void* cookie, off64_t* offset, int whence) {
+  DjifixOffset pos = (DjifixOffset)*offset;
+
+  if (readerStreamSeek((ReaderStream*)cookie, &pos, whence) != 0) return -1;
+  *offset = (off64_t)pos;
+  return 0;
+}
+
+static int readerCookieClose(void* cookie) {
+  return readerStreamClose((ReaderStream*)cookie);
+}
+#else
+static int readerCookieRead(void* cookie, char* buf, int numBytes) {
+  return numBytes < 0 ? -1 : (int)readerStreamRead((ReaderStream*)cookie, buf, (size_t)numBytes);
+}
+
+static fpos_t readerCookieSeek(void* cookie, fpos_t offset, int whence) {
+  DjifixOffset pos = (DjifixOffset)offset;
+
+  if (readerStreamSeek((ReaderStream*)cookie, &pos, whence) != 0) return -1;
+  return (fpos_t)pos;
+}
+
+static int readerCookieClose(void* cookie) {
+  return readerStreamClose((ReaderStream*)cookie);
+}
+#endif
+#endif
+
+/* Makes an "InputFile" that reads through a "DjifixReader" (whose "close()" is called when the
+   "InputFile" is closed - but not if this fails): */
+static InputFile* openInputReader(DjifixReader const* reader, Arena* arena) {
+#ifdef HAVE_READER_STREAMS
+  ReaderStream* rs;
+  FILE* fid;
+  InputFile* inputFile;
+
+  if (reader == NULL || reader->read == NULL || reader->size <= 0) return NULL;
+
+  rs = arenaAlloc(arena, sizeof (ReaderStream));
+  if (rs == NULL) return NULL;
+  memset(rs, 0, sizeof (ReaderStream));
+  rs->reader = *reader;
+  rs->lastReadEnd = -1;
+  rs->arena = arena;
+
+#if defined(__linux__)
+  {
+    cookie_io_functions_t functions;
+
+    memset(&functions, 0, sizeof functions);
+    functions.read = readerCookieRead;
+    functions.seek = readerCookieSeek;
+    functions.close = readerCookieClose;
+    fid = fopencookie(rs, "rb", functions);
+  }
+#else
+  fid = funopen(rs, readerCookieRead, NULL, readerCookieSeek, readerCookieClose);
+#endif
+  if (fid == NULL) {
+    arenaFree(arena, rs);
+    return NULL;
+  }
+
+  inputFile = openInputFID(fid, 0, arena); /* (with no file descriptor, this doesn't try to map it) */
+  if (inputFile == NULL) {
+    rs->reader.close = NULL;
+    fclose(fid);
+    return NULL;
+  }
+  inputFile->reader = &rs->reader;
+  return inputFile;
+#else
+  (void)reader; (void)arena;
+  return NULL;
+#endif
+}
+
+static void closeInputFile(InputFile* inputFile) {
+  Arena* arena = inputFile->arena;
+
+  if (inputFile->fid == NULL) { /* the caller's data */
+    arenaFree(arena, inputFile);
+    return;
+  }
+
+#ifdef HAVE_MMAP
+  if (inputFile->mapStart != NULL) {
+    munmap((void*)inputFile->mapStart, (size_t)inputFile->mapSize);
+  }
+#endif
+  if (inputFile->streamBuffer != NULL) arenaFree(arena, inputFile->streamBuffer);
+  if (inputFile->fid != stdin) fclose(inputFile->fid);
+  if (inputFile->stdioBuffer != NULL) arenaFree(arena, inputFile->stdioBuffer);
+  arenaFree(arena, inputFile);
+}
+
+/* Makes sure that (unless we reach the end of the stream first) "streamBuffer" holds the
+   "numBytes" bytes at "streamPos" (and any data that we skipped over to get there).  Returns
+   the number of those bytes that it holds.  To make room, we discard data from before
+   "streamPos" if we've been told that we no longer need it - or if we can't afford to keep
+   it any longer: */
+static size_t fillStream(InputFile* inputFile, size_t numBytes) {
+  size_t offset = inputFile->streamPos - inputFile->streamBufferPos;
+
+  while (inputFile->streamBufferLen < offset + numBytes) {
+    size_t numToRead, numRead;
+
+    if (inputFile->streamBufferLen == inputFile->streamBufferSize) {
+      size_t numToDiscard = offset < inputFile->streamBufferLen ? offset : inputFile->streamBufferLen;
+
+      if (numToDiscard > 0 &&
+	  (inputFile->streamIsForwardOnly || inputFile->streamBufferSize >= STREAM_BUFFER_MAX_SIZE)) {
+	memmove(inputFile->streamBuffer, &inputFile->streamBuffer[numToDiscard],
+		inputFile->streamBufferLen - numToDiscard);
+	inputFile->streamBufferLen -= numToDiscard;
+	inputFile->streamBufferPos += numToDiscard;
+	offset -= numToDiscard;
+      } else {
+	unsigned char* newBuffer = arenaRealloc(inputFile->arena, inputFile->streamBuffer,
+						2*inputFile->streamBufferSize);
+
+	if (newBuffer == NULL) break;
+	inputFile->streamBuffer = newBuffer;
+	inputFile->streamBufferSize *= 2;
+      }
+      continue;
+    }
+
+    numToRead = offset + numBytes - inputFile->streamBufferLen;
+    if (numToRead > inputFile->streamBufferSize - inputFile->streamBufferLen) {
+      numToRead = inputFile->streamBufferSize - inputFile->streamBufferLen;
+    }
+    numRead = fread(&inputFile->streamBuffer[inputFile->streamBufferLen], 1, numToRead,
+		    inputFile->fid);
+    inputFile->streamBufferLen += numRead;
+    if (numRead < numToRead) break; /* we reached the end of the stream */
+  }
+
+  if (inputFile->streamBufferLen <= offset) return 0;
+  return inputFile->streamBufferLen - offset < numBytes ? inputFile->streamBufferLen - offset : numBytes;
+}
+
+/* Tells us that we'll no longer move back in the input file (so, if it's a stream, we no
+   longer need to keep data from before our current position): */
+static void inputDiscardHistory(InputFile* inputFile) {
+  inputFile->streamIsForwardOnly = 1;
+}
+
+/* Like "fseek()" (including allowing us to seek past the end of the file): */
+static int inputSeek(InputFile* inputFile, DjifixOffset offset, int whence) {
+  DjifixOffset newPos;
+
+  if (inputFile->streamBuffer != NULL) {
+    /* We can move forward (lazily: "fillStream()" reads the data that we skip over), and
+       back, but only within the data that we've kept: */
+    if (whence == SEEK_SET) newPos = offset;
+    else if (whence == SEEK_CUR) newPos = inputFile->streamPos + offset;
+    else return -1;
+    if (newPos < inputFile->streamBufferPos) return -1;
+
+    inputFile->streamPos = newPos;
+    return 0;
+  }
+
+  if (inputFile->mapStart == NULL) return fseek64(inputFile->fid, offset, whence);
+
+  switch (whence) {
+    case SEEK_SET: { newPos = offset; break; }
+    case SEEK_CUR: { newPos = inputFile->mapPos + offset; break; }
+    case SEEK_END: { newPos = inputFile->mapSize + offset; break; }
+    default: { return -1; }
+  }
+  if (newPos < 0) return -1;
+
+  inputFile->mapPos = newPos;
+  return 0;
+}
+
+/* Like "ftell()": */
+static DjifixOffset inputTell(InputFile* inputFile) {
+  if (inputFile->streamBuffer != NULL) return inputFile->streamPos;
+  if (inputFile->mapStart == NULL) return ftell64(inputFile->fid);
+
+  return inputFile->mapPos;
+}
+
+/* Returns the input file's 'stdio' handle, positioned at our current position in the file
+   (so that the caller can read - or copy - the rest of the file some other way), or NULL if
+   we can't do this (e.g., because the file is a stream): */
+static FILE* inputFIDAtCurrentPosition(InputFile* inputFile) {
+  if (inputFile->streamBuffer != NULL || inputFile->fid == NULL) return NULL;
+  if (inputFile->mapStart != NULL && fseek64(inputFile->fid, inputFile->mapPos, SEEK_SET) != 0) {
+    return NULL;
+  }
+
+  return inputFile->fid;
+}
+
+static int get1Byte(InputFile* inputFile, unsigned char* result) {
+  int fgetcResult;
+  FILE* fid;
+
+  if (inputFile->mapStart != NULL) {
+    if (inputFile->mapPos >= inputFile->mapSize) return 0;
+
+    *result = inputFile->mapStart[inputFile->mapPos++];
+    return 1;
+  }
+
+  if (inputFile->streamBuffer != NULL) {
+    if (fillStream(inputFile, 1) == 0) return 0;
+
+    *result = inputFile->streamBuffer[inputFile->streamPos++ - inputFile->streamBufferPos];
+    return 1;
+  }
+
+  fid = inputFile->fid;
+  fgetcResult = fgetc(fid);
+  if (feof(fid) || ferror(fid)) return 0;
+
+  *result = (unsigned char)fgetcResult;
+  return 1;
+}
+
+static int get4Bytes(InputFile* inputFile, unsigned* result) {
+  unsigned char c1, c2, c3, c4;
+
+  if (inputFile->mapStart != NULL && inputFile->mapPos <= inputFile->mapSize - 4) {
+    unsigned char const* p = &inputFile->mapStart[inputFile->mapPos];
+
+    *result = (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+    inputFile->mapPos += 4;
+    return 1;
+  }
+
+  if (inputFile->streamBuffer != NULL && fillStream(inputFile, 4) == 4) {
+    unsigned char const* p = &inputFile->streamBuffer[inputFile->streamPos - inputFile->streamBufferPos];
+
+    *result = (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+    inputFile->streamPos += 4;
+    return 1;
+  }
+
+  if (!get1Byte(inputFile, &c1)) return 0;
+  if (!get1Byte(inputFile, &c2)) return 0;
+  if (!get1Byte(inputFile, &c3)) return 0;
+  if (!get1Byte(inputFile, &c4)) return 0;
+
+  *result = (c1<<24)|(c2<<16)|(c3<<8)|c4;
+  return 1;
+}
+
+/* Reads up to "numBytes" bytes into "to"; returns the number of bytes read (which will be
+   less than "numBytes" only at the end of the file): */
+static size_t getBytes(InputFile* inputFile, unsigned char* to, size_t numBytes) {
+  if (inputFile->mapStart != NULL) {
+    if (inputFile->mapPos >= inputFile->mapSize) return 0;
+    if (numBytes > (size_t)(inputFile->mapSize - inputFile->mapPos)) {
+      numBytes = inputFile->mapSize - inputFile->mapPos;
+    }
+
+    memcpy(to, &inputFile->mapStart[inputFile->mapPos], numBytes);
+    inputFile->mapPos += numBytes;
+    return numBytes;
+  }
+
+  if (inputFile->streamBuffer != NULL) {
+    numBytes = fillStream(inputFile, numBytes);
+    memcpy(to, &inputFile->streamBuffer[inputFile->streamPos - inputFile->streamBufferPos],
+	   numBytes);
+    inputFile->streamPos += numBytes;
+    return numBytes;
+  }
+
+  return fread(to, 1, numBytes, inputFile->fid);
+}
+
+/* Returns true iff reading the input file failed (rather than just reaching its end): */
+static int inputFailed(InputFile* inputFile) {
+  return inputFile->fid != NULL && ferror(inputFile->fid);
+}
+
+static int checkAtom(InputFile* inputFile, unsigned fourccToCheck, DjifixOffset* numRemainingBytesToSkip) {
+  do {
+    unsigned atomSize, fourcc;
+
+    if (!get4Bytes(inputFile, &atomSize)) break;
+
+    if (!get4Bytes(inputFile, &fourcc) || fourcc != fourccToCheck) break;
+
+    if (atomSize == 1 && fourcc != fourcc_ftyp) {
+      /* A 64-bit 'largesize' follows (e.g., for a 'mdat' atom in a file larger than 4 GB): */
+      unsigned sizeHigh, sizeLow;
+      DjifixOffset largeSize;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) break;
+      largeSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      if (largeSize < 16) break;
+      *numRemainingBytesToSkip = largeSize - 16;
+      return 1;
+    }
+
+    if (atomSize < 8) break; /* atom size should be >= 8 */
+    *numRemainingBytesToSkip = atomSize - 8;
+
+    return 1;
+  } while (0);
+
+  /* An error occurred: */
+  return 0;
+}
+
+/* Scanning quickly through (possibly large amounts of) data, looking for data that we
+   understand.  Where possible, we use SIMD instructions to reject most positions (several at
+   a time), and then check any remaining candidate positions individually: */
+
+#ifdef SCAN_BLOCK_SIZE
+/* Returns a bit mask of those of the SCAN_BLOCK_SIZE positions beginning at "p" that might be
+   the start of sane data (see "isSaneDataAt()" below).  Each of the signatures that we look
+   for either begins with a 0x00 or 0xFF byte, or has 'f' 4 bytes in.
+   ("p" must be followed by at least SCAN_BLOCK_SIZE+4 bytes of data.)
+*/
+static unsigned saneDataCandidates(unsigned char const* p) {
+#if defined(USE_AVX2)
+  __m256i b0 = _mm256_loadu_si256((__m256i const*)p);
+  __m256i b4 = _mm256_loadu_si256((__m256i const*)(p+4));
+  __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b0, _mm256_setzero_si256()),
+					      _mm256_cmpeq_epi8(b0, _mm256_set1_epi8((char)0xFF))),
+			      _mm256_cmpeq_epi8(b4, _mm256_set1_epi8('f')));
+  return (unsigned)_mm256_movemask_epi8(m);
+#elif defined(USE_SSE2)
+  __m128i b0 = _mm_loadu_si128((__m128i const*)p);
+  __m128i b4 = _mm_loadu_si128((__m128i const*)(p+4));
+  __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b0, _mm_setzero_si128()),
+					_mm_cmpeq_epi8(b0, _mm_set1_epi8((char)0xFF))),
+			   _mm_cmpeq_epi8(b4, _mm_set1_epi8('f')));
+  return (unsigned)_mm_movemask_epi8(m);
+#else /* USE_NEON */
+  uint8x16_t b0 = vld1q_u8(p);
+  uint8x16_t b4 = vld1q_u8(p+4);
+  uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(b0, vdupq_n_u8(0x00)), vceqq_u8(b0, vdupq_n_u8(0xFF))),
+			  vceqq_u8(b4, vdupq_n_u8('f')));
+  return vmaxvq_u8(m) != 0 ? 0xFFFF : 0; /* NEON has no 'movemask'; check all positions */
+#endif
+}
+
+/* Returns a bit mask of those of the SCAN_BLOCK_SIZE/4 4-byte words beginning at "p" that are
+   0x00000002: */
+static unsigned nalSize2Candidates(unsigned char const* p) {
+#if defined(USE_AVX2)
+  __m256i const two = _mm256_setr_epi8(0,0,0,2, 0,0,0,2, 0,0,0,2, 0,0,0,2,
+					0,0,0,2, 0,0,0,2, 0,0,0,2, 0,0,0,2);
+  __m256i b = _mm256_loadu_si256((__m256i const*)p);
+  __m256i m = _mm256_cmpeq_epi32(_mm256_cmpeq_epi8(b, two), _mm256_set1_epi8((char)0xFF));
+  return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+#elif defined(USE_SSE2)
+  __m128i const two = _mm_setr_epi8(0,0,0,2, 0,0,0,2, 0,0,0,2, 0,0,0,2);
+  __m128i b = _mm_loadu_si128((__m128i const*)p);
+  __m128i m = _mm_cmpeq_epi32(_mm_cmpeq_epi8(b, two), _mm_set1_epi8((char)0xFF));
+  return (unsigned)_mm_movemask_ps(_mm_castsi128_ps(m));
+#else /* USE_NEON */
+  static unsigned char const twoBytes[16] = { 0,0,0,2, 0,0,0,2, 0,0,0,2, 0,0,0,2 };
+  uint32x4_t m = vreinterpretq_u32_u8(vceqq_u8(vld1q_u8(p), vld1q_u8(twoBytes)));
+  return vmaxvq_u32(vceqq_u32(m, vdupq_n_u32(0xFFFFFFFF))) != 0 ? 0xF : 0;
+#endif
+}
+
+/* Returns a bit mask of those of the SCAN_BLOCK_SIZE bytes beginning at "p" that are 0x02.
+   (Runs of 0x00 or 0xFF bytes - the usual contents of a damaged region - contain none, so
+   such runs get skipped a whole block at a time.)
+*/
+static unsigned byte2Candidates(unsigned char const* p) {
+#if defined(USE_AVX2)
+  __m256i b = _mm256_loadu_si256((__m256i const*)p);
+  return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(2)));
+#elif defined(USE_SSE2)
+  __m128i b = _mm_loadu_si128((__m128i const*)p);
+  return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8(2)));
+#else /* USE_NEON */
+  return vmaxvq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8(2))) != 0 ? 0xFFFF : 0;
+#endif
+}
+#endif
+
+/* Returns true iff the 8 bytes at "p" are data that we understand at the start of a file:
+   a 'ftyp' atom header, 0x00000002 (the start of a 'type 2' file), or 0x00000000 or
+   0xFFFFFFFF (junk that we know how to skip over): */
+static int isSaneDataAt(unsigned char const* p) {
+  unsigned first4Bytes = (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+
+  return first4Bytes == 0x00000002 || first4Bytes == 0x00000000 || first4Bytes == 0xFFFFFFFF ||
+    (p[4] == 'f' && p[5] == 't' && p[6] == 'y' && p[7] == 'p');
+}
+
+/* Returns the offset of the first position (in the "len" bytes at "buf") at which
+   "isSaneDataAt()" is true, or "len" if there is none: */
+static size_t findSaneData(unsigned char const* buf, size_t len) {
+  size_t i = 0;
+
+  if (len < 8) return len;
+
+#ifdef SCAN_BLOCK_SIZE
+  for (; i + SCAN_BLOCK_SIZE + 7 <= len; i += SCAN_BLOCK_SIZE) {
+    unsigned mask = saneDataCandidates(&buf[i]);
+    size_t j;
+
+    for (j = 0; mask != 0; ++j, mask >>= 1) {
+      if ((mask&1) != 0 && isSaneDataAt(&buf[i+j])) return i+j;
+    }
+  }
+#endif
+
+  for (; i + 8 <= len; ++i) {
+    if (isSaneDataAt(&buf[i])) return i;
+  }
+
+  return len;
+}
+
+/* Returns the offset of the first 4-byte boundary (in the "len" bytes at "buf") at which the
+   bytes 0x00000002 appear (followed by at least another 4 bytes), or "len" if there is none: */
+static size_t findNALSize2(unsigned char const* buf, size_t len) {
+  size_t i = 0;
+
+  if (len < 8) return len;
+
+#ifdef SCAN_BLOCK_SIZE
+  for (; i + SCAN_BLOCK_SIZE + 4 <= len; i += SCAN_BLOCK_SIZE) {
+    unsigned mask = nalSize2Candidates(&buf[i]);
+    size_t j;
+
+    for (j = 0; mask != 0; j += 4, mask >>= 1) {
+      if ((mask&1) != 0 && buf[i+j] == 0 && buf[i+j+1] == 0 && buf[i+j+2] == 0 && buf[i+j+3] == 2) {
+	return i+j;
+      }
+    }
+  }
+#endif
+
+  for (; i + 8 <= len; i += 4) {
+    if (buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 0 && buf[i+3] == 2) return i;
+  }
+
+  return len;
+}
+
+/* The number of bytes (beginning at a position) that "isResumedDataAt()" (below) looks at: */
+#define RESUMED_DATA_SIZE 11
+
+/* Returns true iff the bytes at "p" look like the place where sane 'type 2' data resumes
+   after an anomalous 'NAL size': a 0x00000002 'NAL size', followed by its (2-byte) NAL unit,
+   and then the size and header byte of another plausible NAL unit.  (Checking this chain of
+   two sizes - rather than accepting the first 0x00000002 that we see - avoids resuming at a
+   0x00000002 that just happens to appear within garbage.)
+*/
+static int isResumedDataAt(unsigned char const* p) {
+  unsigned nextNALSize;
+  unsigned char nextNALHeader = p[10];
+
+  if (p[0] != 0 || p[1] != 0 || p[2] != 0 || p[3] != 2 || (p[4]&0x80) != 0) return 0;
+
+  nextNALSize = (p[6]<<24)|(p[7]<<16)|(p[8]<<8)|p[9];
+  return nextNALSize != 0 && nextNALSize <= 0x00FFFFFF &&
+    (nextNALHeader&0x80) == 0 && (nextNALHeader&0x1F) >= 1 && (nextNALHeader&0x1F) <= 12;
+}
+
+/* Returns the offset of the first position (in the "len" bytes at "buf"; at any alignment) at
+   which "isResumedDataAt()" is true, or "len" if there is none: */
+static size_t findResumedData(unsigned char const* buf, size_t len) {
+  size_t i = 0;
+
+  if (len < RESUMED_DATA_SIZE) return len;
+
+#ifdef SCAN_BLOCK_SIZE
+  /* Look for the 0x02 byte that ends each candidate's 0x00000002: */
+  for (; i + SCAN_BLOCK_SIZE + RESUMED_DATA_SIZE <= len; i += SCAN_BLOCK_SIZE) {
+    unsigned mask = byte2Candidates(&buf[i+3]);
+    size_t j;
+
+    for (j = 0; mask != 0; ++j, mask >>= 1) {
+      if ((mask&1) != 0 && isResumedDataAt(&buf[i+j])) return i+j;
+    }
+  }
+#endif
+
+  for (; i + RESUMED_DATA_SIZE <= len; ++i) {
+    if (isResumedDataAt(&buf[i])) return i;
+  }
+
+  return len;
+}
+
+/* The size of each chunk that we read when scanning a file that isn't memory-mapped: */
+#define SCAN_CHUNK_SIZE (64*1024)
+
+/* The most data (beginning at a position) that any of the above 'finder' functions needs to
+   look at to check the position: */
+#define SCAN_LOOKAHEAD_SIZE 16
+
+static int scanInput(InputFile* inputFile, size_t (*finder)(unsigned char const*, size_t),
+		     unsigned stride) {
+  unsigned char* buffer;
+  DjifixOffset bufferPos; /* the file position of the start of "buffer" */
+  size_t bufferLen, offset, numRead;
+
+  if (inputFile->mapStart != NULL) {
+    /* Scan the mapping directly: */
+    if (inputFile->mapPos >= inputFile->mapSize) return 0;
+
+    offset = (*finder)(&inputFile->mapStart[inputFile->mapPos],
+		       inputFile->mapSize - inputFile->mapPos);
+    if (offset == (size_t)(inputFile->mapSize - inputFile->mapPos)) return 0;
+
+    inputFile->mapPos += offset;
+    return 1;
+  }
+
+  if (inputFile->streamBuffer != NULL) {
+    /* Scan the stream's buffer, a chunk at a time: */
+    while ((bufferLen = fillStream(inputFile, SCAN_CHUNK_SIZE)) > 0) {
+      offset = (*finder)(&inputFile->streamBuffer[inputFile->streamPos - inputFile->streamBufferPos],
+			 bufferLen);
+      if (offset < bufferLen) {
+	inputFile->streamPos += offset;
+	return 1;
+      }
+      if (bufferLen < SCAN_CHUNK_SIZE) break; /* we reached the end of the stream */
+
+      inputFile->streamPos += ((bufferLen-SCAN_LOOKAHEAD_SIZE)/stride + 1)*stride;
+    }
+    return 0;
+  }
+
+  buffer = arenaAlloc(inputFile->arena, SCAN_CHUNK_SIZE);
+  if (buffer == NULL) return 0;
+  bufferPos = ftell64(inputFile->fid);
+  bufferLen = 0;
+
+  while ((numRead = fread(&buffer[bufferLen], 1, SCAN_CHUNK_SIZE - bufferLen, inputFile->fid)) > 0) {
+    size_t numChecked;
+
+    bufferLen += numRead;
+    offset = (*finder)(buffer, bufferLen);
+    if (offset < bufferLen) {
+      arenaFree(inputFile->arena, buffer);
+      return fseek64(inputFile->fid, bufferPos + offset, SEEK_SET) == 0;
+    }
+
+    /* Keep the bytes at positions that we couldn't yet check (because they weren't followed by
+       enough data), and read more: */
+    numChecked = bufferLen < SCAN_LOOKAHEAD_SIZE ? 0
+      : ((bufferLen-SCAN_LOOKAHEAD_SIZE)/stride + 1)*stride;
+    memmove(buffer, &buffer[numChecked], bufferLen - numChecked);
+    bufferLen -= numChecked;
+    bufferPos += numChecked;
+  }
+
+  arenaFree(inputFile->arena, buffer);
+  return 0;
+}
+
+/* Reporting the progress of a repair (if asked): every "progressInterval" bytes of input, we
+   write a line about it to the log (if "showProgress" is set), and/or a JSON object (on one
+   line) to "statsFID".  Between reports, noting our progress costs just a comparison. */
+
+/* Writes "str" to "fid" as a JSON string: */
+static void writeJSONString(FILE* fid, char const* str) {
+  fputc('"', fid);
+  for (; *str != '\0'; ++str) {
+    unsigned char c = (unsigned char)*str;
+
+    if (c == '"' || c == '\\') fprintf(fid, "\\%c", c);
+    else if (c < 0x20) fprintf(fid, "\\u%04x", c);
+    else fputc(c, fid);
+  }
+  fputc('"', fid);
+}
+
+static double secondsNow(void) {
+#if defined(HAVE_FILE_DESCRIPTORS) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) return ts.tv_sec + ts.tv_nsec/1e9;
+#endif
+  return (double)time(NULL);
+}
+
+/* Fixed-memory operation ("memory"): Every buffer that we use for a file then comes from the
+   caller's memory, which we manage as an 'arena'.  We begin with an "Arena" header (at the
+   start of the memory), and allocate blocks - each preceded by a "ArenaBlock" header - one
+   after another.  Freeing the last block gives its space back (along with that of any freed
+   blocks before it); any other freed block is kept on a list, and reused for a later request
+   that it's big enough for (but not much bigger than), so that buffers that we allocate and
+   free over and over (e.g., for each segment that we copy) don't use up the arena.  When the
+   file is closed, we free everything at once.  (Without "memory", these just call "malloc()",
+   "realloc()" and "free()".): */
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+  size_t size; /* not counting this header */
+  struct ArenaBlock* nextFree; /* if the block is on the free list */
+} ArenaBlock;
+#define ARENA_BLOCK_HEADER_SIZE ((sizeof (ArenaBlock) + ARENA_ALIGNMENT - 1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT)
+
+struct Arena {
+  unsigned char* start; /* of our blocks (after this header) */
+  size_t size, used, peak;
+  ArenaBlock* freeList;
+#ifdef HAVE_THREADS
+  pthread_mutex_t mutex; /* (different threads - e.g., copying segments - can share the arena) */
+#endif
+};
+
+/* Sets up an arena in the "size" bytes at "memory"; returns NULL if there's no room: */
+static Arena* openArena(void* memory, size_t size) {
+  unsigned char* p = (unsigned char*)memory;
+  size_t headerSize = (sizeof (Arena) + ARENA_ALIGNMENT - 1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT;
+  size_t misalignment = (size_t)((unsigned long long)(size_t)p%ARENA_ALIGNMENT);
+  Arena* arena;
+
+  if (misalignment > 0) {
+    if (size < ARENA_ALIGNMENT - misalignment) return NULL;
+    p += ARENA_ALIGNMENT - misalignment;
+    size -= ARENA_ALIGNMENT - misalignment;
+  }
+  if (size < headerSize) return NULL;
+
+  arena = (Arena*)p;
+  memset(arena, 0, sizeof (Arena));
+  arena->start = p + headerSize;
+  arena->size = size - headerSize;
+#ifdef HAVE_THREADS
+  pthread_mutex_init(&arena->mutex, NULL);
+#endif
+  return arena;
+}
+
+/* Sets "memoryPeak" (if we have an arena): */
+static void noteMemoryPeak(DjifixContext* ctx) {
+  if (ctx->arena != NULL) ctx->memoryPeak = ctx->arena->peak;
+}
+
+static void closeArena(Arena* arena) {
+#ifdef HAVE_THREADS
+  pthread_mutex_destroy(&arena->mutex);
+#else
+  (void)arena;
+#endif
+}
+
+#ifdef HAVE_THREADS
+#define lockArena(arena) pthread_mutex_lock(&(arena)->mutex)
+#define unlockArena(arena) pthread_mutex_unlock(&(arena)->mutex)
+#else
+#define lockArena(arena)
+#define unlockArena(arena)
+#endif
+
+static void* arenaAlloc(Arena* arena, size_t size) {
+  ArenaBlock* block = NULL;
+  ArenaBlock** link;
+  ArenaBlock** bestLink = NULL;
+
+  if (arena == NULL) return malloc(size);
+
+  size = (size + ARENA_ALIGNMENT - 1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT;
+  lockArena(arena);
+
+  /* Reuse the smallest free block that's big enough (unless it's more than twice the size): */
+  for (link = &arena->freeList; *link != NULL; link = &(*link)->nextFree) {
+    if ((*link)->size >= size && (*link)->size/2 <= size &&
+	(bestLink == NULL || (*link)->size < (*bestLink)->size)) {
+      bestLink = link;
+    }
+  }
+  if (bestLink != NULL) {
+    block = *bestLink;
+    *bestLink = block->nextFree;
+  } else if (arena->size - arena->used >= ARENA_BLOCK_HEADER_SIZE &&
+	     arena->size - arena->used - ARENA_BLOCK_HEADER_SIZE >= size) {
+    /* Otherwise, allocate a new block at the end: */
+    block = (ArenaBlock*)&arena->start[arena->used];
+    block->size = size;
+    arena->used += ARENA_BLOCK_HEADER_SIZE + size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+  }
+
+  unlockArena(arena);
+  if (block == NULL) return NULL;
+  block->nextFree = NULL;
+  return (unsigned char*)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+static void arenaFree(Arena* arena, void* ptr) {
+  ArenaBlock* block;
+
+  if (arena == NULL) {
+    free(ptr);
+    return;
+  }
+  if (ptr == NULL) return;
+
+  block = (ArenaBlock*)((unsigned char*)ptr - ARENA_BLOCK_HEADER_SIZE);
+  lockArena(arena);
+  if ((unsigned char*)ptr + block->size == &arena->start[arena->used]) {
+    /* This is the last block, so give back its space - and that of any freed blocks that are
+       then at the end: */
+    int foundOne;
+
+    arena->used = (unsigned char*)block - arena->start;
+    do {
+      ArenaBlock** link;
+
+      foundOne = 0;
+      for (link = &arena->freeList; *link != NULL; link = &(*link)->nextFree) {
+	if ((unsigned char*)*link + ARENA_BLOCK_HEADER_SIZE + (*link)->size == &arena->start[arena->used]) {
+	  arena->used = (unsigned char*)*link - arena->start;
+	  *link = (*link)->nextFree;
+	  foundOne = 1;
+	  break;
+	}
+      }
+    } while (foundOne);
+  } else {
+    block->nextFree = arena->freeList;
+    arena->freeList = block;
+  }
+  unlockArena(arena);
+}
+
+static void* arenaRealloc(Arena* arena, void* ptr, size_t size) {
+  ArenaBlock* block;
+  void* newPtr;
+
+  if (arena == NULL) return realloc(ptr, size);
+  if (ptr == NULL) return arenaAlloc(arena, size);
+
+  block = (ArenaBlock*)((unsigned char*)ptr - ARENA_BLOCK_HEADER_SIZE);
+  if (size <= block->size) return ptr;
+
+  /* If this is the last block, and there's room, just make it larger: */
+  size = (size + ARENA_ALIGNMENT - 1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT;
+  lockArena(arena);
+  if ((unsigned char*)ptr + block->size == &arena->start[arena->used] &&
+      arena->size - arena->used >= size - block->size) {
+    arena->used += size - block->size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    block->size = size;
+    unlockArena(arena);
+    return ptr;
+  }
+  unlockArena(arena);
+
+  newPtr = arenaAlloc(arena, size);
+  if (newPtr == NULL) return NULL;
+  memcpy(newPtr, ptr, block->size);
+  arenaFree(arena, ptr);
+  return newPtr;
+}
+
+/* Profiling ("profile"): For each phase, we note the time, the input file position, and (if
+   we can) the CPU's cycle and cache miss counts when it begins, and add the differences when it
+   ends.  The CPU counters (from "perf_event_open()") are opened when the first phase begins,
+   for the calling thread and any threads that it later starts.  (If the kernel won't let us
+   count kernel code too, we count just our own code.): */
+#define PROFILE_NUM_COUNTERS 2 /* cycles, cache misses */
+
+struct Profiler {
+  int counterFDs[PROFILE_NUM_COUNTERS]; /* -1 if we can't count it */
+  int isRunning[DJIFIX_NUM_PHASES];
+  double startSeconds[DJIFIX_NUM_PHASES];
+  DjifixOffset startPos[DJIFIX_NUM_PHASES];
+  long long startCounts[DJIFIX_NUM_PHASES][PROFILE_NUM_COUNTERS];
+};
+
+static char const* phaseNames[DJIFIX_NUM_PHASES] = {
+  "probe", "atomChecks", "nestedFtyps", "type1Copy", "type2NALUnits", "recovery"
+};
+
+#ifdef HAVE_PERF_EVENTS
+static int openProfileCounter(unsigned long long config) {
+  struct perf_event_attr attr;
+  int excludeKernel;
+
+  for (excludeKernel = 0; excludeKernel <= 1; ++excludeKernel) {
+    long fd;
+
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0/*this thread*/, -1/*any CPU*/, -1, 0);
+    if (fd >= 0) return (int)fd;
+  }
+  return -1;
+}
+#endif
+
+static long long readProfileCounter(int fd) {
+#ifdef HAVE_PERF_EVENTS
+  long long count;
+
+  if (fd >= 0 && read(fd, &count, sizeof count) == (ssize_t)sizeof count) return count;
+#else
+  (void)fd;
+#endif
+  return -1;
+}
+
+static void profileBegin(DjifixContext* ctx, int phase, DjifixOffset pos) {
+  struct Profiler* profiler = ctx->profiler;
+  int i;
+
+  if (!ctx->profile) return;
+  if (profiler == NULL) {
+    if ((profiler = ctx->profiler = arenaAlloc(ctx->arena, sizeof (struct Profiler))) == NULL) return;
+    memset(profiler, 0, sizeof (struct Profiler));
+#ifdef HAVE_PERF_EVENTS
+    profiler->counterFDs[0] = openProfileCounter(PERF_COUNT_HW_CPU_CYCLES);
+    profiler->counterFDs[1] = openProfileCounter(PERF_COUNT_HW_CACHE_MISSES);
+#else
+    for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) profiler->counterFDs[i] = -1;
+#endif
+  }
+
+  profiler->isRunning[phase] = 1;
+  profiler->startPos[phase] = pos;
+  for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+    profiler->startCounts[phase][i] = readProfileCounter(profiler->counterFDs[i]);
+  }
+  profiler->startSeconds[phase] = secondsNow();
+}
+
+/* Ends the phase (if it's running), at input file position "pos": */
+static void profileEnd(DjifixContext* ctx, int phase, DjifixOffset pos) {
+  struct Profiler* profiler = ctx->profiler;
+  DjifixPhaseProfile* result = &ctx->phaseProfiles[phase];
+  long long* totals[PROFILE_NUM_COUNTERS];
+  double endSeconds;
+  long long counts[PROFILE_NUM_COUNTERS];
+  int i;
+
+  if (!ctx->profile || profiler == NULL || !profiler->isRunning[phase]) return;
+  endSeconds = secondsNow();
+  for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) counts[i] = readProfileCounter(profiler->counterFDs[i]);
+  profiler->isRunning[phase] = 0;
+
+  ++result->numCalls;
+  result->seconds += endSeconds - profiler->startSeconds[phase];
+  if (pos > profiler->startPos[phase]) result->bytes += pos - profiler->startPos[phase];
+  totals[0] = &result->cycles; totals[1] = &result->cacheMisses;
+  for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+    if (*totals[i] >= 0 && counts[i] >= 0 && profiler->startCounts[phase][i] >= 0) {
+      *totals[i] += counts[i] - profiler->startCounts[phase][i];
+    } else {
+      *totals[i] = -1; /* (once a count is missing, the total is unknown) */
+    }
+  }
+}
+
+static void resetProfile(DjifixContext* ctx) {
+  memset(ctx->phaseProfiles, 0, sizeof ctx->phaseProfiles);
+  if (ctx->profiler != NULL) memset(ctx->profiler->isRunning, 0, sizeof ctx->profiler->isRunning);
+}
+
+static void closeProfiler(DjifixContext* ctx) {
+  int i;
+
+  if (ctx->profiler == NULL) return;
+#ifdef HAVE_PERF_EVENTS
+  for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+    if (ctx->profiler->counterFDs[i] >= 0) close(ctx->profiler->counterFDs[i]);
+  }
+#else
+  (void)i;
+#endif
+  arenaFree(ctx->arena, ctx->profiler);
+  ctx->profiler = NULL;
+}
+
+char const* djifixPhaseName(int phase) {
+  return phase >= 0 && phase < DJIFIX_NUM_PHASES ? phaseNames[phase] : NULL;
+}
+
+static void startProgress(DjifixContext* ctx) {
+  InputFile* inputFile = ctx->inputFile;
+  DjifixOffset pos = inputTell(inputFile);
+
+  ctx->bytesRead = pos;
+  ctx->bytesWritten = 0;
+  ctx->numNALUnits = 0;
+  ctx->numAnomalies = 0;
+  ctx->numBytesSkipped = 0;
+  ctx->recoverySeconds = 0.0;
+  ctx->nextCheckpoint = ctx->checkpoint != NULL && ctx->checkpointInterval > 0
+    ? pos + ctx->checkpointInterval : MAX_OFFSET;
+  if ((!ctx->showProgress && ctx->statsFID == NULL) || ctx->progressInterval <= 0) {
+    ctx->nextProgressReport = MAX_OFFSET; /* never */
+    return;
+  }
+
+  ctx->progressStartTime = secondsNow();
+  ctx->progressStartPos = pos;
+  ctx->totalBytes = -1; /* unknown (e.g., for a stream) */
+  if (inputFile->streamBuffer == NULL && inputSeek(inputFile, 0, SEEK_END) == 0) {
+    ctx->totalBytes = inputTell(inputFile);
+  }
+  inputSeek(inputFile, pos, SEEK_SET);
+  ctx->nextProgressReport = pos + ctx->progressInterval;
+}
+
+/* Notes that we've read the input file up to position "inputPos", and written "outputPos"
+   bytes of output.  (If we're recording checkpoints, the caller must be at a point from which
+   the repair can be resumed.): */
+static void noteProgress(DjifixContext* ctx, DjifixOffset inputPos, DjifixOffset outputPos) {
+  ctx->bytesRead = inputPos;
+  ctx->bytesWritten = outputPos;
+  if (inputPos >= ctx->nextProgressReport) reportProgress(ctx, 0);
+  if (inputPos >= ctx->nextCheckpoint) writeCheckpoint(ctx);
+}
+
+static void reportProgress(DjifixContext* ctx, int isDone) {
+  double elapsed, mbPerSecond, etaSeconds = -1.0;
+  DjifixOffset numDone;
+
+  if (ctx->nextProgressReport == MAX_OFFSET) return; /* we're not reporting progress */
+  ctx->nextProgressReport = ctx->bytesRead + ctx->progressInterval;
+
+  elapsed = secondsNow() - ctx->progressStartTime;
+  numDone = ctx->bytesRead - ctx->progressStartPos;
+  mbPerSecond = elapsed > 0.0 ? numDone/elapsed/(1024*1024) : 0.0;
+  if (ctx->totalBytes >= ctx->bytesRead && numDone > 0 && elapsed > 0.0) {
+    etaSeconds = (ctx->totalBytes - ctx->bytesRead)*elapsed/numDone;
+  }
+
+  if (ctx->showProgress && !isDone) {
+    fprintf(ctx->logFID, "\n(%lld MB", ctx->bytesRead/(1024*1024));
+    if (ctx->totalBytes > 0) {
+      fprintf(ctx->logFID, " of %lld MB (%d%%)", ctx->totalBytes/(1024*1024),
+	      (int)(100.0*ctx->bytesRead/ctx->totalBytes));
+    }
+    fprintf(ctx->logFID, ", %.1f MB/s", mbPerSecond);
+    if (ctx->repairType == 2) fprintf(ctx->logFID, ", %lu NAL units", ctx->numNALUnits);
+    if (ctx->numAnomalies > 0) {
+      fprintf(ctx->logFID, ", %u anomalies (%lld bytes skipped)", ctx->numAnomalies,
+	      ctx->numBytesSkipped);
+    }
+    if (etaSeconds >= 0.0) fprintf(ctx->logFID, "; about %.0f s to go", etaSeconds);
+    fprintf(ctx->logFID, ")");
+  }
+
+  if (ctx->statsFID != NULL) {
+    lockStats();
+    fprintf(ctx->statsFID, "{\"event\":\"%s\",\"file\":", isDone ? "done" : "progress");
+    if (ctx->inputFileName != NULL) writeJSONString(ctx->statsFID, ctx->inputFileName);
+    else fprintf(ctx->statsFID, "null");
+    fprintf(ctx->statsFID, ",\"repairType\":%d,\"bytesRead\":%lld,\"totalBytes\":%lld,\"bytesWritten\":%lld,\"seconds\":%.3f,\"mbPerSecond\":%.2f,\"nalUnits\":%lu,\"anomalies\":%u,\"bytesSkipped\":%lld",
+	    ctx->repairType, ctx->bytesRead, ctx->totalBytes, ctx->bytesWritten, elapsed,
+	    mbPerSecond, ctx->numNALUnits, ctx->numAnomalies, ctx->numBytesSkipped);
+    if (etaSeconds >= 0.0 && !isDone) fprintf(ctx->statsFID, ",\"etaSeconds\":%.0f", etaSeconds);
+    if (ctx->memory != NULL && isDone) fprintf(ctx->statsFID, ",\"memoryPeak\":%lu", (unsigned long)ctx->memoryPeak);
+    if (ctx->haveOutputCRC32C && isDone) fprintf(ctx->statsFID, ",\"crc32c\":\"%08lx\"", ctx->outputCRC32C);
+    if (ctx->structureChecked && isDone) {
+      fprintf(ctx->statsFID, ",\"structure\":\"%s\"", ctx->structureProblem == NULL ? "ok" : "bad");
+      if (ctx->structureProblem != NULL) {
+	fprintf(ctx->statsFID, ",\"structureProblem\":");
+	writeJSONString(ctx->statsFID, ctx->structureProblem);
+      }
+    }
+    fprintf(ctx->statsFID, "}\n");
+    fflush(ctx->statsFID);
+    unlockStats();
+  }
+}
+
+/* Checksumming the repaired file as we write it (the "verify" option): We compute its CRC-32C
+   (the Castagnoli CRC, as used by iSCSI, ext4 and many object stores) - with the CPU's own
+   CRC-32C instruction if it has one (x86 with SSE 4.2, or 64-bit ARM), otherwise 8 bytes at
+   a time with tables.  Unlike most hashes, a CRC can also be extended over a run of zero bytes
+   (e.g., a hole), corrected for bytes that are changed after they're written (e.g., the size
+   of a MP4 file's 'mdat' atom), and combined from the CRCs of consecutive pieces (e.g., those
+   written by different threads) - all without seeing the data again.  So every kind of repair
+   can be checksummed as it goes, without reading the output file back.  (We keep the CRC as
+   its 'state' - i.e., before its final inversion - and work with states throughout.)
+*/
+#define CRC32C_POLYNOMIAL 0x82F63B78U /* (with its bits reversed, as the CRC uses them) */
+
+static unsigned crc32cTable[8][256];
+/* x^(2^n), modulo the polynomial - for every bit of a "DjifixOffset" number of bytes (x^(8*2^n)
+   is "crc32cPowers[3+n]").  (Unlike for some polynomials, these powers don't repeat after 32.): */
+#define CRC32C_NUM_POWERS (3 + 8*sizeof (DjifixOffset))
+static unsigned crc32cPowers[CRC32C_NUM_POWERS];
+static int cpuHasCRC32C = 0;
+#ifdef HAVE_THREADS
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+#else
+static int crc32cIsReady = 0;
+#endif
+
+/* Returns a*b, modulo the polynomial: */
+static unsigned crc32cMultiply(unsigned a, unsigned b) {
+  unsigned m = 0x80000000U, p = 0;
+
+  if (a == 0) return 0;
+  while (1) {
+    if (a&m) {
+      p ^= b;
+      if ((a&(m-1)) == 0) break;
+    }
+    m >>= 1;
+    b = b&1 ? (b>>1)^CRC32C_POLYNOMIAL : b>>1;
+  }
+  return p;
+}
+
+static void setUpCRC32C(void) {
+  unsigned i, k, p;
+
+  for (i = 0; i < 256; ++i) {
+    for (p = i, k = 0; k < 8; ++k) p = p&1 ? (p>>1)^CRC32C_POLYNOMIAL : p>>1;
+    crc32cTable[0][i] = p;
+  }
+  for (i = 0; i < 256; ++i) {
+    for (k = 1; k < 8; ++k) {
+      crc32cTable[k][i] = (crc32cTable[k-1][i]>>8)^crc32cTable[0][crc32cTable[k-1][i]&0xFF];
+    }
+  }
+  p = 0x40000000U; /* x^1 */
+  crc32cPowers[0] = p;
+  for (i = 1; i < CRC32C_NUM_POWERS; ++i) crc32cPowers[i] = p = crc32cMultiply(p, p);
+
+#if defined(__x86_64__) && defined(HAVE_CRC32C_INSTRUCTION)
+  cpuHasCRC32C = __builtin_cpu_supports("sse4.2");
+#elif defined(HAVE_CRC32C_INSTRUCTION)
+  cpuHasCRC32C = 1;
+#endif
+}
+
+static void prepareCRC32C(void) {
+#ifdef HAVE_THREADS
+  pthread_once(&crc32cOnce, setUpCRC32C);
+#else
+  if (!crc32cIsReady) setUpCRC32C();
+  crc32cIsReady = 1;
+#endif
+}
+
+#ifdef HAVE_CRC32C_INSTRUCTION
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+#endif
+static unsigned crc32cWithInstruction(unsigned state, unsigned char const* p, size_t numBytes) {
+#ifdef __x86_64__
+  unsigned long long s = state;
+
+  for (; numBytes > 0 && ((size_t)p&7) != 0; --numBytes) s = __builtin_ia32_crc32qi((unsigned)s, *p++);
+  for (; numBytes >= 8; numBytes -= 8, p += 8) {
+    unsigned long long v;
+
+    memcpy(&v, p, 8);
+    s = __builtin_ia32_crc32di(s, v);
+  }
+  for (; numBytes > 0; --numBytes) s = __builtin_ia32_crc32qi((unsigned)s, *p++);
+  return (unsigned)s;
+#else
+  unsigned s = state;
+
+  for (; numBytes > 0 && ((size_t)p&7) != 0; --numBytes) s = __crc32cb(s, *p++);
+  for (; numBytes >= 8; numBytes -= 8, p += 8) {
+    unsigned long long v;
+
+    memcpy(&v, p, 8);
+    s = __crc32cd(s, v);
+  }
+  for (; numBytes > 0; --numBytes) s = __crc32cb(s, *p++);
+  return s;
+#endif
+}
+#endif
+
+/* Returns the state after the "numBytes" bytes at "p", given the state before them: */
+static unsigned crc32c(unsigned state, unsigned char const* p, size_t numBytes) {
+#ifdef HAVE_CRC32C_INSTRUCTION
+  if (cpuHasCRC32C) return crc32cWithInstruction(state, p, numBytes);
+#endif
+  for (; numBytes >= 8; numBytes -= 8, p += 8) {
+    state ^= p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned)p[3]<<24);
+    state = crc32cTable[7][state&0xFF]^crc32cTable[6][state>>8&0xFF]^
+      crc32cTable[5][state>>16&0xFF]^crc32cTable[4][state>>24]^
+      crc32cTable[3][p[4]]^crc32cTable[2][p[5]]^crc32cTable[1][p[6]]^crc32cTable[0][p[7]];
+  }
+  for (; numBytes > 0; --numBytes) state = (state>>8)^crc32cTable[0][(state^*p++)&0xFF];
+  return state;
+}
+
+/* Returns the state after "numBytes" zero bytes, given the state before them - i.e., the state
+   times x^(8*numBytes): */
+static unsigned crc32cShift(unsigned state, DjifixOffset numBytes) {
+  unsigned p = 0x80000000U; /* x^0 */
+  unsigned k = 3;
+
+  for (; numBytes > 0; numBytes >>= 1, ++k) {
+    if (numBytes&1) p = crc32cMultiply(crc32cPowers[k], p);
+  }
+  return crc32cMultiply(p, state);
+}
+
+/* Checks "crc32cShift()" against the CRC - computed a byte at a time, with none of the
+   shortcuts that "crc32c()" might take - of that many actual zero bytes, fed in 64 KB pieces.
+   One run is of more than 2^29 bytes, the first length for which "crc32cShift()" needs more
+   than 32 powers of x.  (Runs of many GB would take too long to check directly, so those are
+   checked against shifting twice by half as much.)  Returns true iff it's right.  (Used by
+   benchmark mode.): */
+#ifndef DJIFIX_NO_MAIN
+static int checkCRC32CShift(void) {
+  static unsigned char const zeros[64*1024];
+  DjifixOffset const lengths[] = { 1, 4099, 1024*1024, ((DjifixOffset)1<<29) + 4099 };
+  unsigned i;
+
+  prepareCRC32C();
+  for (i = 0; i < sizeof lengths/sizeof lengths[0]; ++i) {
+    unsigned state = 0xFFFFFFFFU;
+    DjifixOffset numLeft;
+
+    for (numLeft = lengths[i]; numLeft > 0; ) {
+      size_t n = numLeft < (DjifixOffset)sizeof zeros ? (size_t)numLeft : sizeof zeros;
+      size_t j;
+
+      for (j = 0; j < n; ++j) state = (state>>8)^crc32cTable[0][(state^zeros[j])&0xFF];
+      numLeft -= n;
+    }
+    if (crc32cShift(0xFFFFFFFFU, lengths[i]) != state) return 0;
+  }
+  for (i = 30; i < 8*sizeof (DjifixOffset) - 1; ++i) {
+    DjifixOffset half = (DjifixOffset)1<<(i-1);
+
+    if (crc32cShift(0xFFFFFFFFU, half+half) !=
+	crc32cShift(crc32cShift(0xFFFFFFFFU, half), half)) return 0;
+  }
+  return 1;
+}
+#endif
+
+/* Notes that "numBytes" bytes (at "data") have been written at the end of the output: */
+static void checksumOutput(DjifixContext* ctx, void const* data, size_t numBytes) {
+  if (!ctx->verify) return;
+  ctx->checksumState = crc32c(ctx->checksumState, (unsigned char const*)data, numBytes);
+  ctx->checksumLength += numBytes;
+}
+
+/* Notes that the output has been extended by "numBytes" zero bytes (or a hole): */
+static void checksumZeros(DjifixContext* ctx, DjifixOffset numBytes) {
+  if (!ctx->verify) return;
+  ctx->checksumState = crc32cShift(ctx->checksumState, numBytes);
+  ctx->checksumLength += numBytes;
+}
+
+/* Notes that "numBytes" bytes - whose state, starting from 0, is "pieceState" - have been
+   written at the end of the output: */
+static void checksumPiece(DjifixContext* ctx, unsigned pieceState, DjifixOffset numBytes) {
+  if (!ctx->verify) return;
+  ctx->checksumState = crc32cShift(ctx->checksumState, numBytes)^pieceState;
+  ctx->checksumLength += numBytes;
+}
+
+/* Notes that the "numBytes" (at most 8) bytes at output position "pos" - which were
+   "oldBytes" - have been changed to "newBytes": */
+static void checksumChange(DjifixContext* ctx, DjifixOffset pos, unsigned char const* oldBytes,
+			   unsigned char const* newBytes, unsigned numBytes) {
+  unsigned char diff[8];
+  unsigned i;
+
+  if (!ctx->verify) return;
+  if (pos < 0 || numBytes > sizeof diff || pos + numBytes > ctx->checksumLength) {
+    ctx->checksumLost = 1;
+    return;
+  }
+  for (i = 0; i < numBytes; ++i) diff[i] = oldBytes[i]^newBytes[i];
+  ctx->checksumState ^= crc32cShift(crc32c(0, diff, numBytes),
+				    ctx->checksumLength - (pos + numBytes));
+}
+
+/* Notes "problem" with the structure of the repaired file (if it's the first that we've
+   found): */
+static void noteStructureProblem(DjifixContext* ctx, char const* problem) {
+  if (ctx->structureProblem == NULL) ctx->structureProblem = problem;
+}
+
+static char const* startCodeProblem = "a NAL unit contains a 'start code' (so it would be split when played)";
+
+/* ('Type 2' repairs) Checks the header (first byte) of a NAL unit that we're writing: */
+static void checkNALUnitHeader(DjifixContext* ctx, unsigned char header) {
+  unsigned nalUnitType = header&0x1F;
+
+  if (!ctx->verify) return;
+  if ((header&0x80) != 0 || nalUnitType == 0) {
+    noteStructureProblem(ctx, "a NAL unit has a bad header (its 'forbidden' bit is set, or its type is 0)");
+  } else if (nalUnitType == 1 || nalUnitType == 5) {
+    ++ctx->numSlicesChecked;
+  }
+}
+
+/* (For a '.h264' file) Returns true iff the "numBytes" bytes at "p" - more of a NAL unit, whose
+   last two bytes so far are "*tail" (0xFFFF at its start) - contain 00 00 00, 00 00 01 or
+   00 00 02, which a player would take as the end of the NAL unit.  Updates "*tail": */
+static int findStartCodePrefix(unsigned char const* p, size_t numBytes, unsigned* tail) {
+  unsigned char const* end = p + numBytes;
+  unsigned char const* z = p;
+  unsigned t = *tail;
+  size_t i;
+
+  /* (First, the bytes that might complete a prefix that began before them:) */
+  for (i = 0; i < numBytes && i < 2; ++i) {
+    if (t == 0 && p[i] <= 2) return 1;
+    t = ((t<<8)|p[i])&0xFFFF;
+  }
+  if (numBytes >= 2) t = (p[numBytes-2]<<8)|p[numBytes-1];
+  *tail = t;
+
+  /* Then look for two zero bytes (at each zero byte, which 'memchr()' finds quickly): */
+  while (numBytes >= 3 && z < end - 2 &&
+	 (z = (unsigned char const*)memchr(z, 0, (size_t)(end - 2 - z))) != NULL) {
+    if (z[1] != 0) {
+      z += 2;
+    } else {
+      if (z[2] <= 2) return 1;
+      ++z;
+    }
+  }
+  return 0;
+}
+
+/* The size of each block that we copy when repairing a file (a multiple of any likely
+   file system block size): */
+#define COPY_BLOCK_SIZE (1024*1024)
+
+/* Writing the output file 'behind' our reading of the input file: We fill one of a ring of
+   (fixed) buffers while another thread writes the others, so that reading block N+1 of the
+   input overlaps writing block N of the output, rather than alternating with it.  (On high-
+   latency storage, this can make a big difference.)  If we can't do this (e.g., we have no
+   threads), each buffer is written - with "fwrite()" - as soon as it's complete.
+*/
+#if defined(HAVE_THREADS) && defined(HAVE_FILE_DESCRIPTORS)
+#define ASYNC_WRITES 1
+#define ASYNC_NUM_BUFFERS 4
+#else
+#define ASYNC_NUM_BUFFERS 1
+#endif
+#define ASYNC_BUFFER_SIZE COPY_BLOCK_SIZE
+
+struct AsyncWriter {
+  FILE* fid;
+  DjifixContext* ctx; /* whose output this is (so that we checksum it, if "verify") */
+  Arena* arena; /* where the buffers are allocated (NULL: with "malloc()") */
+  unsigned char* buffers[ASYNC_NUM_BUFFERS];
+  size_t lens[ASYNC_NUM_BUFFERS];
+  unsigned fillIndex; /* the buffer that we're filling */
+  int failed; /* set (by us, not the writing thread) once we know that writing failed */
+#ifdef ASYNC_WRITES
+  int isRunning; /* set iff the writing thread is running */
+  int fd;
+  unsigned writeIndex; /* the next buffer for the writing thread to write */
+  unsigned numQueued; /* the number of buffers (from "writeIndex") waiting to be written */
+  int isFinishing; /* set when we'll queue no more buffers */
+  int writeFailed; /* set by the writing thread */
+  int writeErrno; /* set by the writing thread (once it fails); read once it has finished */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+#endif
+};
+
+#ifdef ASYNC_WRITES
+static void* asyncWriterThread(void* arg) {
+  AsyncWriter* writer = (AsyncWriter*)arg;
+
+  pthread_mutex_lock(&writer->mutex);
+  while (1) {
+    unsigned char const* from;
+    size_t numRemaining;
+    int failed = writer->writeFailed;
+
+    while (writer->numQueued == 0 && !writer->isFinishing) {
+      pthread_cond_wait(&writer->cond, &writer->mutex);
+    }
+    if (writer->numQueued == 0) break;
+    from = writer->buffers[writer->writeIndex];
+    numRemaining = writer->lens[writer->writeIndex];
+    pthread_mutex_unlock(&writer->mutex);
+
+    while (numRemaining > 0 && !failed) { /* (after a failure, we discard the rest) */
+      ssize_t numWritten = write(writer->fd, from, numRemaining);
+
+      if (numWritten < 0) {
+	if (errno == EINTR) continue;
+	failed = 1;
+	writer->writeErrno = errno;
+	break;
+      }
+      from += numWritten;
+      numRemaining -= numWritten;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    if (failed) writer->writeFailed = 1;
+    writer->writeIndex = (writer->writeIndex + 1)%ASYNC_NUM_BUFFERS;
+    --writer->numQueued;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->mutex);
+
+  return NULL;
+}
+#endif
+
+/* Prepares to write (at its current position) to "outputFID", which mustn't otherwise be used
+   until "finishAsyncWriter()" is called.  Returns 0 if we can't allocate the buffers: */
+static int startAsyncWriter(AsyncWriter* writer, FILE* outputFID, DjifixContext* ctx) {
+  Arena* arena = ctx->arena;
+  unsigned i;
+
+  memset(writer, 0, sizeof (AsyncWriter));
+  writer->fid = outputFID;
+  writer->ctx = ctx;
+  writer->arena = arena;
+  for (i = 0; i < ASYNC_NUM_BUFFERS; ++i) {
+    writer->buffers[i] = arenaAlloc(arena, ASYNC_BUFFER_SIZE);
+    if (writer->buffers[i] == NULL) {
+      while (i > 0) arenaFree(arena, writer->buffers[--i]);
+      return 0;
+    }
+  }
+
+#ifdef ASYNC_WRITES
+  /* The writing thread writes the file descriptor directly, so first write out whatever's in
+     the 'stdio' buffer.  (If the output has no file descriptor - e.g., it writes through
+     functions of its own - we just use "fwrite()".): */
+  if (fileno(outputFID) >= 0 && fflush(outputFID) == 0) {
+    writer->fd = fileno(outputFID);
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    writer->isRunning = pthread_create(&writer->thread, NULL, asyncWriterThread, writer) == 0;
+    if (!writer->isRunning) {
+      pthread_mutex_destroy(&writer->mutex);
+      pthread_cond_destroy(&writer->cond);
+    }
+  }
+#endif
+
+  return 1;
+}
+
+/* Writes out the buffer that we're filling (if it has anything in it), and moves on to the
+   next one (waiting until it's free): */
+static void asyncWriterFlushBuffer(AsyncWriter* writer) {
+  size_t len = writer->lens[writer->fillIndex];
+
+  if (len == 0) return;
+  checksumOutput(writer->ctx, writer->buffers[writer->fillIndex], len);
+#ifdef ASYNC_WRITES
+  if (writer->isRunning) {
+    pthread_mutex_lock(&writer->mutex);
+    ++writer->numQueued;
+    pthread_cond_broadcast(&writer->cond);
+    while (writer->numQueued == ASYNC_NUM_BUFFERS) pthread_cond_wait(&writer->cond, &writer->mutex);
+    if (writer->writeFailed) writer->failed = 1;
+    pthread_mutex_unlock(&writer->mutex);
+
+    writer->fillIndex = (writer->fillIndex + 1)%ASYNC_NUM_BUFFERS;
+    writer->lens[writer->fillIndex] = 0;
+    return;
+  }
+#endif
+  if (fwrite(writer->buffers[writer->fillIndex], 1, len, writer->fid) != len) writer->failed = 1;
+  writer->lens[writer->fillIndex] = 0;
+}
+
+/* Returns the unused part of the buffer that we're filling (setting "*numBytes" to its size),
+   for the caller to read data into directly - then call "asyncWriterCommit()": */
+static unsigned char* asyncWriterSpace(AsyncWriter* writer, size_t* numBytes) {
+  if (writer->lens[writer->fillIndex] == ASYNC_BUFFER_SIZE) asyncWriterFlushBuffer(writer);
+
+  *numBytes = ASYNC_BUFFER_SIZE - writer->lens[writer->fillIndex];
+  return &writer->buffers[writer->fillIndex][writer->lens[writer->fillIndex]];
+}
+
+/* Notes that "numBytes" bytes (at "asyncWriterSpace()") are to be written.  If "endsBlock" is
+   set, we write them now, rather than waiting until the buffer is full: */
+static void asyncWriterCommit(AsyncWriter* writer, size_t numBytes, int endsBlock) {
+  writer->lens[writer->fillIndex] += numBytes;
+  if (endsBlock || writer->lens[writer->fillIndex] == ASYNC_BUFFER_SIZE) {
+    asyncWriterFlushBuffer(writer);
+  }
+}
+
+/* Like "fwrite()": */
+static void asyncWrite(AsyncWriter* writer, unsigned char const* from, size_t numBytes) {
+  while (numBytes > 0) {
+    size_t space;
+    unsigned char* to = asyncWriterSpace(writer, &space);
+    size_t numToCopy = numBytes < space ? numBytes : space;
+
+    memcpy(to, from, numToCopy);
+    asyncWriterCommit(writer, numToCopy, 0);
+    from += numToCopy;
+    numBytes -= numToCopy;
+  }
+}
+
+/* Writes everything that we've been given so far, waiting until it's all been written.
+   Returns 0 if any of the writing failed: */
+static int asyncWriterSync(AsyncWriter* writer) {
+  asyncWriterFlushBuffer(writer);
+#ifdef ASYNC_WRITES
+  if (writer->isRunning) {
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->numQueued > 0) pthread_cond_wait(&writer->cond, &writer->mutex);
+    if (writer->writeFailed) writer->failed = 1;
+    pthread_mutex_unlock(&writer->mutex);
+  }
+#endif
+
+  return !writer->failed;
+}
+
+/* Writes everything that's left, and frees the buffers.  "outputFID" is then positioned just
+   after the data that we wrote.  Returns 0 if any of the writing failed: */
+static int finishAsyncWriter(AsyncWriter* writer) {
+  unsigned i;
+
+  asyncWriterFlushBuffer(writer);
+#ifdef ASYNC_WRITES
+  if (writer->isRunning) {
+    off_t pos;
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->isFinishing = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+    if (writer->writeFailed) writer->failed = 1;
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->cond);
+    writer->isRunning = 0;
+
+    /* Tell 'stdio' where the file descriptor's writing left it (unless it's a pipe): */
+    pos = lseek(writer->fd, 0, SEEK_CUR);
+    if (pos >= 0) fseek64(writer->fid, pos, SEEK_SET);
+  }
+#endif
+  for (i = ASYNC_NUM_BUFFERS; i > 0; --i) arenaFree(writer->arena, writer->buffers[i-1]);
+
+#ifdef ASYNC_WRITES
+  if (writer->writeErrno != 0) errno = writer->writeErrno; /* (for the caller's message) */
+#endif
+  return !writer->failed;
+}
+
+#if defined(__linux__)
+/* Try to copy the rest of the input file (up to "endPos") to the output file entirely within
+   the kernel, without the data passing through our address space.  Returns 1 if the copy was
+   done this way; 0 if the caller should instead copy the data itself; -1 if the copy was
+   started this way, but failed.
+*/
+static int copyRemainderInKernel(FILE* inputFID, FILE* outputFID, DjifixContext* ctx,
+				 DjifixOffset endPos) {
+  int inputFD = fileno(inputFID);
+  int outputFD = fileno(outputFID);
+  off_t inputPos, outputPos;
+  ssize_t numCopied = 0;
+  int isFirstCopy = 1;
+  DjifixOffset outputStart;
+
+  /* The kernel knows nothing of our 'stdio' buffers, so sync the file descriptors with them: */
+  if (fflush(outputFID) != 0) return 0;
+  inputPos = ftello(inputFID);
+  outputPos = ftello(outputFID);
+  if (inputPos < 0 || outputPos < 0) return 0;
+  outputStart = ctx->bytesWritten - (DjifixOffset)outputPos; /* in case "outputPos" isn't from 0 */
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  /* First, try "copy_file_range()".  (On file systems that support it, this can share - rather
+     than copy - the file's data blocks.) */
+  while (inputPos < endPos &&
+	 (numCopied = copy_file_range(inputFD, &inputPos, outputFD, &outputPos,
+				      endPos - inputPos < COPY_BLOCK_SIZE*64 ? (size_t)(endPos - inputPos)
+				      : COPY_BLOCK_SIZE*64, 0)) > 0) {
+    isFirstCopy = 0;
+    noteProgress(ctx, (DjifixOffset)inputPos, outputStart + (DjifixOffset)outputPos);
+  }
+  if (numCopied == 0 || !isFirstCopy || inputPos >= endPos) {
+    /* "copy_file_range()" does not move the file descriptors' offsets; do that ourselves: */
+    fseeko(inputFID, inputPos, SEEK_SET);
+    fseeko(outputFID, outputPos, SEEK_SET);
+    if (numCopied < 0) {
+      fprintf(ctx->logFID, "Failed to copy the file: %s\n", strerror(errno));
+      return -1;
+    }
+    return 1;
+  }
+#endif
+
+  /* If that didn't work (e.g., because the files are on different file systems, or because the
+     kernel is too old), try "sendfile()" instead.  This writes at the output file descriptor's
+     current offset, so make sure that's where our "fflush()" above left the output data: */
+  if (lseek(outputFD, outputPos, SEEK_SET) != outputPos) return 0;
+  while (inputPos < endPos &&
+	 (numCopied = sendfile(outputFD, inputFD, &inputPos,
+			       endPos - inputPos < COPY_BLOCK_SIZE*64 ? (size_t)(endPos - inputPos)
+			       : COPY_BLOCK_SIZE*64)) > 0) {
+    isFirstCopy = 0;
+    outputPos += numCopied;
+    noteProgress(ctx, (DjifixOffset)inputPos, outputStart + (DjifixOffset)outputPos);
+  }
+  if (numCopied < 0 && isFirstCopy && (errno == EINVAL || errno == ENOSYS)) return 0;
+
+  fseeko(inputFID, inputPos, SEEK_SET);
+  fseeko(outputFID, 0, SEEK_END);
+  if (numCopied < 0) {
+    fprintf(ctx->logFID, "Failed to copy the file: %s\n", strerror(errno));
+    return -1;
+  }
+  return 1;
+}
+#endif
+
+/* Copying from a "DjifixReader": Rather than read the data through 'stdio', one read after
+   another, we have several threads each read a large block at once (so that - e.g., for
+   object storage - the round trips overlap), and write the blocks, in order, as they arrive.
+   Thread "i" reads blocks "i", "i + numThreads", etc., each into its own buffer, once we've
+   written the previous one from it: */
+#define READER_COPY_BLOCK_SIZE (COPY_BLOCK_SIZE*4)
+#define READER_DEFAULT_PARALLEL_READS 4
+#define READER_MAX_PARALLEL_READS 32
+
+typedef struct {
+  DjifixReader const* reader;
+  DjifixOffset startPos, endPos;
+  unsigned numThreads;
+  unsigned char* buffers[READER_MAX_PARALLEL_READS];
+  long long lens[READER_MAX_PARALLEL_READS]; /* of each buffer's block; -1 on error */
+  int isFull[READER_MAX_PARALLEL_READS]; /* set iff the buffer's block is waiting to be written */
+  int isStopping;
+#ifdef HAVE_THREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} ReaderCopy;
+
+/* Reads block number "blockNum" into buffer "i"; returns its length (or -1 on error): */
+static long long readCopyBlock(ReaderCopy* rc, unsigned i, DjifixOffset blockNum) {
+  DjifixOffset pos = rc->startPos + blockNum*READER_COPY_BLOCK_SIZE;
+  size_t numToRead;
+
+  if (pos >= rc->endPos) return 0;
+  numToRead = rc->endPos - pos < READER_COPY_BLOCK_SIZE ? (size_t)(rc->endPos - pos)
+    : READER_COPY_BLOCK_SIZE;
+  return rc->reader->read(rc->reader->opaque, rc->buffers[i], numToRead, pos);
+}
+
+#ifdef HAVE_THREADS
+typedef struct {
+  ReaderCopy* rc;
+  unsigned index;
+} ReaderCopyJob;
+
+static void* readerCopyThread(void* jobPtr) {
+  ReaderCopyJob* job = (ReaderCopyJob*)jobPtr;
+  ReaderCopy* rc = job->rc;
+  unsigned i = job->index;
+  DjifixOffset blockNum;
+
+  for (blockNum = i; ; blockNum += rc->numThreads) {
+    long long len;
+
+    pthread_mutex_lock(&rc->mutex);
+    while (rc->isFull[i] && !rc->isStopping) pthread_cond_wait(&rc->cond, &rc->mutex);
+    if (rc->isStopping) break;
+    pthread_mutex_unlock(&rc->mutex);
+
+    len = readCopyBlock(rc, i, blockNum);
+
+    pthread_mutex_lock(&rc->mutex);
+    rc->lens[i] = len;
+    rc->isFull[i] = 1;
+    pthread_cond_broadcast(&rc->cond);
+    if (len < READER_COPY_BLOCK_SIZE) break; /* the end of the data (or an error) */
+    pthread_mutex_unlock(&rc->mutex);
+  }
+  pthread_mutex_unlock(&rc->mutex);
+
+  return NULL;
+}
+#endif
+
+/* Copies the input file (which reads through "inputFile->reader"), from its current position
+   up to "endPos", to the output file.  Returns -1 (having copied nothing) if we can't allocate
+   the buffers (so the caller should copy the data some other way); 0 if reading or writing
+   fails: */
+static int copyFromReader(InputFile* inputFile, FILE* outputFID, DjifixContext* ctx,
+			  DjifixOffset endPos) {
+  ReaderCopy rc;
+  DjifixOffset pos = ftell64(inputFile->fid), blockNum;
+  DjifixOffset outputOffset = ctx->bytesWritten - ctx->bytesRead; /* output position - input position */
+  unsigned i, numBuffers;
+  int result = 1;
+#ifdef HAVE_THREADS
+  pthread_t threads[READER_MAX_PARALLEL_READS];
+  ReaderCopyJob jobs[READER_MAX_PARALLEL_READS];
+  unsigned numStarted = 0;
+#endif
+
+  if (pos < 0) return -1;
+  memset(&rc, 0, sizeof rc);
+  rc.reader = inputFile->reader;
+  rc.startPos = pos;
+  rc.endPos = endPos < rc.reader->size ? endPos : rc.reader->size;
+  rc.numThreads = rc.reader->numParallelReads == 0 ? READER_DEFAULT_PARALLEL_READS
+    : rc.reader->numParallelReads;
+  if (rc.numThreads > READER_MAX_PARALLEL_READS) rc.numThreads = READER_MAX_PARALLEL_READS;
+  if (rc.endPos - pos < (DjifixOffset)rc.numThreads*READER_COPY_BLOCK_SIZE) {
+    rc.numThreads = (unsigned)((rc.endPos - pos + READER_COPY_BLOCK_SIZE - 1)/READER_COPY_BLOCK_SIZE);
+    if (rc.numThreads == 0) return 1; /* there's nothing to copy */
+  }
+#ifndef HAVE_THREADS
+  rc.numThreads = 1;
+#endif
+  numBuffers = rc.numThreads;
+  for (i = 0; i < numBuffers; ++i) {
+    if ((rc.buffers[i] = arenaAlloc(ctx->arena, READER_COPY_BLOCK_SIZE)) == NULL) break;
+  }
+  if (i == 0) return -1;
+  numBuffers = rc.numThreads = i; /* (with less memory, we make fewer reads at a time) */
+
+#ifdef HAVE_THREADS
+  pthread_mutex_init(&rc.mutex, NULL);
+  pthread_cond_init(&rc.cond, NULL);
+  if (rc.numThreads > 1) {
+    for (; numStarted < rc.numThreads; ++numStarted) {
+      jobs[numStarted].rc = &rc;
+      jobs[numStarted].index = numStarted;
+      if (pthread_create(&threads[numStarted], NULL, readerCopyThread, &jobs[numStarted]) != 0) break;
+    }
+    if (numStarted < rc.numThreads) {
+      /* We couldn't start every thread, so stop those that we did, and read the blocks
+	 ourselves, one at a time: */
+      pthread_mutex_lock(&rc.mutex);
+      rc.isStopping = 1;
+      pthread_cond_broadcast(&rc.cond);
+      pthread_mutex_unlock(&rc.mutex);
+      while (numStarted > 0) pthread_join(threads[--numStarted], NULL);
+      rc.isStopping = 0;
+      for (i = 0; i < rc.numThreads; ++i) rc.isFull[i] = 0;
+      rc.numThreads = 1;
+    }
+  }
+#endif
+
+  /* Write each block, in order: */
+  for (blockNum = 0; ; ++blockNum) {
+    long long len;
+
+    i = (unsigned)(blockNum%rc.numThreads);
+
+#ifdef HAVE_THREADS
+    if (numStarted > 0) {
+      pthread_mutex_lock(&rc.mutex);
+      while (!rc.isFull[i]) pthread_cond_wait(&rc.cond, &rc.mutex);
+      len = rc.lens[i];
+      pthread_mutex_unlock(&rc.mutex);
+    } else
+#endif
+    len = readCopyBlock(&rc, i, blockNum);
+
+    if (len < 0) {
+      fprintf(ctx->logFID, "Failed to read the input file!\n");
+      result = 0;
+      break;
+    }
+    if (len > 0 && fwrite(rc.buffers[i], 1, (size_t)len, outputFID) != (size_t)len) {
+      fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+      result = 0;
+      break;
+    }
+    checksumOutput(ctx, rc.buffers[i], (size_t)len);
+    pos += len;
+    noteProgress(ctx, pos, pos + outputOffset);
+    if (len < READER_COPY_BLOCK_SIZE) break; /* the end of the data */
+
+#ifdef HAVE_THREADS
+    if (numStarted > 0) {
+      pthread_mutex_lock(&rc.mutex);
+      rc.isFull[i] = 0;
+      pthread_cond_broadcast(&rc.cond);
+      pthread_mutex_unlock(&rc.mutex);
+    }
+#endif
+  }
+
+#ifdef HAVE_THREADS
+  pthread_mutex_lock(&rc.mutex);
+  rc.isStopping = 1;
+  pthread_cond_broadcast(&rc.cond);
+  pthread_mutex_unlock(&rc.mutex);
+  while (numStarted > 0) pthread_join(threads[--numStarted], NULL);
+  pthread_mutex_destroy(&rc.mutex);
+  pthread_cond_destroy(&rc.cond);
+#endif
+  while (numBuffers > 0) arenaFree(ctx->arena, rc.buffers[--numBuffers]);
+
+  fseek64(inputFile->fid, pos, SEEK_SET); /* (we read around 'stdio', so move it to match) */
+  return result;
+}
+
+/* Copy the rest of the input file (from its current position) to the output file - or just
+   up to file position "endPos", unless that's MAX_OFFSET.  (For a stream, it must be.)
+   Returns 0 if reading or writing fails: */
+static int copyRemainder(InputFile* inputFile, FILE* outputFID, DjifixContext* ctx,
+			 DjifixOffset endPos) {
+  FILE* inputFID;
+  AsyncWriter writer;
+  size_t numToRead, numRead;
+  DjifixOffset inputPos;
+  DjifixOffset outputOffset = ctx->bytesWritten - ctx->bytesRead; /* output position - input position */
+
+  if (inputFile->streamBuffer != NULL) {
+    /* Write whatever's left in the stream's buffer, then read the rest of the stream directly
+       into our write buffers, a block at a time (each block being read while the previous one
+       is being written): */
+    if (!startAsyncWriter(&writer, outputFID, ctx)) {
+      fprintf(ctx->logFID, "Failed to allocate the copy buffers!\n");
+      return 0;
+    }
+    noteCheckpointWriter(ctx, &writer);
+    if (fillStream(inputFile, 1) > 0) { /* (this also reads any data that we skipped over) */
+      size_t offset = inputFile->streamPos - inputFile->streamBufferPos;
+      size_t numBuffered = inputFile->streamBufferLen - offset;
+
+      asyncWrite(&writer, &inputFile->streamBuffer[offset], numBuffered);
+      inputFile->streamPos += numBuffered;
+    }
+    inputFile->streamBufferPos = inputFile->streamPos;
+    inputFile->streamBufferLen = 0;
+
+    while (!writer.failed) {
+      size_t space;
+      unsigned char* to = asyncWriterSpace(&writer, &space);
+
+      if ((numRead = fread(to, 1, space, inputFile->fid)) == 0) break;
+      asyncWriterCommit(&writer, numRead, 0);
+      inputFile->streamPos += numRead;
+      inputFile->streamBufferPos = inputFile->streamPos;
+      noteProgress(ctx, inputFile->streamPos, inputFile->streamPos + outputOffset);
+    }
+    noteCheckpointWriter(ctx, NULL);
+    if (!finishAsyncWriter(&writer)) {
+      fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+      return 0;
+    }
+    return !inputFailed(inputFile);
+  }
+
+  inputFID = inputFIDAtCurrentPosition(inputFile);
+  if (inputFID == NULL && inputFile->mapStart == NULL) return 0;
+
+  if (inputFile->reader != NULL) {
+    int copied = copyFromReader(inputFile, outputFID, ctx, endPos);
+
+    if (copied >= 0) return copied;
+  }
+#if defined(__linux__)
+  if (inputFID != NULL && inputFile->reader == NULL && !ctx->verify) {
+    int copied = copyRemainderInKernel(inputFID, outputFID, ctx, endPos);
+
+    if (copied != 0) return copied > 0;
+  }
+#endif
+
+  if (inputFile->mapStart != NULL) {
+    /* The data is already in memory, so write it directly from there (in large pieces, so
+       that we can note our progress): */
+    DjifixOffset mapEnd = endPos < inputFile->mapSize ? endPos : inputFile->mapSize;
+
+    while (inputFile->mapPos < mapEnd) {
+      numToRead = mapEnd - inputFile->mapPos;
+      if (numToRead > COPY_BLOCK_SIZE*64) numToRead = COPY_BLOCK_SIZE*64;
+      if (fwrite(&inputFile->mapStart[inputFile->mapPos], 1, numToRead, outputFID) != numToRead) {
+	fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	return 0;
+      }
+      checksumOutput(ctx, &inputFile->mapStart[inputFile->mapPos], numToRead);
+      inputFile->mapPos += numToRead;
+      noteProgress(ctx, inputFile->mapPos, inputFile->mapPos + outputOffset);
+    }
+    return 1;
+  }
+
+  if (!startAsyncWriter(&writer, outputFID, ctx)) {
+    fprintf(ctx->logFID, "Failed to allocate the copy buffers!\n");
+    return 0;
+  }
+  noteCheckpointWriter(ctx, &writer);
+
+  /* Make our first read a short one, so that each later read is aligned on a block boundary.
+     (Each block is read directly into a buffer, and written while we read the next one.): */
+  inputPos = ftell64(inputFID);
+  numToRead = COPY_BLOCK_SIZE - (inputPos < 0 ? 0 : inputPos%COPY_BLOCK_SIZE);
+
+  while (!writer.failed && inputPos < endPos) {
+    size_t space;
+    unsigned char* to = asyncWriterSpace(&writer, &space);
+
+    if (numToRead > space) numToRead = space;
+    if (inputPos >= 0 && (DjifixOffset)numToRead > endPos - inputPos) numToRead = endPos - inputPos;
+    if ((numRead = fread(to, 1, numToRead, inputFID)) == 0) break;
+    asyncWriterCommit(&writer, numRead, 1);
+    numToRead = COPY_BLOCK_SIZE;
+    inputPos += numRead;
+    noteProgress(ctx, inputPos, inputPos + outputOffset);
+  }
+
+  noteCheckpointWriter(ctx, NULL);
+  if (!finishAsyncWriter(&writer)) {
+    fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+    return 0;
+  }
+  return !inputFailed(inputFile);
+}
+
+/* Preallocating the output file: When we know how much we're about to write to the output
+   file (from output file position "pos"), we have the file system allocate it all at once -
+   without changing the file's size - so that the file isn't fragmented (e.g., by several
+   threads writing different parts of it at once), and each write needn't allocate more
+   blocks.  This is just a hint: if the output isn't a regular file, or its file system can't
+   do this, we carry on without it: */
+static void preallocateOutput(FILE* outputFID, DjifixOffset pos, DjifixOffset size) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  struct stat sb;
+  int outputFD = fileno(outputFID);
+
+  if (pos >= 0 && size > 0 && fstat(outputFD, &sb) == 0 && S_ISREG(sb.st_mode)) {
+    (void)fallocate(outputFD, FALLOC_FL_KEEP_SIZE, (off_t)pos, (off_t)size);
+  }
+#else
+  (void)outputFID; (void)pos; (void)size;
+#endif
+}
+
+/* Like "copyRemainder()" (to the end of the input file), except that - if both files are
+   regular files - we leave a hole in the output file wherever the input file has one (e.g.,
+   a recovered card image, with unreadable parts left as holes), rather than writing zeros,
+   and preallocate the rest of the output file.  Returns 0 if reading or writing fails: */
+static int copyRemainderSparsely(InputFile* inputFile, FILE* outputFID, DjifixContext* ctx) {
+#if defined(HAVE_FILE_DESCRIPTORS) && defined(SEEK_HOLE) && defined(SEEK_DATA)
+  struct stat sb;
+  DjifixOffset pos = inputTell(inputFile), end, outputPos = ftell64(outputFID);
+
+  if (inputFile->streamBuffer == NULL && inputFile->fid != NULL && inputFile->reader == NULL &&
+      pos >= 0 && outputPos >= 0 &&
+      fstat(fileno(outputFID), &sb) == 0 && S_ISREG(sb.st_mode) &&
+      inputSeek(inputFile, 0, SEEK_END) == 0) {
+    int inputFD = fileno(inputFile->fid);
+
+    end = inputTell(inputFile);
+    while (pos < end) {
+      off_t dataPos = lseek(inputFD, (off_t)pos, SEEK_DATA);
+      off_t holePos;
+
+      if (dataPos < 0 || dataPos > end) dataPos = (off_t)end; /* (the rest is a hole) */
+      if (dataPos > pos) {
+	/* A hole: extend the output file over it, without writing anything: */
+	outputPos += dataPos - pos;
+	if (fflush(outputFID) != 0 || ftruncate(fileno(outputFID), (off_t)outputPos) != 0 ||
+	    fseek64(outputFID, outputPos, SEEK_SET) != 0) {
+	  fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	  return 0;
+	}
+	checksumZeros(ctx, dataPos - pos);
+	noteProgress(ctx, dataPos, ctx->bytesWritten + (dataPos - pos));
+	pos = dataPos;
+	if (pos >= end) break;
+      }
+
+      /* Then copy the data, up to the next hole: */
+      holePos = lseek(inputFD, (off_t)pos, SEEK_HOLE);
+      if (holePos < 0 || holePos > end) holePos = (off_t)end;
+      preallocateOutput(outputFID, outputPos, holePos - pos);
+      if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	  !copyRemainder(inputFile, outputFID, ctx, holePos == end ? MAX_OFFSET : holePos) ||
+	  ctx->bytesRead < holePos || (outputPos = ftell64(outputFID)) < 0) {
+	return 0;
+      }
+      pos = holePos;
+    }
+    return 1;
+  }
+  if (pos >= 0) inputSeek(inputFile, pos, SEEK_SET);
+#endif
+
+  return copyRemainder(inputFile, outputFID, ctx, MAX_OFFSET);
+}
+
+/* Returns 0 if the repair fails (e.g., because we couldn't write the repaired file): */
+static int doRepairType1(DjifixContext* ctx, FILE* outputFID, int isResuming) {
+  InputFile* inputFile = ctx->inputFile;
+  unsigned ftypSize = ctx->ftypSize;
+  int result;
+
+  if (ctx->faststart) {
+    /* Put a 'moov' atom at the start of the repaired file, if we can: */
+    if (!isResuming && ctx->checkpoint == NULL && inputFile->streamBuffer == NULL &&
+	(result = repairFaststart(ctx, outputFID)) != 0) {
+      return result > 0;
+    }
+    fprintf(ctx->logFID, "(We can't put a 'moov' atom that matches the repaired data at the start of the repaired file, so we're repairing it as usual.)\n");
+  }
+
+  fprintf(ctx->logFID, "%s", isResuming ? resumingRepair : startingToRepair);
+  inputDiscardHistory(inputFile);
+
+  /* Begin the repair (unless we're resuming it) by writing the header for the initial 'ftype'
+     atom: */
+  if (!isResuming) {
+    unsigned char ftypHeader[8];
+
+    ftypHeader[0] = ftypSize>>24; ftypHeader[1] = ftypSize>>16;
+    ftypHeader[2] = ftypSize>>8; ftypHeader[3] = ftypSize;
+    ftypHeader[4] = 'f'; ftypHeader[5] = 't'; ftypHeader[6] = 'y'; ftypHeader[7] = 'p';
+    if (fwrite(ftypHeader, 1, sizeof ftypHeader, outputFID) != sizeof ftypHeader) {
+      fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+      return 0;
+    }
+    checksumOutput(ctx, ftypHeader, sizeof ftypHeader);
+    noteProgress(ctx, inputTell(inputFile), sizeof ftypHeader);
+  }
+
+  /* Then complete the repair by copying from the input file to the output file: */
+  result = copyRemainderSparsely(inputFile, outputFID, ctx);
+  if (result && ctx->verify) checkRepairedAtoms(ctx, NULL);
+  return result;
+}
+
+/* Multi-segment salvage (see "djifix.h"): */
+
+/* The largest 'ftyp' atom that we accept as the start of a segment: */
+#define MAX_SEGMENT_FTYP_SIZE 4096
+
+/* Returns true iff "fourcc" looks like the type of an atom (i.e., it's four letters, digits
+   or spaces): */
+static int isAtomType(unsigned fourcc) {
+  unsigned i;
+
+  for (i = 0; i < 4; ++i) {
+    unsigned c = (fourcc>>(24-8*i))&0xFF;
+
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+	  c == ' ')) return 0;
+  }
+  return 1;
+}
+
+/* Returns the offset of the first position (in the "len" bytes at "buf"; at any alignment) at
+   which there is the header of a plausible 'ftyp' atom - followed by the header of another
+   atom - or "len" if there is none: */
+static size_t findFtypAtom(unsigned char const* buf, size_t len) {
+  size_t i = 0;
+
+  while (i + 16 <= len) {
+    unsigned char const* f = memchr(&buf[i+4], 'f', len - 16 - i + 1);
+    unsigned ftypSize;
+
+    if (f == NULL) break;
+    i = (f - buf) - 4;
+    ftypSize = (buf[i]<<24)|(buf[i+1]<<16)|(buf[i+2]<<8)|buf[i+3];
+    if (memcmp(&buf[i+4], "ftyp", 4) == 0 && ftypSize >= 8 && ftypSize <= MAX_SEGMENT_FTYP_SIZE &&
+	(i + ftypSize + 8 > len ||
+	 isAtomType((buf[i+ftypSize+4]<<24)|(buf[i+ftypSize+5]<<16)|(buf[i+ftypSize+6]<<8)|
+		    buf[i+ftypSize+7]))) return i;
+    ++i;
+  }
+
+  return len;
+}
+
+/* Walks through the atoms of the segment that begins with the 'ftyp' atom at "start", up to
+   (at most) "limit".  Returns the position where the segment's atoms end (or "start", if it
+   has nothing after its 'ftyp'), setting "*hasMoov", and "*isWrapper" if the segment's 'mdat'
+   just wraps another 'ftyp' (i.e., the segment's real data belongs to the next segment): */
+static DjifixOffset segmentEnd(InputFile* inputFile, DjifixOffset start, DjifixOffset limit,
+			       int* hasMoov, int* isWrapper) {
+  DjifixOffset pos = start, ftypEnd = start;
+
+  *hasMoov = *isWrapper = 0;
+  while (pos + 8 <= limit) {
+    unsigned size32, fourcc;
+    DjifixOffset atomSize, dummy;
+
+    if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	!get4Bytes(inputFile, &size32) || !get4Bytes(inputFile, &fourcc)) break;
+    if (!isAtomType(fourcc) || (pos == start && fourcc != fourcc_ftyp)) break; /* junk */
+    atomSize = size32;
+    if (size32 == 1) { /* a 64-bit 'largesize' follows */
+      unsigned sizeHigh, sizeLow;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) break;
+      atomSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      if (atomSize < 16) break;
+    }
+    if (size32 == 0 && fourcc == fourcc_mdat) atomSize = limit - pos; /* to the end */
+    if (atomSize < 8) break;
+
+    if (fourcc == fourcc_moov) {
+      *hasMoov = 1;
+    } else if (fourcc == fourcc_mdat && checkAtom(inputFile, fourcc_ftyp, &dummy)) {
+      *isWrapper = 1;
+      break;
+    }
+    if (atomSize > limit - pos) {
+      /* The atom was cut short (e.g., by a power cut, or by the start of the next segment): */
+      return limit;
+    }
+    pos += atomSize;
+    if (fourcc == fourcc_ftyp) ftypEnd = pos;
+  }
+
+  return pos == ftypEnd ? start : pos;
+}
+
+unsigned djifixFindSegments(DjifixContext* ctx, DjifixSegment** segments) {
+  InputFile* inputFile = ctx->inputFile;
+  DjifixSegment* result = NULL;
+  unsigned numSegments = 0, numAllocated = 0;
+  DjifixOffset fileSize, pos, savedPos;
+
+  *segments = NULL;
+  if (inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE || ctx->repairType != 1 ||
+      inputFile->streamBuffer != NULL) return 0;
+
+  savedPos = inputTell(inputFile);
+  if (inputSeek(inputFile, 0, SEEK_END) != 0) return 0;
+  fileSize = inputTell(inputFile);
+
+  /* Scan (once) from the first segment's 'ftyp' atom for the start of each later segment: */
+  pos = ctx->dataOffset;
+  while (pos >= 0) {
+    DjifixOffset next = -1, end;
+    int hasMoov, isWrapper;
+
+    if (inputSeek(inputFile, pos + 8, SEEK_SET) == 0 && scanInput(inputFile, findFtypAtom, 1)) {
+      next = inputTell(inputFile);
+    }
+
+    end = segmentEnd(inputFile, pos, next < 0 ? fileSize : next, &hasMoov, &isWrapper);
+    if (!isWrapper && end > pos) {
+      if (numSegments == numAllocated) {
+	DjifixSegment* newResult;
+
+	numAllocated = numAllocated == 0 ? 4 : 2*numAllocated;
+	newResult = realloc(result, numAllocated*sizeof (DjifixSegment));
+	if (newResult == NULL) {
+	  fprintf(ctx->logFID, "Failed to allocate the segment table!\n");
+	  break;
+	}
+	result = newResult;
+      }
+      result[numSegments].start = pos;
+      result[numSegments].size = end - pos;
+      result[numSegments].hasMoov = hasMoov;
+      ++numSegments;
+    }
+    pos = next;
+  }
+
+  inputSeek(inputFile, savedPos, SEEK_SET);
+  if (numSegments == 0) {
+    free(result);
+    result = NULL;
+  }
+  *segments = result;
+  return numSegments;
+}
+
+int djifixCopySegment(DjifixContext* ctx, DjifixSegment const* segment, FILE* outputFID) {
+  InputFile* inputFile = ctx->inputFile;
+  DjifixOffset pos = segment->start, end = segment->start + segment->size;
+  size_t numToCopy;
+
+  if (inputFile == NULL || inputFile->streamBuffer != NULL || pos < 0 || end < pos) return 0;
+
+  if (inputFile->mapStart != NULL) {
+    /* The data is already in memory, so write it directly from there: */
+    if (end > (DjifixOffset)inputFile->mapSize) return 0;
+    for (; pos < end; pos += numToCopy) {
+      numToCopy = end - pos < COPY_BLOCK_SIZE*64 ? (size_t)(end - pos) : COPY_BLOCK_SIZE*64;
+      if (fwrite(&inputFile->mapStart[pos], 1, numToCopy, outputFID) != numToCopy) return 0;
+    }
+    return 1;
+  }
+
+  if (inputFile->reader != NULL) {
+    /* Read the segment directly from the reader (so that other segments can be read at the
+       same time): */
+    unsigned char* buffer = arenaAlloc(ctx->arena, READER_COPY_BLOCK_SIZE);
+    long long numRead = 0;
+
+    if (buffer == NULL) return 0;
+    for (; pos < end; pos += numRead) {
+      numToCopy = end - pos < READER_COPY_BLOCK_SIZE ? (size_t)(end - pos) : READER_COPY_BLOCK_SIZE;
+      if (pos >= inputFile->reader->size) break;
+      numRead = inputFile->reader->read(inputFile->reader->opaque, buffer, numToCopy, pos);
+      if (numRead <= 0 || fwrite(buffer, 1, (size_t)numRead, outputFID) != (size_t)numRead) break;
+    }
+    arenaFree(ctx->arena, buffer);
+    return pos == end;
+  }
+
+#ifdef HAVE_FILE_DESCRIPTORS
+  {
+    /* Read the segment with "pread()" (rather than through the input file's 'stdio' buffer),
+       so that we don't move the input file's position, and so that other segments can be
+       copied at the same time: */
+    int inputFD = fileno(inputFile->fid);
+    unsigned char* buffer;
+    ssize_t numRead;
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    /* First, try to copy the segment entirely within the kernel: */
+    if (fflush(outputFID) == 0) {
+      off_t inputPos = pos, outputPos = ftello(outputFID);
+      ssize_t numCopied = -1;
+
+      while (outputPos >= 0 && inputPos < end &&
+	     (numCopied = copy_file_range(inputFD, &inputPos, fileno(outputFID), &outputPos,
+					  end - inputPos < COPY_BLOCK_SIZE*64 ? (size_t)(end - inputPos)
+					  : COPY_BLOCK_SIZE*64, 0)) > 0) {
+      }
+      if (inputPos > pos) {
+	/* "copy_file_range()" does not move the output file descriptor's offset; do that
+	   ourselves: */
+	if (fseeko(outputFID, outputPos, SEEK_SET) != 0) return 0;
+	if (numCopied < 0) return 0;
+	pos = inputPos; /* (if the input file was shorter than we thought, we copy no more) */
+	if (pos < end) return 0;
+	return 1;
+      }
+    }
+#endif
+
+    buffer = arenaAlloc(ctx->arena, COPY_BLOCK_SIZE);
+    if (buffer == NULL) return 0;
+    for (; pos < end; pos += numRead) {
+      numToCopy = end - pos < COPY_BLOCK_SIZE ? (size_t)(end - pos) : COPY_BLOCK_SIZE;
+      numRead = pread(inputFD, buffer, numToCopy, (off_t)pos);
+      if (numRead <= 0 || fwrite(buffer, 1, numRead, outputFID) != (size_t)numRead) break;
+    }
+    arenaFree(ctx->arena, buffer);
+    return pos == end;
+  }
+#else
+  {
+    unsigned char* buffer = arenaAlloc(ctx->arena, COPY_BLOCK_SIZE);
+    DjifixOffset savedPos = inputTell(inputFile);
+    size_t numRead = 0;
+
+    if (buffer == NULL) return 0;
+    if (inputSeek(inputFile, pos, SEEK_SET) == 0) {
+      for (; pos < end; pos += numRead) {
+	numToCopy = end - pos < COPY_BLOCK_SIZE ? (size_t)(end - pos) : COPY_BLOCK_SIZE;
+	numRead = getBytes(inputFile, buffer, numToCopy);
+	if (numRead == 0 || fwrite(buffer, 1, numRead, outputFID) != numRead) break;
+      }
+    }
+    inputSeek(inputFile, savedPos, SEEK_SET);
+    arenaFree(ctx->arena, buffer);
+    return pos == end;
+  }
+#endif
+}
+
+/* The size of the buffer that we use to copy each NAL unit.  (Larger NAL units are copied in
+   pieces.)  This is enough for all but the largest (4k) key frames: */
+#define NAL_BUFFER_SIZE (1024*1024)
+
+/* When detecting the video format, how many slice NAL units (and how many bytes of each) we
+   check, and how many NAL units (of any type) we look through to find them: */
+#define MAX_SLICES_TO_CHECK 30
+#define SLICE_HEADER_BYTES_TO_CHECK 64
+#define MAX_NAL_UNITS_TO_CHECK 300
+
+static unsigned char const startCode[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* More than the combined size of any of our SPS and PPS NAL units: */
+#define MAX_PARAMETER_SETS_SIZE 100
+
+/* Detecting the video format of a 'type 2' file, by parsing the headers of its first few
+   slice NAL units using each of our SPS/PPS pairs in turn, and seeing which pairs make
+   sense of them.  (Some formats differ only in their frame rate - i.e., only in the SPS's
+   timing information - so they can't be told apart this way.)
+*/
+
+/* Reads bits from a NAL unit (from which any 'emulation prevention' bytes have been removed): */
+typedef struct {
+  unsigned char const* data;
+  unsigned numBits;
+  unsigned bitPos;
+  int overrun; /* set if we tried to read past the end of the data */
+} BitReader;
+
+static void initBitReader(BitReader* br, unsigned char const* data, unsigned numBytes) {
+  br->data = data;
+  br->numBits = numBytes*8;
+  br->bitPos = 0;
+  br->overrun = 0;
+}
+
+static unsigned getBits(BitReader* br, unsigned numBits) {
+  unsigned result = 0;
+
+  while (numBits-- > 0) {
+    if (br->bitPos >= br->numBits) {
+      br->overrun = 1;
+      return 0;
+    }
+    result = (result<<1) | ((br->data[br->bitPos>>3]>>(7-(br->bitPos&7)))&1);
+    ++br->bitPos;
+  }
+
+  return result;
+}
+
+/* Reads an unsigned Exp-Golomb-coded value: */
+static unsigned getUE(BitReader* br) {
+  unsigned numLeadingZeroBits = 0;
+
+  while (getBits(br, 1) == 0) {
+    if (br->overrun || ++numLeadingZeroBits > 31) {
+      br->overrun = 1;
+      return 0;
+    }
+  }
+
+  return (1u<<numLeadingZeroBits) - 1 + getBits(br, numLeadingZeroBits);
+}
+
+/* Reads a signed Exp-Golomb-coded value: */
+static int getSE(BitReader* br) {
+  unsigned codeNum = getUE(br);
+
+  return (codeNum&1) != 0 ? (int)((codeNum+1)/2) : -(int)(codeNum/2);
+}
+
+/* Copies a NAL unit, removing any 'emulation prevention' (0x03) bytes; returns the new size: */
+static unsigned removeEmulationPrevention(unsigned char const* from, unsigned numBytes,
+					  unsigned char* to) {
+  unsigned i, toSize = 0, numZeros = 0;
+
+  for (i = 0; i < numBytes; ++i) {
+    if (numZeros >= 2 && from[i] == 0x03) {
+      numZeros = 0;
+      continue;
+    }
+    numZeros = from[i] == 0x00 ? numZeros+1 : 0;
+    to[toSize++] = from[i];
+  }
+
+  return toSize;
+}
+
+/* Those parts of the SPS and PPS that affect how we parse slice headers: */
+typedef struct {
+  unsigned log2MaxFrameNum, log2MaxPicOrderCntLsb;
+  unsigned picWidthInMbs, picHeightInMapUnits;
+  int frameMbsOnly, mbAdaptiveFrameField;
+  int entropyCodingMode, bottomFieldPicOrderInFramePresent, redundantPicCntPresent;
+  int weightedPred, weightedBipredIdc, deblockingFilterControlPresent;
+  int picInitQp;
+} SliceHeaderParams;
+
+/* Parses the SPS and PPS of one of our video formats.  Returns 0 if they use features that we
+   don't handle (none of ours do): */
+static int parseParameterSets(VideoFormat const* format, SliceHeaderParams* params) {
+  unsigned char rbsp[MAX_PARAMETER_SETS_SIZE];
+  BitReader br;
+  unsigned profileIdc, picOrderCntType;
+
+  if (format->spsSize > sizeof rbsp) return 0;
+  initBitReader(&br, rbsp, removeEmulationPrevention(format->sps, format->spsSize, rbsp));
+  (void)getBits(&br, 8); /* NAL unit header */
+  profileIdc = getBits(&br, 8);
+  (void)getBits(&br, 16); /* constraint flags; level_idc */
+  (void)getUE(&br); /* seq_parameter_set_id */
+  if (profileIdc == 100 || profileIdc == 110 || profileIdc == 122 || profileIdc == 244 ||
+      profileIdc == 44 || profileIdc == 83 || profileIdc == 86 || profileIdc == 118 ||
+      profileIdc == 128) {
+    if (getUE(&br) == 3) (void)getBits(&br, 1); /* chroma_format_idc; separate_colour_plane */
+    (void)getUE(&br); (void)getUE(&br); /* bit depths */
+    (void)getBits(&br, 1); /* qpprime_y_zero_transform_bypass_flag */
+    if (getBits(&br, 1)) return 0; /* seq_scaling_matrix_present_flag */
+  }
+  params->log2MaxFrameNum = getUE(&br) + 4;
+  picOrderCntType = getUE(&br);
+  if (picOrderCntType == 0) {
+    params->log2MaxPicOrderCntLsb = getUE(&br) + 4;
+  } else if (picOrderCntType == 1) {
+    return 0;
+  } else {
+    params->log2MaxPicOrderCntLsb = 0;
+  }
+  (void)getUE(&br); /* max_num_ref_frames */
+  (void)getBits(&br, 1); /* gaps_in_frame_num_value_allowed_flag */
+  params->picWidthInMbs = getUE(&br) + 1;
+  params->picHeightInMapUnits = getUE(&br) + 1;
+  params->frameMbsOnly = getBits(&br, 1);
+  params->mbAdaptiveFrameField = params->frameMbsOnly ? 0 : getBits(&br, 1);
+  if (br.overrun) return 0;
+
+  if (format->ppsSize > sizeof rbsp) return 0;
+  initBitReader(&br, rbsp, removeEmulationPrevention(format->pps, format->ppsSize, rbsp));
+  (void)getBits(&br, 8); /* NAL unit header */
+  (void)getUE(&br); (void)getUE(&br); /* pic_parameter_set_id; seq_parameter_set_id */
+  params->entropyCodingMode = getBits(&br, 1);
+  params->bottomFieldPicOrderInFramePresent = getBits(&br, 1);
+  if (getUE(&br) != 0) return 0; /* num_slice_groups_minus1 */
+  (void)getUE(&br); (void)getUE(&br); /* num_ref_idx_l[01]_default_active_minus1 */
+  params->weightedPred = getBits(&br, 1);
+  params->weightedBipredIdc = getBits(&br, 2);
+  params->picInitQp = 26 + getSE(&br);
+  (void)getSE(&br); (void)getSE(&br); /* pic_init_qs_minus26; chroma_qp_index_offset */
+  params->deblockingFilterControlPresent = getBits(&br, 1);
+  (void)getBits(&br, 1); /* constrained_intra_pred_flag */
+  params->redundantPicCntPresent = getBits(&br, 1);
+
+  return !br.overrun;
+}
+
+/* Returns true iff the start of a slice NAL unit ("nal", of "numBytes" bytes, which might be
+   just the start of the NAL unit) parses as a sensible slice header with these parameters: */
+static int sliceHeaderIsValid(SliceHeaderParams const* params,
+			      unsigned char const* nal, unsigned numBytes) {
+  unsigned char rbsp[SLICE_HEADER_BYTES_TO_CHECK];
+  BitReader br;
+  int isIDR = (nal[0]&0x1F) == 5;
+  int nalRefIdc = (nal[0]>>5)&0x03;
+  unsigned firstMbInSlice, sliceType, frameNum, picSizeInMbs, i;
+  int fieldPic = 0, qp;
+
+  if (numBytes > sizeof rbsp) numBytes = sizeof rbsp;
+  initBitReader(&br, rbsp, removeEmulationPrevention(nal, numBytes, rbsp));
+  (void)getBits(&br, 8); /* NAL unit header */
+
+  firstMbInSlice = getUE(&br);
+  sliceType = getUE(&br);
+  if (sliceType > 9) return 0;
+  sliceType %= 5; /* 0: P; 1: B; 2: I; 3: SP; 4: SI */
+  if (getUE(&br) != 0) return 0; /* pic_parameter_set_id (we have only one PPS) */
+  frameNum = getBits(&br, params->log2MaxFrameNum);
+  if (!params->frameMbsOnly) {
+    fieldPic = getBits(&br, 1);
+    if (fieldPic) (void)getBits(&br, 1); /* bottom_field_flag */
+  }
+
+  picSizeInMbs = params->picWidthInMbs*params->picHeightInMapUnits;
+  if (!params->frameMbsOnly && !fieldPic) {
+    picSizeInMbs *= 2; /* a frame (of two fields) */
+    if (params->mbAdaptiveFrameField) picSizeInMbs /= 2; /* we count macroblock pairs */
+  }
+  if (firstMbInSlice >= picSizeInMbs) return 0;
+
+  if (isIDR) {
+    if (frameNum != 0) return 0;
+    if (getUE(&br) > 65535) return 0; /* idr_pic_id */
+  }
+  if (params->log2MaxPicOrderCntLsb > 0) {
+    (void)getBits(&br, params->log2MaxPicOrderCntLsb); /* pic_order_cnt_lsb */
+    if (params->bottomFieldPicOrderInFramePresent && !fieldPic) (void)getSE(&br);
+  }
+  if (params->redundantPicCntPresent) (void)getUE(&br);
+  if (sliceType == 1) (void)getBits(&br, 1); /* direct_spatial_mv_pred_flag */
+  if (sliceType == 0 || sliceType == 1 || sliceType == 3) {
+    if (getBits(&br, 1)) { /* num_ref_idx_active_override_flag */
+      if (getUE(&br) > 31) return 0;
+      if (sliceType == 1 && getUE(&br) > 31) return 0;
+    }
+  }
+
+  /* ref_pic_list_modification(): */
+  for (i = 0; i < (sliceType == 1 ? 2u : sliceType == 2 || sliceType == 4 ? 0u : 1u); ++i) {
+    if (getBits(&br, 1)) { /* ref_pic_list_modification_flag_l[01] */
+      unsigned numModifications = 0;
+      unsigned modificationOfPicNumsIdc;
+
+      while ((modificationOfPicNumsIdc = getUE(&br)) != 3) {
+	if (modificationOfPicNumsIdc > 3 || ++numModifications > 32 || br.overrun) return 0;
+	(void)getUE(&br);
+      }
+    }
+  }
+
+  if ((params->weightedPred && (sliceType == 0 || sliceType == 3)) ||
+      (params->weightedBipredIdc == 1 && sliceType == 1)) {
+    /* We don't parse pred_weight_table() (none of our PPSs use it), so stop here: */
+    return !br.overrun;
+  }
+
+  if (nalRefIdc != 0) {
+    /* dec_ref_pic_marking(): */
+    if (isIDR) {
+      (void)getBits(&br, 2); /* no_output_of_prior_pics_flag; long_term_reference_flag */
+    } else if (getBits(&br, 1)) { /* adaptive_ref_pic_marking_mode_flag */
+      unsigned numOperations = 0;
+      unsigned memoryManagementControlOperation;
+
+      while ((memoryManagementControlOperation = getUE(&br)) != 0) {
+	if (memoryManagementControlOperation > 6 || ++numOperations > 66 || br.overrun) return 0;
+	if (memoryManagementControlOperation != 5) (void)getUE(&br);
+	if (memoryManagementControlOperation == 3) (void)getUE(&br);
+      }
+    }
+  }
+
+  if (params->entropyCodingMode && sliceType != 2 && sliceType != 4) {
+    if (getUE(&br) > 2) return 0; /* cabac_init_idc */
+  }
+  qp = params->picInitQp + getSE(&br); /* slice_qp_delta */
+  if (qp < 0 || qp > 51) return 0;
+  if (sliceType == 3 || sliceType == 4) {
+    if (sliceType == 3) (void)getBits(&br, 1); /* sp_for_switch_flag */
+    (void)getSE(&br); /* slice_qs_delta */
+  }
+  if (params->deblockingFilterControlPresent) {
+    unsigned disableDeblockingFilterIdc = getUE(&br);
+
+    if (disableDeblockingFilterIdc > 2) return 0;
+    if (disableDeblockingFilterIdc != 1) {
+      int alphaOffset = getSE(&br), betaOffset = getSE(&br);
+
+      if (alphaOffset < -6 || alphaOffset > 6 || betaOffset < -6 || betaOffset > 6) return 0;
+    }
+  }
+
+  if (params->entropyCodingMode) {
+    /* The slice data begins with 'cabac_alignment_one_bit's, up to a byte boundary: */
+    while ((br.bitPos&7) != 0) {
+      if (getBits(&br, 1) != 1) return 0;
+    }
+  }
+
+  return !br.overrun;
+}
+
+/* Looks at the first few slice NAL units (the input file is positioned just after the initial
+   0x00000002 NAL unit, and the first 2 bytes of the next 'NAL size'), and returns the index of
+   the format that best fits them, or FORMAT_NONE if none fits.  "*isCertain" is set iff no
+   other format fits equally well.  If "candidates" is not NULL (it must have room for
+   NUM_VIDEO_FORMATS+1 entries), it's set to each of the formats that fit equally well (the
+   one that we return first), followed by FORMAT_NONE.  The input file is left where it was.
+*/
+static int detectVideoFormat(InputFile* inputFile, unsigned second4Bytes, FILE* logFID,
+			     int* isCertain, int* candidates) {
+  unsigned char slices[MAX_SLICES_TO_CHECK][SLICE_HEADER_BYTES_TO_CHECK];
+  unsigned sliceSizes[MAX_SLICES_TO_CHECK];
+  unsigned numSlices = 0, numNALUnits = 0;
+  DjifixOffset startPos = inputTell(inputFile);
+  unsigned nalSize;
+  unsigned char c1, c2;
+  unsigned scores[NUM_VIDEO_FORMATS];
+  unsigned picSizes[NUM_VIDEO_FORMATS];
+  int i, best = 0;
+  unsigned j, bestScore = 0, numBest = 0, maxFirstMbInSlice = 0;
+
+  *isCertain = 0;
+  if (candidates != NULL) candidates[0] = FORMAT_NONE;
+
+  /* First, collect the start of each of the first few slice NAL units: */
+  if (get1Byte(inputFile, &c1) && get1Byte(inputFile, &c2)) {
+    nalSize = ((second4Bytes&0xFFFF)<<16)|(c1<<8)|c2;
+    while (numSlices < MAX_SLICES_TO_CHECK && numNALUnits++ < MAX_NAL_UNITS_TO_CHECK &&
+	   nalSize > 0 && nalSize <= 0x00FFFFFF) {
+      unsigned char* slice = slices[numSlices];
+      unsigned numToRead = nalSize < SLICE_HEADER_BYTES_TO_CHECK ? nalSize : SLICE_HEADER_BYTES_TO_CHECK;
+
+      if (getBytes(inputFile, slice, numToRead) != numToRead) break;
+      if ((slice[0]&0x80) == 0 && ((slice[0]&0x1F) == 1 || (slice[0]&0x1F) == 5)) {
+	unsigned char rbsp[SLICE_HEADER_BYTES_TO_CHECK];
+	BitReader br;
+	unsigned firstMbInSlice;
+
+	initBitReader(&br, rbsp, removeEmulationPrevention(slice, numToRead, rbsp));
+	(void)getBits(&br, 8);
+	firstMbInSlice = getUE(&br);
+	if (!br.overrun && firstMbInSlice > maxFirstMbInSlice) maxFirstMbInSlice = firstMbInSlice;
+	sliceSizes[numSlices++] = numToRead;
+      }
+      if (inputSeek(inputFile, nalSize - numToRead, SEEK_CUR) != 0) break;
+      if (!get4Bytes(inputFile, &nalSize)) break;
+    }
+  }
+  inputSeek(inputFile, startPos, SEEK_SET);
+  if (numSlices == 0) return FORMAT_NONE;
+
+  /* Then see how many of them make sense with each format: */
+  for (i = 0; i < NUM_VIDEO_FORMATS; ++i) {
+    SliceHeaderParams params;
+
+    scores[i] = picSizes[i] = 0;
+    if (!parseParameterSets(&videoFormats[i], &params)) continue;
+    picSizes[i] = params.picWidthInMbs*params.picHeightInMapUnits*(params.frameMbsOnly ? 1 : 2);
+
+    for (j = 0; j < numSlices; ++j) {
+      if (sliceHeaderIsValid(&params, slices[j], sliceSizes[j])) ++scores[i];
+    }
+
+    /* Slice headers that make sense for one picture size usually also make sense for any
+       larger one.  So, if the slices' positions tell us anything about the picture size (i.e.,
+       there's more than one slice per picture), break ties in favor of the smallest picture
+       that can hold them all: */
+    if (scores[i] > bestScore ||
+	(scores[i] == bestScore && bestScore > 0 && maxFirstMbInSlice > 0 &&
+	 picSizes[i] < picSizes[best])) {
+      bestScore = scores[i];
+      best = i;
+      numBest = 1;
+    } else if (scores[i] == bestScore && bestScore > 0 &&
+	       (maxFirstMbInSlice == 0 || picSizes[i] == picSizes[best])) {
+      ++numBest;
+    }
+  }
+
+  /* Demand that (almost) all of the slices make sense: */
+  if (bestScore < numSlices - numSlices/8) {
+    fprintf(logFID, "We were unable to detect the video format from the file's contents.\n");
+    return FORMAT_NONE;
+  }
+
+  *isCertain = numBest == 1;
+  if (*isCertain) {
+    fprintf(logFID, "The video format appears to be %s.\n", videoFormats[best].name);
+  } else {
+    fprintf(logFID, "The video format appears to be one of:");
+    for (i = 0; i < NUM_VIDEO_FORMATS; ++i) {
+      if (scores[i] == bestScore &&
+	  (maxFirstMbInSlice == 0 || picSizes[i] == picSizes[best])) {
+	fprintf(logFID, " %s", videoFormats[i].name);
+      }
+    }
+    fprintf(logFID, "\n");
+  }
+  if (candidates != NULL) {
+    unsigned numCandidates = 0;
+
+    candidates[numCandidates++] = best;
+    for (i = 0; i < NUM_VIDEO_FORMATS && !*isCertain; ++i) {
+      if (i != best && scores[i] == bestScore &&
+	  (maxFirstMbInSlice == 0 || picSizes[i] == picSizes[best])) {
+	candidates[numCandidates++] = i;
+      }
+    }
+    candidates[numCandidates] = FORMAT_NONE;
+  }
+
+  return best;
+}
+
+/* Writing a MP4 file (for 'type 2' repairs, if asked for one).  The NAL units - each still
+   preceded by its 4-byte size, as in the input file - are copied into a 'mdat' atom, grouped
+   into samples (one per 'access unit', i.e., picture).  Then we write a 'moov' atom that
+   describes the samples, and that contains our SPS and PPS NAL units (in the 'avcC' atom).
+*/
+
+/* The 'timescale' (units per second) that we use for the video track's timing: */
+#define MP4_TIMESCALE 90000
+
+/* The samples that we've written to the 'mdat' atom: */
+typedef struct {
+  unsigned* sizes;
+  DjifixOffset* offsets; /* within the output file */
+  unsigned char* isSync; /* the sample is a key frame (contains an IDR picture) */
+  unsigned numSamples, numSamplesAllocated;
+  Arena* arena; /* where the arrays are allocated (NULL: with "malloc()") */
+} SampleTable;
+
+static int addSample(SampleTable* samples, DjifixOffset offset) {
+  if (samples->numSamples == samples->numSamplesAllocated) {
+    unsigned newNumAllocated = samples->numSamplesAllocated == 0 ? 1024 : 2*samples->numSamplesAllocated;
+    unsigned* newSizes = arenaRealloc(samples->arena, samples->sizes, newNumAllocated*sizeof (unsigned));
+    DjifixOffset* newOffsets;
+    unsigned char* newIsSync;
+
+    if (newSizes == NULL) return 0;
+    samples->sizes = newSizes;
+    newOffsets = arenaRealloc(samples->arena, samples->offsets, newNumAllocated*sizeof (DjifixOffset));
+    if (newOffsets == NULL) return 0;
+    samples->offsets = newOffsets;
+    newIsSync = arenaRealloc(samples->arena, samples->isSync, newNumAllocated);
+    if (newIsSync == NULL) return 0;
+    samples->isSync = newIsSync;
+    samples->numSamplesAllocated = newNumAllocated;
+  }
+
+  samples->sizes[samples->numSamples] = 0;
+  samples->offsets[samples->numSamples] = offset;
+  samples->isSync[samples->numSamples] = 0;
+  ++samples->numSamples;
+  return 1;
+}
+
+/* Frees the samples' arrays, leaving the table empty: */
+static void freeSampleTable(SampleTable* samples) {
+  Arena* arena = samples->arena;
+
+  arenaFree(arena, samples->isSync);
+  arenaFree(arena, samples->offsets);
+  arenaFree(arena, samples->sizes);
+  memset(samples, 0, sizeof (SampleTable));
+  samples->arena = arena;
+}
+
+/* Returns true iff the NAL unit (beginning with the "numBytes" bytes at "nal") begins a new
+   access unit - i.e., a new sample.  DJI cameras begin each access unit with an 'access unit
+   delimiter' (the 2-byte NAL units whose size we look for when recovering from corrupted
+   data), but if a stream has none, we go by the rules in the H.264 standard instead: */
+static int nalUnitBeginsSample(unsigned char const* nal, unsigned numBytes,
+			       int streamHasAUDs, int sampleHasSlice) {
+  unsigned nalUnitType = nal[0]&0x1F;
+
+  if (nalUnitType == 9) return 1; /* access unit delimiter */
+  if (streamHasAUDs || !sampleHasSlice) return 0;
+
+  if (nalUnitType == 6 || nalUnitType == 7 || nalUnitType == 8) return 1; /* SEI, SPS, PPS */
+  /* Otherwise, a slice with first_mb_in_slice == 0 begins a new picture: */
+  return (nalUnitType == 1 || nalUnitType == 5) && numBytes > 1 && (nal[1]&0x80) != 0;
+}
+
+/* A growable buffer, into which we build the 'moov' atom: */
+typedef struct {
+  unsigned char* data;
+  size_t len, size;
+  int failed; /* we ran out of memory */
+  Arena* arena; /* where "data" is allocated (NULL: with "malloc()") */
+} BoxBuffer;
+
+static void putBytes(BoxBuffer* b, void const* from, size_t numBytes) {
+  if (b->failed) return;
+  if (b->len + numBytes > b->size) {
+    size_t newSize = b->size == 0 ? 64*1024 : b->size;
+    unsigned char* newData;
+
+    while (newSize < b->len + numBytes) newSize *= 2;
+    newData = arenaRealloc(b->arena, b->data, newSize);
+    if (newData == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->data = newData;
+    b->size = newSize;
+  }
+
+  memcpy(&b->data[b->len], from, numBytes);
+  b->len += numBytes;
+}
+
+static void put8(BoxBuffer* b, unsigned x) {
+  unsigned char c = x;
+
+  putBytes(b, &c, 1);
+}
+
+static void put16(BoxBuffer* b, unsigned x) {
+  unsigned char c[2];
+
+  c[0] = x>>8; c[1] = x;
+  putBytes(b, c, 2);
+}
+
+static void put32(BoxBuffer* b, unsigned long x) {
+  unsigned char c[4];
+
+  c[0] = x>>24; c[1] = x>>16; c[2] = x>>8; c[3] = x;
+  putBytes(b, c, 4);
+}
+
+static void put64(BoxBuffer* b, unsigned long long x) {
+  put32(b, (unsigned long)(x>>32));
+  put32(b, (unsigned long)(x&0xFFFFFFFF));
+}
+
+static void putZeros(BoxBuffer* b, unsigned numBytes) {
+  while (numBytes-- > 0) put8(b, 0);
+}
+
+/* Begins an atom (whose size we fill in later, in "endBox()"): */
+static size_t beginBox(BoxBuffer* b, char const* fourcc) {
+  size_t boxStart = b->len;
+
+  put32(b, 0);
+  putBytes(b, fourcc, 4);
+  return boxStart;
+}
+
+/* Begins a 'full' atom (i.e., with a version and flags): */
+static size_t beginFullBox(BoxBuffer* b, char const* fourcc, unsigned version, unsigned flags) {
+  size_t boxStart = beginBox(b, fourcc);
+
+  put32(b, (version<<24)|flags);
+  return boxStart;
+}
+
+static void endBox(BoxBuffer* b, size_t boxStart) {
+  size_t boxSize = b->len - boxStart;
+
+  if (b->failed) return;
+  b->data[boxStart] = boxSize>>24; b->data[boxStart+1] = boxSize>>16;
+  b->data[boxStart+2] = boxSize>>8; b->data[boxStart+3] = boxSize;
+}
+
+static void putMatrix(BoxBuffer* b) {
+  put32(b, 0x00010000); put32(b, 0); put32(b, 0);
+  put32(b, 0); put32(b, 0x00010000); put32(b, 0);
+  put32(b, 0); put32(b, 0); put32(b, 0x40000000);
+}
+
+/* The start of the MP4 file, up to and including the header of its 'mdat' atom.  (We use a
+   64-bit 'mdat' size, which we fill in when we've finished the file.) */
+#define MP4_MDAT_HEADER_SIZE 16
+static unsigned char const mp4Start[] = {
+  0x00, 0x00, 0x00, 0x18, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm', 0x00, 0x00, 0x02, 0x00,
+  'i', 's', 'o', 'm', 'a', 'v', 'c', '1',
+  0x00, 0x00, 0x00, 0x01, 'm', 'd', 'a', 't', 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* ('verify') Checks the MP4 file that we've written - that its sample table matches the data
+   in its 'mdat' atom (beginning at "mdatStart"), and that its 'moov' atom (the "moovSize" bytes
+   at "moov") is well formed.  Returns NULL if so, otherwise what's wrong: */
+static char const* checkMP4Structure(SampleTable const* samples, DjifixOffset mdatStart,
+				     DjifixOffset mdatEnd, unsigned char const* moov,
+				     size_t moovSize) {
+  DjifixOffset pos = mdatStart + MP4_MDAT_HEADER_SIZE;
+  unsigned i, numSync = 0;
+
+  if (samples->numSamples == 0) return "there are no video samples";
+  for (i = 0; i < samples->numSamples; ++i) {
+    if (samples->offsets[i] != pos || samples->sizes[i] == 0 || samples->sizes[i] > mdatEnd - pos) {
+      return "the sample table doesn't match the data in the 'mdat' atom";
+    }
+    pos += samples->sizes[i];
+    if (samples->isSync[i]) ++numSync;
+  }
+  if (numSync == 0) return "there are no key frames";
+  if (!checkAtomTree(moov, moovSize)) return "the 'moov' atom's structure is bad";
+
+  return NULL;
+}
+
+/* Completes the MP4 file, whose 'mdat' atom (beginning at "mdatStart") ends at "mdatEnd".
+   Returns 0 if this fails: */
+static int finishMP4File(DjifixContext* ctx, FILE* outputFID, DjifixOffset mdatStart,
+			 DjifixOffset mdatEnd, VideoFormat const* format, SampleTable const* samples) {
+  FILE* logFID = ctx->logFID;
+  BoxBuffer b;
+  unsigned framesPerSecond = format->isInterlaced ? format->fps/2 : format->fps;
+  unsigned sampleDuration = MP4_TIMESCALE/framesPerSecond;
+  unsigned long duration = (unsigned long)samples->numSamples*sampleDuration;
+  int needs64BitOffsets = mdatEnd > 0xFFFFFFFFLL;
+  size_t moov, trak, mdia, minf, stbl, box, stsdEntry;
+  unsigned i, numSyncSamples;
+  unsigned char mdatSize[8];
+  int result;
+
+  memset(&b, 0, sizeof b);
+  b.arena = samples->arena;
+
+  moov = beginBox(&b, "moov");
+  box = beginFullBox(&b, "mvhd", 0, 0);
+  put32(&b, 0); put32(&b, 0); /* creation_time; modification_time */
+  put32(&b, MP4_TIMESCALE); put32(&b, duration);
+  put32(&b, 0x00010000); put16(&b, 0x0100); putZeros(&b, 10); /* rate; volume; reserved */
+  putMatrix(&b);
+  putZeros(&b, 24); /* pre_defined */
+  put32(&b, 2); /* next_track_ID */
+  endBox(&b, box);
+
+  trak = beginBox(&b, "trak");
+  box = beginFullBox(&b, "tkhd", 0, 0x000003); /* track_enabled|track_in_movie */
+  put32(&b, 0); put32(&b, 0); /* creation_time; modification_time */
+  put32(&b, 1); put32(&b, 0); put32(&b, duration); /* track_ID; reserved; duration */
+  putZeros(&b, 8); put16(&b, 0); put16(&b, 0); put16(&b, 0); put16(&b, 0);
+  putMatrix(&b);
+  put32(&b, format->width<<16); put32(&b, format->height<<16);
+  endBox(&b, box);
+
+  mdia = beginBox(&b, "mdia");
+  box = beginFullBox(&b, "mdhd", 0, 0);
+  put32(&b, 0); put32(&b, 0); /* creation_time; modification_time */
+  put32(&b, MP4_TIMESCALE); put32(&b, duration);
+  put16(&b, 0x55C4); put16(&b, 0); /* language ("und"); pre_defined */
+  endBox(&b, box);
+  box = beginFullBox(&b, "hdlr", 0, 0);
+  put32(&b, 0); putBytes(&b, "vide", 4); putZeros(&b, 12);
+  putBytes(&b, "VideoHandler", 13);
+  endBox(&b, box);
+
+  minf = beginBox(&b, "minf");
+  box = beginFullBox(&b, "vmhd", 0, 1);
+  putZeros(&b, 8); /* graphicsmode; opcolor */
+  endBox(&b, box);
+  box = beginBox(&b, "dinf");
+  {
+    size_t dref = beginFullBox(&b, "dref", 0, 0);
+    size_t url;
+
+    put32(&b, 1);
+    url = beginFullBox(&b, "url ", 0, 1); /* the data is in this file */
+    endBox(&b, url);
+    endBox(&b, dref);
+  }
+  endBox(&b, box);
+
+  stbl = beginBox(&b, "stbl");
+  box = beginFullBox(&b, "stsd", 0, 0);
+  put32(&b, 1);
+  stsdEntry = beginBox(&b, "avc1");
+  putZeros(&b, 6); put16(&b, 1); /* reserved; data_reference_index */
+  putZeros(&b, 16); /* pre_defined; reserved */
+  put16(&b, format->width); put16(&b, format->height);
+  put32(&b, 0x00480000); put32(&b, 0x00480000); /* 72 dpi */
+  put32(&b, 0); put16(&b, 1); /* reserved; frame_count */
+  putZeros(&b, 32); /* compressorname */
+  put16(&b, 0x0018); put16(&b, 0xFFFF); /* depth; pre_defined */
+  {
+    size_t avcC = beginBox(&b, "avcC");
+
+    put8(&b, 1); /* configurationVersion */
+    put8(&b, format->sps[1]); put8(&b, format->sps[2]); put8(&b, format->sps[3]);
+    put8(&b, 0xFF); /* lengthSizeMinusOne: 3 */
+    put8(&b, 0xE1); put16(&b, format->spsSize); putBytes(&b, format->sps, format->spsSize);
+    put8(&b, 1); put16(&b, format->ppsSize); putBytes(&b, format->pps, format->ppsSize);
+    if (format->sps[1] == 100) {
+      /* 'High' profile: chroma_format 4:2:0; 8-bit luma and chroma; no SPS extensions */
+      put8(&b, 0xFD); put8(&b, 0xF8); put8(&b, 0xF8); put8(&b, 0);
+    }
+    endBox(&b, avcC);
+  }
+  endBox(&b, stsdEntry);
+  endBox(&b, box);
+
+  box = beginFullBox(&b, "stts", 0, 0);
+  put32(&b, 1); put32(&b, samples->numSamples); put32(&b, sampleDuration);
+  endBox(&b, box);
+
+  for (i = numSyncSamples = 0; i < samples->numSamples; ++i) numSyncSamples += samples->isSync[i];
+  if (numSyncSamples < samples->numSamples) {
+    box = beginFullBox(&b, "stss", 0, 0);
+    put32(&b, numSyncSamples);
+    for (i = 0; i < samples->numSamples; ++i) if (samples->isSync[i]) put32(&b, i+1);
+    endBox(&b, box);
+  }
+
+  box = beginFullBox(&b, "stsc", 0, 0); /* one sample per chunk */
+  put32(&b, 1); put32(&b, 1); put32(&b, 1); put32(&b, 1);
+  endBox(&b, box);
+
+  box = beginFullBox(&b, "stsz", 0, 0);
+  put32(&b, 0); put32(&b, samples->numSamples);
+  for (i = 0; i < samples->numSamples; ++i) put32(&b, samples->sizes[i]);
+  endBox(&b, box);
+
+  box = beginFullBox(&b, needs64BitOffsets ? "co64" : "stco", 0, 0);
+  put32(&b, samples->numSamples);
+  for (i = 0; i < samples->numSamples; ++i) {
+    if (needs64BitOffsets) put64(&b, samples->offsets[i]); else put32(&b, samples->offsets[i]);
+  }
+  endBox(&b, box);
+
+  endBox(&b, stbl);
+  endBox(&b, minf);
+  endBox(&b, mdia);
+  endBox(&b, trak);
+  endBox(&b, moov);
+
+  if (b.failed) {
+    fprintf(logFID, "Failed to allocate memory for the 'moov' atom!\n");
+    return 0;
+  }
+
+  /* Fill in the size of the 'mdat' atom, then write the 'moov' atom after it: */
+  {
+    unsigned long long size = mdatEnd - mdatStart;
+
+    mdatSize[0] = size>>56; mdatSize[1] = size>>48; mdatSize[2] = size>>40;
+    mdatSize[3] = size>>32; mdatSize[4] = size>>24; mdatSize[5] = size>>16;
+    mdatSize[6] = size>>8; mdatSize[7] = size;
+  }
+  result = fseek64(outputFID, mdatStart + 8, SEEK_SET) == 0 &&
+    fwrite(mdatSize, 1, sizeof mdatSize, outputFID) == sizeof mdatSize &&
+    fseek64(outputFID, mdatEnd, SEEK_SET) == 0 &&
+    fwrite(b.data, 1, b.len, outputFID) == b.len;
+  if (!result) fprintf(logFID, "Failed to complete the MP4 file!\n");
+  checksumChange(ctx, mdatStart + 8, &mp4Start[sizeof mp4Start - sizeof mdatSize], mdatSize,
+		 sizeof mdatSize); /* (replacing the zero size in "mp4Start") */
+  checksumOutput(ctx, b.data, b.len);
+  if (ctx->verify) {
+    noteStructureProblem(ctx, checkMP4Structure(samples, mdatStart, mdatEnd, b.data, b.len));
+    ctx->structureChecked = 1;
+  }
+
+  arenaFree(b.arena, b.data);
+  return result;
+}
+
+/* Faststart 'type 1' repairs (the "faststart" option): Rather than leaving the 'moov' atom
+   where it was - usually after the 'mdat' atom, or (for a 'moov' atom that came before the
+   'ftyp') not in the repaired file at all - we write it straight after the 'ftyp' atom, so
+   that players can start playing (and seeking) as soon as they've read the start of the file.
+   We use the repaired data's own 'moov' atom if it has one; otherwise the 'moov' atom that
+   came before the (outer) 'mdat'.  Either way, we first check - from its sample sizes, samples
+   per chunk, and chunk offsets - that each chunk that it describes lies within the repaired
+   data's 'mdat' atom(s).  We then write it with its chunk offsets changed to match the new
+   layout, followed by the rest of the repaired data (without the old 'moov' atom), unchanged.
+*/
+
+/* The largest 'moov' atom that we'll read into memory: */
+#define MAX_FASTSTART_MOOV_SIZE (256*1024*1024)
+
+/* The most (top-level) 'mdat' atoms that we look for chunks in: */
+#define MAX_FASTSTART_MDATS 16
+
+struct FaststartLayout {
+  DjifixOffset dataStart, dataEnd; /* the data (after the 'ftyp' atom) that we copy... */
+  DjifixOffset skipStart, skipEnd; /* ...except for this (the old 'moov' atom, if it's there) */
+  DjifixOffset mdatStart[MAX_FASTSTART_MDATS], mdatEnd[MAX_FASTSTART_MDATS]; /* their data */
+  unsigned numMdats;
+  unsigned char* moov; /* the 'moov' atom that we'll write (before we change it) */
+  size_t moovSize;
+  int moovIsInner; /* the 'moov' atom is the repaired data's own */
+  DjifixOffset offsetBase; /* a chunk offset, plus this, is a position in the input file */
+  unsigned long numChunks; /* the number of chunks that we've checked */
+  int use64BitOffsets; /* we write each chunk offset as 64 bits (in a 'co64' atom) */
+  DjifixOffset outputDataStart; /* the output file position of "dataStart" */
+};
+
+static unsigned long long getBytesAt(unsigned char const* p, unsigned numBytes) {
+  unsigned long long result = 0;
+
+  while (numBytes-- > 0) result = (result<<8)|*p++;
+  return result;
+}
+
+/* Returns the output file position of the data at input file position "pos": */
+static DjifixOffset faststartOutputPos(FaststartLayout const* layout, DjifixOffset pos) {
+  if (layout->skipEnd > layout->skipStart && pos >= layout->skipEnd) {
+    pos -= layout->skipEnd - layout->skipStart;
+  }
+  return pos - layout->dataStart + layout->outputDataStart;
+}
+
+/* Returns a pointer to the contents (after the header) of the first atom of type "fourcc"
+   among the atoms in the "size" bytes at "p" - setting "*contentSize" - or NULL if there is
+   none: */
+static unsigned char const* findChildAtom(unsigned char const* p, size_t size, unsigned fourcc,
+					   size_t* contentSize) {
+  while (size >= 8) {
+    size_t atomSize = (size_t)getBytesAt(p, 4);
+
+    if (atomSize < 8 || atomSize > size) break;
+    if (getBytesAt(&p[4], 4) == fourcc) {
+      *contentSize = atomSize - 8;
+      return &p[8];
+    }
+    p += atomSize;
+    size -= atomSize;
+  }
+
+  return NULL;
+}
+
+/* Returns true iff the atoms in the "size" bytes at "p" - and those inside any of them that
+   contain atoms - each fit within their parent.  (Fewer than 8 bytes after them may be
+   padding.): */
+static int checkAtomTree(unsigned char const* p, size_t size) {
+  while (size >= 8) {
+    size_t atomSize = (size_t)getBytesAt(p, 4);
+    unsigned fourcc = (unsigned)getBytesAt(&p[4], 4);
+
+    if (atomSize < 8 || atomSize > size) return 0;
+    if ((fourcc == fourcc_moov || fourcc == fourcc_trak || fourcc == fourcc_edts ||
+	 fourcc == fourcc_mdia || fourcc == fourcc_minf || fourcc == fourcc_dinf ||
+	 fourcc == fourcc_stbl) && !checkAtomTree(&p[8], atomSize - 8)) {
+      return 0;
+    }
+    p += atomSize;
+    size -= atomSize;
+  }
+  return 1;
+}
+
+/* Checks that each chunk described by a 'stbl' atom (whose contents are the "size" bytes at
+   "stbl") lies within one of the repaired data's 'mdat' atoms, and that each sample is in a
+   chunk.  Returns 0 if not: */
+static int checkFaststartChunks(FaststartLayout* layout, unsigned char const* stbl, size_t size) {
+  unsigned char const* stsz;
+  unsigned char const* stsc;
+  unsigned char const* stco;
+  size_t stszSize, stscSize, stcoSize;
+  unsigned offsetSize = 4;
+  unsigned long sampleSize, numSamples, numStscEntries, numChunks, chunk, stscIndex, sample;
+
+  stco = findChildAtom(stbl, size, fourcc_stco, &stcoSize);
+  if (stco == NULL) {
+    stco = findChildAtom(stbl, size, fourcc_co64, &stcoSize);
+    offsetSize = 8;
+  }
+  stsz = findChildAtom(stbl, size, fourcc_stsz, &stszSize);
+  stsc = findChildAtom(stbl, size, fourcc_stsc, &stscSize);
+  if (stco == NULL || stsz == NULL || stsc == NULL ||
+      stcoSize < 8 || stszSize < 12 || stscSize < 8) return 0;
+
+  sampleSize = (unsigned long)getBytesAt(&stsz[4], 4);
+  numSamples = (unsigned long)getBytesAt(&stsz[8], 4);
+  numStscEntries = (unsigned long)getBytesAt(&stsc[4], 4);
+  numChunks = (unsigned long)getBytesAt(&stco[4], 4);
+  if ((sampleSize == 0 && numSamples > (stszSize - 12)/4) ||
+      numStscEntries > (stscSize - 8)/12 || numChunks > (stcoSize - 8)/offsetSize) return 0;
+
+  for (chunk = 1, stscIndex = sample = 0; chunk <= numChunks; ++chunk) {
+    DjifixOffset pos = (DjifixOffset)getBytesAt(&stco[8 + (chunk-1)*offsetSize], offsetSize);
+    DjifixOffset chunkSize = 0;
+    unsigned long samplesPerChunk, i;
+
+    /* Find how many samples this chunk has, and their total size: */
+    while (stscIndex + 1 < numStscEntries && getBytesAt(&stsc[8 + (stscIndex+1)*12], 4) <= chunk) {
+      ++stscIndex;
+    }
+    samplesPerChunk = numStscEntries == 0 ? 0 : (unsigned long)getBytesAt(&stsc[8 + stscIndex*12 + 4], 4);
+    if (samplesPerChunk > numSamples - sample) return 0;
+    if (sampleSize != 0) {
+      chunkSize = (DjifixOffset)sampleSize*samplesPerChunk;
+    } else {
+      for (i = 0; i < samplesPerChunk; ++i) chunkSize += getBytesAt(&stsz[12 + 4*(sample+i)], 4);
+    }
+    sample += samplesPerChunk;
+
+    /* Check that the chunk is within a 'mdat' atom: */
+    if (pos < 0 || pos > MAX_OFFSET - layout->offsetBase) return 0;
+    pos += layout->offsetBase;
+    for (i = 0; i < layout->numMdats; ++i) {
+      if (pos >= layout->mdatStart[i] && chunkSize <= layout->mdatEnd[i] - pos) break;
+    }
+    if (i == layout->numMdats) return 0;
+  }
+  layout->numChunks += numChunks;
+
+  return sample == numSamples;
+}
+
+/* Checks the chunks of each track in the atoms in the "size" bytes at "p" (descending into
+   those atoms that can contain them).  Returns 0 if any of them is wrong: */
+static int checkFaststartAtoms(FaststartLayout* layout, unsigned char const* p, size_t size) {
+  while (size >= 8) {
+    size_t atomSize = (size_t)getBytesAt(p, 4);
+    unsigned fourcc = (unsigned)getBytesAt(&p[4], 4);
+
+    if (atomSize < 8 || atomSize > size) return 0; /* (we don't expect 64-bit sizes here) */
+    if (fourcc == fourcc_moov || fourcc == fourcc_trak || fourcc == fourcc_mdia ||
+	fourcc == fourcc_minf) {
+      if (!checkFaststartAtoms(layout, &p[8], atomSize - 8)) return 0;
+    } else if (fourcc == fourcc_stbl) {
+      if (!checkFaststartChunks(layout, &p[8], atomSize - 8)) return 0;
+    }
+    p += atomSize;
+    size -= atomSize;
+  }
+
+  return 1; /* (any remaining bytes are padding) */
+}
+
+/* Adds (a copy of) the (already checked) atoms in the "size" bytes at "p" to "b", changing
+   their chunk offsets to match the output file: */
+static void putFaststartAtoms(BoxBuffer* b, FaststartLayout const* layout,
+			      unsigned char const* p, size_t size) {
+  while (size >= 8) {
+    size_t atomSize = (size_t)getBytesAt(p, 4);
+    unsigned fourcc = (unsigned)getBytesAt(&p[4], 4);
+
+    if (fourcc == fourcc_moov || fourcc == fourcc_trak || fourcc == fourcc_mdia ||
+	fourcc == fourcc_minf || fourcc == fourcc_stbl) {
+      size_t box = b->len;
+
+      putBytes(b, p, 8);
+      putFaststartAtoms(b, layout, &p[8], atomSize - 8);
+      endBox(b, box);
+    } else if (fourcc == fourcc_stco || fourcc == fourcc_co64) {
+      unsigned offsetSize = fourcc == fourcc_co64 ? 8 : 4;
+      int is64Bit = offsetSize == 8 || layout->use64BitOffsets;
+      unsigned long numChunks = atomSize < 16 ? 0 : (unsigned long)getBytesAt(&p[12], 4), i;
+      size_t box = beginFullBox(b, is64Bit ? "co64" : "stco", p[8], (unsigned)getBytesAt(&p[9], 3));
+
+      if (atomSize < 16 || numChunks > (atomSize - 16)/offsetSize) numChunks = 0; /* (unchecked) */
+      put32(b, numChunks);
+      for (i = 0; i < numChunks; ++i) {
+	DjifixOffset pos = faststartOutputPos(layout, (DjifixOffset)getBytesAt(&p[16 + i*offsetSize],
+										  offsetSize)
+					      + layout->offsetBase);
+
+	if (is64Bit) put64(b, pos); else put32(b, (unsigned long)pos);
+      }
+      endBox(b, box);
+    } else {
+      putBytes(b, p, atomSize);
+    }
+    p += atomSize;
+    size -= atomSize;
+  }
+  putBytes(b, p, size); /* any padding */
+}
+
+/* Sets up "layout" for a faststart repair.  Returns 0 (with nothing to free) if we can't do
+   one - e.g., because we didn't find a 'moov' atom that matches the repaired data: */
+static int planFaststart(DjifixContext* ctx, FaststartLayout* layout) {
+  InputFile* inputFile = ctx->inputFile;
+  DjifixOffset pos, innerMoovPos = -1, innerMoovSize = 0;
+  unsigned i;
+
+  memset(layout, 0, sizeof (FaststartLayout));
+  if (inputSeek(inputFile, 0, SEEK_END) != 0) return 0;
+  layout->dataEnd = inputTell(inputFile);
+  layout->dataStart = ctx->dataOffset + ctx->ftypSize;
+
+  /* Find the repaired data's (top-level) 'mdat' atoms, and its 'moov' atom (if any): */
+  for (pos = layout->dataStart; pos <= layout->dataEnd - 8; ) {
+    unsigned size32, fourcc;
+    DjifixOffset atomSize, headerSize = 8;
+
+    if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	!get4Bytes(inputFile, &size32) || !get4Bytes(inputFile, &fourcc)) break;
+    atomSize = size32;
+    if (size32 == 1) { /* a 64-bit 'largesize' follows */
+      unsigned sizeHigh, sizeLow;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) break;
+      atomSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      headerSize = 16;
+    } else if (size32 == 0) { /* the atom extends to the end */
+      atomSize = layout->dataEnd - pos;
+    }
+    if (atomSize < headerSize) break;
+
+    if (fourcc == fourcc_mdat && layout->numMdats < MAX_FASTSTART_MDATS) {
+      /* (If recording stopped unexpectedly, the 'mdat' atom may have been cut short.) */
+      layout->mdatStart[layout->numMdats] = pos + headerSize;
+      layout->mdatEnd[layout->numMdats] = atomSize > layout->dataEnd - pos ? layout->dataEnd
+	: pos + atomSize;
+      ++layout->numMdats;
+    } else if (fourcc == fourcc_moov && innerMoovPos < 0 && atomSize <= layout->dataEnd - pos) {
+      innerMoovPos = pos;
+      innerMoovSize = atomSize;
+    }
+    if (atomSize > layout->dataEnd - pos) break;
+    pos += atomSize;
+  }
+  if (layout->numMdats == 0) return 0;
+
+  /* Choose the 'moov' atom.  Its chunk offsets might be from the start of the repaired
+     data (i.e., its 'ftyp' atom), or from the start of the input file: */
+  for (i = 0; i < 4; ++i) {
+    DjifixOffset moovPos = i < 2 ? innerMoovPos : ctx->outerMoovSize > 0 ? ctx->outerMoovPos : -1;
+    DjifixOffset moovSize = i < 2 ? innerMoovSize : ctx->outerMoovSize;
+
+    if (moovPos < 0 || moovSize > MAX_FASTSTART_MOOV_SIZE) continue;
+    if (i%2 == 0) {
+      arenaFree(ctx->arena, layout->moov);
+      layout->moov = arenaAlloc(ctx->arena, (size_t)moovSize);
+      layout->moovSize = (size_t)moovSize;
+      if (layout->moov == NULL) return 0;
+      if (inputSeek(inputFile, moovPos, SEEK_SET) != 0 ||
+	  getBytes(inputFile, layout->moov, layout->moovSize) != layout->moovSize) {
+	++i; /* (there's no point checking it again) */
+	continue;
+      }
+    }
+    layout->moovIsInner = i < 2;
+    layout->offsetBase = i == 0 || i == 3 ? ctx->dataOffset : 0;
+    layout->numChunks = 0;
+    if (checkFaststartAtoms(layout, layout->moov, layout->moovSize) && layout->numChunks > 0) break;
+  }
+  if (i == 4) {
+    arenaFree(ctx->arena, layout->moov);
+    return 0;
+  }
+
+  /* We don't copy the old 'moov' atom (even if we're not using it): */
+  if (innerMoovPos >= 0) {
+    layout->skipStart = innerMoovPos;
+    layout->skipEnd = innerMoovPos + innerMoovSize;
+  }
+  return 1;
+}
+
+/* ('Type 1' repairs, if "verify") Checks the repaired data's top-level atoms - in the input
+   file, after its 'ftyp' atom, and (for a faststart repair) except for the old 'moov' atom -
+   and then (unless it's a faststart repair, whose 'moov' atom was checked before it was
+   written) that each chunk that its 'moov' atom describes lies within a 'mdat' atom.  (This
+   reads only the atoms' headers, and the 'moov' atom.): */
+static void checkRepairedAtoms(DjifixContext* ctx, FaststartLayout const* faststart) {
+  InputFile* inputFile = ctx->inputFile;
+  FaststartLayout layout;
+  DjifixOffset pos, moovPos = -1, moovSize = 0;
+  char const* problem = NULL;
+
+  if (inputFile->streamBuffer != NULL) return; /* we can't go back to the atoms */
+  memset(&layout, 0, sizeof layout);
+  if (inputSeek(inputFile, 0, SEEK_END) != 0) return;
+  layout.dataEnd = inputTell(inputFile);
+
+  for (pos = ctx->dataOffset + ctx->ftypSize; pos < layout.dataEnd; ) {
+    unsigned size32, fourcc;
+    DjifixOffset atomSize, headerSize = 8;
+
+    if (faststart != NULL && faststart->skipEnd > faststart->skipStart && pos == faststart->skipStart) {
+      pos = faststart->skipEnd;
+      continue;
+    }
+    if (layout.dataEnd - pos < 8) {
+      problem = "there are stray bytes after the last atom";
+      break;
+    }
+    if (inputSeek(inputFile, pos, SEEK_SET) != 0 ||
+	!get4Bytes(inputFile, &size32) || !get4Bytes(inputFile, &fourcc)) return;
+    atomSize = size32;
+    if (size32 == 1) { /* a 64-bit 'largesize' follows */
+      unsigned sizeHigh, sizeLow;
+
+      if (!get4Bytes(inputFile, &sizeHigh) || !get4Bytes(inputFile, &sizeLow)) return;
+      atomSize = (DjifixOffset)(((unsigned long long)sizeHigh<<32)|sizeLow);
+      headerSize = 16;
+    } else if (size32 == 0) { /* the atom extends to the end */
+      atomSize = layout.dataEnd - pos;
+    }
+    if (atomSize < headerSize) {
+      problem = "an atom has a bad size";
+      break;
+    }
+
+    if (fourcc == fourcc_mdat && layout.numMdats < MAX_FASTSTART_MDATS) {
+      layout.mdatStart[layout.numMdats] = pos + headerSize;
+      layout.mdatEnd[layout.numMdats] = atomSize > layout.dataEnd - pos ? layout.dataEnd
+	: pos + atomSize;
+      ++layout.numMdats;
+    } else if (fourcc == fourcc_moov && moovPos < 0) {
+      moovPos = pos;
+      moovSize = atomSize;
+    }
+    if (atomSize > layout.dataEnd - pos) {
+      problem = fourcc == fourcc_mdat ? "the 'mdat' atom is cut short" : "the last atom is cut short";
+      break;
+    }
+    pos += atomSize;
+  }
+  if (problem == NULL && layout.numMdats == 0) problem = "there's no 'mdat' atom";
+
+  if (problem == NULL && faststart == NULL) {
+    unsigned char* moov;
+
+    if (moovPos < 0) {
+      problem = "there's no 'moov' atom";
+    } else {
+      if (moovSize > MAX_FASTSTART_MOOV_SIZE ||
+	  (moov = arenaAlloc(ctx->arena, (size_t)moovSize)) == NULL) return; /* we can't check it */
+      if (inputSeek(inputFile, moovPos, SEEK_SET) != 0 ||
+	  getBytes(inputFile, moov, (size_t)moovSize) != (size_t)moovSize) {
+	arenaFree(ctx->arena, moov);
+	return;
+      }
+      layout.offsetBase = ctx->dataOffset; /* (chunk offsets are from the repaired file's start) */
+      if (!checkAtomTree(moov, (size_t)moovSize)) {
+	problem = "the 'moov' atom's structure is bad";
+      } else if (!checkFaststartAtoms(&layout, moov, (size_t)moovSize) || layout.numChunks == 0) {
+	problem = "the 'moov' atom describes data that's not in the 'mdat' atom";
+      }
+      arenaFree(ctx->arena, moov);
+    }
+  }
+
+  ctx->structureChecked = 1;
+  if (problem != NULL) noteStructureProblem(ctx, problem);
+}
+
+/* Does a faststart repair, as planned by "planFaststart()".  Returns 0 (having written
+   nothing) if we ran out of memory; -1 if reading or writing failed: */
+static int doRepairWithLayout(DjifixContext* ctx, FILE* outputFID, FaststartLayout* layout) {
+  InputFile* inputFile = ctx->inputFile;
+  BoxBuffer b;
+  DjifixOffset dataSize = (layout->dataEnd - layout->dataStart) - (layout->skipEnd - layout->skipStart);
+  int pass;
+
+  /* Build the new 'moov' atom.  Its size (and so its chunk offsets) depends on whether its
+     chunk offsets must be 64 bits, so we build it until it comes out the same size: */
+  memset(&b, 0, sizeof b);
+  b.arena = ctx->arena;
+  layout->outputDataStart = 0;
+  for (pass = 0; pass < 4; ++pass) {
+    b.len = 0;
+    putFaststartAtoms(&b, layout, layout->moov, layout->moovSize);
+    if (b.failed) break;
+    if (!layout->use64BitOffsets && ctx->ftypSize + (DjifixOffset)b.len + dataSize > 0xFFFFFFFFLL) {
+      layout->use64BitOffsets = 1;
+      continue;
+    }
+    if (layout->outputDataStart == ctx->ftypSize + (DjifixOffset)b.len) break;
+    layout->outputDataStart = ctx->ftypSize + (DjifixOffset)b.len;
+  }
+  if (b.failed || pass == 4) {
+    fprintf(ctx->logFID, "Failed to allocate memory for the 'moov' atom!\n");
+    arenaFree(b.arena, b.data);
+    return 0;
+  }
+
+  /* Write the 'ftyp' atom, then the new 'moov' atom, then the rest of the data (around the
+     old 'moov' atom, if it was there): */
+  preallocateOutput(outputFID, ftell64(outputFID), layout->outputDataStart + dataSize);
+  noteProgress(ctx, ctx->dataOffset, 0);
+  if (inputSeek(inputFile, ctx->dataOffset, SEEK_SET) != 0 ||
+      !copyRemainder(inputFile, outputFID, ctx, layout->dataStart)) {
+    arenaFree(b.arena, b.data);
+    return -1;
+  }
+  if (fwrite(b.data, 1, b.len, outputFID) != b.len) {
+    fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+    arenaFree(b.arena, b.data);
+    return -1;
+  }
+  checksumOutput(ctx, b.data, b.len);
+  if (ctx->verify && !checkAtomTree(b.data, b.len)) {
+    noteStructureProblem(ctx, "the 'moov' atom's structure is bad");
+  }
+  arenaFree(b.arena, b.data);
+
+  noteProgress(ctx, layout->dataStart, layout->outputDataStart);
+  if (layout->skipEnd > layout->skipStart) {
+    if (inputSeek(inputFile, layout->dataStart, SEEK_SET) != 0 ||
+	!copyRemainder(inputFile, outputFID, ctx, layout->skipStart)) {
+      return -1;
+    }
+    noteProgress(ctx, layout->skipEnd, faststartOutputPos(layout, layout->skipEnd));
+    if (inputSeek(inputFile, layout->skipEnd, SEEK_SET) != 0 ||
+	!copyRemainder(inputFile, outputFID, ctx, MAX_OFFSET)) {
+      return -1;
+    }
+  } else if (inputSeek(inputFile, layout->dataStart, SEEK_SET) != 0 ||
+	     !copyRemainder(inputFile, outputFID, ctx, MAX_OFFSET)) {
+    return -1;
+  }
+  if (ctx->verify) checkRepairedAtoms(ctx, layout);
+
+  return 1;
+}
+
+static int repairFaststart(DjifixContext* ctx, FILE* outputFID) {
+  DjifixOffset savedPos = inputTell(ctx->inputFile);
+  FaststartLayout layout;
+  int result;
+
+  if (!planFaststart(ctx, &layout)) {
+    inputSeek(ctx->inputFile, savedPos, SEEK_SET);
+    return 0;
+  }
+
+  fprintf(ctx->logFID, "Putting %s 'moov' atom (%lu chunks, all within the repaired data) at the start of the repaired file.\n",
+	  layout.moovIsInner ? "the repaired data's" : "the file's original", layout.numChunks);
+  fprintf(ctx->logFID, "%s", startingToRepair);
+  result = doRepairWithLayout(ctx, outputFID, &layout);
+  arenaFree(ctx->arena, layout.moov);
+  if (!result) inputSeek(ctx->inputFile, savedPos, SEEK_SET);
+  return result;
+}
+
+/* Notes that a NAL unit (beginning with the "numBytes" bytes at "nal") is about to be written
+   at "outputPos" in a MP4 file, beginning a new sample if it should.  (The caller then adds
+   the bytes that it writes to the size of the last sample.)  Returns 0 if we run out of
+   memory: */
+static int noteNALUnitInSamples(SampleTable* samples, unsigned char const* nal, unsigned numBytes,
+				DjifixOffset outputPos, int streamHasAUDs, int* sampleHasSlice) {
+  unsigned nalUnitType = nal[0]&0x1F;
+
+  if (nalUnitBeginsSample(nal, numBytes, streamHasAUDs, *sampleHasSlice)) {
+    if (!addSample(samples, outputPos)) return 0;
+    *sampleHasSlice = 0;
+  }
+  if (nalUnitType == 1 || nalUnitType == 5) *sampleHasSlice = 1;
+  if (nalUnitType == 5) samples->isSync[samples->numSamples-1] = 1;
+
+  return 1;
+}
+
+/* Writing a NAL index (see "djifix.h") for a '.h264' file.  We know where each NAL unit goes
+   as we copy it, so this costs just one (buffered) 16-byte write per NAL unit: */
+
+static void writeIndexHeader(FILE* fid) {
+  unsigned char header[DJIFIX_INDEX_HEADER_SIZE];
+
+  memcpy(header, DJIFIX_INDEX_MAGIC, 8);
+  header[8] = header[9] = header[10] = 0; header[11] = DJIFIX_INDEX_VERSION;
+  header[12] = header[13] = header[14] = 0; header[15] = DJIFIX_INDEX_ENTRY_SIZE;
+  fwrite(header, 1, sizeof header, fid);
+}
+
+static void writeIndexEntry(FILE* fid, DjifixOffset outputPos, unsigned nalSize,
+			    unsigned nalUnitType, unsigned flags) {
+  unsigned char entry[DJIFIX_INDEX_ENTRY_SIZE];
+  unsigned i;
+
+  for (i = 0; i < 8; ++i) entry[i] = (unsigned char)((unsigned long long)outputPos>>(56-8*i));
+  entry[8] = nalSize>>24; entry[9] = nalSize>>16; entry[10] = nalSize>>8; entry[11] = nalSize;
+  entry[12] = nalUnitType; entry[13] = flags; entry[14] = entry[15] = 0;
+  fwrite(entry, 1, sizeof entry, fid);
+}
+
+/* Notes (in the NAL index, if we're writing one) a NAL unit - beginning with the "numBytes"
+   bytes at "nal", and "nalSize" bytes in all - whose 'start code' we wrote at "outputPos".
+   (As for a MP4 file's samples, we also work out whether it begins an access unit.): */
+static void noteNALUnitInIndex(DjifixContext* ctx, unsigned char const* nal, unsigned numBytes,
+			       unsigned nalSize, DjifixOffset outputPos) {
+  unsigned nalUnitType = nal[0]&0x1F;
+  int streamHasAUDs = (ctx->second4Bytes>>24&0x1F) == 9;
+  unsigned flags = 0;
+
+  if (ctx->indexFID == NULL) return;
+  if (nalUnitBeginsSample(nal, numBytes, streamHasAUDs, ctx->indexSampleHasSlice)) {
+    flags |= DJIFIX_INDEX_BEGINS_ACCESS_UNIT;
+    ctx->indexSampleHasSlice = 0;
+  }
+  if (nalUnitType == 1 || nalUnitType == 5) ctx->indexSampleHasSlice = 1;
+  writeIndexEntry(ctx->indexFID, outputPos, nalSize, nalUnitType, flags);
+}
+
+#if defined(HAVE_THREADS) && defined(HAVE_MMAP)
+/* Repairing a memory-mapped 'type 2' file in two passes.  First, we hop from 'NAL size' to
+   'NAL size' through the file, recording where each NAL unit is, and where it will go in the
+   output file.  (Because each NAL unit's 4-byte size is replaced by a 4-byte 'start code' -
+   or, in a MP4 file, kept - this is just a running total.)  Then several threads copy the
+   NAL units, each writing its own part of the output file: */
+
+typedef struct {
+  DjifixOffset inputOffset; /* of the NAL unit's data (after its size) */
+  DjifixOffset outputOffset; /* of the NAL unit's 'start code' (or size); -1 if we don't write it */
+  unsigned size; /* the size of the data that we have (less than its 'NAL size', if truncated) */
+} NALUnitEntry;
+
+typedef struct {
+  NALUnitEntry* entries;
+  unsigned numEntries, numEntriesAllocated;
+  Arena* arena; /* where "entries" is allocated (NULL: with "malloc()") */
+} NALUnitIndex;
+
+static int addNALUnitEntry(NALUnitIndex* index, DjifixOffset inputOffset, unsigned size) {
+  if (index->numEntries == index->numEntriesAllocated) {
+    unsigned newNumAllocated = index->numEntriesAllocated == 0 ? 4096 : 2*index->numEntriesAllocated;
+    NALUnitEntry* newEntries = arenaRealloc(index->arena, index->entries,
+					    newNumAllocated*sizeof (NALUnitEntry));
+
+    if (newEntries == NULL) return 0;
+    index->entries = newEntries;
+    index->numEntriesAllocated = newNumAllocated;
+  }
+
+  index->entries[index->numEntries].inputOffset = inputOffset;
+  index->entries[index->numEntries].outputOffset = -1;
+  index->entries[index->numEntries].size = size;
+  ++index->numEntries;
+  return 1;
+}
+
+/* The first pass: Finds each NAL unit in the (memory-mapped) input file, beginning with one of
+   size "nalSize" at the current position.  This does the same as the loop at the end of
+   "doRepairType2()" (including recovering from anomalous 'NAL sizes'), except that it copies
+   nothing.  Returns 0 if we run out of memory: */
+static int indexNALUnits(DjifixContext* ctx, unsigned nalSize, NALUnitIndex* index) {
+  InputFile* inputFile = ctx->inputFile;
+  FILE* logFID = ctx->logFID;
+  unsigned char const* p = inputFile->mapStart;
+  DjifixOffset pos = inputFile->mapPos;
+
+  while (1) {
+    DjifixOffset numRemaining = pos < inputFile->mapSize ? inputFile->mapSize - pos : 0;
+
+    if (numRemaining < (DjifixOffset)nalSize) {
+      /* The NAL unit is truncated by the end of the file: */
+      if (!addNALUnitEntry(index, pos, (unsigned)numRemaining)) return 0;
+      break;
+    }
+    if (!addNALUnitEntry(index, pos, nalSize)) return 0;
+    pos += nalSize;
+
+    if (pos > inputFile->mapSize - 4) break;
+    nalSize = (p[pos]<<24)|(p[pos+1]<<16)|(p[pos+2]<<8)|p[pos+3];
+    pos += 4;
+    if (nalSize == 0 || nalSize > 0x00FFFFFF) {
+      /* An anomalous situation.  Look for where sane data resumes (beginning at least 1 byte
+	 past the start of the anomalous 'NAL size'): */
+      DjifixOffset anomalyPos = pos-4;
+      DjifixOffset q = pos-3;
+      double recoveryStart = secondsNow();
+
+      fprintf(logFID, "\n(Skipping over anomalous bytes...");
+      ++ctx->numAnomalies;
+      profileBegin(ctx, DJIFIX_PHASE_RECOVERY, anomalyPos);
+      q += findResumedData(&p[q], inputFile->mapSize - q);
+      profileEnd(ctx, DJIFIX_PHASE_RECOVERY, q < inputFile->mapSize ? q : inputFile->mapSize);
+      ctx->recoverySeconds += secondsNow() - recoveryStart;
+      if (q >= inputFile->mapSize) {
+	fprintf(logFID, "...reached the end of the file)\n");
+	ctx->numBytesSkipped += inputFile->mapSize - anomalyPos;
+	break;
+      }
+      ctx->numBytesSkipped += q - anomalyPos;
+      pos = q + 4;
+      nalSize = 2;
+      fprintf(logFID, "...done; skipped %lld bytes)\nContinuing to repair the file (please wait)...",
+	      q - anomalyPos);
+    }
+  }
+
+  inputFile->mapPos = inputFile->mapSize;
+  return 1;
+}
+
+typedef struct {
+  InputFile const* inputFile;
+  int outputFD;
+  NALUnitEntry const* entries;
+  unsigned firstEntry, numEntries;
+  int asMP4;
+  int failed;
+  struct CopyProgress* progress; /* NULL if we're not reporting progress */
+  int verify; /* if set, we checksum what we write (starting from a state of 0)... */
+  unsigned checksumState;
+  DjifixOffset numWritten;
+  int foundStartCode; /* ...and (for a '.h264' file) check it for NAL units with 'start codes' */
+} CopyJob;
+
+/* The progress of all of the threads' copying (which we report as if we'd read the input
+   file that far): */
+typedef struct CopyProgress {
+  pthread_mutex_t mutex;
+  DjifixContext* ctx;
+  DjifixOffset inputStart, outputStart;
+  DjifixOffset numCopied;
+} CopyProgress;
+
+static void noteCopyProgress(CopyProgress* progress, size_t numBytes) {
+  if (progress == NULL) return;
+
+  pthread_mutex_lock(&progress->mutex);
+  progress->numCopied += numBytes;
+  noteProgress(progress->ctx, progress->inputStart + progress->numCopied,
+	       progress->outputStart + progress->numCopied);
+  pthread_mutex_unlock(&progress->mutex);
+}
+
+/* Like "pwrite()", but keeps going until everything is written.  Returns 0 on error: */
+static int pwriteAll(int fd, unsigned char const* from, size_t numBytes, DjifixOffset offset) {
+  while (numBytes > 0) {
+    ssize_t numWritten = pwrite(fd, from, numBytes, (off_t)offset);
+
+    if (numWritten <= 0) {
+      if (numWritten < 0 && errno == EINTR) continue;
+      return 0;
+    }
+    from += numWritten; numBytes -= numWritten; offset += numWritten;
+  }
+
   return 1;
 }
 
-static int get1Byte(FILE* fid, unsigned char* result) {
-  int fgetcResult;
+/* Notes (for "verify") that "numBytes" bytes (at "from") were written, in "job"'s part of the
+   output: */
+static void checksumJobOutput(CopyJob* job, unsigned char const* from, size_t numBytes) {
+  if (!job->verify) return;
+  job->checksumState = crc32c(job->checksumState, from, numBytes);
+  job->numWritten += numBytes;
+}
 
-  fgetcResult = fgetc(fid);
-  if (feof(fid) || ferror(fid)) return 0;
+/* The second pass (for some of the NAL units): We gather consecutive NAL units (each with its
+   'start code' or size) into a buffer, and write it with a single "pwrite()".  Large NAL units
+   are written straight from the mapping: */
+static void* copyNALUnits(void* jobPtr) {
+  CopyJob* job = (CopyJob*)jobPtr;
+  unsigned char const* mapStart = job->inputFile->mapStart;
+  unsigned char* buffer;
+  size_t bufferLen = 0;
+  DjifixOffset bufferOutputOffset = 0;
+  unsigned i;
 
-  *result = (unsigned char)fgetcResult;
+  buffer = arenaAlloc(job->inputFile->arena, COPY_BLOCK_SIZE);
+  if (buffer == NULL) {
+    job->failed = 1;
+    return NULL;
+  }
+
+  for (i = job->firstEntry; i < job->firstEntry + job->numEntries && !job->failed; ++i) {
+    NALUnitEntry const* entry = &job->entries[i];
+    unsigned char prefix[4];
+    size_t totalSize = sizeof prefix + entry->size;
+
+    if (entry->outputOffset < 0) continue;
+    if (job->verify && !job->asMP4) {
+      unsigned tail = 0xFFFF;
+
+      if (findStartCodePrefix(&mapStart[entry->inputOffset], entry->size, &tail)) {
+	job->foundStartCode = 1;
+      }
+    }
+    if (job->asMP4) {
+      prefix[0] = entry->size>>24; prefix[1] = entry->size>>16;
+      prefix[2] = entry->size>>8; prefix[3] = entry->size;
+    } else {
+      memcpy(prefix, startCode, sizeof prefix);
+    }
+
+    if (bufferLen > 0 && (bufferLen + totalSize > COPY_BLOCK_SIZE ||
+			  bufferOutputOffset + (DjifixOffset)bufferLen != entry->outputOffset)) {
+      if (!pwriteAll(job->outputFD, buffer, bufferLen, bufferOutputOffset)) job->failed = 1;
+      checksumJobOutput(job, buffer, bufferLen);
+      noteCopyProgress(job->progress, bufferLen);
+      bufferLen = 0;
+    }
+    if (totalSize > COPY_BLOCK_SIZE) {
+      if (!pwriteAll(job->outputFD, prefix, sizeof prefix, entry->outputOffset) ||
+	  !pwriteAll(job->outputFD, &mapStart[entry->inputOffset], entry->size,
+		     entry->outputOffset + sizeof prefix)) {
+	job->failed = 1;
+      }
+      checksumJobOutput(job, prefix, sizeof prefix);
+      checksumJobOutput(job, &mapStart[entry->inputOffset], entry->size);
+      noteCopyProgress(job->progress, totalSize);
+      continue;
+    }
+
+    if (bufferLen == 0) bufferOutputOffset = entry->outputOffset;
+    memcpy(&buffer[bufferLen], prefix, sizeof prefix);
+    memcpy(&buffer[bufferLen + sizeof prefix], &mapStart[entry->inputOffset], entry->size);
+    bufferLen += totalSize;
+  }
+  if (bufferLen > 0 && !job->failed &&
+      !pwriteAll(job->outputFD, buffer, bufferLen, bufferOutputOffset)) {
+    job->failed = 1;
+  }
+  if (bufferLen > 0) checksumJobOutput(job, buffer, bufferLen);
+
+  arenaFree(job->inputFile->arena, buffer);
+  return NULL;
+}
+
+/* Copies the rest of a memory-mapped 'type 2' file (whose next NAL unit has size "nalSize")
+   to the output file - a regular file, which we've written up to "*outputPos" - using
+   "numThreads" threads.  (For a MP4 file, we also build the sample table.)  Returns 0 if this
+   fails: */
+static int copyNALUnitsInParallel(DjifixContext* ctx, unsigned nalSize, FILE* outputFID,
+				  DjifixOffset* outputPos, unsigned numThreads, int asMP4,
+				  SampleTable* samples, int streamHasAUDs, int* sampleHasSlice) {
+  InputFile* inputFile = ctx->inputFile;
+  FILE* logFID = ctx->logFID;
+  DjifixOffset inputStart = inputTell(inputFile);
+  CopyProgress progress;
+  NALUnitIndex index;
+  CopyJob* jobs = NULL;
+  pthread_t* threads = NULL;
+  unsigned i, j, numStarted = 0;
+  DjifixOffset startPos = *outputPos, totalSize;
+  int result = 0;
+
+  memset(&index, 0, sizeof index);
+  index.arena = ctx->arena;
+  do {
+    if (!indexNALUnits(ctx, nalSize, &index)) {
+      fprintf(logFID, "\nFailed to allocate the NAL unit index!%s\n", cantRepair);
+      break;
+    }
+
+    /* Work out where each NAL unit goes (and, for a MP4 file, which sample it's in): */
+    for (i = 0; i < index.numEntries; ++i) {
+      NALUnitEntry* entry = &index.entries[i];
+
+      if (entry->size > 0) checkNALUnitHeader(ctx, inputFile->mapStart[entry->inputOffset]);
+      if (asMP4) {
+	if (entry->size == 0) continue; /* don't write a NAL unit with no data */
+	if (!noteNALUnitInSamples(samples, &inputFile->mapStart[entry->inputOffset], entry->size,
+				  *outputPos, streamHasAUDs, sampleHasSlice)) {
+	  fprintf(logFID, "\nFailed to allocate the sample table!%s\n", cantRepair);
+	  break;
+	}
+	samples->sizes[samples->numSamples-1] += sizeof startCode + entry->size;
+      } else if (entry->size > 0) {
+	noteNALUnitInIndex(ctx, &inputFile->mapStart[entry->inputOffset], entry->size, entry->size,
+			   *outputPos);
+      }
+      entry->outputOffset = *outputPos;
+      *outputPos += sizeof startCode + entry->size;
+    }
+    if (i < index.numEntries) break;
+
+    /* Then give each thread a contiguous part of the output, of roughly equal size: */
+    if (numThreads > index.numEntries) numThreads = index.numEntries;
+    if (numThreads == 0) numThreads = 1;
+    jobs = arenaAlloc(ctx->arena, numThreads*sizeof (CopyJob));
+    threads = arenaAlloc(ctx->arena, numThreads*sizeof (pthread_t));
+    if (jobs == NULL || threads == NULL) {
+      fprintf(logFID, "\nFailed to allocate the copying threads!%s\n", cantRepair);
+      break;
+    }
+    totalSize = *outputPos - startPos;
+    for (i = j = 0; i < numThreads; ++i) {
+      DjifixOffset endOffset = startPos + (DjifixOffset)((double)totalSize*(i+1)/numThreads);
+
+      jobs[i].inputFile = inputFile;
+      jobs[i].outputFD = fileno(outputFID);
+      jobs[i].entries = index.entries;
+      jobs[i].firstEntry = j;
+      while (j < index.numEntries &&
+	     (i == numThreads-1 || index.entries[j].outputOffset < endOffset)) {
+	++j;
+      }
+      jobs[i].numEntries = j - jobs[i].firstEntry;
+      jobs[i].asMP4 = asMP4;
+      jobs[i].failed = 0;
+      jobs[i].progress = ctx->nextProgressReport == MAX_OFFSET ? NULL : &progress;
+      jobs[i].verify = ctx->verify;
+      jobs[i].checksumState = 0;
+      jobs[i].numWritten = 0;
+      jobs[i].foundStartCode = 0;
+    }
+    ctx->numNALUnits += index.numEntries;
+    progress.ctx = ctx;
+    progress.inputStart = inputStart;
+    progress.outputStart = startPos;
+    progress.numCopied = 0;
+    pthread_mutex_init(&progress.mutex, NULL);
+
+    /* The threads write using the file descriptor, so first flush what we've already
+       written.  (We now know exactly how much the threads will write, so preallocate it.): */
+    if (fflush(outputFID) != 0) {
+      fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+      break;
+    }
+    preallocateOutput(outputFID, startPos, totalSize);
+    for (i = 1; i < numThreads; ++i) {
+      if (pthread_create(&threads[i], NULL, copyNALUnits, &jobs[i]) != 0) break;
+      ++numStarted;
+    }
+    copyNALUnits(&jobs[0]); /* in this thread */
+    for (i = numStarted+1; i < numThreads; ++i) copyNALUnits(&jobs[i]); /* any that didn't start */
+    for (i = 1; i <= numStarted; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&progress.mutex);
+    noteProgress(ctx, inputFile->mapPos, *outputPos);
+
+    for (i = 0; i < numThreads; ++i) if (jobs[i].failed) break;
+    if (i < numThreads) {
+      fprintf(logFID, "Failed to write to the output file!\n");
+      break;
+    }
+
+    /* Each thread checksummed its own (contiguous) part of the output; combine them: */
+    for (i = 0; i < numThreads; ++i) {
+      checksumPiece(ctx, jobs[i].checksumState, jobs[i].numWritten);
+      if (jobs[i].foundStartCode) {
+	noteStructureProblem(ctx, startCodeProblem);
+      }
+    }
+    if (ctx->verify && ctx->checksumLength != *outputPos) ctx->checksumLost = 1;
+
+    /* Leave the output file positioned at its end: */
+    if (fseek64(outputFID, *outputPos, SEEK_SET) != 0) break;
+    result = 1;
+  } while (0);
+
+  arenaFree(ctx->arena, threads);
+  arenaFree(ctx->arena, jobs);
+  arenaFree(ctx->arena, index.entries);
+  return result;
+}
+#endif
+
+/* Checkpoints, so that an interrupted repair can be resumed ("djifixRepairWithCheckpoints()").
+   Every "checkpointInterval" bytes of input - at a point from which we could continue the
+   repair: the start of a block ('type 1'), or of a 'NAL size' ('type 2') - we make sure that
+   what we've written of the output file is on disk, and then record (in a single line of
+   text) the input and output positions, the video format, and enough about each file (the
+   input file's size, and a hash of the data just before each position) to tell later whether
+   we can continue from there.  (We write the checkpoint file under a temporary name, and then
+   rename it, so that it's never left half-written.)
+*/
+
+/* How much of each file's data (just before the recorded position) we hash: */
+#define CHECKPOINT_HASH_SIZE 4096
+
+/* The contents of a checkpoint file (used both to write it, and to read it): */
+#define CHECKPOINT_FORMAT "djifix-checkpoint 1 repairType=%d inputSize=%lld dataOffset=%lld ftypSize=%u second4Bytes=%x inputPos=%lld outputPos=%lld format=%d outputIsMP4=%d nalUnits=%lu anomalies=%u bytesSkipped=%lld inputHash=%llx outputHash=%llx indexPos=%lld indexHasSlice=%d\n"
+#define CHECKPOINT_NUM_FIELDS 16
+
+struct Checkpoint {
+  char* fileName;
+  char* tempFileName; /* that we write, then rename to "fileName" */
+  FILE* outputFID;
+  AsyncWriter* writer; /* the one (if any) that's currently writing "outputFID" */
+  DjifixOffset inputSize;
+
+  /* The position from which the repair can be resumed: */
+  DjifixOffset inputPos, outputPos;
+  int format;
+  unsigned long numNALUnits;
+  unsigned numAnomalies;
+  DjifixOffset numBytesSkipped;
+  unsigned long long inputHash, outputHash;
+  DjifixOffset indexPos; /* how much of the NAL index we'd written; -1 if none */
+  int indexHasSlice;
+
+  /* When resuming a 'type 2' repair to a MP4 file: the samples that were already written: */
+  SampleTable samples;
+  int sampleHasSlice;
+};
+
+/* ('verify') Begins checksumming the output - reading back the "numWritten" bytes that were
+   written already (if we're resuming a repair), leaving the output positioned after them: */
+static void startVerifying(DjifixContext* ctx, FILE* outputFID, DjifixOffset numWritten) {
+  unsigned char* buffer;
+
+  ctx->haveOutputCRC32C = ctx->structureChecked = 0;
+  ctx->outputCRC32C = 0;
+  ctx->structureProblem = NULL;
+  ctx->checksumState = 0xFFFFFFFFU;
+  ctx->checksumLength = 0;
+  ctx->checksumLost = 0;
+  ctx->numSlicesChecked = 0;
+  if (!ctx->verify) return;
+  prepareCRC32C();
+  if (numWritten == 0) return;
+
+  buffer = arenaAlloc(ctx->arena, COPY_BLOCK_SIZE);
+  if (buffer == NULL || fseek64(outputFID, 0, SEEK_SET) != 0) {
+    ctx->checksumLost = 1;
+  } else {
+    while (ctx->checksumLength < numWritten) {
+      DjifixOffset numRemaining = numWritten - ctx->checksumLength;
+      size_t numToRead = numRemaining < COPY_BLOCK_SIZE ? (size_t)numRemaining : COPY_BLOCK_SIZE;
+
+      if (fread(buffer, 1, numToRead, outputFID) != numToRead) {
+	ctx->checksumLost = 1;
+	break;
+      }
+      checksumOutput(ctx, buffer, numToRead);
+    }
+  }
+  arenaFree(ctx->arena, buffer);
+  fseek64(outputFID, numWritten, SEEK_SET);
+}
+
+/* ('verify') Completes the checksum - provided that it covers all of the output - and (for a
+   '.h264' file, whose NAL units we've checked as we wrote them) the structure check: */
+static void finishVerifying(DjifixContext* ctx, FILE* outputFID, int isResuming) {
+  DjifixOffset outputSize;
+
+  if (!ctx->verify) return;
+  if (ctx->repairType == 2 && !ctx->outputIsMP4) {
+    if (ctx->numSlicesChecked == 0 && !isResuming) {
+      noteStructureProblem(ctx, "there are no video slices");
+    }
+    ctx->structureChecked = 1;
+  }
+
+  outputSize = fflush(outputFID) == 0 ? ftell64(outputFID) : -1; /* (-1 for a pipe) */
+  if (ctx->checksumLost || (outputSize >= 0 && outputSize != ctx->checksumLength)) {
+    fprintf(ctx->logFID, "\n(We couldn't follow everything that was written, so we can't give the repaired file's checksum.)\n");
+    return;
+  }
+  ctx->outputCRC32C = ~ctx->checksumState&0xFFFFFFFFUL;
+  ctx->haveOutputCRC32C = 1;
+}
+
+static int doRepair(DjifixContext* ctx, FILE* outputFID, Checkpoint* resume) {
+  int result;
+
+  startProgress(ctx);
+  startVerifying(ctx, outputFID, resume != NULL ? resume->outputPos : 0);
+  if (resume != NULL) {
+    ctx->bytesWritten = resume->outputPos;
+    ctx->numNALUnits = resume->numNALUnits;
+    ctx->numAnomalies = resume->numAnomalies;
+    ctx->numBytesSkipped = resume->numBytesSkipped;
+    ctx->indexSampleHasSlice = resume->indexHasSlice;
+  }
+  if (ctx->repairType == 1) {
+    profileBegin(ctx, DJIFIX_PHASE_TYPE1_COPY, inputTell(ctx->inputFile));
+    result = doRepairType1(ctx, outputFID, resume != NULL);
+    profileEnd(ctx, DJIFIX_PHASE_TYPE1_COPY, ctx->bytesRead);
+  } else {
+    result = doRepairType2(ctx, outputFID, resume);
+  }
+  if (result && fflush(outputFID) != 0) {
+    /* (Whatever's still in the 'stdio' buffer must be written, too, for the repair to be done): */
+    fprintf(ctx->logFID, "Failed to write to the output file: %s\n", strerror(errno));
+    result = 0;
+  }
+  if (result) finishVerifying(ctx, outputFID, resume != NULL);
+  noteMemoryPeak(ctx);
+  if (result) reportProgress(ctx, 1);
+
+  return result;
+}
+
+#ifdef HAVE_FILE_DESCRIPTORS
+/* A 64-bit FNV-1a hash: */
+static unsigned long long hashBytes(unsigned char const* p, size_t numBytes) {
+  unsigned long long hash = 14695981039346656037ULL;
+
+  while (numBytes-- > 0) hash = (hash ^ *p++)*1099511628211ULL;
+  return hash;
+}
+
+/* Sets "*result" to a hash of the (up to CHECKPOINT_HASH_SIZE) bytes before position "pos" -
+   in "data", if it's not NULL; otherwise in the file "fd".  Returns 0 if we can't read them: */
+static int hashDataBefore(unsigned char const* data, int fd, DjifixOffset pos,
+			  unsigned long long* result) {
+  unsigned char buffer[CHECKPOINT_HASH_SIZE];
+  size_t numBytes = pos < CHECKPOINT_HASH_SIZE ? (size_t)pos : CHECKPOINT_HASH_SIZE;
+
+  if (data != NULL) {
+    *result = hashBytes(&data[pos - numBytes], numBytes);
+    return 1;
+  }
+  if (pread(fd, buffer, numBytes, (off_t)(pos - numBytes)) != (ssize_t)numBytes) return 0;
+  *result = hashBytes(buffer, numBytes);
   return 1;
 }
 
-static int get4Bytes(FILE* fid, unsigned* result) {
-  unsigned char c1, c2, c3, c4;
+/* (The input file is never a stream here.  We read it without moving its position.): */
+static int hashInputBefore(InputFile* inputFile, DjifixOffset pos, unsigned long long* result) {
+  if (inputFile->mapStart != NULL && pos > inputFile->mapSize) return 0;
+  if (inputFile->reader != NULL) {
+    unsigned char buffer[CHECKPOINT_HASH_SIZE];
+    size_t numBytes = pos < CHECKPOINT_HASH_SIZE ? (size_t)pos : CHECKPOINT_HASH_SIZE;
+
+    if (numBytes > 0 && (pos > inputFile->reader->size ||
+			 inputFile->reader->read(inputFile->reader->opaque, buffer, numBytes,
+						 pos - numBytes) != (long long)numBytes)) return 0;
+    *result = hashBytes(buffer, numBytes);
+    return 1;
+  }
+  return hashDataBefore(inputFile->mapStart, inputFile->mapStart == NULL ? fileno(inputFile->fid) : -1,
+			pos, result);
+}
 
-  if (!get1Byte(fid, &c1)) return 0;
-  if (!get1Byte(fid, &c2)) return 0;
-  if (!get1Byte(fid, &c3)) return 0;
-  if (!get1Byte(fid, &c4)) return 0;
+static void writeCheckpoint(DjifixContext* ctx) {
+  Checkpoint* cp = ctx->checkpoint;
+  int outputFD = fileno(cp->outputFID);
+  FILE* fid;
+  int ok;
 
-  *result = (c1<<24)|(c2<<16)|(c3<<8)|c4;
+  ctx->nextCheckpoint = ctx->bytesRead + ctx->checkpointInterval;
+
+  /* First, make sure that everything we've written so far is on disk: */
+  ok = (cp->writer == NULL || asyncWriterSync(cp->writer)) && fflush(cp->outputFID) == 0 &&
+    fsync(outputFD) == 0;
+  cp->indexPos = -1;
+  if (ctx->indexFID != NULL) {
+    ok = ok && fflush(ctx->indexFID) == 0 && fsync(fileno(ctx->indexFID)) == 0 &&
+      (cp->indexPos = ftell64(ctx->indexFID)) >= 0;
+  }
+  cp->indexHasSlice = ctx->indexSampleHasSlice;
+
+  cp->inputPos = ctx->bytesRead;
+  cp->outputPos = ctx->bytesWritten;
+  cp->format = ctx->chosenFormat;
+  cp->numNALUnits = ctx->numNALUnits;
+  cp->numAnomalies = ctx->numAnomalies;
+  cp->numBytesSkipped = ctx->numBytesSkipped;
+  ok = ok && hashInputBefore(ctx->inputFile, cp->inputPos, &cp->inputHash) &&
+    hashDataBefore(NULL, outputFD, cp->outputPos, &cp->outputHash);
+
+  if (ok) {
+    fid = fopen(cp->tempFileName, "w");
+    ok = fid != NULL;
+    if (ok) {
+      fprintf(fid, CHECKPOINT_FORMAT, ctx->repairType, cp->inputSize, ctx->dataOffset,
+	      ctx->ftypSize, ctx->second4Bytes, cp->inputPos, cp->outputPos, cp->format,
+	      ctx->outputIsMP4, cp->numNALUnits, cp->numAnomalies, cp->numBytesSkipped,
+	      cp->inputHash, cp->outputHash, cp->indexPos, cp->indexHasSlice);
+      ok = fflush(fid) == 0 && fsync(fileno(fid)) == 0;
+      if (fclose(fid) != 0) ok = 0;
+    }
+    ok = ok && rename(cp->tempFileName, cp->fileName) == 0;
+  }
+  if (!ok) {
+    fprintf(ctx->logFID, "\n(Failed to write the checkpoint file \"%s\", so we'll record no more checkpoints.)\n",
+	    cp->fileName);
+    remove(cp->tempFileName);
+    ctx->nextCheckpoint = MAX_OFFSET;
+  }
+}
+
+static void noteCheckpointWriter(DjifixContext* ctx, AsyncWriter* writer) {
+  if (ctx->checkpoint != NULL) ctx->checkpoint->writer = writer;
+}
+
+/* When resuming a 'type 2' repair to a MP4 file: Rebuilds the sample table for the data that
+   was written before the checkpoint, by hopping from 'NAL size' to 'NAL size' through the
+   output file's 'mdat' atom.  Returns 0 if these don't end exactly at the checkpoint: */
+static int findWrittenSamples(DjifixContext* ctx, Checkpoint* cp, FILE* outputFID) {
+  DjifixOffset pos = sizeof mp4Start;
+  int streamHasAUDs = (ctx->second4Bytes>>24&0x1F) == 9;
+  unsigned char buf[6];
+
+  /* The first NAL unit is the 2-byte one that we found at the start of the input file: */
+  if (fseek64(outputFID, pos, SEEK_SET) != 0 || fread(buf, 1, sizeof buf, outputFID) != sizeof buf ||
+      buf[0] != 0 || buf[1] != 0 || buf[2] != 0 || buf[3] != 2 || !addSample(&cp->samples, pos)) {
+    return 0;
+  }
+  cp->samples.sizes[0] = sizeof buf;
+  pos += sizeof buf;
+  cp->sampleHasSlice = 0;
+
+  while (pos < cp->outputPos) {
+    unsigned nalSize;
+
+    if (fseek64(outputFID, pos, SEEK_SET) != 0 || fread(buf, 1, sizeof buf, outputFID) < 5) return 0;
+    nalSize = ((unsigned)buf[0]<<24)|(buf[1]<<16)|(buf[2]<<8)|buf[3];
+    if (nalSize == 0 || nalSize > 0x00FFFFFF || nalSize > cp->outputPos - pos - 4) return 0;
+    if (!noteNALUnitInSamples(&cp->samples, &buf[4], nalSize < 2 ? 1 : 2, pos, streamHasAUDs,
+			      &cp->sampleHasSlice)) {
+      return 0;
+    }
+    cp->samples.sizes[cp->samples.numSamples-1] += 4 + nalSize;
+    pos += 4 + nalSize;
+  }
+
+  return pos == cp->outputPos;
+}
+
+/* Reads the checkpoint file (if there is one), and checks whether we can resume the repair
+   from it, to "outputFID" (which is open for reading and writing).  If we can, we discard
+   anything that was written after the checkpoint, leave the input and output files positioned
+   at the checkpoint, and return 1: */
+static int prepareToResume(DjifixContext* ctx, Checkpoint* cp, FILE* outputFID) {
+  FILE* fid = fopen(cp->fileName, "r");
+  char line[512];
+  int repairType, outputIsMP4, outputFD = fileno(outputFID), ok;
+  DjifixOffset inputSize, dataOffset;
+  unsigned ftypSize, second4Bytes;
+  unsigned long long hash;
+  struct stat sb;
+
+  if (fid == NULL) return 0; /* there's no checkpoint */
+  ok = fgets(line, sizeof line, fid) != NULL &&
+    sscanf(line, CHECKPOINT_FORMAT, &repairType, &inputSize, &dataOffset, &ftypSize,
+	   &second4Bytes, &cp->inputPos, &cp->outputPos, &cp->format, &outputIsMP4,
+	   &cp->numNALUnits, &cp->numAnomalies, &cp->numBytesSkipped, &cp->inputHash,
+	   &cp->outputHash, &cp->indexPos, &cp->indexHasSlice) == CHECKPOINT_NUM_FIELDS;
+  fclose(fid);
+
+  /* Check that the checkpoint is for this repair, of this input file: */
+  ok = ok && repairType == ctx->repairType && inputSize == cp->inputSize &&
+    dataOffset == ctx->dataOffset && ftypSize == ctx->ftypSize &&
+    second4Bytes == ctx->second4Bytes && outputIsMP4 == ctx->outputIsMP4 &&
+    cp->inputPos > dataOffset && cp->inputPos <= inputSize && cp->outputPos > 0 &&
+    (repairType == 1 ||
+     (cp->format >= 0 && cp->format < NUM_VIDEO_FORMATS &&
+      (ctx->format < 0 || ctx->format == cp->format))) &&
+    hashInputBefore(ctx->inputFile, cp->inputPos, &hash) && hash == cp->inputHash;
+
+  /* And that the output file still holds what we'd written by then: */
+  ok = ok && fstat(outputFD, &sb) == 0 && sb.st_size >= cp->outputPos &&
+    hashDataBefore(NULL, outputFD, cp->outputPos, &hash) && hash == cp->outputHash &&
+    (repairType == 1 || !outputIsMP4 || findWrittenSamples(ctx, cp, outputFID));
+
+  /* And (if we're writing a NAL index) that the index does too: */
+  ok = ok && (ctx->indexFID == NULL ||
+	      (cp->indexPos >= 0 && fstat(fileno(ctx->indexFID), &sb) == 0 &&
+	       sb.st_size >= cp->indexPos &&
+	       ftruncate(fileno(ctx->indexFID), (off_t)cp->indexPos) == 0 &&
+	       fseek64(ctx->indexFID, cp->indexPos, SEEK_SET) == 0));
+
+  ok = ok && ftruncate(outputFD, (off_t)cp->outputPos) == 0 &&
+    fseek64(outputFID, cp->outputPos, SEEK_SET) == 0 &&
+    inputSeek(ctx->inputFile, cp->inputPos, SEEK_SET) == 0;
+  if (!ok) {
+    fprintf(ctx->logFID, "(The checkpoint file \"%s\" doesn't match this repair, so we're starting it again from the beginning.)\n",
+	    cp->fileName);
+    freeSampleTable(&cp->samples);
+    return 0;
+  }
+
+  fprintf(ctx->logFID, "(Resuming the repair from the checkpoint in \"%s\": %lld bytes into the file.)\n",
+	  cp->fileName, cp->inputPos);
   return 1;
 }
 
-static int checkAtom(FILE* fid, unsigned fourccToCheck, unsigned* numRemainingBytesToSkip) {
+int djifixRepairWithCheckpoints(DjifixContext* ctx, char const* outputFileName) {
+  InputFile* inputFile = ctx->inputFile;
+  Checkpoint cp;
+  FILE* outputFID;
+  DjifixOffset startPos;
+  int isResuming = 0, result = 0;
+
+  if (inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE) return 0;
+
+  if (inputFile->streamBuffer != NULL) {
+    /* We couldn't resume reading a stream, so just do the repair: */
+    if ((outputFID = fopen(outputFileName, "wb")) == NULL) return 0;
+    result = djifixRepair(ctx, outputFID);
+    if (fclose(outputFID) != 0) result = 0;
+    return result;
+  }
+
+  memset(&cp, 0, sizeof cp);
+  cp.samples.arena = ctx->arena;
+  cp.fileName = arenaAlloc(ctx->arena, strlen(outputFileName) + sizeof ".checkpoint");
+  cp.tempFileName = arenaAlloc(ctx->arena, strlen(outputFileName) + sizeof ".checkpoint.tmp");
   do {
-    unsigned atomSize, fourcc;
+    if (cp.fileName == NULL || cp.tempFileName == NULL) break;
+    sprintf(cp.fileName, "%s.checkpoint", outputFileName);
+    sprintf(cp.tempFileName, "%s.checkpoint.tmp", outputFileName);
 
-    if (!get4Bytes(fid, &atomSize)) break;
+    startPos = inputTell(inputFile);
+    if (inputSeek(inputFile, 0, SEEK_END) != 0) break;
+    cp.inputSize = inputTell(inputFile);
+    if (inputSeek(inputFile, startPos, SEEK_SET) != 0) break;
 
-    if (!get4Bytes(fid, &fourcc) || fourcc != fourccToCheck) break;
+    /* If there's a checkpoint that we can use, continue the repair from there.  Otherwise,
+       start it from the beginning: */
+    if ((outputFID = fopen(outputFileName, "r+b")) != NULL) {
+      isResuming = prepareToResume(ctx, &cp, outputFID);
+      if (!isResuming) {
+	fclose(outputFID);
+	if (inputSeek(inputFile, startPos, SEEK_SET) != 0) break;
+      }
+    }
+    if (!isResuming) {
+      if ((outputFID = fopen(outputFileName, "w+b")) == NULL) break;
+      if (ctx->indexFID != NULL &&
+	  (fseek64(ctx->indexFID, 0, SEEK_SET) != 0 || ftruncate(fileno(ctx->indexFID), 0) != 0)) {
+	fclose(outputFID);
+	break;
+      }
+    }
 
-    if (atomSize < 8) break; /* atom size should be >= 8 */
-    *numRemainingBytesToSkip = atomSize - 8;
+    cp.outputFID = outputFID;
+    ctx->checkpoint = &cp;
+    result = doRepair(ctx, outputFID, isResuming ? &cp : NULL);
+    ctx->checkpoint = NULL;
+    if (fclose(outputFID) != 0) result = 0;
 
-    return 1;
+    /* Once the repair is done, we no longer need the checkpoint (but if it failed, we keep
+       it, in case the repair can be continued later): */
+    if (result) remove(cp.fileName);
   } while (0);
 
-  /* An error occurred: */
-  return 0;
+  freeSampleTable(&cp.samples);
+  arenaFree(ctx->arena, cp.tempFileName);
+  arenaFree(ctx->arena, cp.fileName);
+  return result;
+}
+#else
+/* We need file descriptors to make sure that the output file is on disk (and to truncate it),
+   so without them, we don't record checkpoints: */
+static void writeCheckpoint(DjifixContext* ctx) {
+  (void)ctx;
+}
+
+static void noteCheckpointWriter(DjifixContext* ctx, AsyncWriter* writer) {
+  (void)ctx; (void)writer;
 }
 
-static void doRepairType1(FILE* inputFID, FILE* outputFID, unsigned ftypSize) {
-  fprintf(stderr, "%s", startingToRepair);
+int djifixRepairWithCheckpoints(DjifixContext* ctx, char const* outputFileName) {
+  FILE* outputFID;
+  int result;
 
-  /* Begin the repair by writing the header for the initial 'ftype' atom: */
-  fputc(ftypSize>>24, outputFID);
-  fputc(ftypSize>>16, outputFID);
-  fputc(ftypSize>>8, outputFID);
-  fputc(ftypSize, outputFID);
+  if (ctx->inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE) return 0;
+  if ((outputFID = fopen(outputFileName, "wb")) == NULL) return 0;
+  result = djifixRepair(ctx, outputFID);
+  if (fclose(outputFID) != 0) result = 0;
+  return result;
+}
+#endif
 
-  fputc('f', outputFID); fputc('t', outputFID); fputc('y', outputFID); fputc('p', outputFID);
+/* Reads the next 'NAL size' (into "*nalSize").  If it's anomalous, we first try to recover, by
+   scanning ahead (beginning 1 byte past the start of the anomalous 'NAL size') for a
+   0x00000002 'NAL size' that looks like the start of sane data once again.  Returns 0 if we
+   reach the end of the file: */
+static int getNALSize(DjifixContext* ctx, unsigned* nalSize) {
+  InputFile* inputFile = ctx->inputFile;
+  FILE* logFID = ctx->logFID;
+  DjifixOffset anomalyPos;
+  double recoveryStart;
+  int resumed;
 
-  /* Then complete the repair by copying from the input file to the output file: */
-  {
-    unsigned char c;
+  if (!get4Bytes(inputFile, nalSize)) return 0;
+  if (*nalSize != 0 && *nalSize <= 0x00FFFFFF) return 1;
 
-    while (get1Byte(inputFID, &c)) fputc(c, outputFID);
+  /* An anomalous situation: */
+  anomalyPos = inputTell(inputFile) - 4;
+  recoveryStart = secondsNow();
+  fprintf(logFID, "\n(Skipping over anomalous bytes...");
+  ++ctx->numAnomalies;
+  profileBegin(ctx, DJIFIX_PHASE_RECOVERY, anomalyPos);
+  resumed = inputSeek(inputFile, anomalyPos + 1, SEEK_SET) == 0 &&
+    scanInput(inputFile, findResumedData, 1) && get4Bytes(inputFile, nalSize);
+  profileEnd(ctx, DJIFIX_PHASE_RECOVERY, inputTell(inputFile) - (resumed ? 4 : 0));
+  ctx->recoverySeconds += secondsNow() - recoveryStart;
+  if (!resumed) {
+    fprintf(logFID, "...reached the end of the file)\n");
+    if (inputTell(inputFile) > anomalyPos) ctx->numBytesSkipped += inputTell(inputFile) - anomalyPos;
+    return 0;
   }
+  ctx->numBytesSkipped += inputTell(inputFile) - 4 - anomalyPos;
+  fprintf(logFID, "...done; skipped %lld bytes)\nContinuing to repair the file (please wait)...",
+	  inputTell(inputFile) - 4 - anomalyPos);
+  return 1;
+}
+
+/* Sets "header" to the start of a '.h264' file in the video format "format": its SPS and PPS
+   NAL units, and then the start of the first (2-byte) NAL unit (each preceded by a 'start
+   code').  Returns its size: */
+static unsigned makeH264Header(int format, unsigned second4Bytes, unsigned char* header) {
+  unsigned headerSize = 0;
+
+  /*SPS*/
+  memcpy(&header[headerSize], startCode, sizeof startCode); headerSize += sizeof startCode;
+  memcpy(&header[headerSize], videoFormats[format].sps, videoFormats[format].spsSize);
+  headerSize += videoFormats[format].spsSize;
+
+  /*PPS*/
+  memcpy(&header[headerSize], startCode, sizeof startCode); headerSize += sizeof startCode;
+  memcpy(&header[headerSize], videoFormats[format].pps, videoFormats[format].ppsSize);
+  headerSize += videoFormats[format].ppsSize;
+
+  /* The first NAL unit: */
+  memcpy(&header[headerSize], startCode, sizeof startCode); headerSize += sizeof startCode;
+  header[headerSize++] = second4Bytes>>24; header[headerSize++] = second4Bytes>>16;
+
+  return headerSize;
 }
+#define MAX_H264_HEADER_SIZE (3*sizeof startCode + MAX_PARAMETER_SETS_SIZE + 2)
+
+static int writeZeros(FILE* fid, DjifixOffset numBytes) {
+  static unsigned char const zeros[1024];
 
-#define wr(c) fputc((c), outputFID)
+  while (numBytes > 0) {
+    size_t numToWrite = numBytes < (DjifixOffset)sizeof zeros ? (size_t)numBytes : sizeof zeros;
 
-static void putStartCode(FILE* outputFID) {
-  wr(0x00); wr(0x00); wr(0x00); wr(0x01);
+    if (fwrite(zeros, 1, numToWrite, fid) != numToWrite) return 0;
+    numBytes -= numToWrite;
+  }
+  return 1;
 }
 
-static unsigned char SPS_2160p30[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x03, 0xc0, 0x04, 0x3e, 0xc0, 0x5a, 0x80, 0x80, 0x80, 0xa0, 0x00, 0x00, 0x7d, 0x20, 0x00, 0x1d, 0x4c, 0x1d, 0x0c, 0x00, 0x07, 0x27, 0x08, 0x00, 0x01, 0xc9, 0xc3, 0x97, 0x79, 0x71, 0xa1, 0x80, 0x00, 0xe4, 0xe1, 0x00, 0x00, 0x39, 0x38, 0x72, 0xef, 0x2e, 0x1f, 0x08, 0x84, 0x53, 0x80, 0xff };
-// The following was used in an earlier version of the software, but does not appear to be correct:
-//static unsigned char SPS_2160p25[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x01, 0x00, 0x01, 0x0f, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x40, 0x00, 0x06, 0x1a, 0x87, 0x43, 0x00, 0x01, 0xc9, 0xc2, 0x00, 0x00, 0x72, 0x70, 0xe5, 0xde, 0x5c, 0x68, 0x60, 0x00, 0x39, 0x38, 0x40, 0x00, 0x0e, 0x4e, 0x1c, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0xe0, 0xff };
-static unsigned char SPS_2160p25[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x03, 0xc0, 0x04, 0x3e, 0xc0, 0x5a, 0x80, 0x80, 0x80, 0xa0, 0x00, 0x00, 0x7d, 0x00, 0x00, 0x18, 0x6a, 0x1d, 0x0c, 0x00, 0x07, 0x27, 0x08, 0x00, 0x01, 0xc9, 0xc3, 0x97, 0x79, 0x71, 0xa1, 0x80, 0x00, 0xe4, 0xe1, 0x00, 0x00, 0x39, 0x38, 0x72, 0xef, 0x2e, 0x1f, 0x08, 0x84, 0x53, 0x80, 0xff };
-static unsigned char SPS_2160p24[] = { 0x27, 0x64, 0x00, 0x33, 0xac, 0x34, 0xc8, 0x01, 0x00, 0x01, 0x0f, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x48, 0x00, 0x05, 0xdc, 0x07, 0x43, 0x00, 0x01, 0xc9, 0xc2, 0x00, 0x00, 0x72, 0x70, 0xe5, 0xde, 0x5c, 0x68, 0x60, 0x00, 0x39, 0x38, 0x40, 0x00, 0x0e, 0x4e, 0x1c, 0xbb, 0xff };
-static unsigned char SPS_1520p30[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x02, 0xa4, 0x0b, 0xfb, 0x01, 0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x01, 0xf4, 0x80, 0x00, 0x75, 0x30, 0x74, 0x30, 0x00, 0x13, 0x12, 0xc0, 0x00, 0x04, 0xc4, 0xb4, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x02, 0x62, 0x58, 0x00, 0x00, 0x98, 0x96, 0x8b, 0xbc, 0xb8, 0x7c, 0x22, 0x11, 0x4e, 0x00, 0x00, 0x00, 0xff };
-static unsigned char SPS_1520p25[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x02, 0xa4, 0x0b, 0xfb, 0x01, 0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80, 0x00, 0x00, 0x19, 0x74, 0x30, 0x00, 0x13, 0x12, 0xc0, 0x00, 0x04, 0xc4, 0xb4, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x02, 0x62, 0x58, 0x00, 0x00, 0x98, 0x96, 0x8b, 0xbc, 0xb8, 0x7c, 0x22, 0x11, 0x4e, 0xff };
-static unsigned char SPS_1080p60[] = { 0x27, 0x64, 0x00, 0x2a, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd2, 0x00, 0x03, 0xa9, 0x81, 0xd0, 0xc0, 0x00, 0x4c, 0x4b, 0x00, 0x00, 0x13, 0x12, 0xd1, 0x77, 0x97, 0x1a, 0x18, 0x00, 0x09, 0x89, 0x60, 0x00, 0x02, 0x62, 0x5a, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16, 0xff };
-static unsigned char SPS_1080i60[] = { 0x27, 0x4d, 0x00, 0x2a, 0x9a, 0x66, 0x03, 0xc0, 0x22, 0x3e, 0xf0, 0x16, 0xc8, 0x00, 0x00, 0x1f, 0x48, 0x00, 0x07, 0x53, 0x07, 0x43, 0x00, 0x02, 0x36, 0x78, 0x00, 0x02, 0x36, 0x78, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x04, 0x6c, 0xf0, 0x00, 0x04, 0x6c, 0xf0, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0x58, 0xff };
-static unsigned char SPS_1080p50[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd0, 0x00, 0x03, 0x0d, 0x41, 0xd0, 0xc0, 0x00, 0x4c, 0x4b, 0x00, 0x00, 0x13, 0x12, 0xd1, 0x77, 0x97, 0x1a, 0x18, 0x00, 0x09, 0x89, 0x60, 0x00, 0x02, 0x62, 0x5a, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16, 0xff };
-static unsigned char SPS_1080p30[] = { 0x27, 0x4d, 0x00, 0x28, 0x9a, 0x66, 0x03, 0xc0, 0x11, 0x3f, 0x2e, 0x02, 0xd9, 0x00, 0x00, 0x03, 0x03, 0xe9, 0x00, 0x00, 0xea, 0x60, 0xe8, 0x60, 0x00, 0xe2, 0x98, 0x00, 0x03, 0x8a, 0x60, 0xbb, 0xcb, 0x8d, 0x0c, 0x00, 0x1c, 0x53, 0x00, 0x00, 0x71, 0x4c, 0x17, 0x79, 0x70, 0xf8, 0x44, 0x22, 0x8b, 0xff };
-static unsigned char SPS_1080p25[] = { 0x27, 0x4d, 0x00, 0x28, 0x9a, 0x66, 0x03, 0xc0, 0x11, 0x3f, 0x2e, 0x02, 0xd9, 0x00, 0x00, 0x03, 0x03, 0xe8, 0x00, 0x00, 0xc3, 0x50, 0xe8, 0x60, 0x00, 0xdc, 0xf0, 0x00, 0x03, 0x73, 0xb8, 0xbb, 0xcb, 0x8d, 0x0c, 0x00, 0x1b, 0x9e, 0x00, 0x00, 0x6e, 0x77, 0x17, 0x79, 0x70, 0xf8, 0x44, 0x22, 0x8b, 0xff };
-static unsigned char SPS_1080p24[] = { 0x27, 0x64, 0x00, 0x29, 0xac, 0x34, 0xc8, 0x07, 0x80, 0x22, 0x7e, 0x5c, 0x05, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x07, 0xd2, 0x00, 0x01, 0x77, 0x01, 0xd0, 0xc0, 0x00, 0xbe, 0xbc, 0x00, 0x00, 0xbe, 0xbc, 0x17, 0x79, 0x71, 0xa1, 0x80, 0x01, 0x7d, 0x78, 0x00, 0x01, 0x7d, 0x78, 0x2e, 0xf2, 0xe1, 0xf0, 0x88, 0x45, 0x16, 0x00, 0x00, 0x00, 0xff };
-static unsigned char SPS_720p60[] = { 0x27, 0x4d, 0x00, 0x20, 0x9a, 0x66, 0x02, 0x80, 0x2d, 0xd8, 0x0b, 0x64, 0x00, 0x00, 0x0f, 0xa4, 0x00, 0x07, 0x53, 0x03, 0xa1, 0x80, 0x03, 0x8a, 0x60, 0x00, 0x0e, 0x29, 0x82, 0xef, 0x2e, 0x34, 0x30, 0x00, 0x71, 0x4c, 0x00, 0x01, 0xc5, 0x30, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x34, 0xff };
-static unsigned char SPS_720p30[] = { 0x27, 0x4d, 0x00, 0x1f, 0x9a, 0x66, 0x02, 0x80, 0x2d, 0xd8, 0x0b, 0x64, 0x00, 0x00, 0x0f, 0xa4, 0x00, 0x03, 0xa9, 0x83, 0xa1, 0x80, 0x02, 0x5c, 0x40, 0x00, 0x09, 0x71, 0x02, 0xef, 0x2e, 0x34, 0x30, 0x00, 0x4b, 0x88, 0x00, 0x01, 0x2e, 0x20, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x34, 0xff };
-static unsigned char SPS_720p25[] = { 0x27, 0x64, 0x00, 0x28, 0xac, 0x34, 0xc8, 0x05, 0x00, 0x5b, 0xb0, 0x16, 0xa0, 0x20, 0x20, 0x28, 0x00, 0x00, 0x1f, 0x40, 0x00, 0x06, 0x1a, 0x87, 0x43, 0x00, 0x0f, 0xd4, 0x80, 0x00, 0xfd, 0x4b, 0x5d, 0xe5, 0xc6, 0x86, 0x00, 0x1f, 0xa9, 0x00, 0x01, 0xfa, 0x96, 0xbb, 0xcb, 0x87, 0xc2, 0x21, 0x14, 0x78, 0xff };
-static unsigned char SPS_480p30[] = { 0x27, 0x4d, 0x40, 0x1e, 0x9a, 0x66, 0x05, 0x01, 0xed, 0x80, 0xb6, 0x40, 0x00, 0x00, 0xfa, 0x40, 0x00, 0x3a, 0x98, 0x3a, 0x10, 0x00, 0x5e, 0x68, 0x00, 0x02, 0xf3, 0x40, 0xbb, 0xcb, 0x8d, 0x08, 0x00, 0x2f, 0x34, 0x00, 0x01, 0x79, 0xa0, 0x5d, 0xe5, 0xc3, 0xe1, 0x10, 0x8a, 0x3c, 0xff };
-
-static unsigned char PPS_P2VP[] =    { 0x28, 0xee, 0x3c, 0x80, 0xff };
-static unsigned char PPS_Inspire[] = { 0x28, 0xee, 0x38, 0x30, 0xff };
-
-static void doRepairType2(FILE* inputFID, FILE* outputFID, unsigned second4Bytes) {
-  /* Begin the repair by writing SPS and PPS NAL units (each preceded by a 'start code'): */
-  {
-    int formatCode;
-    unsigned char* sps;
-    unsigned char* pps;
-    unsigned char c;
+static int doRepairType2(DjifixContext* ctx, FILE* outputFID, Checkpoint* resume) {
+  InputFile* inputFile = ctx->inputFile;
+  unsigned second4Bytes = ctx->second4Bytes;
+  int asMP4 = ctx->outputIsMP4;
+  FILE* logFID = ctx->logFID;
+  int format;
+  SampleTable samples; /* used only if "asMP4" */
+  DjifixOffset outputPos; /* ditto */
+  int streamHasAUDs = (second4Bytes>>24&0x1F) == 9, sampleHasSlice = 0, result = 1;
 
-    /* The content of the SPS NAL unit depends upon which video format was used.
-       Prompt the user for this now:
+  memset(&samples, 0, sizeof samples);
+  samples.arena = ctx->arena;
+
+  if (resume != NULL) {
+    /* We're continuing an earlier repair, so we already know the video format, and (for a
+       MP4 file) the samples that were written: */
+    format = ctx->chosenFormat = resume->format;
+    outputPos = resume->outputPos;
+    samples = resume->samples;
+    memset(&resume->samples, 0, sizeof resume->samples); /* they're ours now */
+    resume->samples.arena = ctx->arena;
+    sampleHasSlice = resume->sampleHasSlice;
+    fprintf(logFID, "%s", resumingRepair);
+  } else {
+    /* Begin the repair by writing SPS and PPS NAL units, and then the first (2-byte) NAL unit
+       (each preceded by a 'start code').  Or, for a MP4 file, the start of the file, up to the
+       first NAL unit (preceded by its size) inside the 'mdat' atom: */
+    int detectedFormat = FORMAT_NONE, detectionIsCertain = 0;
+    unsigned char header[sizeof mp4Start + MAX_H264_HEADER_SIZE];
+    unsigned headerSize = 0;
+    int canPrompt = ctx->canPrompt && inputFile->streamBuffer == NULL;
+
+    /* The content of the SPS NAL unit depends upon which video format was used.  Unless we were
+       told this on the command line, or can detect it ourselves, prompt the user for it now.
+       (In batch mode, other repairs might also be prompting, so we take turns, and say which
+       file we're asking about.  And if we're repairing our standard input, we can't prompt at
+       all, so we use the format that we detect.)
     */
-    while (1) {
-      fprintf(stderr, "First, however, we need to know which video format was used.  Enter this now.\n");
-      fprintf(stderr, "\tIf the video format was 2160p(4k), 30fps: Type 0, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 2160p(4k), 25fps: Type 1, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 2160p(4k), 24fps: Type 2, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1520p, 30fps: Type 3, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1520p, 25fps: Type 4, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080p, 60fps: Type 5, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080i, 60fps: Type 6, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080p, 50fps: Type 7, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080p, 30fps: Type 8, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080p, 25fps: Type 9, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 1080p, 24fps: Type A, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 720p, 60fps: Type B, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 720p, 30fps: Type C, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 720p, 25fps: Type D, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf the video format was 480p, 30fps: Type E, then the \"Return\" key.\n");
-      fprintf(stderr, "(If you are unsure which video format was used, then guess as follows:\n");
-      fprintf(stderr, "\tIf your file was from a Phantom 2 Vision+: Type 8, then the \"Return\" key.\n");
-      fprintf(stderr, "\tIf your file was from an Inspire: Type 2, then the \"Return\" key.\n");
-      fprintf(stderr, " If the resulting file is unplayable by VLC, then you probably guessed the wrong format;\n");
-      fprintf(stderr, " try again with another format.)\n");
-      do {formatCode = getchar(); } while (formatCode == '\r' && formatCode == '\n');
-      if ((formatCode >= '0' && formatCode <= '9') ||
-	  (formatCode >= 'a' && formatCode <= 'e') ||
-	  (formatCode >= 'A' && formatCode <= 'E')) {
-	break;
+    if (ctx->format == FORMAT_NONE || ctx->format == FORMAT_AUTO) {
+      detectedFormat = detectVideoFormat(inputFile, second4Bytes, logFID, &detectionIsCertain,
+				       NULL);
+    }
+
+    if (ctx->format != FORMAT_NONE && ctx->format != FORMAT_AUTO) {
+      format = ctx->format;
+    } else if (detectedFormat != FORMAT_NONE &&
+	       (detectionIsCertain || ctx->format == FORMAT_AUTO || !canPrompt)) {
+      format = detectedFormat;
+    } else if (ctx->format == FORMAT_AUTO || !canPrompt) {
+      fprintf(logFID, "Unable to detect the video format (give it with \"-f\").%s\n", cantRepair);
+      return 0;
+    } else {
+      int menuCode, i;
+
+      lockPrompt();
+      if (logFID != stderr && ctx->inputFileName != NULL) {
+	fprintf(stderr, "\n==> %s <==\n", ctx->inputFileName);
+      }
+      while (1) {
+	fprintf(stderr, "First, however, we need to know which video format was used.  Enter this now.\n");
+	for (i = 0; i < NUM_VIDEO_FORMATS; ++i) {
+	  fprintf(stderr, "\tIf the video format was %u%c%s, %ufps: Type %c, then the \"Return\" key.\n",
+		  videoFormats[i].height, videoFormats[i].isInterlaced ? 'i' : 'p',
+		  videoFormats[i].height == 2160 ? "(4k)" : "", videoFormats[i].fps,
+		  menuCodeForFormat(i));
+	}
+	fprintf(stderr, "(If you are unsure which video format was used, then guess as follows:\n");
+	for (i = 0; i < NUM_VIDEO_FORMATS; ++i) {
+	  if (!videoFormats[i].isCameraDefault) continue;
+	  fprintf(stderr, "\tIf your file was from %s %s: Type %c, then the \"Return\" key.\n",
+		  strchr("AEIOU", videoFormats[i].camera[0]) != NULL ? "an" : "a",
+		  videoFormats[i].camera, menuCodeForFormat(i));
+	}
+	fprintf(stderr, " If the resulting file is unplayable by VLC, then you probably guessed the wrong format;\n");
+	fprintf(stderr, " try again with another format.)\n");
+	if (detectedFormat != FORMAT_NONE) {
+	  fprintf(stderr, "(From the file's contents, the video format is probably %s - or another format that we can't tell apart from it.)\n",
+		  videoFormats[detectedFormat].name);
+	}
+	do {menuCode = getchar(); } while (menuCode == '\r' || menuCode == '\n');
+	if (menuCode == EOF) break;
+	if ((format = formatForMenuCode(menuCode)) != FORMAT_NONE) break;
+	fprintf(stderr, "Invalid entry!\n");
+      }
+      unlockPrompt();
+      if (menuCode == EOF) {
+	if (detectedFormat == FORMAT_NONE) {
+	  fprintf(logFID, "No video format was entered.%s\n", cantRepair);
+	  return 0;
+	}
+	fprintf(logFID, "No video format was entered, so we'll use the one that best fits the file.\n");
+	format = detectedFormat;
+      }
+    }
+    ctx->chosenFormat = format;
+
+    fprintf(logFID, "%s", startingToRepair);
+
+    if (asMP4) {
+      memcpy(header, mp4Start, sizeof mp4Start); headerSize = sizeof mp4Start;
+      header[headerSize++] = 0; header[headerSize++] = 0; header[headerSize++] = 0;
+      header[headerSize++] = 2;
+      header[headerSize++] = second4Bytes>>24; header[headerSize++] = second4Bytes>>16;
+      if (fwrite(header, 1, headerSize, outputFID) != headerSize) {
+	fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	return 0;
+      }
+      checksumOutput(ctx, header, headerSize);
+
+      if (!addSample(&samples, sizeof mp4Start)) {
+	fprintf(logFID, "Failed to allocate the sample table!%s\n", cantRepair);
+	return 0;
+      }
+      samples.sizes[0] = headerSize - sizeof mp4Start;
+      outputPos = headerSize;
+    } else {
+      /* (For a trial repair, this is preceded by zero bytes; see "djifixRepairTrials()".): */
+      unsigned zeros = ctx->leadingZeros;
+
+      headerSize = makeH264Header(format, second4Bytes, header);
+      if (!writeZeros(outputFID, zeros) || fwrite(header, 1, headerSize, outputFID) != headerSize) {
+	fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	return 0;
+      }
+      checksumZeros(ctx, zeros);
+      checksumOutput(ctx, header, headerSize);
+      outputPos = zeros + headerSize;
+
+      if (ctx->indexFID != NULL) {
+	unsigned firstNALUnitType = second4Bytes>>24&0x1F;
+
+	writeIndexHeader(ctx->indexFID);
+	writeIndexEntry(ctx->indexFID, zeros, videoFormats[format].spsSize,
+			videoFormats[format].sps[0]&0x1F, 0);
+	writeIndexEntry(ctx->indexFID, zeros + sizeof startCode + videoFormats[format].spsSize,
+			videoFormats[format].ppsSize, videoFormats[format].pps[0]&0x1F, 0);
+	writeIndexEntry(ctx->indexFID, outputPos - 2 - sizeof startCode, 2, firstNALUnitType,
+			DJIFIX_INDEX_BEGINS_ACCESS_UNIT);
+	ctx->indexSampleHasSlice = firstNALUnitType == 1 || firstNALUnitType == 5;
       }
-      fprintf(stderr, "Invalid entry!\n");
-    }
-
-    fprintf(stderr, "%s", startingToRepair);
-    switch (formatCode) {
-      case '0': { sps = SPS_2160p30; pps = PPS_Inspire; break; }
-      case '1': { sps = SPS_2160p25; pps = PPS_Inspire; break; }
-      case '2': { sps = SPS_2160p24; pps = PPS_Inspire; break; }
-      case '3': { sps = SPS_1520p30; pps = PPS_Inspire; break; }
-      case '4': { sps = SPS_1520p25; pps = PPS_Inspire; break; }
-      case '5': { sps = SPS_1080p60; pps = PPS_Inspire; break; }
-      case '6': { sps = SPS_1080i60; pps = PPS_P2VP; break; }
-      case '7': { sps = SPS_1080p50; pps = PPS_Inspire; break; }
-      case '8': { sps = SPS_1080p30; pps = PPS_P2VP; break; }
-      case '9': { sps = SPS_1080p25; pps = PPS_P2VP; break; }
-      case 'a': case 'A': { sps = SPS_1080p24; pps = PPS_Inspire; break; }
-      case 'b': case 'B': { sps = SPS_720p60; pps = PPS_P2VP; break; }
-      case 'c': case 'C': { sps = SPS_720p30; pps = PPS_P2VP; break; }
-      case 'd': case 'D': { sps = SPS_720p25; pps = PPS_Inspire; break; }
-      case 'e': case 'E': { sps = SPS_480p30; pps = PPS_P2VP; break; }
-      default: { sps = SPS_1080p30; pps = PPS_P2VP; break; } /* shouldn't happen */
-    };
-
-    /*SPS*/
-    putStartCode(outputFID);
-    while ((c = *sps++) != 0xff) wr(c);
-
-    /*PPS*/
-    putStartCode(outputFID);
-    while ((c = *pps++) != 0xff) wr(c);
-  }
-
-  /* Then write the first (2-byte) NAL unit, preceded by a 'start code': */
-  putStartCode(outputFID);
-  wr(second4Bytes>>24); wr(second4Bytes>>16);
+    }
+    ctx->numNALUnits = 1; /* the first (2-byte) NAL unit */
+    checkNALUnitHeader(ctx, second4Bytes>>24);
+  }
 
   /* Then repeatedly:
      1/ Read a 4-byte NAL unit size.
-     2/ Write a 'start code'.
-     3/ Read 'NAL unit size' bytes, and write them to the output file.
+     2/ Read 'NAL unit size' bytes, and write them - preceded by a 'start code' - to the output
+	file.  We do this using a buffer that begins with a 'start code', so that (unless the NAL
+	unit is larger than the buffer) it takes just a single write.
+     (For a MP4 file, the buffer begins with the NAL unit's size instead - as in the input
+     file - and we also note which sample the NAL unit belongs to.)
   */
   {
     unsigned nalSize;
     unsigned char c1, c2;
+    unsigned char* nalBuffer = NULL;
+    AsyncWriter writer; /* used iff "isWriting" */
+    int isWriting = 0;
+    int copiedInParallel = 0, haveNALUnit = 0;
+
+    inputDiscardHistory(inputFile);
+    if (resume != NULL) {
+      /* The input file is positioned at the next NAL unit's size: */
+      haveNALUnit = getNALSize(ctx, &nalSize);
+    } else if (get1Byte(inputFile, &c1) && get1Byte(inputFile, &c2)) {
+      nalSize = ((second4Bytes&0xFFFF)<<16)|(c1<<8)|c2; /* for the first NAL unit */
+      haveNALUnit = 1;
+    }
+    profileBegin(ctx, DJIFIX_PHASE_TYPE2_NAL_UNITS, inputTell(inputFile));
+    if (haveNALUnit) {
+#if defined(HAVE_THREADS) && defined(HAVE_MMAP)
+      /* If we can, copy the NAL units using several threads instead (see above).  (But not if
+	 we're recording checkpoints, because the threads don't write the output in order.): */
+      {
+	struct stat sb;
+
+	if (ctx->numCopyThreads > 1 && inputFile->mapStart != NULL && ctx->checkpoint == NULL &&
+	    fstat(fileno(outputFID), &sb) == 0 && S_ISREG(sb.st_mode)) {
+	  result = copyNALUnitsInParallel(ctx, nalSize, outputFID, &outputPos, ctx->numCopyThreads,
+					  asMP4, &samples, streamHasAUDs, &sampleHasSlice);
+	  copiedInParallel = 1;
+	}
+      }
+#endif
+      if (!copiedInParallel) {
+	nalBuffer = arenaAlloc(ctx->arena, sizeof startCode + NAL_BUFFER_SIZE);
+	if (nalBuffer != NULL && !(isWriting = startAsyncWriter(&writer, outputFID, ctx))) {
+	  arenaFree(ctx->arena, nalBuffer);
+	  nalBuffer = NULL;
+	}
+	if (isWriting) noteCheckpointWriter(ctx, &writer);
+	if (nalBuffer == NULL) {
+	  /* We've already written some output, so let the repair complete: */
+	  fprintf(logFID, "Failed to allocate a NAL unit buffer!\n");
+	}
+      }
+    }
+    if (nalBuffer != NULL && !asMP4) memcpy(nalBuffer, startCode, sizeof startCode);
 
-    if (!get1Byte(inputFID, &c1)) return;
-    if (!get1Byte(inputFID, &c2)) return;
-    nalSize = ((second4Bytes&0xFFFF)<<16)|(c1<<8)|c2; /* for the first NAL unit */
+    while (nalBuffer != NULL) {
+      unsigned char* from = nalBuffer; /* we begin by writing the 'start code' (or size) */
+      DjifixOffset nalStart = outputPos;
+      size_t numToRead, numRead, numToWrite;
+      unsigned char firstBytes[2]; /* of the NAL unit, for its entry in the NAL index */
+      unsigned numFirstBytes = 0;
+      unsigned tail = 0xFFFF; /* (for "findStartCodePrefix()") */
 
-    while (!feof(inputFID)) {
-      putStartCode(outputFID);
-      while (nalSize-- > 0) {
-	wr(fgetc(inputFID));
+      if (asMP4) {
+	nalBuffer[0] = nalSize>>24; nalBuffer[1] = nalSize>>16;
+	nalBuffer[2] = nalSize>>8; nalBuffer[3] = nalSize;
       }
 
-      if (!get4Bytes(inputFID, &nalSize)) return;
-      if (nalSize == 0 || nalSize > 0x00FFFFFF) {
-	/* An anomalous situation.  Try to recover from this by repeatedly reading bytes until
-	   we get a 'nalSize' of 0x00000002.  With luck, that will begin sane data once again.
-	*/
-	unsigned char c;
+      /* Copy the NAL unit (in pieces, if it's larger than our buffer): */
+      do {
+	numToRead = nalSize < NAL_BUFFER_SIZE ? nalSize : NAL_BUFFER_SIZE;
+	numRead = getBytes(inputFile, &nalBuffer[sizeof startCode], numToRead);
+	numToWrite = &nalBuffer[sizeof startCode + numRead] - from;
+	if (ctx->verify && numRead > 0) {
+	  if (from == nalBuffer) checkNALUnitHeader(ctx, nalBuffer[sizeof startCode]);
+	  if (!asMP4 && findStartCodePrefix(&nalBuffer[sizeof startCode], numRead, &tail)) {
+	    noteStructureProblem(ctx, startCodeProblem);
+	  }
+	}
+	if (asMP4) {
+	  if (from == nalBuffer) {
+	    if (numRead == 0) break; /* don't write a NAL unit with no data */
+	    if (!noteNALUnitInSamples(&samples, &nalBuffer[sizeof startCode], numRead, outputPos,
+				      streamHasAUDs, &sampleHasSlice)) {
+	      fprintf(logFID, "\nFailed to allocate the sample table!%s\n", cantRepair);
+	      result = 0;
+	      break;
+	    }
+	  }
+	  samples.sizes[samples.numSamples-1] += numToWrite;
+	} else if (from == nalBuffer && numRead > 0) {
+	  numFirstBytes = numRead < sizeof firstBytes ? numRead : sizeof firstBytes;
+	  memcpy(firstBytes, &nalBuffer[sizeof startCode], numFirstBytes);
+	}
+	asyncWrite(&writer, from, numToWrite);
+	outputPos += numToWrite;
+	nalSize -= numRead;
+	from = &nalBuffer[sizeof startCode]; /* for any further pieces */
+      } while (nalSize > 0 && numRead == numToRead);
+      if (result == 0) break;
+      if (numFirstBytes > 0) {
+	noteNALUnitInIndex(ctx, firstBytes, numFirstBytes, outputPos - nalStart - sizeof startCode,
+			   nalStart);
+      }
+      ++ctx->numNALUnits;
+      noteProgress(ctx, inputTell(inputFile), outputPos);
+      if (numRead < numToRead) {
+	/* We reached the end of the file.  In a MP4 file, make the size that precedes the
+	   (truncated) last NAL unit match the data that we actually wrote: */
+	if (asMP4 && from != nalBuffer) {
+	  unsigned char newSize[4];
+	  unsigned long numWritten = outputPos - nalStart - sizeof startCode;
 
-	fprintf(stderr, "\n(Skipping over anomalous bytes...");
-	do {
-	  if (!get1Byte(inputFID, &c)) return;
-	  nalSize = (nalSize<<8)|c;
-	} while (nalSize != 2);
-	fprintf(stderr, "...done)\nContinuing to repair the file (please wait)...");
+	  noteCheckpointWriter(ctx, NULL);
+	  isWriting = 0;
+	  if (!finishAsyncWriter(&writer)) {
+	    fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+	    result = 0;
+	    break;
+	  }
+	  newSize[0] = numWritten>>24; newSize[1] = numWritten>>16;
+	  newSize[2] = numWritten>>8; newSize[3] = numWritten;
+	  if (fseek64(outputFID, nalStart, SEEK_SET) != 0 ||
+	      fwrite(newSize, 1, sizeof newSize, outputFID) != sizeof newSize ||
+	      fseek64(outputFID, outputPos, SEEK_SET) != 0) {
+	    fprintf(logFID, "\nFailed to fix the size of the last NAL unit!\n");
+	    result = 0;
+	  }
+	  checksumChange(ctx, nalStart, nalBuffer, newSize, sizeof newSize); /* (we wrote "nalBuffer[0..3]" there) */
+	}
+	break;
       }
+
+      if (writer.failed || !getNALSize(ctx, &nalSize)) break; /* (stop once a write fails) */
+    }
+
+    if (isWriting) noteCheckpointWriter(ctx, NULL);
+    if (isWriting && !finishAsyncWriter(&writer)) {
+      fprintf(logFID, "Failed to write to the output file: %s\n", strerror(errno));
+      result = 0;
+    }
+    arenaFree(ctx->arena, nalBuffer);
+    if (result != 0 && inputFailed(inputFile)) {
+      fprintf(logFID, "\nFailed to read the input file!%s\n", cantRepair);
+      result = 0;
+    }
+    profileEnd(ctx, DJIFIX_PHASE_TYPE2_NAL_UNITS, inputTell(inputFile));
+  }
+
+  if (!asMP4 && ctx->indexFID != NULL && fflush(ctx->indexFID) != 0) {
+    fprintf(logFID, "\nFailed to write the NAL index!\n");
+  }
+
+  /* Finally, for a MP4 file, write the 'moov' atom that describes the samples: */
+  if (asMP4) {
+    if (!sampleHasSlice && samples.numSamples > 1) {
+      --samples.numSamples; /* the last sample has no picture (e.g., it's just a delimiter) */
+    }
+    if (result != 0) {
+      result = finishMP4File(ctx, outputFID, sizeof mp4Start - MP4_MDAT_HEADER_SIZE, outputPos,
+			     &videoFormats[format], &samples);
     }
+    freeSampleTable(&samples);
   }
+
+  return result;
+}
+
+/* Trial repairs (see "djifix.h"): */
+
+unsigned djifixCandidateFormats(DjifixContext* ctx, int* formats) {
+  int candidates[NUM_VIDEO_FORMATS+1];
+  int isCertain;
+  unsigned numFormats = 0;
+
+  if (ctx->inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE ||
+      ctx->repairType != 2) return 0;
+
+  if (detectVideoFormat(ctx->inputFile, ctx->second4Bytes, ctx->logFID, &isCertain,
+			candidates) == FORMAT_NONE) {
+    /* We can't tell, so any format might be the one: */
+    for (numFormats = 0; numFormats < NUM_VIDEO_FORMATS; ++numFormats) {
+      formats[numFormats] = numFormats;
+    }
+  } else {
+    for (numFormats = 0; candidates[numFormats] != FORMAT_NONE; ++numFormats) {
+      formats[numFormats] = candidates[numFormats];
+    }
+  }
+  return numFormats;
+}
+
+/* Copies the data from file position "pos" to the end of "fromFID" (which is "numBytes"
+   bytes) to the same position of "toFID" (which is positioned there), leaving "toFID"
+   positioned after it.  If the file system can do it, the data is shared between the two files
+   ('reflinked'), rather than copied.  (For this, "pos" must be a multiple of the file system's
+   block size.): */
+static int copyTrialData(FILE* fromFID, FILE* toFID, DjifixOffset pos, DjifixOffset numBytes,
+			 Arena* arena) {
+  DjifixOffset end = pos + numBytes;
+  unsigned char* buffer;
+  size_t numRead = 0;
+
+  if (fflush(fromFID) != 0 || fflush(toFID) != 0) return 0;
+#if defined(__linux__) && defined(FICLONERANGE)
+  {
+    struct file_clone_range range;
+
+    range.src_fd = fileno(fromFID);
+    range.src_offset = (unsigned long long)pos;
+    range.src_length = 0; /* to the end of "fromFID" */
+    range.dest_offset = (unsigned long long)pos;
+    if (ioctl(fileno(toFID), FICLONERANGE, &range) == 0) return fseek64(toFID, end, SEEK_SET) == 0;
+  }
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  {
+    /* Otherwise, try to copy the data entirely within the kernel: */
+    off_t fromPos = pos, toPos = pos;
+
+    while (fromPos < end &&
+	   copy_file_range(fileno(fromFID), &fromPos, fileno(toFID), &toPos,
+			   end - fromPos < COPY_BLOCK_SIZE*64 ? (size_t)(end - fromPos)
+			   : COPY_BLOCK_SIZE*64, 0) > 0) {
+    }
+    /* ("copy_file_range()" does not move the output file descriptor's offset; do that
+       ourselves, before copying anything that's left): */
+    pos = fromPos;
+    if (fseek64(toFID, pos, SEEK_SET) != 0) return 0;
+    if (pos == end) return 1;
+  }
+#endif
+
+  buffer = arenaAlloc(arena, COPY_BLOCK_SIZE);
+  if (buffer == NULL) return 0;
+  if (fseek64(fromFID, pos, SEEK_SET) == 0) {
+    for (; pos < end; pos += numRead) {
+      size_t numToRead = end - pos < COPY_BLOCK_SIZE ? (size_t)(end - pos) : COPY_BLOCK_SIZE;
+
+      numRead = fread(buffer, 1, numToRead, fromFID);
+      if (numRead == 0 || fwrite(buffer, 1, numRead, toFID) != numRead) break;
+    }
+  }
+  arenaFree(arena, buffer);
+  return pos == end;
+}
+
+int djifixRepairTrials(DjifixContext* ctx, FILE* const* outputFIDs, int const* formats,
+		       unsigned numFormats) {
+  int savedFormat = ctx->format, savedOutputIsMP4 = ctx->outputIsMP4;
+  FILE* savedIndexFID = ctx->indexFID;
+  unsigned char header[MAX_H264_HEADER_SIZE];
+  unsigned char trialStart[DJIFIX_TRIAL_DATA_OFFSET];
+  DjifixOffset dataEnd;
+  unsigned i, headerSize;
+  int result;
+
+  if (ctx->inputFile == NULL || ctx->probeResult != DJIFIX_PROBE_REPAIRABLE ||
+      ctx->repairType != 2 || numFormats == 0) return 0;
+  for (i = 0; i < numFormats; ++i) {
+    if (formats[i] < 0 || formats[i] >= NUM_VIDEO_FORMATS) return 0;
+  }
+
+  /* First, repair the file (just once) to the first output file: */
+  ctx->format = formats[0];
+  ctx->outputIsMP4 = 0;
+  ctx->indexFID = NULL;
+  ctx->leadingZeros = DJIFIX_TRIAL_DATA_OFFSET - makeH264Header(formats[0], ctx->second4Bytes, header);
+  result = doRepair(ctx, outputFIDs[0], NULL);
+  ctx->format = savedFormat;
+  ctx->outputIsMP4 = savedOutputIsMP4;
+  ctx->indexFID = savedIndexFID;
+  ctx->leadingZeros = 0;
+  if (!result || fflush(outputFIDs[0]) != 0 ||
+      (dataEnd = ftell64(outputFIDs[0])) < DJIFIX_TRIAL_DATA_OFFSET) return 0;
+
+  /* Then write each of the other output files: its own start, and then the first file's
+     data: */
+  for (i = 1; i < numFormats; ++i) {
+    headerSize = makeH264Header(formats[i], ctx->second4Bytes, header);
+    memset(trialStart, 0, sizeof trialStart - headerSize);
+    memcpy(&trialStart[sizeof trialStart - headerSize], header, headerSize);
+    if (fwrite(trialStart, 1, sizeof trialStart, outputFIDs[i]) != sizeof trialStart ||
+	!copyTrialData(outputFIDs[0], outputFIDs[i], DJIFIX_TRIAL_DATA_OFFSET,
+		       dataEnd - DJIFIX_TRIAL_DATA_OFFSET, ctx->arena)) {
+      result = 0;
+    }
+  }
+  if (fseek64(outputFIDs[0], dataEnd, SEEK_SET) != 0) result = 0;
+
+  return result;
 }
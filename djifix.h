@@ -0,0 +1,291 @@
+/* A library interface to "djifix": for programs that want to repair DJI video files
+   themselves (e.g., many of them, in a long-running server), without running the "djifix"
+   program for each one.
+
+   To build the library, compile "djifix.c" with DJIFIX_NO_MAIN defined:
+	cc -O -c -DDJIFIX_NO_MAIN djifix.c
+   and link the resulting "djifix.o" (with "-lpthread") into your program.
+
+   We repair each file using a "DjifixContext":
+	1/ Call "djifixInitContext()", then set any options that you want.
+	2/ Open the file to repair: "djifixOpenFile()" (by name), "djifixOpenFD()" (from an open
+	   file descriptor), "djifixOpenBuffer()" (from data already in memory), or
+	   "djifixOpenReader()" (from a function that reads ranges of it, e.g., from
+	   object storage).
+	3/ Call "djifixProbe()", to find out whether (and how) the file can be repaired.
+	4/ If it can, call "djifixRepair()" (to a 'stdio' file) or "djifixRepairToFD()" - or
+	   "djifixRepairWithCheckpoints()" (to a named file), so that it can later be resumed.
+	5/ Call "djifixClose()".  (The context can then be used again, from step 2/.)
+   Different contexts can be used at the same time, from different threads.
+*/
+
+#ifndef _DJIFIX_H
+#define _DJIFIX_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Values for "format" (other than a video format's index; see "djifixFormatForName()"): */
+#define DJIFIX_FORMAT_DETECT (-1) /* detect the format if we can; otherwise ask (if allowed) */
+#define DJIFIX_FORMAT_AUTO (-2) /* always use the format that best fits the file */
+
+/* The results of "djifixProbe()": */
+#define DJIFIX_PROBE_UNREPAIRABLE 0
+#define DJIFIX_PROBE_REPAIRABLE 1
+#define DJIFIX_PROBE_UNCORRUPTED 2 /* only if "skipIfUncorrupted" was set */
+
+#define DJIFIX_DEFAULT_PROGRESS_INTERVAL (64LL*1024*1024)
+#define DJIFIX_DEFAULT_CHECKPOINT_INTERVAL (256LL*1024*1024)
+
+/* The least "memorySize" with which every kind of repair can work.  ('Type 2' repairs to a
+   MP4 file also need about 40 bytes (at most) per frame - e.g., 5 MB per hour of 30fps
+   video - and a 'faststart' repair needs room for a copy of the 'moov' atom.): */
+#define DJIFIX_MIN_MEMORY_SIZE (16*1024*1024)
+
+/* A file position or size (64 bits, even on 32-bit systems): */
+typedef long long DjifixOffset;
+
+/* A 'NAL index' (see "indexFID", below) lets other programs seek in a repaired '.h264' file
+   (e.g., to a key frame) without scanning it.  It's a 16-byte header - the 8 bytes
+   DJIFIX_INDEX_MAGIC, then (each as 4 bytes, big-endian) DJIFIX_INDEX_VERSION and
+   DJIFIX_INDEX_ENTRY_SIZE - followed by one entry for each NAL unit in the file, in order:
+	bytes 0-7: the file position of the NAL unit's 'start code' (big-endian)
+	bytes 8-11: the size of the NAL unit, not counting its 'start code' (big-endian)
+	byte 12: the NAL unit's type (e.g., 5: an IDR (key frame) slice; 1: a non-IDR slice;
+		 6: SEI; 7: SPS; 8: PPS; 9: an access unit delimiter)
+	byte 13: flags: DJIFIX_INDEX_BEGINS_ACCESS_UNIT if the NAL unit begins an access unit
+		 (i.e., a frame)
+	bytes 14-15: zero
+   (The file's first two NAL units are the SPS and PPS, which a decoder needs before it can
+   decode any frame.) */
+#define DJIFIX_INDEX_MAGIC "djifixNI"
+#define DJIFIX_INDEX_VERSION 1
+#define DJIFIX_INDEX_HEADER_SIZE 16
+#define DJIFIX_INDEX_ENTRY_SIZE 16
+#define DJIFIX_INDEX_BEGINS_ACCESS_UNIT 0x01
+
+/* The phases of a probe and repair that we profile (see "profile", below).  (A phase's
+   figures include those of any phase that it contains.): */
+#define DJIFIX_PHASE_PROBE 0 /* all of "djifixProbe()" */
+#define DJIFIX_PHASE_ATOM_CHECKS 1 /* ('type 1') checking the atoms after the 'ftyp' atom */
+#define DJIFIX_PHASE_NESTED_FTYPS 2 /* ('type 1') walking through nested 'ftyp' atoms */
+#define DJIFIX_PHASE_TYPE1_COPY 3 /* ('type 1') copying the data */
+#define DJIFIX_PHASE_TYPE2_NAL_UNITS 4 /* ('type 2') copying the NAL units */
+#define DJIFIX_PHASE_RECOVERY 5 /* ('type 2') looking for where sane data resumes, after an anomaly */
+#define DJIFIX_NUM_PHASES 6
+
+typedef struct {
+  unsigned long numCalls; /* how many times the phase was run */
+  double seconds; /* wall-clock time */
+  DjifixOffset bytes; /* of the input file */
+  long long cycles, cacheMisses; /* CPU cycles and cache misses (on Linux, if the kernel lets us
+				    count them); -1 if they weren't counted */
+} DjifixPhaseProfile;
+
+struct InputFile; /* private */
+struct Checkpoint; /* private */
+struct Profiler; /* private */
+struct Arena; /* private */
+
+typedef struct {
+  /* Options (set by "djifixInitContext()" to their defaults): */
+  FILE* logFID; /* where we write messages about the repair (default: stderr) */
+  int format; /* for 'type 2' repairs (default: DJIFIX_FORMAT_DETECT) */
+  int outputIsMP4; /* if set, 'type 2' repairs produce a MP4 file, not raw H.264 (default: 0) */
+  unsigned numCopyThreads; /* threads to copy a 'type 2' file's data, if in memory (default: 1) */
+  int skipIfUncorrupted; /* if set, "djifixProbe()" checks for an uncorrupted file (default: 0) */
+  int canPrompt; /* if set, we may ask the user (on stdin) for the video format (default: 0) */
+  char const* inputFileName; /* used only in messages and stats (default: NULL) */
+  int showProgress; /* if set, we report the repair's progress in "logFID" (default: 0) */
+  FILE* statsFID; /* if not NULL, we write the repair's progress here, as JSON lines (default) */
+  DjifixOffset progressInterval; /* how often (in bytes of input) we report progress (default: 64 MB) */
+  DjifixOffset checkpointInterval; /* how often (in bytes of input) "djifixRepairWithCheckpoints()"
+				      records how far it's got (default: 256 MB) */
+  FILE* indexFID; /* if not NULL, 'type 2' repairs to a '.h264' file write a NAL index here
+		     (default: NULL).  (With "djifixRepairWithCheckpoints()", this must be a
+		     file that's open for reading and writing; we write it from its start.) */
+  int faststart; /* if set, 'type 1' repairs put a 'moov' atom - checked against the repaired
+		    data, with its chunk offsets corrected - at the start of the file, before the
+		    'mdat', so that it can be played (and seeked in) as it streams (default: 0).
+		    (Not for a stream, or with "djifixRepairWithCheckpoints()".) */
+  int profile; /* if set, we profile each phase of the probe and repair, in "phaseProfiles"
+		  (default: 0).  (CPU counts are for the thread that probes the file, and any
+		  threads that it starts.) */
+  void* memory; /* if not NULL, every buffer that we use for a file - from opening it until
+		   "djifixClose()" - comes from these "memorySize" bytes, rather than from
+		   "malloc()" (default: NULL).  A probe or repair that needs more fails, rather
+		   than using more; opening a file fails if "memorySize" is less than
+		   DJIFIX_MIN_MEMORY_SIZE.  The memory must remain valid until "djifixClose()";
+		   it can then be used again (e.g., for the next file).  (Opening a file then
+		   first closes any file that's already open.  The pages of a memory-mapped
+		   input file aren't counted: they're the file's own.) */
+  size_t memorySize;
+  int verify; /* if set, we compute the repaired file's CRC-32C checksum as we write it, and
+		 then check its structure - from what the repair already knows, rather than
+		 by reading the file again (default: 0).  (Not for "djifixRepairInPlace()" or
+		 "djifixCopySegment()"; for "djifixRepairTrials()", these are of the first
+		 file.  For a resumed repair, the part that was already written is read again
+		 to checksum it.) */
+
+  /* The results of "djifixProbe()": */
+  int probeResult; /* one of the DJIFIX_PROBE_* values */
+  int repairType; /* 1 or 2 */
+  unsigned ftypSize; /* ('type 1' repairs only) the size of the 'ftyp' atom to be repaired */
+  unsigned second4Bytes; /* ('type 2' repairs only) the 4 bytes that follow the initial 0x00000002 */
+  DjifixOffset dataOffset; /* the file position of the 'ftyp' atom (type 1) or 0x00000002 (type 2) */
+  unsigned numNestedFtyps; /* ('type 1' repairs only) how many 'ftyp's were nested in 'mdat's */
+
+  /* The results of "djifixRepair()" (updated as the repair runs): */
+  int chosenFormat; /* ('type 2' repairs only) the video format that we used */
+  DjifixOffset bytesRead; /* how far we've got through the input file */
+  DjifixOffset bytesWritten;
+  unsigned long numNALUnits; /* ('type 2' repairs only) */
+  unsigned numAnomalies; /* ('type 2' repairs only) anomalous 'NAL sizes' that we skipped over */
+  DjifixOffset numBytesSkipped; /* ditto: the number of bytes that we skipped */
+  double recoverySeconds; /* ditto: the time that we spent looking for where sane data resumes */
+  DjifixPhaseProfile phaseProfiles[DJIFIX_NUM_PHASES]; /* if "profile" is set (from "djifixProbe()" on) */
+  size_t memoryPeak; /* if "memory" is set: the most of it that's been in use since the file
+			was opened */
+  int haveOutputCRC32C; /* if "verify" is set: set once the repair is done (unless we couldn't
+			   follow everything that it wrote)... */
+  unsigned long outputCRC32C; /* ...and then the repaired file's CRC-32C (Castagnoli) checksum */
+  int structureChecked; /* if "verify" is set: set if we checked the repaired file's structure
+			   (e.g., not for a 'type 1' repair of a stream)... */
+  char const* structureProblem; /* ...and then NULL if it's sound, otherwise what's wrong: e.g.,
+				   a 'type 1' file with no 'moov' atom, a MP4 file whose sample
+				   table doesn't match its data, or a '.h264' file in which a NAL
+				   unit contains a 'start code' (and so would be split when
+				   played) */
+
+  /* Private: */
+  struct InputFile* inputFile;
+  double progressStartTime;
+  DjifixOffset progressStartPos, totalBytes, nextProgressReport;
+  struct Checkpoint* checkpoint;
+  DjifixOffset nextCheckpoint;
+  int indexSampleHasSlice;
+  DjifixOffset outerMoovPos, outerMoovSize; /* ('type 1' only) the 'moov' before the 'mdat' */
+  struct Profiler* profiler;
+  unsigned leadingZeros; /* ('type 2' repairs to '.h264' only) written before the SPS */
+  struct Arena* arena; /* (in "memory") if "memory" is set, and a file is open */
+  unsigned checksumState; /* (if "verify") the CRC-32C of the first "checksumLength" bytes of */
+  DjifixOffset checksumLength; /* the output, before its final inversion */
+  int checksumLost; /* we couldn't follow some of what was written */
+  unsigned long numSlicesChecked; /* ('type 2' repairs only) the NAL units that were slices */
+} DjifixContext;
+
+char const* djifixVersion(void); /* e.g., "2026-10-14" */
+
+void djifixInitContext(DjifixContext* ctx);
+
+/* Each of these returns 0 (with the context unchanged) on failure: */
+int djifixOpenFile(DjifixContext* ctx, char const* fileName); /* "-" means stdin */
+int djifixOpenFD(DjifixContext* ctx, int fd); /* "fd" may be a pipe or socket; it's not closed */
+int djifixOpenBuffer(DjifixContext* ctx, unsigned char const* data, size_t dataSize);
+	/* "data" must remain valid until "djifixClose()" */
+
+/* A 'reader' lets us repair a file that's not on a local file system (e.g., in S3-compatible
+   object storage), by reading just the ranges of it that we need: "read()" reads up to
+   "numBytes" bytes, from file position "pos", into "buf", and returns the number of bytes
+   read (less than "numBytes" only at the end of the file), or -1 on error.  (It's called
+   only for positions before "size", and may be called from several threads at once.)  A
+   probe usually reads only a few KB - the start of the file, and the atom headers that it
+   skips between - in small reads that grow as we read further; copying the bulk of a file
+   uses "numParallelReads" reads (each of several MB) at a time. */
+typedef struct {
+  long long (*read)(void* opaque, void* buf, size_t numBytes, DjifixOffset pos);
+  void (*close)(void* opaque); /* if not NULL, called by "djifixClose()" (but not if
+				  "djifixOpenReader()" fails) */
+  void* opaque;
+  DjifixOffset size; /* the size of the file (which must be known beforehand) */
+  unsigned numParallelReads; /* 0 means 4 */
+} DjifixReader;
+
+/* (The reader is copied, so needn't remain valid.  Not on systems whose 'stdio' can't read
+   through functions - i.e., other than Linux, macOS and the BSDs.): */
+int djifixOpenReader(DjifixContext* ctx, DjifixReader const* reader);
+
+int djifixProbe(DjifixContext* ctx); /* returns "probeResult" */
+
+/* Each of these returns 1 if the repair was done, 0 otherwise.  (To produce a MP4 file, the
+   output must be seekable.): */
+int djifixRepair(DjifixContext* ctx, FILE* outputFID);
+int djifixRepairToFD(DjifixContext* ctx, int fd); /* "fd" is not closed */
+
+/* Like "djifixRepair()", but to the file named "outputFileName", and as we go, we record how
+   far we've got (the input and output positions, and the video format) in a 'checkpoint'
+   file: "outputFileName" plus ".checkpoint".  If the repair is interrupted (e.g., the program
+   is killed), calling this again - with the same input file - resumes the repair from the last
+   checkpoint, after checking that the end of what's already been written is what we wrote.
+   (Otherwise, the repair starts again from the beginning.)  The checkpoint file is removed
+   once the repair is done.  (The input file must be seekable; if it's not, this is just
+   "djifixRepair()" to the named file.): */
+int djifixRepairWithCheckpoints(DjifixContext* ctx, char const* outputFileName);
+
+/* For a 'type 1' repair of a regular file: Repairs the file itself (which "fd" must have open
+   for reading and writing), rather than writing a new file.  Only the start of the file (and
+   its chunk offsets) are written.  Returns 1 if the repair was done, 0 otherwise (e.g., if the
+   file's layout doesn't allow this; the file is then unchanged - unless writing it failed): */
+int djifixRepairInPlace(DjifixContext* ctx, int fd);
+
+/* 'Multi-segment' salvage of a 'type 1' file (which must not be a stream): A file
+   recovered after (e.g.) a power cut can hold several recordings, one after another, each
+   beginning with its own 'ftyp' atom (perhaps with junk in between).  A normal repair
+   copies everything after the (innermost) 'ftyp'; instead, "djifixFindSegments()" finds each
+   recording - in one pass over the file's atoms (skipping over their data) - and then
+   "djifixCopySegment()" copies each one to its own output file.  Different segments (of the
+   same context) can be copied at the same time, from different threads. */
+typedef struct {
+  DjifixOffset start; /* the file position of the segment's 'ftyp' atom */
+  DjifixOffset size;
+  int hasMoov; /* the segment has a 'moov' atom (without it, it's unlikely to be playable) */
+} DjifixSegment;
+
+/* Returns the number of segments (after "djifixProbe()" has found a 'type 1' file), setting
+   "*segments" to an array of them (which the caller must "free()"); or 0 (and NULL) if there
+   are none: */
+unsigned djifixFindSegments(DjifixContext* ctx, DjifixSegment** segments);
+
+/* Returns 1 if the segment was copied, 0 otherwise: */
+int djifixCopySegment(DjifixContext* ctx, DjifixSegment const* segment, FILE* outputFID);
+
+/* 'Trial' repairs, for a 'type 2' file whose video format we can't detect for sure: Rather
+   than repairing the file again for each format that it might be, we repair it once, to a
+   '.h264' file for each of these formats.  (These differ only in their first few bytes: the
+   SPS and PPS NAL units.)
+   "djifixCandidateFormats()" (after "djifixProbe()" has found a 'type 2' file) sets
+   "formats" (which must have room for "djifixNumFormats()" entries) to the formats that fit
+   the file's contents, best first - or to every format, if none could be detected - and
+   returns how many there are (1 if the format was detected for sure; 0 on failure).
+   "djifixRepairTrials()" then repairs the file to "outputFIDs[0]" (in the format
+   "formats[0]"), and writes each of the other files (in the corresponding format) by copying
+   the data after the first file's SPS and PPS - or, on Linux file systems that can do it
+   (e.g., Btrfs or XFS), by sharing it with the first file, rather than copying it.  So that
+   this data is at the same (block-aligned) position in every file, each file begins with
+   zero bytes (which H.264 decoders skip over), and its SPS and PPS end at file position
+   DJIFIX_TRIAL_DATA_OFFSET.  The output files must be empty regular files, open for reading
+   and writing.  ("outputIsMP4" and "indexFID" are not used.)  Returns 1 if every file was
+   written, 0 otherwise: */
+#define DJIFIX_TRIAL_DATA_OFFSET 4096
+unsigned djifixCandidateFormats(DjifixContext* ctx, int* formats);
+int djifixRepairTrials(DjifixContext* ctx, FILE* const* outputFIDs, int const* formats,
+		       unsigned numFormats);
+
+void djifixClose(DjifixContext* ctx);
+
+/* Video formats: */
+int djifixNumFormats(void);
+char const* djifixFormatName(int format); /* e.g., "2160p30" */
+int djifixFormatForName(char const* name); /* returns -1 if there is no such format */
+
+char const* djifixPhaseName(int phase); /* e.g., "probe"; NULL if there is no such phase */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif